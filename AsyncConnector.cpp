@@ -0,0 +1,316 @@
+/*
+ *  Non-blocking TCP connect over several candidate servers
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "AsyncConnector.h"
+
+namespace {
+
+/* Poll interval for stacks that do not signal connect completion */
+const int CONNECT_POLL_MS = 20;
+
+}
+
+AsyncConnector::AsyncConnector(NetworkInterface *net_iface, DnsCache *dns,
+                               EventQueue *queue) :
+        _net_iface(net_iface), _dns(dns), _queue(queue), _event(0), _tick_id(0),
+        _active(false), _endpoints(NULL), _count(0), _next(0), _timeout_ms(0),
+        _stagger_ms(0), _next_start_ms(0), _last_error(NSAPI_ERROR_NO_CONNECTION),
+        _result(NSAPI_ERROR_NO_CONNECTION), _socket(NULL), _index(-1)
+{
+    for (size_t i = 0; i < MBED_CONF_APP_CONNECT_MAX_PARALLEL; i++) {
+        _attempts[i].socket = NULL;
+        _attempts[i].endpoint = -1;
+        _attempts[i].cached = false;
+    }
+}
+
+AsyncConnector::~AsyncConnector()
+{
+    if (_active) {
+        finish(NSAPI_ERROR_NO_CONNECTION, NULL);
+    }
+    delete _socket;
+}
+
+int AsyncConnector::start(const ConnectEndpoint *endpoints, size_t count, done_cb_t done,
+                          uint32_t timeout_ms, uint32_t stagger_ms)
+{
+    if (_queue == NULL || count == 0) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    if (_active) {
+        return NSAPI_ERROR_ALREADY;
+    }
+
+    _done = done;
+    begin(endpoints, count, timeout_ms, stagger_ms);
+    _tick_id = _queue->call_every(CONNECT_POLL_MS, this, &AsyncConnector::on_tick);
+    _queue->call(this, &AsyncConnector::on_tick);
+
+    return NSAPI_ERROR_OK;
+}
+
+int AsyncConnector::connect(const ConnectEndpoint *endpoints, size_t count, TCPSocket **socket,
+                            int *index, uint32_t timeout_ms, uint32_t stagger_ms)
+{
+    if (count == 0) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    if (_active) {
+        return NSAPI_ERROR_ALREADY;
+    }
+
+    _done = done_cb_t();
+    begin(endpoints, count, timeout_ms, stagger_ms);
+    while (!step()) {
+        _event.wait(CONNECT_POLL_MS);
+    }
+
+    *socket = _socket;
+    _socket = NULL;
+    if (index != NULL) {
+        *index = _index;
+    }
+    return _result;
+}
+
+void AsyncConnector::cancel()
+{
+    if (_active) {
+        _done = done_cb_t();
+        finish(NSAPI_ERROR_NO_CONNECTION, NULL);
+        delete _socket;
+        _socket = NULL;
+    }
+}
+
+void AsyncConnector::begin(const ConnectEndpoint *endpoints, size_t count,
+                           uint32_t timeout_ms, uint32_t stagger_ms)
+{
+    _endpoints = endpoints;
+    _count = count;
+    _next = 0;
+    _timeout_ms = timeout_ms;
+    _stagger_ms = stagger_ms;
+    _next_start_ms = 0;
+    _last_error = NSAPI_ERROR_NO_CONNECTION;
+    _result = NSAPI_ERROR_NO_CONNECTION;
+    _index = -1;
+    delete _socket;
+    _socket = NULL;
+
+    _timer.reset();
+    _timer.start();
+    _active = true;
+}
+
+bool AsyncConnector::step()
+{
+    if (!_active) {
+        return true;
+    }
+
+    uint32_t now = _timer.read_ms();
+    bool pending = false;
+
+    /* Advance the outstanding attempts */
+    for (size_t i = 0; i < MBED_CONF_APP_CONNECT_MAX_PARALLEL; i++) {
+        Attempt &attempt = _attempts[i];
+        if (attempt.socket == NULL) {
+            continue;
+        }
+
+        int ret = poll_attempt(attempt);
+        if (ret == NSAPI_ERROR_OK) {
+            finish(NSAPI_ERROR_OK, &attempt);
+            return true;
+        } else if (ret == NSAPI_ERROR_IN_PROGRESS) {
+            pending = true;
+            continue;
+        }
+
+        _last_error = ret;
+        int endpoint = attempt.endpoint;
+        bool cached = attempt.cached;
+        release(attempt);
+
+        if (cached) {
+            /* The cached address may be stale, retry with a fresh lookup */
+            _dns->invalidate(_endpoints[endpoint].hostname);
+            ret = start_attempt(attempt, endpoint, true);
+            if (ret == NSAPI_ERROR_OK) {
+                finish(NSAPI_ERROR_OK, &attempt);
+                return true;
+            } else if (ret == NSAPI_ERROR_IN_PROGRESS) {
+                pending = true;
+                continue;
+            }
+            _last_error = ret;
+        }
+
+        /* Do not wait for the stagger interval once an attempt failed */
+        _next_start_ms = now;
+    }
+
+    /* Start the next attempt when a slot is free and it is time */
+    while (_next < _count && (int32_t) (now - _next_start_ms) >= 0) {
+        Attempt *slot = NULL;
+        for (size_t i = 0; i < MBED_CONF_APP_CONNECT_MAX_PARALLEL; i++) {
+            if (_attempts[i].socket == NULL) {
+                slot = &_attempts[i];
+                break;
+            }
+        }
+        if (slot == NULL) {
+            break;
+        }
+
+        int ret = start_attempt(*slot, _next++, false);
+        if (ret == NSAPI_ERROR_OK) {
+            finish(NSAPI_ERROR_OK, slot);
+            return true;
+        } else if (ret == NSAPI_ERROR_IN_PROGRESS) {
+            pending = true;
+            _next_start_ms = _timer.read_ms() + _stagger_ms;
+        } else {
+            _last_error = ret;
+        }
+        now = _timer.read_ms();
+    }
+
+    if (!pending && _next >= _count) {
+        finish(_last_error, NULL);
+        return true;
+    }
+    if ((uint32_t) _timer.read_ms() >= _timeout_ms) {
+        finish(NSAPI_ERROR_TIMEOUT, NULL);
+        return true;
+    }
+
+    return false;
+}
+
+int AsyncConnector::start_attempt(Attempt &attempt, int endpoint, bool fresh)
+{
+    const ConnectEndpoint &ep = _endpoints[endpoint];
+    nsapi_error_t ret;
+
+    attempt.endpoint = endpoint;
+    attempt.cached = false;
+    if (_dns != NULL) {
+        ret = _dns->resolve(ep.hostname, &attempt.address, fresh, &attempt.cached);
+    } else {
+        ret = _net_iface->gethostbyname(ep.hostname, &attempt.address);
+    }
+    if (ret != NSAPI_ERROR_OK) {
+        return ret;
+    }
+    attempt.address.set_port(ep.port);
+
+    printf("Connecting with %s (%s)\n", ep.hostname, attempt.address.get_ip_address());
+    attempt.socket = new TCPSocket();
+    if ((ret = attempt.socket->open(_net_iface)) != NSAPI_ERROR_OK) {
+        release(attempt);
+        return ret;
+    }
+    attempt.socket->set_blocking(false);
+    attempt.socket->sigio(callback(this, &AsyncConnector::on_sigio));
+
+    ret = poll_attempt(attempt);
+    if (ret != NSAPI_ERROR_OK && ret != NSAPI_ERROR_IN_PROGRESS) {
+        bool cached = attempt.cached;
+        release(attempt);
+        if (cached) {
+            /* The cached address may be stale, retry with a fresh lookup */
+            _dns->invalidate(ep.hostname);
+            return start_attempt(attempt, endpoint, true);
+        }
+    }
+    return ret;
+}
+
+int AsyncConnector::poll_attempt(Attempt &attempt)
+{
+    nsapi_error_t ret = attempt.socket->connect(attempt.address);
+
+    switch (ret) {
+        case NSAPI_ERROR_OK:
+        case NSAPI_ERROR_IS_CONNECTED:
+            return NSAPI_ERROR_OK;
+        case NSAPI_ERROR_IN_PROGRESS:
+        case NSAPI_ERROR_ALREADY:
+        case NSAPI_ERROR_WOULD_BLOCK:
+            return NSAPI_ERROR_IN_PROGRESS;
+        default:
+            return ret;
+    }
+}
+
+void AsyncConnector::release(Attempt &attempt)
+{
+    if (attempt.socket != NULL) {
+        attempt.socket->sigio(NULL);
+        attempt.socket->close();
+        delete attempt.socket;
+        attempt.socket = NULL;
+    }
+}
+
+void AsyncConnector::finish(int result, Attempt *winner)
+{
+    _active = false;
+    if (_queue != NULL && _tick_id != 0) {
+        _queue->cancel(_tick_id);
+        _tick_id = 0;
+    }
+
+    if (winner != NULL) {
+        winner->socket->sigio(NULL);
+        _socket = winner->socket;
+        _index = winner->endpoint;
+        winner->socket = NULL;
+    }
+    for (size_t i = 0; i < MBED_CONF_APP_CONNECT_MAX_PARALLEL; i++) {
+        release(_attempts[i]);
+    }
+
+    _result = result;
+    if (result != NSAPI_ERROR_OK) {
+        printf("Failed to connect: %d\n", result);
+    }
+
+    if (_done) {
+        TCPSocket *socket = _socket;
+        _socket = NULL;
+        _done(_result, socket, _index);
+    }
+}
+
+void AsyncConnector::on_tick()
+{
+    step();
+}
+
+void AsyncConnector::on_sigio()
+{
+    if (_queue != NULL) {
+        _queue->call(this, &AsyncConnector::on_tick);
+    } else {
+        _event.release();
+    }
+}
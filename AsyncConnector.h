@@ -0,0 +1,211 @@
+/*
+ *  Non-blocking TCP connect over several candidate servers
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file AsyncConnector.h
+ *  \brief Staggered parallel connect with an overall timeout
+ *  Given a list of servers (e.g. a primary and a backup broker), attempts
+ *  are started one stagger interval apart, or as soon as the previous one
+ *  failed, and the first socket to connect wins. This bounds the time to
+ *  reconnect after a failover to roughly one connect instead of one
+ *  timeout per dead server.
+ */
+
+#ifndef __ASYNC_CONNECTOR_H_
+#define __ASYNC_CONNECTOR_H_
+
+#include "mbed.h"
+#include "DnsCache.h"
+
+/** Milliseconds before giving up on all servers */
+#ifndef MBED_CONF_APP_CONNECT_TIMEOUT
+#define MBED_CONF_APP_CONNECT_TIMEOUT 10000
+#endif
+
+/** Milliseconds between starting two connect attempts */
+#ifndef MBED_CONF_APP_CONNECT_STAGGER
+#define MBED_CONF_APP_CONNECT_STAGGER 250
+#endif
+
+/** Number of connect attempts that may be outstanding at once */
+#ifndef MBED_CONF_APP_CONNECT_MAX_PARALLEL
+#define MBED_CONF_APP_CONNECT_MAX_PARALLEL 2
+#endif
+
+/**
+ * A server to connect to
+ */
+struct ConnectEndpoint {
+    const char *hostname;   /**< Hostname or address literal */
+    uint16_t port;          /**< The server port */
+};
+
+/**
+ * \brief AsyncConnector races non-blocking connects to a list of servers.
+ *
+ * Used with an EventQueue, start() returns immediately and the completion
+ * callback runs on the queue's thread. connect() is the blocking variant,
+ * driving the same state machine from the calling thread.
+ *
+ * Stacks whose connect() blocks (like the ESP8266 AT driver) still work,
+ * the attempts then simply run one after another within the timeout.
+ */
+class AsyncConnector {
+public:
+    /**
+     * Completion callback: the result, the connected socket (owned by the
+     * callee from then on, NULL on failure) and the index of the endpoint
+     */
+    typedef Callback<void(int, TCPSocket *, int)> done_cb_t;
+
+    /**
+     * AsyncConnector Constructor
+     *
+     * @param[in] net_iface The network interface to open sockets on
+     * @param[in] dns An optional cache to resolve the server names through
+     * @param[in] queue An optional queue to run start() on
+     */
+    AsyncConnector(NetworkInterface *net_iface, DnsCache *dns = NULL,
+                   EventQueue *queue = NULL);
+    /**
+     * AsyncConnector Destructor
+     */
+    ~AsyncConnector();
+
+    /**
+     * Start connecting in the background, needs the EventQueue.
+     *
+     * @param[in] endpoints The servers, in order of preference
+     * @param[in] count The number of servers
+     * @param[in] done Called on the queue thread once connected or failed
+     * @param[in] timeout_ms Time before giving up on all servers
+     * @param[in] stagger_ms Time between starting two attempts
+     * @return NSAPI_ERROR_OK if started, or an nsapi error code on failure
+     */
+    int start(const ConnectEndpoint *endpoints, size_t count, done_cb_t done,
+              uint32_t timeout_ms = MBED_CONF_APP_CONNECT_TIMEOUT,
+              uint32_t stagger_ms = MBED_CONF_APP_CONNECT_STAGGER);
+
+    /**
+     * Connect, blocking the caller until done.
+     *
+     * @param[in] endpoints The servers, in order of preference
+     * @param[in] count The number of servers
+     * @param[out] socket The connected socket, owned by the caller
+     * @param[out] index Optionally, the index of the endpoint that won
+     * @param[in] timeout_ms Time before giving up on all servers
+     * @param[in] stagger_ms Time between starting two attempts
+     * @return NSAPI_ERROR_OK on success, or an nsapi error code on failure
+     */
+    int connect(const ConnectEndpoint *endpoints, size_t count, TCPSocket **socket,
+                int *index = NULL,
+                uint32_t timeout_ms = MBED_CONF_APP_CONNECT_TIMEOUT,
+                uint32_t stagger_ms = MBED_CONF_APP_CONNECT_STAGGER);
+
+    /**
+     * Abort a background connect without calling the callback. Must be
+     * called from the queue thread.
+     */
+    void cancel();
+
+    /**
+     * Whether a connect is in progress
+     */
+    bool is_active() const {
+        return _active;
+    }
+
+protected:
+    struct Attempt {
+        TCPSocket *socket;      /**< NULL while the slot is free */
+        SocketAddress address;  /**< The address being connected to */
+        int endpoint;           /**< Index of the endpoint */
+        bool cached;            /**< The address came from the DNS cache */
+    };
+
+    /**
+     * Begin a run over the endpoints
+     */
+    void begin(const ConnectEndpoint *endpoints, size_t count,
+               uint32_t timeout_ms, uint32_t stagger_ms);
+
+    /**
+     * Advance all attempts, start new ones and check the timeout.
+     *
+     * @return true once the run completed
+     */
+    bool step();
+
+    /**
+     * Resolve an endpoint and open a connecting socket in a slot
+     */
+    int start_attempt(Attempt &attempt, int endpoint, bool fresh);
+
+    /**
+     * Poll a connecting socket
+     *
+     * @return NSAPI_ERROR_OK once connected, NSAPI_ERROR_IN_PROGRESS while
+     *         connecting, or an nsapi error code on failure
+     */
+    int poll_attempt(Attempt &attempt);
+
+    /**
+     * Close the socket of a slot and free it
+     */
+    void release(Attempt &attempt);
+
+    /**
+     * Complete the run, handing the winning slot's socket over
+     */
+    void finish(int result, Attempt *winner);
+
+    /**
+     * Periodic and sigio driven step on the queue
+     */
+    void on_tick();
+
+    /**
+     * Socket state change, may be called from any context
+     */
+    void on_sigio();
+
+protected:
+    NetworkInterface *_net_iface;
+    DnsCache *_dns;
+    EventQueue *_queue;
+    Semaphore _event;               /**< Wakes the blocking connect() */
+    Timer _timer;                   /**< Time since the run started */
+    int _tick_id;                   /**< The periodic step on the queue */
+    bool _active;
+
+    const ConnectEndpoint *_endpoints;
+    size_t _count;
+    size_t _next;                   /**< The next endpoint to try */
+    uint32_t _timeout_ms;
+    uint32_t _stagger_ms;
+    uint32_t _next_start_ms;        /**< When the next attempt may start */
+    int _last_error;
+
+    done_cb_t _done;
+    int _result;
+    TCPSocket *_socket;             /**< The winning socket */
+    int _index;                     /**< The winning endpoint */
+
+    Attempt _attempts[MBED_CONF_APP_CONNECT_MAX_PARALLEL];
+};
+
+#endif /* __ASYNC_CONNECTOR_H_ */
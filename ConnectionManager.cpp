@@ -0,0 +1,764 @@
+/*
+ *  Keeps the MQTT uplink connected
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "ConnectionManager.h"
+
+/* The status message in CBOR: an array of the uptime, the reconnection
+   statistics, the link statistics and those of every publish class */
+template <> struct MessageSchema<ReconnectStats> {
+    typedef MessageFields<
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::reconnects>,
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::attempts>,
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::resumed>,
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::last_ms>,
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::stored>,
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::forwarded>,
+        MessageField<ReconnectStats, uint32_t, &ReconnectStats::dropped> > Fields;
+};
+
+template <> struct MessageSchema<LinkStats> {
+    typedef MessageFields<
+        MessageField<LinkStats, uint32_t, &LinkStats::bandwidth>,
+        MessageField<LinkStats, uint32_t, &LinkStats::write_us>,
+        MessageField<LinkStats, uint32_t, &LinkStats::bytes>,
+        MessageField<LinkStats, uint32_t, &LinkStats::paced_ms> > Fields;
+};
+
+template <> struct MessageSchema<PublishClassStats> {
+    typedef MessageFields<
+        MessageField<PublishClassStats, uint32_t, &PublishClassStats::sent>,
+        MessageField<PublishClassStats, uint32_t, &PublishClassStats::late>,
+        MessageField<PublishClassStats, uint32_t, &PublishClassStats::max_wait_ms>,
+        MessageField<PublishClassStats, uint32_t, &PublishClassStats::dropped>,
+        MessageField<PublishClassStats, uint32_t, &PublishClassStats::refused> > Fields;
+};
+
+template <> struct MessageSchema<ConnectionStatus> {
+    typedef MessageFields<
+        MessageField<ConnectionStatus, uint32_t, &ConnectionStatus::uptime_s>,
+        MessageField<ConnectionStatus, ReconnectStats, &ConnectionStatus::reconnect>,
+        MessageField<ConnectionStatus, LinkStats, &ConnectionStatus::link>,
+        MessageField<ConnectionStatus, PublishClassStats[PUBLISH_CLASSES],
+                     &ConnectionStatus::classes> > Fields;
+};
+
+ConnectionManager *ConnectionManager::_dispatcher = NULL;
+
+ConnectionManager::ConnectionManager(TLSConnection<TcpTransport> &connection,
+                                     const ConnectEndpoint *brokers, size_t count,
+                                     const char *client_id) :
+        _connection(connection), _network(connection), _client(NULL),
+        _brokers(brokers), _broker_count(count), _client_id(client_id),
+        _subscription_count(0), _offline(NULL), _online(false), _status_ms(0), _forwarded(0),
+        _was_connected(false), _down(true)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    _downtime.start();
+    _clock.start();
+    _connection.transport().set_pacer(&_pacer);
+}
+
+ConnectionManager::~ConnectionManager()
+{
+    if (_client != NULL && _connection.is_connected() && _client->isConnected()) {
+        _client->disconnect();
+    }
+    delete _client;
+    _connection.close();
+
+    /* The handlers must not reach a manager that is gone */
+    if (_dispatcher == this) {
+        _dispatcher = NULL;
+    }
+}
+
+void ConnectionManager::set_offline_queue(OfflineQueue *queue)
+{
+    _offline = queue;
+}
+
+int ConnectionManager::subscribe(const char *topic_filter, MQTT::QoS qos,
+                                 message_handler_t handler)
+{
+    if (strlen(topic_filter) > MBED_CONF_APP_MQTT_MAX_TOPIC_LEN) {
+        return -1;
+    }
+
+    _mutex.lock();
+    if (_subscription_count == MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS) {
+        _mutex.unlock();
+        return -1;
+    }
+    if (_filters.insert(topic_filter, _subscription_count) != 0) {
+        _mutex.unlock();
+        return -1;
+    }
+    Subscription &sub = _subscriptions[_subscription_count++];
+    strcpy(sub.topic_filter, topic_filter);
+    sub.qos = qos;
+    sub.handler = handler;
+    sub.active = false;
+    _mutex.unlock();
+
+    /* Picked up by the next poll() */
+    return 0;
+}
+
+int ConnectionManager::publish(const char *topic, const void *payload, size_t len,
+                               MQTT::QoS qos, PublishClass cls)
+{
+    if (strlen(topic) > MBED_CONF_APP_MQTT_MAX_TOPIC_LEN) {
+        return -1;
+    }
+
+    /* Compressed, a payload may fit that did not */
+    uint8_t packed[MBED_CONF_APP_PUBLISH_MAX_PAYLOAD];
+    if (_compressor.selected(topic)) {
+        int n = _compressor.compress(payload, len, packed, sizeof (packed));
+        if (n < 0) {
+            return -1;
+        }
+        payload = packed;
+        len = n;
+    }
+    if (len > MBED_CONF_APP_PUBLISH_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    /* Once there is a backlog, new messages queue behind it to keep the order;
+       alarms and control messages do not wait for it */
+    if (cls >= PUBLISH_TELEMETRY && _offline != NULL && (!_online || !_offline->empty()) &&
+        _offline->push(topic, payload, len) == 0) {
+        _mutex.lock();
+        _stats.stored++;
+        _mutex.unlock();
+        return 0;
+    }
+
+    return _scheduler.push(cls, topic, payload, len, qos, now_ms());
+}
+
+void ConnectionManager::run()
+{
+    while (true) {
+        poll();
+    }
+}
+
+void ConnectionManager::poll(uint32_t yield_ms)
+{
+    if (!is_connected()) {
+        reconnect();
+    }
+
+    if (subscribe_pending() != 0) {
+        connection_lost();
+        return;
+    }
+
+    if (drain() != 0) {
+        connection_lost();
+        return;
+    }
+
+    if (publish_status() != 0) {
+        connection_lost();
+        return;
+    }
+
+    if (_client != NULL && _client->yield(yield_ms) != MQTT::SUCCESS) {
+        connection_lost();
+    }
+}
+
+bool ConnectionManager::is_connected()
+{
+    return _client != NULL && _client->isConnected() && _connection.is_connected();
+}
+
+ReconnectStats ConnectionManager::stats()
+{
+    _mutex.lock();
+    ReconnectStats stats = _stats;
+    _mutex.unlock();
+
+    for (int c = 0; c < PUBLISH_CLASSES; c++) {
+        PublishClassStats s = _scheduler.stats((PublishClass) c);
+        stats.dropped += s.dropped + s.refused;
+    }
+    return stats;
+}
+
+void ConnectionManager::print_stats()
+{
+    ReconnectStats s = stats();
+    printf("MQTT: %lu reconnects in %lu attempts, %lu resumed, %lu dropped\n",
+           (unsigned long) s.reconnects, (unsigned long) s.attempts,
+           (unsigned long) s.resumed, (unsigned long) s.dropped);
+    if (_offline != NULL) {
+        printf("MQTT: %lu stored offline, %lu forwarded, %lu lost to a full log\n",
+               (unsigned long) s.stored, (unsigned long) s.forwarded,
+               (unsigned long) _offline->dropped());
+    }
+    if (s.reconnects > 0) {
+        printf("MQTT: time to reconnect last %lu ms, min %lu ms, max %lu ms, avg %lu ms\n",
+               (unsigned long) s.last_ms, (unsigned long) s.min_ms,
+               (unsigned long) s.max_ms, (unsigned long) (s.total_ms / s.reconnects));
+    }
+
+    static const char *const names[PUBLISH_CLASSES] = { "alarm", "control", "telemetry", "bulk" };
+    for (int c = 0; c < PUBLISH_CLASSES; c++) {
+        PublishClassStats p = _scheduler.stats((PublishClass) c);
+        printf("MQTT: %s %lu queued, %lu sent, %lu late, longest wait %lu ms, %lu dropped, %lu refused\n",
+               names[c], (unsigned long) p.queued, (unsigned long) p.sent, (unsigned long) p.late,
+               (unsigned long) p.max_wait_ms, (unsigned long) p.dropped, (unsigned long) p.refused);
+    }
+
+    LinkStats l = _pacer.stats();
+    printf("MQTT: link %lu B/s, write %lu us, %lu writes, %lu bytes, %lu paced for %lu ms\n",
+           (unsigned long) l.bandwidth, (unsigned long) l.write_us, (unsigned long) l.writes,
+           (unsigned long) l.bytes, (unsigned long) l.paced, (unsigned long) l.paced_ms);
+
+    CompressStats c = _compressor.stats();
+    if (c.messages > 0) {
+        printf("MQTT: compressed %lu messages, %lu -> %lu bytes in %lu us, %lu did not fit\n",
+               (unsigned long) c.messages, (unsigned long) c.bytes_in, (unsigned long) c.bytes_out,
+               (unsigned long) c.total_us, (unsigned long) c.refused);
+    }
+}
+
+int ConnectionManager::connect_once()
+{
+    int ret;
+
+    _mutex.lock();
+    _stats.attempts++;
+    _mutex.unlock();
+
+    if ((ret = _connection.connect(_brokers, _broker_count)) != 0) {
+        return ret;
+    }
+
+    delete _client;
+    _client = new MQTTClient(_network);
+    _dispatcher = this;
+    _client->setDefaultMessageHandler(&ConnectionManager::on_message);
+#if MBED_CONF_APP_MQTT_VERSION == 5
+    _client->setPubackHandler(&ConnectionManager::on_puback);
+#endif
+
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = MBED_CONF_APP_MQTT_VERSION;
+    data.clientID.cstring = const_cast<char *>(_client_id);
+    data.keepAliveInterval = MBED_CONF_APP_MQTT_KEEPALIVE;
+    data.cleansession = 1;
+
+    if ((ret = _client->connect(data)) != MQTT::SUCCESS) {
+        printf("MQTT: connect failed: %d\n", ret);
+        connection_lost();
+        return ret;
+    }
+#if MBED_CONF_APP_MQTT_VERSION == 5
+    printf("MQTT: v5 session, %u topic aliases, %u messages in flight, packets up to %lu bytes\n",
+           _client->topic_aliases(), _client->max_inflight(),
+           (unsigned long) _client->max_packet_size());
+#endif
+
+    /* A new session, every filter has to be subscribed again */
+    _mutex.lock();
+    for (size_t i = 0; i < _subscription_count; i++) {
+        _subscriptions[i].active = false;
+    }
+    _mutex.unlock();
+
+    if ((ret = subscribe_pending()) != 0) {
+        connection_lost();
+        return ret;
+    }
+
+    return 0;
+}
+
+void ConnectionManager::reconnect()
+{
+    uint32_t attempt = 0;
+
+    while (connect_once() != 0) {
+        uint32_t delay = backoff_ms(attempt++);
+        printf("MQTT: reconnecting in %lu ms\n", (unsigned long) delay);
+        Thread::wait(delay);
+    }
+
+    uint32_t down_ms = _downtime.read_ms();
+    _downtime.stop();
+    _down = false;
+    _online = true;
+
+    _mutex.lock();
+    if (_connection.is_resumed()) {
+        _stats.resumed++;
+    }
+    if (_was_connected) {
+        /* Only outages count, not the initial connection */
+        _stats.reconnects++;
+        _stats.last_ms = down_ms;
+        _stats.total_ms += down_ms;
+        if (_stats.reconnects == 1 || down_ms < _stats.min_ms) {
+            _stats.min_ms = down_ms;
+        }
+        if (down_ms > _stats.max_ms) {
+            _stats.max_ms = down_ms;
+        }
+    }
+    _mutex.unlock();
+
+    _was_connected = true;
+    printf("MQTT: connected after %lu ms%s\n", (unsigned long) down_ms,
+           _connection.is_resumed() ? ", TLS session resumed" : "");
+}
+
+uint32_t ConnectionManager::backoff_ms(uint32_t attempt)
+{
+    uint32_t delay = MBED_CONF_APP_RECONNECT_BACKOFF_MIN;
+    for (uint32_t i = 0; i < attempt && delay < MBED_CONF_APP_RECONNECT_BACKOFF_MAX; i++) {
+        delay *= 2;
+    }
+    if (delay > MBED_CONF_APP_RECONNECT_BACKOFF_MAX) {
+        delay = MBED_CONF_APP_RECONNECT_BACKOFF_MAX;
+    }
+
+    /* Half fixed, half random, so a fleet of gateways does not reconnect in lockstep */
+    uint32_t r = 0;
+    _connection.context().random(reinterpret_cast<unsigned char *>(&r), sizeof (r));
+    return delay / 2 + r % (delay / 2 + 1);
+}
+
+int ConnectionManager::subscribe_pending()
+{
+    for (size_t i = 0; ; i++) {
+        _mutex.lock();
+        if (i >= _subscription_count) {
+            _mutex.unlock();
+            return 0;
+        }
+        Subscription &sub = _subscriptions[i];
+        bool pending = !sub.active;
+        _mutex.unlock();
+
+        /* The entry never moves once added, so it is safe to use unlocked */
+        if (pending) {
+            int ret = _client->subscribe(sub.topic_filter, sub.qos, sub.handler);
+            if (ret != MQTT::SUCCESS) {
+                printf("MQTT: subscribe to %s failed: %d\n", sub.topic_filter, ret);
+                return ret;
+            }
+            /* Dispatched by the trie, the client is left with no filter to scan */
+            _client->setMessageHandler(sub.topic_filter, NULL);
+            sub.active = true;
+        }
+    }
+}
+
+void ConnectionManager::on_message(MQTT::MessageData &md)
+{
+    if (_dispatcher != NULL) {
+        _dispatcher->dispatch(md);
+    }
+}
+
+#if MBED_CONF_APP_MQTT_VERSION == 5
+void ConnectionManager::on_puback(uint16_t id, uint8_t reason)
+{
+    if (_dispatcher == NULL) {
+        return;
+    }
+    if (reason >= 0x80) {
+        /* Refused by the broker, sending it again would not help */
+        printf("MQTT: message %u refused: 0x%02x\n", id, reason);
+    }
+    _dispatcher->_scheduler.acked(id);
+}
+#endif
+
+void ConnectionManager::on_match(void *context, uint16_t subscription)
+{
+    Matches *matches = static_cast<Matches *>(context);
+    if (matches->count < MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS) {
+        matches->handlers[matches->count++] =
+            matches->manager->_subscriptions[subscription].handler;
+    }
+}
+
+void ConnectionManager::dispatch(MQTT::MessageData &md)
+{
+    const char *topic = md.topicName.cstring;
+    size_t len;
+    if (topic != NULL) {
+        len = strlen(topic);
+    } else {
+        topic = md.topicName.lenstring.data;
+        len = md.topicName.lenstring.len;
+    }
+
+    /* Collect the handlers first, they may well subscribe */
+    Matches matches;
+    matches.manager = this;
+    matches.count = 0;
+    _mutex.lock();
+    _filters.match(topic, len, &ConnectionManager::on_match, &matches);
+    _mutex.unlock();
+
+    for (size_t i = 0; i < matches.count; i++) {
+        matches.handlers[i](md);
+    }
+}
+
+int ConnectionManager::serialize_publish(unsigned char *buf, size_t size, const char *topic,
+                                         uint8_t *payload, size_t len)
+{
+#if MBED_CONF_APP_MQTT_VERSION == 5
+    return _client->serialize_publish(buf, size, topic, payload, len, MQTT::QOS0, 0, false,
+                                      content_type(topic));
+#else
+    if (payload == NULL) {
+        /* MQTTSerialize_publish() would copy the payload in */
+        int rem = 2 + strlen(topic) + len;
+        if ((size_t) MQTTPacket_len(rem) > size) {
+            return MQTTPACKET_BUFFER_TOO_SHORT;
+        }
+        unsigned char *p = buf;
+        *p++ = 0x30;
+        p += MQTTPacket_encode(p, rem);
+        writeCString(&p, topic);
+        return MQTTPacket_len(rem);
+    }
+    MQTTString name = MQTTString_initializer;
+    name.cstring = const_cast<char *>(topic);
+    return MQTTSerialize_publish(buf, size, 0, 0, 0, 0, name, payload, len);
+#endif
+}
+
+const char *ConnectionManager::content_type(const char *topic)
+{
+#if MBED_CONF_APP_MQTT_STATUS_CBOR
+    if (strcmp(topic, MBED_CONF_APP_MQTT_STATUS_TOPIC) == 0) {
+        return "application/cbor";
+    }
+#endif
+    return _compressor.selected(topic) ? MBED_CONF_APP_COMPRESS_CONTENT_TYPE : NULL;
+}
+
+void ConnectionManager::write_status(JsonWriter &json, const ConnectionStatus &status)
+{
+    static const char *const names[PUBLISH_CLASSES] = { "alarm", "control", "telemetry", "bulk" };
+
+    json.begin_object();
+    json.key("uptime");
+    json.integer(status.uptime_s);
+
+    json.key("reconnects");
+    json.integer(status.reconnect.reconnects);
+    json.key("attempts");
+    json.integer(status.reconnect.attempts);
+    json.key("resumed");
+    json.integer(status.reconnect.resumed);
+    json.key("last_outage_ms");
+    json.integer(status.reconnect.last_ms);
+    json.key("stored");
+    json.integer(status.reconnect.stored);
+    json.key("forwarded");
+    json.integer(status.reconnect.forwarded);
+    json.key("dropped");
+    json.integer(status.reconnect.dropped);
+
+    json.key("link");
+    json.begin_object();
+    json.key("bandwidth");
+    json.integer(status.link.bandwidth);
+    json.key("write_us");
+    json.integer(status.link.write_us);
+    json.key("bytes");
+    json.integer(status.link.bytes);
+    json.key("paced_ms");
+    json.integer(status.link.paced_ms);
+    json.end_object();
+
+    json.key("classes");
+    json.begin_object();
+    for (int c = 0; c < PUBLISH_CLASSES; c++) {
+        json.key(names[c]);
+        json.begin_object();
+        json.key("sent");
+        json.integer(status.classes[c].sent);
+        json.key("late");
+        json.integer(status.classes[c].late);
+        json.key("max_wait_ms");
+        json.integer(status.classes[c].max_wait_ms);
+        json.key("dropped");
+        json.integer(status.classes[c].dropped + status.classes[c].refused);
+        json.end_object();
+    }
+    json.end_object();
+    json.end_object();
+}
+
+int ConnectionManager::publish_status()
+{
+    const char *topic = MBED_CONF_APP_MQTT_STATUS_TOPIC;
+    uint32_t now = now_ms();
+    if (topic[0] == '\0' || !is_connected() ||
+        (int32_t) (now - _status_ms) < MBED_CONF_APP_MQTT_STATUS_INTERVAL * 1000) {
+        return 0;
+    }
+    _status_ms = now;
+
+    ConnectionStatus status;
+    status.uptime_s = now / 1000;
+    status.reconnect = stats();
+    status.link = _pacer.stats();
+    for (int c = 0; c < PUBLISH_CLASSES; c++) {
+        status.classes[c] = _scheduler.stats((PublishClass) c);
+    }
+
+#if MBED_CONF_APP_MQTT_STATUS_CBOR
+    uint8_t cbor[MessageCodec<CborFormat, ConnectionStatus>::MAX_LEN];
+    size_t n = MessageCodec<CborFormat, ConnectionStatus>::encode(status, cbor);
+    int ret = publish_in_record(topic, cbor, n);
+    if (ret == MQTT::BUFFER_OVERFLOW) {
+        printf("MQTT: status message of %lu bytes too large, not sent\n", (unsigned long) n);
+        return 0;
+    }
+    return ret < 0 ? -1 : 0;
+#else
+    /* The length goes into the header, ahead of the JSON */
+    JsonWriter measure(NULL, 0);
+    write_status(measure, status);
+    int len = measure.length();
+    if (len < 0) {
+        return 0;
+    }
+
+    size_t room;
+    unsigned char *record = _connection.begin_record(&room);
+    if (record == NULL) {
+        return -1;
+    }
+    int n = serialize_publish(record, room, topic, NULL, len);
+    if (n <= 0) {
+        printf("MQTT: status message of %d bytes too large, not sent\n", len);
+        return 0;
+    }
+
+    JsonWriter json(reinterpret_cast<char *>(record) + n - len, len);
+    write_status(json, status);
+    if (json.length() != len) {
+        return -1;
+    }
+    return _connection.end_record(n) < 0 ? -1 : 0;
+#endif
+}
+
+int ConnectionManager::publish_in_record(const char *topic, uint8_t *payload, size_t len)
+{
+    size_t room;
+    unsigned char *record = _connection.begin_record(&room);
+    if (record == NULL) {
+        return -1;
+    }
+
+    int n = serialize_publish(record, room, topic, payload, len);
+    if (n <= 0) {
+        return MQTT::BUFFER_OVERFLOW;
+    }
+    return _connection.end_record(n) < 0 ? -1 : n;
+}
+
+int ConnectionManager::drain()
+{
+    while (is_connected()) {
+        bool backlog = _offline != NULL && !_offline->empty();
+        int cls = _scheduler.next(now_ms(), backlog);
+        if (cls < 0) {
+            return 0;
+        }
+
+        int ret;
+        if (cls == PUBLISH_BULK && _scheduler.empty(PUBLISH_BULK)) {
+            ret = send_backlog();
+        } else {
+            ret = send_queued((PublishClass) cls);
+        }
+        if (ret == BACKLOG_STALLED) {
+            return 0;
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int ConnectionManager::send_queued(PublishClass cls)
+{
+    /* Copy out so publishers are not blocked while we send */
+    if (!_scheduler.peek(cls, &_sending)) {
+        return 0;
+    }
+
+    int ret;
+    size_t bytes;
+    uint16_t packet_id = 0;
+    if (_sending.qos == MQTT::QOS0) {
+        ret = publish_in_record(_sending.topic, _sending.payload, _sending.len);
+        bytes = ret;
+    } else {
+#if MBED_CONF_APP_MQTT_VERSION == 5
+        ret = _client->publish(_sending.topic, _sending.payload, _sending.len, _sending.qos,
+                               false, content_type(_sending.topic), &packet_id);
+#else
+        /* MQTT::Client would only say it failed */
+        int rem = 2 + strlen(_sending.topic) + 2 + _sending.len;
+        if (MQTTPacket_len(rem) > MBED_CONF_APP_MQTT_MAX_PACKET_SIZE) {
+            ret = MQTT::BUFFER_OVERFLOW;
+        } else {
+            ret = _client->publish(_sending.topic, _sending.payload, _sending.len, _sending.qos);
+        }
+#endif
+        /* Close enough, for the share of the link */
+        bytes = 4 + strlen(_sending.topic) + _sending.len;
+    }
+    if (ret == MQTT::BUFFER_OVERFLOW) {
+        /* It would fail again after a reconnect, and hold its class up */
+        printf("MQTT: message to %s too large, dropped\n", _sending.topic);
+        _scheduler.drop(cls, _sending.seq);
+        return 0;
+    }
+    if (ret < 0) {
+        printf("MQTT: publish to %s failed: %d\n", _sending.topic, ret);
+        return ret;
+    }
+
+    /* A QoS 1 message not acknowledged yet stays in flight */
+    _scheduler.sent(cls, &_sending, bytes, now_ms(), packet_id);
+    return 0;
+}
+
+int ConnectionManager::send_backlog()
+{
+    int used = 0;
+    int batched = 0;
+    int ret = 0;
+
+    size_t room;
+    unsigned char *record = _connection.begin_record(&room);
+    if (record == NULL) {
+        return -1;
+    }
+    /* Smaller batches on a fast link, where the record overhead matters less */
+    size_t batch = _pacer.adapt(MBED_CONF_APP_OFFLINE_BATCH_SIZE / 4,
+                                MBED_CONF_APP_OFFLINE_BATCH_SIZE);
+    if (room > batch) {
+        room = batch;
+    }
+    if (_forwarded == 0) {
+        _forward_timer.reset();
+        _forward_timer.start();
+    }
+
+    /* Pack as many PUBLISH packets as fit into the record */
+    _offline->rewind();
+    while (true) {
+        size_t len = sizeof (_batch_payload);
+        ret = _offline->peek(_batch_topic, sizeof (_batch_topic), _batch_payload, &len);
+        if (ret != 1) {
+            break;
+        }
+
+        int n = serialize_publish(record + used, room - used, _batch_topic,
+                                  _batch_payload, len);
+        if (n <= 0) {
+            if (used > 0) {
+                /* Goes into the next batch */
+                _offline->unpeek();
+            } else {
+                printf("MQTT: stored message to %s too large, dropped\n", _batch_topic);
+            }
+            ret = 0;
+            break;
+        }
+        used += n;
+        batched++;
+    }
+    if (ret < 0) {
+        printf("MQTT: offline queue read failed: %d\n", ret);
+        return BACKLOG_STALLED;
+    }
+
+    if (used > 0) {
+        /* The whole batch in one record, without waiting for the broker in between */
+        if ((ret = _connection.end_record(used)) < 0) {
+            printf("MQTT: batch of %d stored messages failed: %d\n", batched, ret);
+            return ret;
+        }
+    }
+
+    /* Only now the batch is on its way, stored messages are at least once */
+    if ((ret = _offline->pop()) != 0) {
+        printf("MQTT: offline queue erase failed: %d\n", ret);
+        return BACKLOG_STALLED;
+    }
+    _scheduler.sent(PUBLISH_BULK, NULL, used, now_ms());
+
+    _mutex.lock();
+    _stats.forwarded += batched;
+    _mutex.unlock();
+
+    _forwarded += batched;
+    if (_offline->empty()) {
+        printf("MQTT: forwarded %lu stored messages in %lu ms\n",
+               (unsigned long) _forwarded, (unsigned long) _forward_timer.read_ms());
+        _forwarded = 0;
+    }
+    return 0;
+}
+
+uint32_t ConnectionManager::now_ms()
+{
+    return _clock.read_high_resolution_us() / 1000;
+}
+
+void ConnectionManager::connection_lost()
+{
+    _online = false;
+    if (_client != NULL && _connection.is_connected() && _client->isConnected()) {
+        _client->disconnect();
+    }
+    delete _client;
+    _client = NULL;
+    _connection.close();
+
+    /* The session is gone with what it did not acknowledge, send it again */
+    _scheduler.requeue();
+
+    if (!_down) {
+        /* Start timing the outage */
+        _down = true;
+        _downtime.reset();
+        _downtime.start();
+    }
+}
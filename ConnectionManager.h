@@ -0,0 +1,465 @@
+/*
+ *  Keeps the MQTT uplink connected
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file ConnectionManager.h
+ *  \brief MQTT over TLS with automatic reconnection
+ *  The manager owns the MQTT client, reconnects with jittered exponential
+ *  backoff when the link drops, resumes the TLS session, subscribes again
+ *  and then drains the messages queued while offline.
+ *
+ *  With an OfflineQueue attached, messages published while the uplink is
+ *  down are stored in flash instead of the small RAM queue. After the
+ *  reconnection the backlog is packed into batches of PUBLISH packets that
+ *  each go out in a single TLS record, rather than one round of the MQTT
+ *  client per message.
+ *
+ *  Messages are sent in the order a PublishScheduler picks: alarms first,
+ *  then control, telemetry and the backlog by weight, so an alarm waits at
+ *  most for the message or backlog batch on the wire when it arrives.
+ *  Alarm and control messages are never stored in flash, they wait in RAM
+ *  across an outage and go out ahead of the backlog.
+ *
+ *  QoS 0 messages and the offline batches are serialized straight into the
+ *  TLS output record, see TLSConnection::begin_record(), instead of into a
+ *  buffer that mbedtls_ssl_write() then copies. QoS 1 and 2 messages go
+ *  through the MQTT client. The Mqtt5Client does not wait for a QoS 1
+ *  PUBACK, the message stays in the scheduler until it arrives, and is
+ *  sent again after a reconnect if the session is lost first.
+ *
+ *  The connection's socket writes are paced by a LinkPacer, whose estimate
+ *  of the link's bandwidth also sizes the backlog batches: the whole
+ *  offline-batch-size on a slow link, where a record's overhead counts,
+ *  down to a quarter of it on a fast one, so an alarm waits less behind.
+ *
+ *  With mqtt-version 5 the session is run by Mqtt5Client instead of the
+ *  MQTT 3.1.1 client of MQTT.lib, so that publishes to a topic seen before
+ *  carry a two byte topic alias instead of the topic.
+ *
+ *  The payloads of the topics selected by compress-topics are compressed
+ *  by a PayloadCompressor before they are queued or stored, see there.
+ *
+ *  With mqtt-status-topic set, the manager's statistics are published
+ *  there as a JSON object every mqtt-status-interval seconds. The object
+ *  is written by a JsonWriter straight into the TLS record, after the
+ *  PUBLISH header: once without a buffer to learn the length the header
+ *  carries, then in place. With mqtt-status-cbor the statistics go out
+ *  as CBOR instead, encoded by a MessageCodec in a fraction of the bytes.
+ *
+ *  Incoming messages are dispatched through a TopicTrie of the filters
+ *  subscribed to, by a default handler, and the MQTT client's own table
+ *  of handlers is emptied right after every subscription. The client
+ *  would otherwise compare each message with every filter in turn.
+ */
+
+#ifndef __CONNECTION_MANAGER_H_
+#define __CONNECTION_MANAGER_H_
+
+#include "mbed.h"
+#include "MQTTClient.h"
+#include "MQTTmbed.h"
+
+#include "TLSConnection.h"
+#include "TLSNetwork.h"
+#include "OfflineQueue.h"
+#include "TopicTrie.h"
+#include "Mqtt5Client.h"
+#include "PublishScheduler.h"
+#include "LinkPacer.h"
+#include "PayloadCompressor.h"
+#include "JsonWriter.h"
+#include "MessageCodec.h"
+
+/** MQTT protocol version: 5, or 4 for MQTT 3.1.1 brokers */
+#ifndef MBED_CONF_APP_MQTT_VERSION
+#define MBED_CONF_APP_MQTT_VERSION 5
+#endif
+
+/** Topics published to that are given an MQTT v5 topic alias */
+#ifndef MBED_CONF_APP_MQTT5_TOPIC_ALIASES
+#define MBED_CONF_APP_MQTT5_TOPIC_ALIASES 8
+#endif
+
+/** Size of the MQTT client's send and receive buffers */
+#ifndef MBED_CONF_APP_MQTT_MAX_PACKET_SIZE
+#define MBED_CONF_APP_MQTT_MAX_PACKET_SIZE 256
+#endif
+
+/** Number of topic filters that can be subscribed to */
+#ifndef MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS
+#define MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS 5
+#endif
+
+/** Levels of the subscribed filters not shared with another, in the dispatch trie */
+#ifndef MBED_CONF_APP_MQTT_DISPATCH_LEVELS
+#define MBED_CONF_APP_MQTT_DISPATCH_LEVELS (4 * MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS)
+#endif
+
+/** Seconds between MQTT keep alive pings */
+#ifndef MBED_CONF_APP_MQTT_KEEPALIVE
+#define MBED_CONF_APP_MQTT_KEEPALIVE 60
+#endif
+
+/** Topic the statistics are published to, as JSON or CBOR, empty for none */
+#ifndef MBED_CONF_APP_MQTT_STATUS_TOPIC
+#define MBED_CONF_APP_MQTT_STATUS_TOPIC ""
+#endif
+
+/** Seconds between two statistics messages */
+#ifndef MBED_CONF_APP_MQTT_STATUS_INTERVAL
+#define MBED_CONF_APP_MQTT_STATUS_INTERVAL 60
+#endif
+
+/** Publish the statistics as CBOR rather than JSON */
+#ifndef MBED_CONF_APP_MQTT_STATUS_CBOR
+#define MBED_CONF_APP_MQTT_STATUS_CBOR false
+#endif
+
+/** Bytes of the offline backlog batched in one TLS record, at least one packet */
+#ifndef MBED_CONF_APP_OFFLINE_BATCH_SIZE
+#define MBED_CONF_APP_OFFLINE_BATCH_SIZE 1024
+#endif
+
+/** First reconnect delay in milliseconds, doubled on every failure */
+#ifndef MBED_CONF_APP_RECONNECT_BACKOFF_MIN
+#define MBED_CONF_APP_RECONNECT_BACKOFF_MIN 500
+#endif
+
+/** Longest reconnect delay in milliseconds */
+#ifndef MBED_CONF_APP_RECONNECT_BACKOFF_MAX
+#define MBED_CONF_APP_RECONNECT_BACKOFF_MAX 60000
+#endif
+
+/**
+ * Time to reconnect statistics, all durations in milliseconds
+ */
+struct ReconnectStats {
+    uint32_t reconnects;    /**< Successful reconnections */
+    uint32_t attempts;      /**< Connection attempts, including failed ones */
+    uint32_t resumed;       /**< Reconnections that resumed the TLS session */
+    uint32_t last_ms;       /**< Downtime of the last outage */
+    uint32_t min_ms;        /**< Shortest outage */
+    uint32_t max_ms;        /**< Longest outage */
+    uint64_t total_ms;      /**< Sum of all outages */
+    uint32_t dropped;       /**< Messages dropped or refused because the queue was full */
+    uint32_t stored;        /**< Messages stored in flash while offline */
+    uint32_t forwarded;     /**< Stored messages sent after reconnecting */
+};
+
+/**
+ * The statistics published to the status topic
+ */
+struct ConnectionStatus {
+    uint32_t uptime_s;
+    ReconnectStats reconnect;
+    LinkStats link;
+    PublishClassStats classes[PUBLISH_CLASSES];
+};
+
+/**
+ * \brief ConnectionManager keeps an MQTT session to a broker alive.
+ *
+ * publish() and subscribe() may be called from any thread; the messages
+ * are queued and sent by the thread running run(), which is also the
+ * thread message handlers are called on.
+ *
+ * There is one ConnectionManager per process. The MQTT clients take plain
+ * functions as message and PUBACK handlers, with no context, so these
+ * reach the manager through a static pointer set when it connects: a
+ * second manager connecting would take the first one's messages.
+ */
+class ConnectionManager {
+public:
+#if MBED_CONF_APP_MQTT_VERSION == 5
+    typedef Mqtt5Client<TLSNetwork, MBED_CONF_APP_MQTT_MAX_PACKET_SIZE,
+                        MBED_CONF_APP_MQTT5_TOPIC_ALIASES, MBED_CONF_APP_MQTT_MAX_TOPIC_LEN> MQTTClient;
+#else
+    typedef MQTT::Client<TLSNetwork, Countdown, MBED_CONF_APP_MQTT_MAX_PACKET_SIZE,
+                         MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS> MQTTClient;
+#endif
+    typedef MQTTClient::messageHandler message_handler_t;
+
+    /**
+     * ConnectionManager Constructor
+     *
+     * @param[in] connection The TLS connection to run MQTT over, its
+     *            TcpTransport is paced by the manager
+     * @param[in] brokers The brokers, in order of preference
+     * @param[in] count The number of brokers
+     * @param[in] client_id The MQTT client identifier
+     */
+    ConnectionManager(TLSConnection<TcpTransport> &connection, const ConnectEndpoint *brokers,
+                      size_t count, const char *client_id);
+    /**
+     * ConnectionManager Destructor
+     */
+    ~ConnectionManager();
+
+    /**
+     * Store the messages published while offline in flash. Stored messages
+     * are sent with QoS 0, in the order they were published.
+     *
+     * @param[in] queue The mounted queue, or NULL to use the RAM queue only
+     */
+    void set_offline_queue(OfflineQueue *queue);
+
+    /**
+     * Subscribe to a topic filter, now and after every reconnection.
+     *
+     * @param[in] topic_filter The filter, copied
+     * @param[in] qos The requested QoS
+     * @param[in] handler Called on the run() thread for each message
+     * @return 0 on success, or -1 if the filter is invalid or too long, or the table full
+     */
+    int subscribe(const char *topic_filter, MQTT::QoS qos, message_handler_t handler);
+
+    /**
+     * Queue a message for publishing. It is sent as soon as the uplink is
+     * up, in the order the PublishScheduler picks; when the queue is full
+     * the oldest message of the least urgent class is dropped. While the
+     * uplink is down or a stored backlog remains, telemetry and bulk
+     * messages go to the offline queue if there is one. The payload is
+     * compressed first if the topic is selected for it.
+     *
+     * @param[in] topic The topic name, copied
+     * @param[in] payload The payload, copied
+     * @param[in] len The payload length
+     * @param[in] qos The QoS to publish with
+     * @param[in] cls The message's class
+     * @return 0 on success, or -1 if the topic or payload, compressed or
+     *         not, is too large or the queue is full of more urgent messages
+     */
+    int publish(const char *topic, const void *payload, size_t len,
+                MQTT::QoS qos = MQTT::QOS0, PublishClass cls = PUBLISH_TELEMETRY);
+
+    /**
+     * Keep the uplink connected and process traffic, never returns.
+     */
+    void run();
+
+    /**
+     * One iteration of run(): reconnect if needed, send the queued
+     * messages and process incoming traffic for up to yield_ms.
+     */
+    void poll(uint32_t yield_ms = 100);
+
+    /**
+     * Whether the MQTT session is up
+     */
+    bool is_connected();
+
+    /**
+     * A snapshot of the reconnection statistics
+     */
+    ReconnectStats stats();
+
+    /**
+     * A snapshot of the statistics of a class of messages
+     */
+    PublishClassStats publish_stats(PublishClass cls) {
+        return _scheduler.stats(cls);
+    }
+
+    /**
+     * The pacer of the connection's writes, and its link estimate
+     */
+    LinkPacer &pacer() {
+        return _pacer;
+    }
+
+    /**
+     * The compressor of the payloads, to select more topics
+     */
+    PayloadCompressor &compressor() {
+        return _compressor;
+    }
+
+    /**
+     * Print the reconnection, scheduling, link and compression statistics
+     */
+    void print_stats();
+
+protected:
+    struct Subscription {
+        char topic_filter[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+        MQTT::QoS qos;
+        message_handler_t handler;
+        bool active;            /**< Subscribed in the current session */
+    };
+
+    /**
+     * Connect TLS and MQTT once and subscribe again
+     *
+     * @return 0 on success, or an error code on failure
+     */
+    int connect_once();
+
+    /**
+     * Reconnect with backoff until the session is up again
+     */
+    void reconnect();
+
+    /**
+     * The delay before the given reconnect attempt, with jitter
+     */
+    uint32_t backoff_ms(uint32_t attempt);
+
+    /**
+     * Subscribe the filters not yet active in this session
+     */
+    int subscribe_pending();
+
+    /** The handlers of the filters matching a message */
+    struct Matches {
+        ConnectionManager *manager;
+        size_t count;
+        message_handler_t handlers[MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS];
+    };
+
+    /**
+     * Default MQTT message handler, the client's table being empty
+     */
+    static void on_message(MQTT::MessageData &md);
+
+#if MBED_CONF_APP_MQTT_VERSION == 5
+    /**
+     * Mqtt5Client PUBACK handler, release the message acknowledged
+     */
+    static void on_puback(uint16_t id, uint8_t reason);
+#endif
+
+    /**
+     * TopicTrie callback, collect a subscription matching the message
+     */
+    static void on_match(void *context, uint16_t subscription);
+
+    /**
+     * Call the handlers of the filters matching a message
+     */
+    void dispatch(MQTT::MessageData &md);
+
+    /**
+     * The Content Type of the messages to a topic, NULL for none
+     */
+    const char *content_type(const char *topic);
+
+    /**
+     * Serialize a QoS 0 PUBLISH into a buffer, with its topic alias and
+     * Content Type in v5
+     *
+     * @param[in] payload The payload, or NULL to leave its len bytes at the
+     *            end of the packet to the caller
+     * @return The packet length, or a negative value if it does not fit
+     */
+    int serialize_publish(unsigned char *buf, size_t size, const char *topic,
+                          uint8_t *payload, size_t len);
+
+    /**
+     * Serialize a QoS 0 PUBLISH straight into a TLS record and send it
+     *
+     * @return The bytes sent, MQTT::BUFFER_OVERFLOW if the message does not
+     *         fit a record or the broker's Maximum Packet Size, or -1 if the
+     *         connection failed
+     */
+    int publish_in_record(const char *topic, uint8_t *payload, size_t len);
+
+    /**
+     * Write the status message, the same for the same status
+     */
+    static void write_status(JsonWriter &json, const ConnectionStatus &status);
+
+    /**
+     * Publish the statistics to the status topic, QoS 0, if it is time to
+     *
+     * @return 0 on success, or an error code on failure
+     */
+    int publish_status();
+
+    /**
+     * Send the queued messages and the offline backlog, in the order the
+     * scheduler picks, until there is nothing left or a failure
+     *
+     * @return 0 on success, or an error code on failure
+     */
+    int drain();
+
+    /**
+     * Publish the oldest message of a class
+     *
+     * @return 0 on success, or an error code on failure
+     */
+    int send_queued(PublishClass cls);
+
+    /**
+     * Send one batch of the offline backlog, in a single TLS record
+     *
+     * @return 0 on success, BACKLOG_STALLED if the backlog cannot be read
+     *         for now, or an error code on failure
+     */
+    int send_backlog();
+
+    /**
+     * Milliseconds on the manager's clock, wrapping at 2^32
+     */
+    uint32_t now_ms();
+
+    /**
+     * Tear the session down after a failure
+     */
+    void connection_lost();
+
+protected:
+    static const int BACKLOG_STALLED = 1;
+
+    static ConnectionManager *_dispatcher;  /**< The manager whose client is running, the only one */
+
+    TLSConnection<TcpTransport> &_connection;
+    TLSNetwork _network;
+    MQTTClient *_client;            /**< Recreated for every session, owned */
+
+    const ConnectEndpoint *_brokers;
+    size_t _broker_count;
+    const char *_client_id;
+
+    Mutex _mutex;                   /**< Guards the tables and statistics below */
+    Subscription _subscriptions[MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS];
+    size_t _subscription_count;
+    TopicTrie<MBED_CONF_APP_MQTT_DISPATCH_LEVELS + 1,
+              MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS * (MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1),
+              MBED_CONF_APP_MQTT_MAX_SUBSCRIPTIONS> _filters;
+
+    PublishScheduler _scheduler;
+    PublishMessage _sending;        /**< The message being published */
+    LinkPacer _pacer;               /**< Paces the connection's writes */
+    PayloadCompressor _compressor;
+
+    OfflineQueue *_offline;
+    volatile bool _online;          /**< Cleared as soon as the session is lost */
+    char _batch_topic[OfflineQueue::MAX_TOPIC_LEN + 1];
+    uint8_t _batch_payload[MBED_CONF_APP_PUBLISH_MAX_PAYLOAD];
+    uint32_t _status_ms;            /**< When the last status message was sent */
+    uint32_t _forwarded;            /**< Stored messages sent since the backlog started draining */
+    Timer _forward_timer;
+
+    bool _was_connected;            /**< A session was up before the outage */
+    bool _down;                     /**< The uplink is down */
+    Timer _downtime;                /**< Runs while the uplink is down */
+    Timer _clock;
+    ReconnectStats _stats;
+};
+
+#endif /* __CONNECTION_MANAGER_H_ */
@@ -0,0 +1,287 @@
+/*
+ *  A small cache of resolved server addresses
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "DnsCache.h"
+
+namespace {
+
+/* Marks a stored cache image, bump when the layout changes */
+const uint32_t DNS_CACHE_MAGIC = 0x444e5302;
+
+/* One persisted entry, without a time to live: the clock does not run while
+   the power is off, so it would mean nothing after a reboot */
+struct StoredEntry {
+    char hostname[DnsCache::MAX_HOSTNAME_LEN + 1];
+    nsapi_addr_t addr;
+};
+
+struct StoredImage {
+    uint32_t magic;
+    uint32_t count;
+    StoredEntry entries[MBED_CONF_APP_DNS_CACHE_SIZE];
+};
+
+/* Round a size up to a multiple of the program or read unit of a device */
+bd_size_t round_up(bd_size_t size, bd_size_t unit)
+{
+    return ((size + unit - 1) / unit) * unit;
+}
+
+}
+
+DnsCache::DnsCache(NetworkInterface *net_iface, uint32_t ttl_s) :
+        _net_iface(net_iface), _storage(NULL), _ttl_s(ttl_s),
+        _use_count(0), _hits(0), _misses(0), _stored_hash(0), _stored_at(0), _stored(false)
+{
+    memset(_entries, 0, sizeof (_entries));
+    _clock.start();
+}
+
+int DnsCache::set_storage(BlockDevice *bd)
+{
+    _mutex.lock();
+    _storage = bd;
+    int ret = load();
+    _mutex.unlock();
+    return ret;
+}
+
+nsapi_error_t DnsCache::resolve(const char *hostname, SocketAddress *address, bool fresh,
+                                bool *cached)
+{
+    if (cached != NULL) {
+        *cached = false;
+    }
+
+    /* Address literals need no lookup at all */
+    if (address->set_ip_address(hostname)) {
+        return NSAPI_ERROR_OK;
+    }
+
+    if (!fresh) {
+        _mutex.lock();
+        Entry *entry = find(hostname);
+        if (entry != NULL && (int32_t) (entry->expires - now()) > 0) {
+            entry->last_used = ++_use_count;
+            address->set_addr(entry->addr);
+            _hits++;
+            _mutex.unlock();
+            if (cached != NULL) {
+                *cached = true;
+            }
+            return NSAPI_ERROR_OK;
+        }
+        _mutex.unlock();
+    }
+
+    /* Resolve without holding the lock, this can take a while */
+    SocketAddress resolved;
+    nsapi_error_t ret = _net_iface->gethostbyname(hostname, &resolved);
+    if (ret != NSAPI_ERROR_OK) {
+        printf("DNS: resolving %s failed: %d\n", hostname, ret);
+
+        /* The address stored before the reboot is better than none */
+        _mutex.lock();
+        Entry *entry = find(hostname);
+        if (entry != NULL && entry->hint) {
+            entry->last_used = ++_use_count;
+            address->set_addr(entry->addr);
+            _hits++;
+            ret = NSAPI_ERROR_OK;
+            if (cached != NULL) {
+                *cached = true;
+            }
+        }
+        _mutex.unlock();
+        return ret;
+    }
+    address->set_addr(resolved.get_addr());
+
+    _mutex.lock();
+    _misses++;
+    insert(hostname, resolved.get_addr());
+    store_if_due();
+    _mutex.unlock();
+
+    return NSAPI_ERROR_OK;
+}
+
+int DnsCache::flush()
+{
+    _mutex.lock();
+    int ret = 0;
+    if (_storage != NULL && content_hash() != _stored_hash) {
+        ret = store();
+    }
+    _mutex.unlock();
+    return ret;
+}
+
+void DnsCache::invalidate(const char *hostname)
+{
+    _mutex.lock();
+    Entry *entry = find(hostname);
+    if (entry != NULL) {
+        /* Stored with the next change, if it is not inserted again by then */
+        entry->hostname[0] = '\0';
+    }
+    _mutex.unlock();
+}
+
+uint32_t DnsCache::now()
+{
+    return (uint32_t) (_clock.read_high_resolution_us() / 1000000);
+}
+
+DnsCache::Entry *DnsCache::find(const char *hostname)
+{
+    for (size_t i = 0; i < MBED_CONF_APP_DNS_CACHE_SIZE; i++) {
+        if (_entries[i].hostname[0] != '\0' &&
+            strcmp(_entries[i].hostname, hostname) == 0) {
+            return &_entries[i];
+        }
+    }
+    return NULL;
+}
+
+void DnsCache::insert(const char *hostname, const nsapi_addr_t &addr)
+{
+    if (strlen(hostname) > MAX_HOSTNAME_LEN) {
+        return;
+    }
+
+    Entry *entry = find(hostname);
+    if (entry == NULL) {
+        /* Take a free slot, or the least recently used one */
+        entry = &_entries[0];
+        for (size_t i = 0; i < MBED_CONF_APP_DNS_CACHE_SIZE; i++) {
+            if (_entries[i].hostname[0] == '\0') {
+                entry = &_entries[i];
+                break;
+            }
+            if (_entries[i].last_used < entry->last_used) {
+                entry = &_entries[i];
+            }
+        }
+        strcpy(entry->hostname, hostname);
+    }
+
+    entry->addr = addr;
+    entry->expires = now() + _ttl_s;
+    entry->last_used = ++_use_count;
+    entry->hint = false;
+}
+
+uint32_t DnsCache::content_hash()
+{
+    /* FNV-1a of every entry, summed so that the slots do not matter */
+    uint32_t sum = 0;
+    for (size_t i = 0; i < MBED_CONF_APP_DNS_CACHE_SIZE; i++) {
+        const Entry &entry = _entries[i];
+        if (entry.hostname[0] == '\0') {
+            continue;
+        }
+        uint32_t h = 2166136261UL;
+        for (const char *c = entry.hostname; *c != '\0'; c++) {
+            h = (h ^ (uint8_t) *c) * 16777619UL;
+        }
+        const uint8_t *a = reinterpret_cast<const uint8_t *>(&entry.addr);
+        for (size_t j = 0; j < sizeof (entry.addr); j++) {
+            h = (h ^ a[j]) * 16777619UL;
+        }
+        sum += h;
+    }
+    return sum;
+}
+
+void DnsCache::store_if_due()
+{
+    if (_storage == NULL || content_hash() == _stored_hash) {
+        return;
+    }
+    if (_stored && now() - _stored_at < MBED_CONF_APP_DNS_CACHE_STORE_INTERVAL) {
+        return;
+    }
+    store();
+}
+
+int DnsCache::store()
+{
+    if (_storage == NULL) {
+        return 0;
+    }
+
+    bd_size_t size = round_up(sizeof (StoredImage), _storage->get_program_size());
+    uint8_t *buf = new uint8_t[size];
+    memset(buf, 0, size);
+
+    StoredImage *image = reinterpret_cast<StoredImage *>(buf);
+    image->magic = DNS_CACHE_MAGIC;
+    image->count = 0;
+    for (size_t i = 0; i < MBED_CONF_APP_DNS_CACHE_SIZE; i++) {
+        const Entry &entry = _entries[i];
+        if (entry.hostname[0] == '\0') {
+            continue;
+        }
+        StoredEntry &stored = image->entries[image->count++];
+        strcpy(stored.hostname, entry.hostname);
+        stored.addr = entry.addr;
+    }
+
+    int ret = _storage->erase(0, _storage->get_erase_size());
+    if (ret == 0) {
+        ret = _storage->program(buf, 0, size);
+    }
+    delete[] buf;
+
+    if (ret != 0) {
+        printf("DNS: storing the cache failed: %d\n", ret);
+    }
+    /* Not tried again before the interval, even after a failure */
+    _stored_hash = content_hash();
+    _stored_at = now();
+    _stored = true;
+    return ret;
+}
+
+int DnsCache::load()
+{
+    bd_size_t size = round_up(sizeof (StoredImage), _storage->get_read_size());
+    uint8_t *buf = new uint8_t[size];
+
+    int ret = _storage->read(buf, 0, size);
+    const StoredImage *image = reinterpret_cast<const StoredImage *>(buf);
+    if (ret == 0 && image->magic == DNS_CACHE_MAGIC &&
+        image->count <= MBED_CONF_APP_DNS_CACHE_SIZE) {
+        for (size_t i = 0; i < image->count; i++) {
+            const StoredEntry &stored = image->entries[i];
+            Entry &entry = _entries[i];
+            memcpy(entry.hostname, stored.hostname, sizeof (entry.hostname));
+            entry.hostname[MAX_HOSTNAME_LEN] = '\0';
+            entry.addr = stored.addr;
+            /* Resolved again before it is used, see resolve() */
+            entry.expires = now();
+            entry.last_used = ++_use_count;
+            entry.hint = true;
+        }
+        _stored_hash = content_hash();
+    }
+    delete[] buf;
+
+    return ret;
+}
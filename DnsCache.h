@@ -0,0 +1,183 @@
+/*
+ *  A small cache of resolved server addresses
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file DnsCache.h
+ *  \brief Hostname to address cache with a time to live
+ *  Resolving through the ESP8266 AT stack costs hundreds of milliseconds, so
+ *  the addresses of the few servers we talk to are kept here, optionally
+ *  persisted on a block device so they survive a reboot.
+ *
+ *  Every write to the storage erases a flash unit, so the cache lives in
+ *  RAM and is only written when the hostnames or addresses it holds differ
+ *  from those stored, at most once every dns-cache-store-interval seconds.
+ *  Reconnecting to the same server over and over writes nothing. There is
+ *  no clock that runs while the power is off, so the entries loaded at
+ *  boot are only hints: the name is resolved again, and the stored address
+ *  is used if that fails.
+ */
+
+#ifndef __DNS_CACHE_H_
+#define __DNS_CACHE_H_
+
+#include "mbed.h"
+
+/** Number of hostnames kept in the cache */
+#ifndef MBED_CONF_APP_DNS_CACHE_SIZE
+#define MBED_CONF_APP_DNS_CACHE_SIZE 4
+#endif
+
+/** Seconds a resolved address is used before it is resolved again */
+#ifndef MBED_CONF_APP_DNS_CACHE_TTL
+#define MBED_CONF_APP_DNS_CACHE_TTL 300
+#endif
+
+/** Least seconds between two writes of the cache to the storage */
+#ifndef MBED_CONF_APP_DNS_CACHE_STORE_INTERVAL
+#define MBED_CONF_APP_DNS_CACHE_STORE_INTERVAL 3600
+#endif
+
+/**
+ * \brief DnsCache resolves hostnames through a NetworkInterface and keeps
+ * the results for a fixed time to live.
+ *
+ * The network stacks we use do not report the record TTL, so every entry
+ * gets the configured one. When full, the least recently used entry is
+ * replaced. All methods are thread safe.
+ */
+class DnsCache {
+public:
+    /** Longest hostname that is cached, longer ones are always resolved */
+    static const size_t MAX_HOSTNAME_LEN = 63;
+
+    /**
+     * DnsCache Constructor
+     *
+     * @param[in] net_iface The interface used for resolving
+     * @param[in] ttl_s The time to live of an entry, in seconds
+     */
+    DnsCache(NetworkInterface *net_iface, uint32_t ttl_s = MBED_CONF_APP_DNS_CACHE_TTL);
+
+    /**
+     * Persist the cache on a block device. The entries stored are loaded
+     * right away, as hints used only when resolving fails.
+     *
+     * @param[in] bd The initialized block device, one erase unit is used
+     * @return 0 on success, or a block device error code on failure
+     */
+    int set_storage(BlockDevice *bd);
+
+    /**
+     * Resolve a hostname, from the cache when a valid entry exists.
+     *
+     * @param[in] hostname The name to resolve, or an IP address literal
+     * @param[out] address The resolved address, the port is left untouched
+     * @param[in] fresh Skip the cache and resolve through the network
+     * @param[out] cached Optionally set to whether the cache answered
+     * @return NSAPI_ERROR_OK on success, or an nsapi error code on failure
+     */
+    nsapi_error_t resolve(const char *hostname, SocketAddress *address, bool fresh = false,
+                          bool *cached = NULL);
+
+    /**
+     * Drop the entry of a hostname, e.g. after connecting to it failed
+     */
+    void invalidate(const char *hostname);
+
+    /**
+     * Write the cache to the storage now if it changed, e.g. before a reset
+     *
+     * @return 0 on success, or a block device error code on failure
+     */
+    int flush();
+
+    /**
+     * Number of resolutions served from the cache
+     */
+    uint32_t hits() const {
+        return _hits;
+    }
+
+    /**
+     * Number of resolutions that went to the network
+     */
+    uint32_t misses() const {
+        return _misses;
+    }
+
+protected:
+    struct Entry {
+        char hostname[MAX_HOSTNAME_LEN + 1]; /**< Empty when the slot is free */
+        nsapi_addr_t addr;                   /**< The resolved address */
+        uint32_t expires;                    /**< Expiry, in seconds since boot */
+        uint32_t last_used;                  /**< For LRU replacement */
+        bool hint;                           /**< Loaded at boot, expired */
+    };
+
+    /**
+     * Seconds since boot
+     */
+    uint32_t now();
+
+    /**
+     * Find the entry of a hostname, with _mutex held
+     */
+    Entry *find(const char *hostname);
+
+    /**
+     * Insert or refresh an entry, with _mutex held
+     */
+    void insert(const char *hostname, const nsapi_addr_t &addr);
+
+    /**
+     * A hash of the hostnames and addresses held, in any order
+     */
+    uint32_t content_hash();
+
+    /**
+     * Write the cache to the storage if it changed and the last write is
+     * at least the store interval ago, with _mutex held
+     */
+    void store_if_due();
+
+    /**
+     * Write the cache to the storage, with _mutex held
+     */
+    int store();
+
+    /**
+     * Read the cache from the storage, with _mutex held
+     */
+    int load();
+
+protected:
+    NetworkInterface *_net_iface;
+    BlockDevice *_storage;
+    Mutex _mutex;
+    Timer _clock;
+    uint32_t _ttl_s;
+    uint32_t _use_count;
+    uint32_t _hits;
+    uint32_t _misses;
+    uint32_t _stored_hash;          /**< content_hash() of what the storage holds */
+    uint32_t _stored_at;            /**< When it was written, in seconds since boot */
+    bool _stored;                   /**< Written since boot */
+
+    Entry _entries[MBED_CONF_APP_DNS_CACHE_SIZE];
+};
+
+#endif /* __DNS_CACHE_H_ */
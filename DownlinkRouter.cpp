@@ -0,0 +1,390 @@
+/*
+ *  Routing of MQTT messages from the uplink to XBee nodes
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "DownlinkRouter.h"
+
+namespace {
+
+/* The level under the prefix the router subscribes to */
+const char DOWN_LEVEL[] = "/down/";
+const size_t DOWN_LEVEL_LEN = sizeof (DOWN_LEVEL) - 1;
+
+const uint32_t DOWNLINK_STACK_SIZE = 1536;
+
+}
+
+DownlinkRouter *DownlinkRouter::_instance = NULL;
+
+DownlinkRouter::DownlinkRouter(ConnectionManager &mqtt, XBeeRequests &requests,
+                               XBeeFragmenter &fragmenter, const char *topic_prefix) :
+        _mqtt(mqtt), _requests(requests), _fragmenter(fragmenter), _topic_prefix(topic_prefix),
+        _in_queue(0), _next_node(0), _payload(NULL), _payload_len(0),
+        _wakeup(0), _thread(osPriorityNormal, DOWNLINK_STACK_SIZE)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    memset(_nodes, 0, sizeof (_nodes));
+    memset(_matched, 0, sizeof (_matched));
+
+    /* Every message on the free list */
+    for (uint16_t i = 0; i < MBED_CONF_APP_XBEE_DOWNLINK_QUEUE_SIZE; i++) {
+        _messages[i].next = i + 1 < MBED_CONF_APP_XBEE_DOWNLINK_QUEUE_SIZE ? i + 1 : NONE;
+    }
+    _free = 0;
+    _clock.start();
+}
+
+DownlinkRouter::~DownlinkRouter()
+{
+    _thread.terminate();
+    if (_instance == this) {
+        _instance = NULL;
+    }
+}
+
+int DownlinkRouter::start()
+{
+    if (_instance != NULL) {
+        return -1;
+    }
+    _instance = this;
+
+    load_routes(MBED_CONF_APP_XBEE_DOWNLINK_ROUTES);
+
+    char filter[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+    snprintf(filter, sizeof (filter), "%s%s#", _topic_prefix, DOWN_LEVEL);
+    if (_mqtt.subscribe(filter, MQTT::QOS1, &DownlinkRouter::on_message) != 0) {
+        printf("XBee: downlink subscription to %s failed\n", filter);
+        _instance = NULL;
+        return -1;
+    }
+
+    _thread.start(callback(this, &DownlinkRouter::downlink_task));
+    return 0;
+}
+
+int DownlinkRouter::add_route(const char *filter, uint64_t addr64)
+{
+    _mutex.lock();
+    uint16_t node = find_node(addr64, true);
+    int ret = node != NONE ? _routes.insert(filter, node) : -1;
+    _mutex.unlock();
+
+    return ret;
+}
+
+int DownlinkRouter::set_sleep_schedule(uint64_t addr64, uint32_t period_ms, uint32_t awake_ms)
+{
+    _mutex.lock();
+    uint16_t node = find_node(addr64, true);
+    if (node != NONE) {
+        _nodes[node].period_ms = period_ms;
+        _nodes[node].awake_ms = awake_ms;
+    }
+    _mutex.unlock();
+
+    /* Queued messages may be due under the new schedule */
+    _wakeup.release();
+    return node != NONE ? 0 : -1;
+}
+
+void DownlinkRouter::node_heard(uint64_t addr64, uint16_t addr16)
+{
+    bool pending = false;
+
+    _mutex.lock();
+    uint16_t node = find_node(addr64, false);
+    if (node != NONE) {
+        _nodes[node].addr16 = addr16;
+        _nodes[node].heard = true;
+        _nodes[node].heard_ms = now_ms();
+        pending = _nodes[node].queued > 0;
+    }
+    _mutex.unlock();
+
+    if (pending) {
+        _wakeup.release();
+    }
+}
+
+DownlinkStats DownlinkRouter::stats()
+{
+    _mutex.lock();
+    DownlinkStats stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void DownlinkRouter::on_message(MQTT::MessageData &md)
+{
+    DownlinkRouter *router = _instance;
+    if (router == NULL) {
+        return;
+    }
+
+    /* Strip <prefix>/down/ */
+    const char *topic = md.topicName.lenstring.data;
+    size_t len = md.topicName.lenstring.len;
+    size_t prefix_len = strlen(router->_topic_prefix);
+    if (len < prefix_len + DOWN_LEVEL_LEN ||
+        memcmp(topic, router->_topic_prefix, prefix_len) != 0 ||
+        memcmp(topic + prefix_len, DOWN_LEVEL, DOWN_LEVEL_LEN) != 0) {
+        return;
+    }
+
+    router->route(topic + prefix_len + DOWN_LEVEL_LEN, len - prefix_len - DOWN_LEVEL_LEN,
+                  static_cast<const uint8_t *>(md.message.payload), md.message.payloadlen);
+}
+
+void DownlinkRouter::route(const char *topic, size_t topic_len, const uint8_t *payload, size_t len)
+{
+    _mutex.lock();
+    _stats.received++;
+    if (len > MBED_CONF_APP_XBEE_DOWNLINK_MAX_PAYLOAD) {
+        _stats.oversized++;
+        _mutex.unlock();
+        return;
+    }
+
+    _payload = payload;
+    _payload_len = len;
+    memset(_matched, 0, sizeof (_matched));
+
+    uint32_t matched = 0;
+    const char *sep = (const char *) memchr(topic, '/', topic_len);
+    uint64_t addr64;
+    if (XBeeRequests::parse_addr64(topic, sep != NULL ? sep - topic : topic_len, &addr64)) {
+        /* Addressed to the node itself */
+        uint16_t node = find_node(addr64, true);
+        if (node != NONE) {
+            enqueue(node);
+            matched = 1;
+        }
+    } else {
+        matched = _routes.match(topic, topic_len, &DownlinkRouter::on_match, this);
+    }
+
+    if (matched == 0) {
+        _stats.unrouted++;
+    }
+    _payload = NULL;
+    _mutex.unlock();
+
+    if (matched > 0) {
+        _wakeup.release();
+    }
+}
+
+void DownlinkRouter::on_match(void *context, uint16_t node)
+{
+    static_cast<DownlinkRouter *>(context)->enqueue(node);
+}
+
+void DownlinkRouter::enqueue(uint16_t index)
+{
+    /* Several routes may lead to the same node, it gets one copy */
+    if (_matched[index]) {
+        return;
+    }
+    _matched[index] = true;
+
+    Node &node = _nodes[index];
+    if (_payload_len > MAX_UNFRAGMENTED && !_fragmenter.is_peer(node.addr64)) {
+        /* Only a fragmenter peer can take more than one frame */
+        _stats.oversized++;
+        return;
+    }
+    if (node.queued >= MBED_CONF_APP_XBEE_DOWNLINK_PER_NODE) {
+        /* A newer command supersedes the oldest */
+        uint16_t oldest = node.head;
+        node.head = _messages[oldest].next;
+        if (node.head == NONE) {
+            node.tail = NONE;
+        }
+        _messages[oldest].next = _free;
+        _free = oldest;
+        node.queued--;
+        _in_queue--;
+        _stats.dropped++;
+    }
+
+    if (_free == NONE) {
+        _stats.queue_full++;
+        return;
+    }
+
+    uint16_t m = _free;
+    _free = _messages[m].next;
+    _messages[m].next = NONE;
+    _messages[m].len = _payload_len;
+    memcpy(_messages[m].data, _payload, _payload_len);
+
+    if (node.tail == NONE) {
+        node.head = m;
+    } else {
+        _messages[node.tail].next = m;
+    }
+    node.tail = m;
+    node.queued++;
+
+    _in_queue++;
+    _stats.queued++;
+    if (_in_queue > _stats.max_queued) {
+        _stats.max_queued = _in_queue;
+    }
+}
+
+uint16_t DownlinkRouter::find_node(uint64_t addr64, bool add)
+{
+    uint16_t unused = NONE;
+    for (uint16_t i = 0; i < MBED_CONF_APP_XBEE_DOWNLINK_NODES; i++) {
+        if (!_nodes[i].used) {
+            if (unused == NONE) {
+                unused = i;
+            }
+        } else if (_nodes[i].addr64 == addr64) {
+            return i;
+        }
+    }
+    if (!add || unused == NONE) {
+        return NONE;
+    }
+
+    Node &node = _nodes[unused];
+    node.used = true;
+    node.addr64 = addr64;
+    node.addr16 = XBeeRequests::UNKNOWN_ADDR16;
+    node.heard = false;
+    node.period_ms = MBED_CONF_APP_XBEE_DOWNLINK_SLEEP_PERIOD;
+    node.awake_ms = MBED_CONF_APP_XBEE_DOWNLINK_AWAKE_WINDOW;
+    node.head = NONE;
+    node.tail = NONE;
+    node.queued = 0;
+    return unused;
+}
+
+uint32_t DownlinkRouter::until_awake(const Node &node, uint32_t now_ms)
+{
+    if (node.period_ms == 0) {
+        return 0;
+    }
+    if (!node.heard) {
+        /* Its phase is unknown until it sends something */
+        return osWaitForever;
+    }
+
+    uint32_t phase = (now_ms - node.heard_ms) % node.period_ms;
+    return phase < node.awake_ms ? 0 : node.period_ms - phase;
+}
+
+void DownlinkRouter::load_routes(const char *config)
+{
+    char filter[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+
+    while (*config != '\0') {
+        const char *end = strchr(config, ';');
+        if (end == NULL) {
+            end = config + strlen(config);
+        }
+
+        const char *eq = (const char *) memchr(config, '=', end - config);
+        uint64_t addr64;
+        if (eq == NULL || (size_t) (eq - config) >= sizeof (filter) ||
+            !XBeeRequests::parse_addr64(eq + 1, end - eq - 1, &addr64)) {
+            printf("XBee: bad downlink route \"%.*s\"\n", (int) (end - config), config);
+        } else {
+            memcpy(filter, config, eq - config);
+            filter[eq - config] = '\0';
+            if (add_route(filter, addr64) != 0) {
+                printf("XBee: downlink route %s not added\n", filter);
+            }
+        }
+
+        config = *end == ';' ? end + 1 : end;
+    }
+}
+
+void DownlinkRouter::downlink_task()
+{
+    while (true) {
+        uint32_t wait = osWaitForever;
+        uint16_t m = NONE;
+        uint64_t addr64 = 0;
+        uint16_t addr16 = XBeeRequests::UNKNOWN_ADDR16;
+
+        _mutex.lock();
+        uint32_t now = now_ms();
+        for (uint16_t k = 0; k < MBED_CONF_APP_XBEE_DOWNLINK_NODES; k++) {
+            /* Round robin, so a node with a long queue does not starve the others */
+            uint16_t i = (_next_node + k) % MBED_CONF_APP_XBEE_DOWNLINK_NODES;
+            Node &node = _nodes[i];
+            if (!node.used || node.queued == 0) {
+                continue;
+            }
+
+            uint32_t until = until_awake(node, now);
+            if (until == 0) {
+                m = node.head;
+                node.head = _messages[m].next;
+                if (node.head == NONE) {
+                    node.tail = NONE;
+                }
+                node.queued--;
+                addr64 = node.addr64;
+                addr16 = node.addr16;
+                _next_node = (i + 1) % MBED_CONF_APP_XBEE_DOWNLINK_NODES;
+                break;
+            }
+            if (until < wait) {
+                wait = until;
+            }
+        }
+        _mutex.unlock();
+
+        if (m == NONE) {
+            _wakeup.wait(wait);
+            continue;
+        }
+
+        /* The message is off its queue and not yet free, nobody else touches it */
+        const Message &msg = _messages[m];
+        int ret;
+        if (_fragmenter.is_peer(addr64)) {
+            /* A peer reads every frame as a fragment, however short the message */
+            ret = _fragmenter.send(addr64, addr16, msg.data, msg.len);
+        } else {
+            ret = _requests.send_data(addr64, addr16, msg.data, msg.len,
+                                      XBeeRequests::response_cb_t()) < 0 ? -1 : 0;
+        }
+
+        _mutex.lock();
+        _messages[m].next = _free;
+        _free = m;
+        _in_queue--;
+        if (ret == 0) {
+            _stats.sent++;
+        } else {
+            _stats.send_failures++;
+        }
+        _mutex.unlock();
+    }
+}
+
+uint32_t DownlinkRouter::now_ms()
+{
+    return _clock.read_high_resolution_us() / 1000;
+}
@@ -0,0 +1,259 @@
+/*
+ *  Routing of MQTT messages from the uplink to XBee nodes
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file DownlinkRouter.h
+ *  \brief Commands from the broker to the field nodes
+ *  The router subscribes to <prefix>/down/# and sends every message it
+ *  receives there to one or more nodes:
+ *
+ *    <prefix>/down/<64 bit address in hex>/...  goes to that node
+ *    <prefix>/down/<topic>                       goes to every node routed
+ *                                                a filter matching <topic>
+ *
+ *  Routes are kept in a TopicTrie, so a lookup costs the depth of the
+ *  topic, not the number of routes. Messages wait in a queue per node
+ *  until the node is awake: a node with a sleep schedule is taken to wake
+ *  up every period, starting when it was last heard from, and to stay
+ *  awake for its awake window. A sleeping node that was never heard from
+ *  keeps its messages until it is.
+ *
+ *  Messages to the nodes in xbee-fragment-peers are sent by the
+ *  XBeeFragmenter, whatever their length. Other nodes get each message in
+ *  one frame, so a message longer than that is not sent to them.
+ */
+
+#ifndef __DOWNLINK_ROUTER_H_
+#define __DOWNLINK_ROUTER_H_
+
+#include "mbed.h"
+
+#include "ConnectionManager.h"
+#include "TopicTrie.h"
+#include "XBeeFragmenter.h"
+#include "XBeeRequests.h"
+
+/** Nodes with routes or queued messages */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_NODES
+#define MBED_CONF_APP_XBEE_DOWNLINK_NODES 8
+#endif
+
+/** Messages queued for all the nodes together */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_QUEUE_SIZE
+#define MBED_CONF_APP_XBEE_DOWNLINK_QUEUE_SIZE 8
+#endif
+
+/** Messages queued for one node, the oldest is dropped beyond */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_PER_NODE
+#define MBED_CONF_APP_XBEE_DOWNLINK_PER_NODE 4
+#endif
+
+/** Largest message sent to a node */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_MAX_PAYLOAD
+#define MBED_CONF_APP_XBEE_DOWNLINK_MAX_PAYLOAD 256
+#endif
+
+/** Routes, as "<filter>=<64 bit address in hex>;..." */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_ROUTES
+#define MBED_CONF_APP_XBEE_DOWNLINK_ROUTES ""
+#endif
+
+/** Sleep period of the nodes in milliseconds, 0 for nodes always awake */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_SLEEP_PERIOD
+#define MBED_CONF_APP_XBEE_DOWNLINK_SLEEP_PERIOD 0
+#endif
+
+/** Milliseconds a sleeping node stays awake every period */
+#ifndef MBED_CONF_APP_XBEE_DOWNLINK_AWAKE_WINDOW
+#define MBED_CONF_APP_XBEE_DOWNLINK_AWAKE_WINDOW 0
+#endif
+
+/**
+ * Downlink statistics
+ */
+struct DownlinkStats {
+    uint32_t received;      /**< Messages received from the broker */
+    uint32_t unrouted;      /**< Messages matching no node */
+    uint32_t queued;        /**< Copies queued, one per node routed to */
+    uint32_t sent;
+    uint32_t send_failures;
+    uint32_t dropped;       /**< Queued messages dropped for a newer one */
+    uint32_t queue_full;    /**< Copies not queued for lack of room */
+    uint32_t oversized;     /**< Messages too large for the payload, or for one frame to a node */
+    uint32_t max_queued;    /**< Most messages queued at once */
+};
+
+/**
+ * \brief DownlinkRouter queues messages from the broker for the nodes.
+ */
+class DownlinkRouter {
+public:
+    /**
+     * DownlinkRouter Constructor
+     *
+     * @param[in] mqtt The uplink to subscribe on
+     * @param[in] requests Sends the messages that fit a fragment
+     * @param[in] fragmenter Sends the longer messages
+     * @param[in] topic_prefix Prefix of the topics, kept by reference
+     */
+    DownlinkRouter(ConnectionManager &mqtt, XBeeRequests &requests, XBeeFragmenter &fragmenter,
+                   const char *topic_prefix);
+    /**
+     * DownlinkRouter Destructor
+     */
+    ~DownlinkRouter();
+
+    /**
+     * Add the configured routes, subscribe and start the downlink thread.
+     * Only one router can be started.
+     *
+     * @return 0 on success, or -1 on failure
+     */
+    int start();
+
+    /**
+     * Route the topics matching a filter to a node
+     *
+     * @param[in] filter The filter, under <prefix>/down/
+     * @param[in] addr64 The node's 64 bit address
+     * @return 0 on success, or -1 if the node table or the trie is full
+     */
+    int add_route(const char *filter, uint64_t addr64);
+
+    /**
+     * Set a node's sleep schedule
+     *
+     * @param[in] addr64 The node's 64 bit address
+     * @param[in] period_ms Its sleep period, 0 if it is always awake
+     * @param[in] awake_ms How long it stays awake every period
+     * @return 0 on success, or -1 if the node table is full
+     */
+    int set_sleep_schedule(uint64_t addr64, uint32_t period_ms, uint32_t awake_ms);
+
+    /**
+     * Note that a node was heard from, so it is awake now
+     */
+    void node_heard(uint64_t addr64, uint16_t addr16);
+
+    /**
+     * A snapshot of the statistics
+     */
+    DownlinkStats stats();
+
+protected:
+    static const uint16_t NONE = 0xFFFF;
+
+    /** Longest message sent to a node in a single frame */
+    static const uint16_t MAX_UNFRAGMENTED = XBeeFragmenter::HEADER_LEN + MBED_CONF_APP_XBEE_FRAGMENT_SIZE;
+
+    struct Node {
+        uint64_t addr64;
+        uint16_t addr16;
+        bool used;
+        bool heard;             /**< heard_ms is valid */
+        uint32_t heard_ms;
+        uint32_t period_ms;
+        uint32_t awake_ms;
+        uint16_t head;          /**< Oldest message queued, or NONE */
+        uint16_t tail;
+        uint16_t queued;
+    };
+
+    struct Message {
+        uint16_t next;          /**< Next in the node's queue or in the free list */
+        uint16_t len;
+        uint8_t data[MBED_CONF_APP_XBEE_DOWNLINK_MAX_PAYLOAD];
+    };
+
+    /**
+     * MQTT message handler, called on the uplink's thread
+     */
+    static void on_message(MQTT::MessageData &md);
+
+    /**
+     * Queue a message for the nodes its topic routes to
+     *
+     * @param[in] topic The topic under <prefix>/down/
+     */
+    void route(const char *topic, size_t topic_len, const uint8_t *payload, size_t len);
+
+    /**
+     * TopicTrie callback, queue the message being routed for a node
+     */
+    static void on_match(void *context, uint16_t node);
+
+    /**
+     * Queue a copy of the message being routed, with _mutex held
+     */
+    void enqueue(uint16_t node);
+
+    /**
+     * The index of a node, added if it is new, with _mutex held
+     *
+     * @return The index, or NONE if the table is full
+     */
+    uint16_t find_node(uint64_t addr64, bool add);
+
+    /**
+     * Milliseconds until a node is awake, 0 if it is now
+     */
+    uint32_t until_awake(const Node &node, uint32_t now_ms);
+
+    /**
+     * Parse MBED_CONF_APP_XBEE_DOWNLINK_ROUTES
+     */
+    void load_routes(const char *config);
+
+    /**
+     * Downlink thread: send the messages of the nodes awake
+     */
+    void downlink_task();
+
+    /**
+     * Milliseconds on the router's clock, wrapping at 2^32
+     */
+    uint32_t now_ms();
+
+protected:
+    static DownlinkRouter *_instance;
+
+    ConnectionManager &_mqtt;
+    XBeeRequests &_requests;
+    XBeeFragmenter &_fragmenter;
+    const char *_topic_prefix;
+
+    Mutex _mutex;                   /**< Guards everything below */
+    TopicTrie<8 * MBED_CONF_APP_XBEE_DOWNLINK_NODES, 32 * MBED_CONF_APP_XBEE_DOWNLINK_NODES,
+              2 * MBED_CONF_APP_XBEE_DOWNLINK_NODES> _routes;
+    Node _nodes[MBED_CONF_APP_XBEE_DOWNLINK_NODES];
+    Message _messages[MBED_CONF_APP_XBEE_DOWNLINK_QUEUE_SIZE];
+    uint16_t _free;                 /**< First free message, or NONE */
+    uint16_t _in_queue;
+    uint16_t _next_node;            /**< Where the next scan for an awake node starts */
+    DownlinkStats _stats;
+
+    /* The message being routed, while the trie calls on_match() */
+    const uint8_t *_payload;
+    size_t _payload_len;
+    bool _matched[MBED_CONF_APP_XBEE_DOWNLINK_NODES];
+
+    Timer _clock;
+    Semaphore _wakeup;
+    Thread _thread;
+};
+
+#endif /* __DOWNLINK_ROUTER_H_ */
@@ -0,0 +1,256 @@
+/*
+ *  Process-wide CTR-DRBG, seeded once at boot
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "DrbgService.h"
+#include "TLSContext.h"
+
+#include "mbedtls/platform.h"
+
+#if defined(MBEDTLS_ENTROPY_NV_SEED)
+namespace {
+
+/* The block device holding the seed, see DrbgService::set_nv_seed_storage() */
+BlockDevice *nv_seed_bd = NULL;
+
+/* Every seed written goes to the slot after the last one: the seed, a
+   generation number and this marker, padded to the program size. Once the
+   slots of an erase unit are all used, the other unit is erased and
+   written, so the last seed survives a power loss in between */
+const uint8_t SLOT_MARKER[4] = { 'S', 'E', 'E', 'D' };
+const size_t SLOT_MAX = 256;
+const int UNITS = 2;
+
+bd_size_t slot_size()
+{
+    bd_size_t program = nv_seed_bd->get_program_size();
+    return (MBEDTLS_ENTROPY_BLOCK_SIZE + sizeof (uint32_t) + sizeof (SLOT_MARKER) + program - 1) /
+           program * program;
+}
+
+int slots_per_unit()
+{
+    return nv_seed_bd->get_erase_size() / slot_size();
+}
+
+/**
+ * Find the slot written last, the one of the highest generation
+ *
+ * @param[out] unit Its unit
+ * @param[out] slot Its slot in the unit
+ * @param[out] generation Its generation
+ * @return false if no slot is written
+ */
+bool last_slot(int *unit, int *slot, uint32_t *generation)
+{
+    bd_size_t size = slot_size();
+    bool found = false;
+    for (int u = 0; u < UNITS; u++) {
+        bd_addr_t base = u * nv_seed_bd->get_erase_size();
+        for (int i = 0; i < slots_per_unit(); i++) {
+            uint8_t tail[sizeof (uint32_t) + sizeof (SLOT_MARKER)];
+            if (nv_seed_bd->read(tail, base + i * size + MBEDTLS_ENTROPY_BLOCK_SIZE,
+                                 sizeof (tail)) != 0 ||
+                memcmp(tail + sizeof (uint32_t), SLOT_MARKER, sizeof (SLOT_MARKER)) != 0) {
+                /* The slots of a unit are written in order */
+                break;
+            }
+            uint32_t g;
+            memcpy(&g, tail, sizeof (g));
+            if (!found || g > *generation) {
+                *unit = u;
+                *slot = i;
+                *generation = g;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+int nv_seed_read(unsigned char *buf, size_t buf_len)
+{
+    if (nv_seed_bd == NULL) {
+        return -1;
+    }
+    /* Without a slot, the seed provisioned at the start of the first unit */
+    int unit = 0;
+    int slot = 0;
+    uint32_t generation;
+    last_slot(&unit, &slot, &generation);
+    bd_addr_t addr = unit * nv_seed_bd->get_erase_size() + slot * slot_size();
+    if (nv_seed_bd->read(buf, addr, buf_len) != 0) {
+        return -1;
+    }
+    return static_cast<int>(buf_len);
+}
+
+int nv_seed_write(unsigned char *buf, size_t buf_len)
+{
+    if (nv_seed_bd == NULL || buf_len != MBEDTLS_ENTROPY_BLOCK_SIZE || slot_size() > SLOT_MAX) {
+        return -1;
+    }
+
+    int unit;
+    int slot;
+    uint32_t generation;
+    if (!last_slot(&unit, &slot, &generation)) {
+        /* Keep the provisioned seed in the first unit until this one is written */
+        unit = 0;
+        slot = slots_per_unit() - 1;
+        generation = 0;
+    }
+    slot++;
+    if (slot == slots_per_unit()) {
+        /* The other unit, while this one still holds the last seed */
+        unit = (unit + 1) % UNITS;
+        slot = 0;
+        if (nv_seed_bd->erase(unit * nv_seed_bd->get_erase_size(),
+                              nv_seed_bd->get_erase_size()) != 0) {
+            return -1;
+        }
+    }
+    generation++;
+
+    uint8_t data[SLOT_MAX];
+    bd_size_t size = slot_size();
+    memset(data, 0xFF, size);
+    memcpy(data, buf, buf_len);
+    memcpy(data + buf_len, &generation, sizeof (generation));
+    memcpy(data + buf_len + sizeof (generation), SLOT_MARKER, sizeof (SLOT_MARKER));
+
+    if (nv_seed_bd->program(data, unit * nv_seed_bd->get_erase_size() + slot * size, size) != 0) {
+        return -1;
+    }
+    return static_cast<int>(buf_len);
+}
+
+}
+
+int DrbgService::set_nv_seed_storage(BlockDevice *bd)
+{
+    if (bd->size() < UNITS * bd->get_erase_size()) {
+        return -1;
+    }
+    nv_seed_bd = bd;
+    return mbedtls_platform_set_nv_seed(nv_seed_read, nv_seed_write);
+}
+#endif
+
+DrbgService::DrbgService() :
+        _seeded(false), _reseed_interval_s(MBED_CONF_APP_DRBG_RESEED_INTERVAL),
+        _seed_time_us(0), _reseed_time_us(0), _reseed_count(0)
+{
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_ctr_drbg);
+}
+
+DrbgService::~DrbgService()
+{
+    mbedtls_ctr_drbg_free(&_ctr_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+int DrbgService::seed(const char *pers)
+{
+    int ret = 0;
+    Timer timer;
+
+    _mutex.lock();
+    if (_seeded) {
+        _mutex.unlock();
+        return 0;
+    }
+
+    timer.start();
+    if ((ret = mbedtls_ctr_drbg_seed(&_ctr_drbg, mbedtls_entropy_func, &_entropy,
+                      (const unsigned char *) pers,
+                      strlen(pers))) != 0) {
+        print_mbedtls_error("mbedtls_crt_drbg_init", ret);
+        _mutex.unlock();
+        return ret;
+    }
+    /* With an NV seed, the first poll of mbedtls_entropy_func() above wrote
+       a new one, so the same seed is never handed out twice. The reseeds
+       do not write it again, every write wears the flash */
+    _seed_time_us = timer.read_us();
+
+    _seeded = true;
+    _since_reseed.reset();
+    _since_reseed.start();
+    _mutex.unlock();
+
+    mbedtls_printf("DRBG: seeded in %lu us\n", (unsigned long) _seed_time_us);
+    return 0;
+}
+
+int DrbgService::reseed()
+{
+    _mutex.lock();
+    int ret = do_reseed();
+    _mutex.unlock();
+    return ret;
+}
+
+int DrbgService::random(unsigned char *output, size_t len)
+{
+    int ret;
+
+    _mutex.lock();
+    if (_reseed_interval_s != 0 &&
+        (uint32_t) _since_reseed.read_ms() / 1000 >= _reseed_interval_s &&
+        do_reseed() != 0) {
+        /* The generator is left in its previous state. Try again in an
+           interval rather than for every random byte */
+        _since_reseed.reset();
+    }
+    ret = mbedtls_ctr_drbg_random(&_ctr_drbg, output, len);
+    _mutex.unlock();
+
+    return ret;
+}
+
+int DrbgService::rng(void *ctx, unsigned char *output, size_t len)
+{
+    return static_cast<DrbgService *>(ctx)->random(output, len);
+}
+
+int DrbgService::do_reseed()
+{
+    int ret;
+    Timer timer;
+
+    timer.start();
+    if ((ret = mbedtls_ctr_drbg_reseed(&_ctr_drbg, NULL, 0)) != 0) {
+        print_mbedtls_error("mbedtls_ctr_drbg_reseed", ret);
+        return ret;
+    }
+    _reseed_time_us = timer.read_us();
+    _reseed_count++;
+
+    _since_reseed.reset();
+    return 0;
+}
+
+void DrbgService::print_stats()
+{
+    _mutex.lock();
+    mbedtls_printf("DRBG: seed %lu us, %lu reseeds, last reseed %lu us\n",
+                   (unsigned long) _seed_time_us, (unsigned long) _reseed_count,
+                   (unsigned long) _reseed_time_us);
+    _mutex.unlock();
+}
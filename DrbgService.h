@@ -0,0 +1,154 @@
+/*
+ *  Process-wide CTR-DRBG, seeded once at boot
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file DrbgService.h
+ *  \brief A single CTR-DRBG shared by every TLS connection
+ *  Gathering entropy is slow on some targets, so the DRBG is seeded once at
+ *  boot and then only reseeded on a schedule. Targets without a hardware
+ *  entropy source can persist an NV seed on a block device; it is written
+ *  once per boot, to the next of the slots an erase unit holds. When they
+ *  are all used the other of two units is erased and written, so there is
+ *  always a seed left should the power fail meanwhile.
+ */
+
+#ifndef __DRBG_SERVICE_H_
+#define __DRBG_SERVICE_H_
+
+#include "mbed.h"
+
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+
+/** Seconds between scheduled reseeds of the DRBG, 0 disables them */
+#ifndef MBED_CONF_APP_DRBG_RESEED_INTERVAL
+#define MBED_CONF_APP_DRBG_RESEED_INTERVAL 3600
+#endif
+
+/**
+ * \brief DrbgService owns the entropy context and the CTR-DRBG.
+ *
+ * All access to the generator is serialized by a mutex. A scheduled reseed
+ * is done lazily by the first request after the interval elapsed, which in
+ * practice is the start of a handshake rather than the middle of a transfer.
+ */
+class DrbgService {
+public:
+    /**
+     * DrbgService Constructor
+     */
+    DrbgService();
+    /**
+     * DrbgService Destructor
+     */
+    ~DrbgService();
+
+#if defined(MBEDTLS_ENTROPY_NV_SEED)
+    /**
+     * Keep the NV seed in the first two erase units of a block device. Must
+     * be called before seed(). The device must be provisioned with a random
+     * seed once, in its first MBEDTLS_ENTROPY_BLOCK_SIZE bytes; an erased
+     * device gives no entropy.
+     *
+     * @param[in] bd The initialized block device holding the seed
+     * @return 0 on success, -1 if the device is smaller than two erase
+     *         units, or an mbed TLS error code on failure
+     */
+    static int set_nv_seed_storage(BlockDevice *bd);
+#endif
+
+    /**
+     * Gather entropy and seed the generator. Only the first call does any
+     * work; the time it took is kept for seed_time_us().
+     *
+     * @param[in] pers The personalization string
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int seed(const char *pers);
+
+    /**
+     * Reseed the generator now, from fresh entropy.
+     *
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int reseed();
+
+    /**
+     * Fill a buffer with random bytes, reseeding first if one is due.
+     *
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int random(unsigned char *output, size_t len);
+
+    /**
+     * RNG callback for Mbed TLS, ctx is the DrbgService
+     */
+    static int rng(void *ctx, unsigned char *output, size_t len);
+
+    /**
+     * Change the reseed interval, in seconds. 0 disables scheduled reseeds.
+     */
+    void set_reseed_interval(uint32_t seconds) {
+        _reseed_interval_s = seconds;
+    }
+
+    /**
+     * The time the initial seeding took, in microseconds
+     */
+    uint32_t seed_time_us() const {
+        return _seed_time_us;
+    }
+
+    /**
+     * The time the last reseed took, in microseconds
+     */
+    uint32_t reseed_time_us() const {
+        return _reseed_time_us;
+    }
+
+    /**
+     * The number of reseeds done since boot
+     */
+    uint32_t reseed_count() const {
+        return _reseed_count;
+    }
+
+    /**
+     * Print the seeding statistics
+     */
+    void print_stats();
+
+protected:
+    /**
+     * Reseed with _mutex held and update the statistics
+     */
+    int do_reseed();
+
+protected:
+    Mutex _mutex;                   /**< Guards the generator */
+    bool _seeded;                   /**< Set once seed() succeeded */
+    Timer _since_reseed;            /**< Time since the last (re)seed */
+    uint32_t _reseed_interval_s;    /**< Seconds between scheduled reseeds */
+    uint32_t _seed_time_us;         /**< Duration of the initial seed */
+    uint32_t _reseed_time_us;       /**< Duration of the last reseed */
+    uint32_t _reseed_count;         /**< Number of reseeds since boot */
+
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _ctr_drbg;
+};
+
+#endif /* __DRBG_SERVICE_H_ */
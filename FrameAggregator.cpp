@@ -0,0 +1,342 @@
+/*
+ *  Batching of sensor frames into compact MQTT messages
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "FrameAggregator.h"
+
+namespace {
+
+/* CBOR major types and simple values */
+const uint8_t CBOR_UINT = 0;
+const uint8_t CBOR_BYTES = 2;
+const uint8_t CBOR_ARRAY = 4;
+const uint8_t CBOR_ARRAY_INDEFINITE = 0x9F;
+const uint8_t CBOR_BREAK = 0xFF;
+
+}
+
+FrameAggregator::FrameAggregator(flush_cb_t cb, uint32_t window_ms, uint32_t priority_latency_ms) :
+        _cb(cb), _priority_latency_ms(priority_latency_ms), _window_ms(window_ms)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_BATCH_NODES; i++) {
+        _batches[i].frames = 0;
+    }
+}
+
+void FrameAggregator::add(uint64_t node, const uint8_t *data, uint16_t len, bool priority,
+                          uint32_t now_ms)
+{
+    _mutex.lock();
+    _stats.frames++;
+
+    bool reading = MBED_CONF_APP_XBEE_BATCH_SERIES && len == READING_LEN;
+    if (!reading && BATCH_OVERHEAD + FRAME_OVERHEAD + len > MBED_CONF_APP_XBEE_BATCH_SIZE) {
+        _stats.oversized++;
+        _mutex.unlock();
+        return;
+    }
+
+    Batch *batch = batch_for(node, now_ms, reading);
+    if (batch->series != reading) {
+        flush(batch, FLUSH_FORMAT);
+        batch = batch_for(node, now_ms, reading);
+    }
+    bool added = reading ? add_reading(batch, data, now_ms) :
+                           add_frame(batch, data, len, now_ms);
+    if (!added) {
+        /* An empty batch holds it */
+        flush(batch, FLUSH_SIZE);
+        batch = batch_for(node, now_ms, reading);
+        if (reading) {
+            add_reading(batch, data, now_ms);
+        } else {
+            add_frame(batch, data, len, now_ms);
+        }
+    }
+    batch->frames++;
+    _stats.payload_bytes += len;
+
+    if (priority) {
+        uint32_t cap = now_ms + _priority_latency_ms;
+        if ((int32_t) (cap - batch->deadline_ms) < 0) {
+            batch->deadline_ms = cap;
+            batch->priority = true;
+        }
+    }
+
+    if ((int32_t) (now_ms - batch->deadline_ms) >= 0) {
+        flush(batch, FLUSH_WINDOW);
+    }
+    _mutex.unlock();
+}
+
+void FrameAggregator::set_window(uint32_t window_ms)
+{
+    _mutex.lock();
+    _window_ms = window_ms;
+    _mutex.unlock();
+}
+
+void FrameAggregator::flush_due(uint32_t now_ms)
+{
+    _mutex.lock();
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_BATCH_NODES; i++) {
+        Batch *batch = &_batches[i];
+        if (batch->frames != 0 && (int32_t) (now_ms - batch->deadline_ms) >= 0) {
+            flush(batch, FLUSH_WINDOW);
+        }
+    }
+    _mutex.unlock();
+}
+
+void FrameAggregator::flush_all()
+{
+    _mutex.lock();
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_BATCH_NODES; i++) {
+        if (_batches[i].frames != 0) {
+            flush(&_batches[i], FLUSH_WINDOW);
+        }
+    }
+    _mutex.unlock();
+}
+
+uint32_t FrameAggregator::wait_time(uint32_t now_ms)
+{
+    uint32_t wait = osWaitForever;
+
+    _mutex.lock();
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_BATCH_NODES; i++) {
+        const Batch *batch = &_batches[i];
+        if (batch->frames == 0) {
+            continue;
+        }
+        int32_t left = batch->deadline_ms - now_ms;
+        if (left <= 0) {
+            wait = 0;
+            break;
+        }
+        if ((uint32_t) left < wait) {
+            wait = left;
+        }
+    }
+    _mutex.unlock();
+
+    return wait;
+}
+
+FrameAggregatorStats FrameAggregator::stats()
+{
+    _mutex.lock();
+    FrameAggregatorStats stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+FrameAggregator::Batch *FrameAggregator::batch_for(uint64_t node, uint32_t now_ms, bool series)
+{
+    Batch *free_slot = NULL;
+    Batch *oldest = NULL;
+
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_BATCH_NODES; i++) {
+        Batch *batch = &_batches[i];
+        if (batch->frames == 0) {
+            if (free_slot == NULL) {
+                free_slot = batch;
+            }
+        } else if (batch->node == node) {
+            return batch;
+        } else if (oldest == NULL || (int32_t) (batch->opened_ms - oldest->opened_ms) < 0) {
+            oldest = batch;
+        }
+    }
+
+    if (free_slot == NULL) {
+        /* More nodes talking than slots, the oldest batch goes out early */
+        flush(oldest, FLUSH_EVICT);
+        free_slot = oldest;
+    }
+
+    free_slot->node = node;
+    free_slot->opened_ms = now_ms;
+    free_slot->deadline_ms = now_ms + _window_ms;
+    free_slot->priority = false;
+    free_slot->series = series;
+    if (series) {
+        free_slot->encoder.begin(free_slot->buf, sizeof (free_slot->buf), now_ms);
+        free_slot->len = free_slot->encoder.length();
+    } else {
+        free_slot->buf[0] = CBOR_ARRAY_INDEFINITE;
+        free_slot->len = 1 + put_head(free_slot->buf + 1, CBOR_UINT, now_ms);
+    }
+    return free_slot;
+}
+
+void FrameAggregator::flush(Batch *batch, FlushReason reason)
+{
+    if (batch->series) {
+        /* The header has the count, there is no end marker */
+        _stats.series++;
+    } else {
+        batch->buf[batch->len++] = CBOR_BREAK;
+    }
+
+    if (reason == FLUSH_SIZE) {
+        _stats.size_flushes++;
+    } else if (reason == FLUSH_EVICT) {
+        _stats.evictions++;
+    } else if (reason == FLUSH_FORMAT) {
+        _stats.format_flushes++;
+    } else if (batch->priority) {
+        _stats.priority_flushes++;
+    } else {
+        _stats.window_flushes++;
+    }
+    _stats.batches++;
+    _stats.message_bytes += batch->len;
+
+    if (_cb) {
+        _cb(batch->node, batch->buf, batch->len, batch->frames, batch->priority);
+    }
+    batch->frames = 0;
+}
+
+bool FrameAggregator::add_frame(Batch *batch, const uint8_t *data, uint16_t len, uint32_t now_ms)
+{
+    if (batch->len + FRAME_OVERHEAD + len + 1 > MBED_CONF_APP_XBEE_BATCH_SIZE) {
+        return false;
+    }
+
+    uint8_t *p = batch->buf + batch->len;
+    p += put_head(p, CBOR_ARRAY, 2);
+    p += put_head(p, CBOR_UINT, now_ms - batch->opened_ms);
+    p += put_head(p, CBOR_BYTES, len);
+    memcpy(p, data, len);
+    batch->len = p + len - batch->buf;
+    return true;
+}
+
+bool FrameAggregator::add_reading(Batch *batch, const uint8_t *data, uint32_t now_ms)
+{
+    /* Little endian, as the nodes' microcontrollers store it */
+    uint32_t value = data[0] | (data[1] << 8) | ((uint32_t) data[2] << 16) |
+                     ((uint32_t) data[3] << 24);
+    if (batch->encoder.append(now_ms, value) != 0) {
+        return false;
+    }
+    batch->len = batch->encoder.length();
+    return true;
+}
+
+uint16_t FrameAggregator::put_head(uint8_t *p, uint8_t major, uint32_t value)
+{
+    major <<= 5;
+    if (value < 24) {
+        p[0] = major | value;
+        return 1;
+    } else if (value <= 0xFF) {
+        p[0] = major | 24;
+        p[1] = value;
+        return 2;
+    } else if (value <= 0xFFFF) {
+        p[0] = major | 25;
+        p[1] = value >> 8;
+        p[2] = value;
+        return 3;
+    }
+    p[0] = major | 26;
+    p[1] = value >> 24;
+    p[2] = value >> 16;
+    p[3] = value >> 8;
+    p[4] = value;
+    return 5;
+}
+
+void FrameAggregator::benchmark()
+{
+    static const int READINGS = 120;
+    static const int ROUNDS = 20;
+    /* Large enough for the whole backlog in either encoding */
+    static uint8_t cbor[READINGS * (1 + 5 + 1 + READING_LEN) + BATCH_OVERHEAD];
+    static uint8_t series[TimeSeriesEncoder::HEADER_LEN + READINGS * 10];
+
+    /* A temperature every second or so, drifting by a few hundredths */
+    uint32_t times[READINGS];
+    uint32_t values[READINGS];
+    uint32_t t = 123456;
+    for (int i = 0; i < READINGS; i++) {
+        t += 1000 + (i * 7) % 5 - 2;
+        float temp = 21.5f + 0.05f * ((i / 4) % 8);
+        times[i] = t;
+        memcpy(&values[i], &temp, sizeof (values[i]));
+    }
+
+    Timer timer;
+    timer.start();
+
+    size_t cbor_len = 0;
+    uint64_t start = timer.read_high_resolution_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        uint8_t *p = cbor;
+        *p++ = CBOR_ARRAY_INDEFINITE;
+        p += put_head(p, CBOR_UINT, times[0]);
+        for (int i = 0; i < READINGS; i++) {
+            p += put_head(p, CBOR_ARRAY, 2);
+            p += put_head(p, CBOR_UINT, times[i] - times[0]);
+            p += put_head(p, CBOR_BYTES, READING_LEN);
+            memcpy(p, &values[i], READING_LEN);
+            p += READING_LEN;
+        }
+        *p++ = CBOR_BREAK;
+        cbor_len = p - cbor;
+    }
+    uint32_t cbor_us = (timer.read_high_resolution_us() - start) / ROUNDS;
+
+    TimeSeriesEncoder encoder;
+    start = timer.read_high_resolution_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        encoder.begin(series, sizeof (series), times[0]);
+        for (int i = 0; i < READINGS; i++) {
+            encoder.append(times[i], values[i]);
+        }
+    }
+    uint32_t encode_us = (timer.read_high_resolution_us() - start) / ROUNDS;
+
+    bool ok = true;
+    start = timer.read_high_resolution_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        TimeSeriesDecoder decoder(series, encoder.length());
+        uint32_t time_ms, value;
+        for (int i = 0; i < READINGS; i++) {
+            if (!decoder.next(&time_ms, &value) || time_ms != times[i] || value != values[i]) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    uint32_t decode_us = (timer.read_high_resolution_us() - start) / ROUNDS;
+
+    if (!ok) {
+        printf("XBee: series benchmark does not round trip\n");
+        return;
+    }
+    printf("XBee: %d readings, CBOR %d bytes in %lu us, series %d bytes (%d%%) in %lu us, "
+           "decoded in %lu us\n",
+           READINGS, (int) cbor_len, (unsigned long) cbor_us, (int) encoder.length(),
+           (int) (encoder.length() * 100 / cbor_len), (unsigned long) encode_us,
+           (unsigned long) decode_us);
+}
@@ -0,0 +1,246 @@
+/*
+ *  Batching of sensor frames into compact MQTT messages
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file FrameAggregator.h
+ *  \brief Collects the frames of a node into one message
+ *  A sensor reading is a few bytes, published on its own it costs a TLS
+ *  record and an MQTT header many times its size. The aggregator keeps an
+ *  open batch per node and appends every frame of that node to it; the
+ *  batch is handed to the flush callback when its window has passed, when
+ *  the next frame does not fit, or when a slot is needed for another node.
+ *  A priority frame shortens the window of its batch to the priority
+ *  latency, so an alarm is not held back behind routine readings.
+ *
+ *  A batch is a CBOR (RFC 7049) indefinite length array: the gateway's
+ *  uptime in milliseconds when the batch was opened, followed by one
+ *  [milliseconds since then, byte string] array per frame.
+ *
+ *    9F 1A 00 01 E2 40  82 00 43 01 02 03  82 18 64 42 04 05  FF
+ *       opened 123456   +0 ms, 01 02 03    +100 ms, 04 05
+ *
+ *  With xbee-batch-series, frames of exactly four bytes are readings, a
+ *  32 bit value such as a float, and batched as a TimeSeriesCodec series
+ *  instead: a node reporting at a steady rate then costs about two bytes
+ *  a reading rather than ten. A frame of another length flushes a series
+ *  batch, and a reading a CBOR one, so the order of the frames is kept.
+ */
+
+#ifndef __FRAME_AGGREGATOR_H_
+#define __FRAME_AGGREGATOR_H_
+
+#include "mbed.h"
+#include "TimeSeriesCodec.h"
+
+/** Milliseconds a batch collects frames, 0 publishes every frame on its own */
+#ifndef MBED_CONF_APP_XBEE_BATCH_WINDOW
+#define MBED_CONF_APP_XBEE_BATCH_WINDOW 1000
+#endif
+
+/** Shortest batch window, the gateway uses it when the uplink is fast */
+#ifndef MBED_CONF_APP_XBEE_BATCH_WINDOW_MIN
+#define MBED_CONF_APP_XBEE_BATCH_WINDOW_MIN 250
+#endif
+
+/** Longest a priority frame waits in its batch, in milliseconds */
+#ifndef MBED_CONF_APP_XBEE_PRIORITY_LATENCY
+#define MBED_CONF_APP_XBEE_PRIORITY_LATENCY 50
+#endif
+
+/** Largest batch message, at most the largest payload publish() accepts */
+#ifndef MBED_CONF_APP_XBEE_BATCH_SIZE
+#define MBED_CONF_APP_XBEE_BATCH_SIZE 128
+#endif
+
+/** Batch the frames of four bytes as a series of readings */
+#ifndef MBED_CONF_APP_XBEE_BATCH_SERIES
+#define MBED_CONF_APP_XBEE_BATCH_SERIES false
+#endif
+
+/** Time the series encoding of a sample backlog at boot */
+#ifndef MBED_CONF_APP_XBEE_SERIES_BENCHMARK
+#define MBED_CONF_APP_XBEE_SERIES_BENCHMARK false
+#endif
+
+/** Number of nodes with a batch open at the same time */
+#ifndef MBED_CONF_APP_XBEE_BATCH_NODES
+#define MBED_CONF_APP_XBEE_BATCH_NODES 4
+#endif
+
+/**
+ * Aggregation statistics
+ */
+struct FrameAggregatorStats {
+    uint32_t frames;            /**< Frames added */
+    uint32_t batches;           /**< Batches flushed */
+    uint32_t payload_bytes;     /**< Frame data added */
+    uint32_t message_bytes;     /**< Batch messages flushed, encoding included */
+    uint32_t window_flushes;    /**< Batches flushed at the end of their window */
+    uint32_t size_flushes;      /**< Batches flushed because a frame did not fit */
+    uint32_t priority_flushes;  /**< Batches flushed early for a priority frame */
+    uint32_t evictions;         /**< Batches flushed early to make room for another node */
+    uint32_t format_flushes;    /**< Batches flushed for a frame of the other kind */
+    uint32_t series;            /**< Batches flushed as a series of readings */
+    uint32_t oversized;         /**< Frames dropped because not even an empty batch holds them */
+};
+
+/**
+ * \brief FrameAggregator batches frames per node.
+ *
+ * Times are passed in by the caller, as milliseconds from a free running
+ * clock that wraps at 2^32. The flush callback is called with the
+ * aggregator locked, so it must not call back into it.
+ */
+class FrameAggregator {
+public:
+    /**
+     * Called with every batch flushed
+     *
+     * @param[in] node The node the frames came from
+     * @param[in] message The encoded batch, valid during the call
+     * @param[in] len The message length
+     * @param[in] frames The number of frames in the batch
+     * @param[in] priority The batch holds a priority frame
+     */
+    typedef Callback<void(uint64_t node, const uint8_t *message, size_t len, uint32_t frames,
+                          bool priority)> flush_cb_t;
+
+    /**
+     * FrameAggregator Constructor
+     *
+     * @param[in] cb Called with every batch flushed
+     * @param[in] window_ms How long a batch collects frames
+     * @param[in] priority_latency_ms How long a priority frame may wait
+     */
+    FrameAggregator(flush_cb_t cb, uint32_t window_ms = MBED_CONF_APP_XBEE_BATCH_WINDOW,
+                    uint32_t priority_latency_ms = MBED_CONF_APP_XBEE_PRIORITY_LATENCY);
+
+    /**
+     * Add a frame to its node's batch, flushing what has to be
+     *
+     * @param[in] node The node the frame came from
+     * @param[in] data The frame data
+     * @param[in] len The frame data length
+     * @param[in] priority Flush the batch within the priority latency
+     * @param[in] now_ms The current time
+     */
+    void add(uint64_t node, const uint8_t *data, uint16_t len, bool priority, uint32_t now_ms);
+
+    /**
+     * Change the window of the batches opened from now on
+     */
+    void set_window(uint32_t window_ms);
+
+    /**
+     * Flush the batches whose window has passed
+     */
+    void flush_due(uint32_t now_ms);
+
+    /**
+     * Flush every open batch
+     */
+    void flush_all();
+
+    /**
+     * Milliseconds until the next batch is due
+     *
+     * @return The time to wait, or osWaitForever when no batch is open
+     */
+    uint32_t wait_time(uint32_t now_ms);
+
+    /**
+     * A snapshot of the statistics
+     */
+    FrameAggregatorStats stats();
+
+    /**
+     * Time encoding and decoding a sample backlog of readings as a series,
+     * and print its size against that of CBOR batches
+     */
+    static void benchmark();
+
+protected:
+    enum FlushReason {
+        FLUSH_WINDOW,
+        FLUSH_SIZE,
+        FLUSH_EVICT,
+        FLUSH_FORMAT
+    };
+
+    struct Batch {
+        uint64_t node;
+        uint32_t opened_ms;
+        uint32_t deadline_ms;
+        uint32_t frames;            /**< 0 when the slot is free */
+        bool priority;              /**< The deadline was brought forward */
+        bool series;                /**< Readings encoded by series, else a CBOR array */
+        TimeSeriesEncoder encoder;
+        uint16_t len;
+        uint8_t buf[MBED_CONF_APP_XBEE_BATCH_SIZE];
+    };
+
+    /**
+     * The open batch of a node, or a new one, evicting the oldest if needed
+     *
+     * @param[in] series Open a new batch as a series of readings
+     */
+    Batch *batch_for(uint64_t node, uint32_t now_ms, bool series);
+
+    /**
+     * Terminate a batch, hand it to the callback and free its slot
+     */
+    void flush(Batch *batch, FlushReason reason);
+
+    /**
+     * Add a frame to a CBOR batch
+     *
+     * @return false if it does not fit
+     */
+    static bool add_frame(Batch *batch, const uint8_t *data, uint16_t len, uint32_t now_ms);
+
+    /**
+     * Add a reading to a series batch
+     *
+     * @return false if it does not fit
+     */
+    static bool add_reading(Batch *batch, const uint8_t *data, uint32_t now_ms);
+
+    /**
+     * Encode a CBOR item head
+     *
+     * @return The head length, 1 to 5 bytes
+     */
+    static uint16_t put_head(uint8_t *p, uint8_t major, uint32_t value);
+
+protected:
+    /** Head of the batch array and the largest opening time, and the break */
+    static const uint16_t BATCH_OVERHEAD = 1 + 5 + 1;
+    /** Head of the frame array, the largest offset and byte string head */
+    static const uint16_t FRAME_OVERHEAD = 1 + 5 + 3;
+    /** Frame length of a reading */
+    static const uint16_t READING_LEN = 4;
+
+    flush_cb_t _cb;
+    uint32_t _priority_latency_ms;
+
+    Mutex _mutex;                   /**< Guards the window, the batches and the statistics */
+    uint32_t _window_ms;
+    Batch _batches[MBED_CONF_APP_XBEE_BATCH_NODES];
+    FrameAggregatorStats _stats;
+};
+
+#endif /* __FRAME_AGGREGATOR_H_ */
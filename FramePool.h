@@ -0,0 +1,184 @@
+/*
+ *  Fixed size pool and queue of frames, with backpressure
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file FramePool.h
+ *  \brief A bounded producer/consumer pipeline of fixed size frames
+ *  Like Mail, frames are allocated from a static pool and passed by
+ *  pointer, but the pool also counts what it drops and remembers the most
+ *  frames it ever had in use, so it can be sized from measured bursts. A
+ *  pressure callback is told when the frames in use reach the high
+ *  watermark and when they fall back to the low one, which lets the
+ *  producer be paused before anything is dropped.
+ */
+
+#ifndef __FRAME_POOL_H_
+#define __FRAME_POOL_H_
+
+#include "mbed.h"
+
+/**
+ * Frame pool statistics
+ */
+struct FramePoolStats {
+    uint32_t capacity;      /**< Frames in the pool */
+    uint32_t in_use;        /**< Frames allocated now */
+    uint32_t high_water;    /**< Most frames ever allocated at once */
+    uint32_t allocated;     /**< Successful allocations */
+    uint32_t drops;         /**< Allocations that failed because the pool was empty */
+    uint32_t pauses;        /**< Times the high watermark was reached */
+};
+
+/**
+ * \brief FramePool passes frames of type T from producers to consumers.
+ *
+ * @tparam T The frame type
+ * @tparam N The number of frames
+ */
+template <typename T, uint32_t N>
+class FramePool {
+public:
+    /**
+     * FramePool Constructor, without backpressure until set_watermarks()
+     */
+    FramePool() : _high(N + 1), _low(0), _paused(false) {
+        memset(&_stats, 0, sizeof (_stats));
+        _stats.capacity = N;
+    }
+
+    /**
+     * Set when the pressure callback is called, with hysteresis
+     *
+     * @param[in] high Frames in use that pause the producer
+     * @param[in] low Frames in use that resume it
+     */
+    void set_watermarks(uint32_t high, uint32_t low) {
+        _mutex.lock();
+        _high = high;
+        _low = low;
+        _mutex.unlock();
+    }
+
+    /**
+     * Attach the pressure callback, called with true to pause the producer
+     * and with false to resume it. It runs on the thread that allocated or
+     * freed the frame.
+     */
+    void attach(Callback<void(bool)> cb) {
+        _pressure_cb = cb;
+    }
+
+    /**
+     * Allocate a frame, never blocks
+     *
+     * @return The frame, or NULL if the pool is empty
+     */
+    T *alloc() {
+        T *frame = _pool.alloc();
+
+        _mutex.lock();
+        if (frame == NULL) {
+            _stats.drops++;
+            _mutex.unlock();
+            return NULL;
+        }
+        _stats.allocated++;
+        if (++_stats.in_use > _stats.high_water) {
+            _stats.high_water = _stats.in_use;
+        }
+        bool pause = !_paused && _stats.in_use >= _high;
+        if (pause) {
+            _paused = true;
+            _stats.pauses++;
+        }
+        _mutex.unlock();
+
+        if (pause && _pressure_cb) {
+            _pressure_cb(true);
+        }
+        return frame;
+    }
+
+    /**
+     * Queue an allocated frame for the consumer
+     */
+    void put(T *frame) {
+        _queue.put(frame);
+    }
+
+    /**
+     * Take the oldest queued frame
+     *
+     * @param[in] timeout_ms How long to wait for one
+     * @return The frame, or NULL on timeout
+     */
+    T *get(uint32_t timeout_ms = osWaitForever) {
+        osEvent evt = _queue.get(timeout_ms);
+        return evt.status == osEventMessage ? static_cast<T *>(evt.value.p) : NULL;
+    }
+
+    /**
+     * Return a frame to the pool
+     */
+    void free(T *frame) {
+        _pool.free(frame);
+
+        _mutex.lock();
+        _stats.in_use--;
+        bool resume = _paused && _stats.in_use <= _low;
+        if (resume) {
+            _paused = false;
+        }
+        _mutex.unlock();
+
+        if (resume && _pressure_cb) {
+            _pressure_cb(false);
+        }
+    }
+
+    /**
+     * A snapshot of the statistics
+     */
+    FramePoolStats stats() {
+        _mutex.lock();
+        FramePoolStats stats = _stats;
+        _mutex.unlock();
+        return stats;
+    }
+
+    /**
+     * Start measuring the high-water mark again
+     */
+    void reset_high_water() {
+        _mutex.lock();
+        _stats.high_water = _stats.in_use;
+        _mutex.unlock();
+    }
+
+protected:
+    MemoryPool<T, N> _pool;
+    Queue<T, N> _queue;
+    Callback<void(bool)> _pressure_cb;
+
+    Mutex _mutex;                   /**< Guards the fields below */
+    uint32_t _high;
+    uint32_t _low;
+    bool _paused;
+    FramePoolStats _stats;
+};
+
+#endif /* __FRAME_POOL_H_ */
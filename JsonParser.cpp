@@ -0,0 +1,290 @@
+/*
+ *  JSON parsed as it arrives
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "JsonParser.h"
+
+namespace {
+
+bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool is_number_char(char c)
+{
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+}
+
+JsonParser::JsonParser(token_fn_t fn, void *context) :
+        _fn(fn), _context(context)
+{
+    reset();
+}
+
+void JsonParser::reset()
+{
+    _state = VALUE;
+    _error = 0;
+    _depth = 0;
+    _objects = 0;
+    _first = false;
+    _is_key = false;
+    _literal = NULL;
+    _matched = 0;
+    _code = 0;
+    _digits = 0;
+    _len = 0;
+}
+
+int JsonParser::feed(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (_error == 0 && i < len) {
+        int ret = step(data[i]);
+        if (ret < 0) {
+            _error = ret;
+        } else if (ret == 0) {
+            i++;
+        }
+    }
+    return _error;
+}
+
+int JsonParser::finish()
+{
+    if (_error == 0 && _state == NUMBER) {
+        /* A number at the top level only ends with the document */
+        emit(JSON_NUMBER);
+        after_value();
+    }
+    if (_error == 0 && _state != DONE) {
+        _error = JSON_ERROR_SYNTAX;
+    }
+    return _error;
+}
+
+int JsonParser::step(char c)
+{
+    switch (_state) {
+    case VALUE:
+        if (is_space(c)) {
+            return 0;
+        }
+        if (c == '{') {
+            return push(true, JSON_OBJECT_BEGIN);
+        } else if (c == '[') {
+            return push(false, JSON_ARRAY_BEGIN);
+        } else if (c == ']' && _first && !in_object()) {
+            return pop(JSON_ARRAY_END);
+        } else if (c == '"') {
+            _is_key = false;
+            _len = 0;
+            _state = STRING;
+            return 0;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            _len = 0;
+            _state = NUMBER;
+            return append(c);
+        } else if (c == 't' || c == 'f' || c == 'n') {
+            _literal = c == 't' ? "true" : c == 'f' ? "false" : "null";
+            _matched = 1;
+            _state = LITERAL;
+            return 0;
+        }
+        return JSON_ERROR_SYNTAX;
+
+    case KEY:
+        if (is_space(c)) {
+            return 0;
+        }
+        if (c == '"') {
+            _is_key = true;
+            _len = 0;
+            _state = STRING;
+            return 0;
+        } else if (c == '}' && _first) {
+            return pop(JSON_OBJECT_END);
+        }
+        return JSON_ERROR_SYNTAX;
+
+    case COLON:
+        if (is_space(c)) {
+            return 0;
+        }
+        if (c != ':') {
+            return JSON_ERROR_SYNTAX;
+        }
+        _first = false;
+        _state = VALUE;
+        return 0;
+
+    case AFTER:
+        if (is_space(c)) {
+            return 0;
+        }
+        if (c == ',') {
+            _first = false;
+            _state = in_object() ? KEY : VALUE;
+            return 0;
+        } else if (c == '}' && in_object()) {
+            return pop(JSON_OBJECT_END);
+        } else if (c == ']' && !in_object()) {
+            return pop(JSON_ARRAY_END);
+        }
+        return JSON_ERROR_SYNTAX;
+
+    case STRING:
+        if (c == '"') {
+            emit(_is_key ? JSON_KEY : JSON_STRING);
+            if (_is_key) {
+                _state = COLON;
+            } else {
+                after_value();
+            }
+            return 0;
+        } else if (c == '\\') {
+            _state = ESCAPE;
+            return 0;
+        } else if ((unsigned char) c < 0x20) {
+            return JSON_ERROR_SYNTAX;
+        }
+        return append(c);
+
+    case ESCAPE:
+        _state = STRING;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            return append(c);
+        case 'b':
+            return append('\b');
+        case 'f':
+            return append('\f');
+        case 'n':
+            return append('\n');
+        case 'r':
+            return append('\r');
+        case 't':
+            return append('\t');
+        case 'u':
+            _code = 0;
+            _digits = 0;
+            _state = UNICODE;
+            return 0;
+        }
+        return JSON_ERROR_SYNTAX;
+
+    case UNICODE: {
+        int v = hex_value(c);
+        if (v < 0) {
+            return JSON_ERROR_SYNTAX;
+        }
+        _code = (_code << 4) | v;
+        if (++_digits < 4) {
+            return 0;
+        }
+
+        _state = STRING;
+        int ret;
+        if (_code < 0x80) {
+            ret = append(_code);
+        } else if (_code < 0x800) {
+            if ((ret = append(0xC0 | (_code >> 6))) == 0) {
+                ret = append(0x80 | (_code & 0x3F));
+            }
+        } else if ((ret = append(0xE0 | (_code >> 12))) == 0 &&
+                   (ret = append(0x80 | ((_code >> 6) & 0x3F))) == 0) {
+            ret = append(0x80 | (_code & 0x3F));
+        }
+        return ret;
+    }
+
+    case NUMBER:
+        if (is_number_char(c)) {
+            return append(c);
+        }
+        emit(JSON_NUMBER);
+        after_value();
+        /* The character after the number is the next token's */
+        return 1;
+
+    case LITERAL:
+        if (c != _literal[_matched]) {
+            return JSON_ERROR_SYNTAX;
+        }
+        if (_literal[++_matched] == '\0') {
+            emit(_literal[0] == 't' ? JSON_TRUE : _literal[0] == 'f' ? JSON_FALSE : JSON_NULL);
+            after_value();
+        }
+        return 0;
+
+    case DONE:
+        return is_space(c) ? 0 : JSON_ERROR_SYNTAX;
+    }
+    return JSON_ERROR_SYNTAX;
+}
+
+int JsonParser::push(bool object, JsonToken token)
+{
+    if (_depth == MAX_DEPTH) {
+        return JSON_ERROR_DEPTH;
+    }
+    _fn(_context, token, NULL, 0, _depth);
+    if (object) {
+        _objects |= 1 << _depth;
+    } else {
+        _objects &= ~(1 << _depth);
+    }
+    _depth++;
+    _first = true;
+    _state = object ? KEY : VALUE;
+    return 0;
+}
+
+int JsonParser::pop(JsonToken token)
+{
+    _depth--;
+    _fn(_context, token, NULL, 0, _depth);
+    after_value();
+    return 0;
+}
+
+void JsonParser::emit(JsonToken token)
+{
+    if (token == JSON_KEY || token == JSON_STRING || token == JSON_NUMBER) {
+        _token[_len] = '\0';
+        _fn(_context, token, _token, _len, _depth);
+    } else {
+        _fn(_context, token, NULL, 0, _depth);
+    }
+}
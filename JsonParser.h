@@ -0,0 +1,195 @@
+/*
+ *  JSON parsed as it arrives
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file JsonParser.h
+ *  \brief Tokens out of a JSON document fed in pieces
+ *  A response body is fed to the parser chunk by chunk as it is received,
+ *  and the parser calls back with every token once it is complete, so
+ *  the body never has to be held in RAM as a whole. Only one string or
+ *  number is buffered at a time, up to MBED_CONF_APP_JSON_MAX_TOKEN bytes.
+ *
+ *  For {"rate":10,"topics":["a","b"]} the callback gets
+ *
+ *    OBJECT_BEGIN  depth 0
+ *    KEY "rate"    depth 1
+ *    NUMBER "10"   depth 1
+ *    KEY "topics"  depth 1
+ *    ARRAY_BEGIN   depth 1
+ *    STRING "a"    depth 2
+ *    STRING "b"    depth 2
+ *    ARRAY_END     depth 1
+ *    OBJECT_END    depth 0
+ *
+ *  Strings are unescaped, \u escapes into UTF-8 each on its own, without
+ *  joining surrogate pairs. Numbers are passed on as text, checked only
+ *  for their characters.
+ *
+ *  Only the C library is used, so the parser builds on a host as well.
+ */
+
+#ifndef __JSON_PARSER_H_
+#define __JSON_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Longest string or number, in bytes */
+#ifndef MBED_CONF_APP_JSON_MAX_TOKEN
+#define MBED_CONF_APP_JSON_MAX_TOKEN 64
+#endif
+
+#define JSON_ERROR_SYNTAX       -3301   /**< Not JSON, or cut short */
+#define JSON_ERROR_TOO_LONG     -3302   /**< A string or number longer than the token buffer */
+#define JSON_ERROR_DEPTH        -3303   /**< Objects and arrays nested too deep */
+
+/**
+ * Tokens reported by JsonParser
+ */
+enum JsonToken {
+    JSON_OBJECT_BEGIN,
+    JSON_OBJECT_END,
+    JSON_ARRAY_BEGIN,
+    JSON_ARRAY_END,
+    JSON_KEY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL
+};
+
+/**
+ * \brief JsonParser tokenizes one JSON value fed in any number of pieces.
+ */
+class JsonParser {
+public:
+    /** Objects and arrays nested in one another */
+    static const uint8_t MAX_DEPTH = 16;
+
+    /**
+     * Called for every token
+     *
+     * @param[in] context The context given to the constructor
+     * @param[in] token The token
+     * @param[in] text The key, string or number, NUL terminated, else NULL
+     * @param[in] len The length of text
+     * @param[in] depth The containers the token is in
+     */
+    typedef void (*token_fn_t)(void *context, JsonToken token, const char *text, size_t len,
+                               uint8_t depth);
+
+    /**
+     * JsonParser Constructor
+     *
+     * @param[in] fn Called for every token
+     * @param[in] context Passed to fn
+     */
+    JsonParser(token_fn_t fn, void *context);
+
+    /**
+     * Start over with a new document
+     */
+    void reset();
+
+    /**
+     * Parse the next piece of the document
+     *
+     * @return 0 on success, or a JSON_ERROR code, which sticks until reset()
+     */
+    int feed(const char *data, size_t len);
+
+    /**
+     * End the document
+     *
+     * @return 0 if it was one complete value, or a JSON_ERROR code
+     */
+    int finish();
+
+    /**
+     * Whether a whole value was read, nothing more is expected
+     */
+    bool done() const {
+        return _state == DONE;
+    }
+
+protected:
+    enum State {
+        VALUE,          /**< A value is next */
+        KEY,            /**< A key is next, or the end of the object */
+        COLON,
+        AFTER,          /**< A comma or the end of the container is next */
+        STRING,
+        ESCAPE,
+        UNICODE,
+        NUMBER,
+        LITERAL,
+        DONE
+    };
+
+    /**
+     * Handle one character
+     *
+     * @return 0, 1 to handle the same character again, or a JSON_ERROR code
+     */
+    int step(char c);
+
+    /**
+     * A value ended, at depth 0 the document did
+     */
+    void after_value() {
+        _state = _depth == 0 ? DONE : AFTER;
+    }
+
+    int push(bool object, JsonToken token);
+    int pop(JsonToken token);
+
+    int append(char c) {
+        if (_len == MBED_CONF_APP_JSON_MAX_TOKEN) {
+            return JSON_ERROR_TOO_LONG;
+        }
+        _token[_len++] = c;
+        return 0;
+    }
+
+    void emit(JsonToken token);
+
+    bool in_object() const {
+        return _depth > 0 && (_objects & (1 << (_depth - 1)));
+    }
+
+protected:
+    token_fn_t _fn;
+    void *_context;
+
+    State _state;
+    int _error;
+    uint8_t _depth;
+    uint16_t _objects;          /**< A bit per depth, set for an object, clear for an array */
+    bool _first;                /**< The container was just opened, it may end right away */
+    bool _is_key;               /**< The string being read is a key */
+    const char *_literal;       /**< The literal being read */
+    uint8_t _matched;           /**< Its characters read so far */
+    uint16_t _code;             /**< The \u escape being read */
+    uint8_t _digits;
+
+    char _token[MBED_CONF_APP_JSON_MAX_TOKEN + 1];
+    size_t _len;
+};
+
+#endif /* __JSON_PARSER_H_ */
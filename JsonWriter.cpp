@@ -0,0 +1,199 @@
+/*
+ *  JSON written straight into a caller's buffer
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "JsonWriter.h"
+
+JsonWriter::JsonWriter(char *buf, size_t size) :
+        _buf(buf), _size(size), _pos(0), _overflow(false), _depth(0), _filled(0),
+        _after_key(false)
+{
+}
+
+void JsonWriter::begin_object()
+{
+    open('{');
+}
+
+void JsonWriter::end_object()
+{
+    close('}');
+}
+
+void JsonWriter::begin_array()
+{
+    open('[');
+}
+
+void JsonWriter::end_array()
+{
+    close(']');
+}
+
+void JsonWriter::key(const char *name)
+{
+    string(name);
+    put(':');
+    /* string() marked the object filled, the comma goes before the next key */
+    _after_key = true;
+}
+
+void JsonWriter::string(const char *value)
+{
+    string(value, strlen(value));
+}
+
+void JsonWriter::string(const char *value, size_t len)
+{
+    static const char HEX[] = "0123456789abcdef";
+
+    separate();
+    put('"');
+    for (size_t i = 0; i < len; i++) {
+        char c = value[i];
+        switch (c) {
+        case '"':
+        case '\\':
+            put('\\');
+            put(c);
+            break;
+        case '\n':
+            put("\\n", 2);
+            break;
+        case '\r':
+            put("\\r", 2);
+            break;
+        case '\t':
+            put("\\t", 2);
+            break;
+        default:
+            if ((unsigned char) c < 0x20) {
+                put("\\u00", 4);
+                put(HEX[c >> 4]);
+                put(HEX[c & 0xF]);
+            } else {
+                put(c);
+            }
+            break;
+        }
+    }
+    put('"');
+    written();
+}
+
+void JsonWriter::integer(int32_t value)
+{
+    separate();
+    uint32_t magnitude = value;
+    if (value < 0) {
+        put('-');
+        magnitude = 0 - magnitude;
+    }
+    put_uint(magnitude, 1);
+    written();
+}
+
+void JsonWriter::fixed(int32_t value, uint8_t decimals)
+{
+    static const uint32_t POWERS[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+
+    if (decimals == 0 || decimals > 9) {
+        integer(value);
+        return;
+    }
+
+    separate();
+    uint32_t magnitude = value;
+    if (value < 0) {
+        put('-');
+        magnitude = 0 - magnitude;
+    }
+    put_uint(magnitude / POWERS[decimals], 1);
+    put('.');
+    put_uint(magnitude % POWERS[decimals], decimals);
+    written();
+}
+
+void JsonWriter::boolean(bool value)
+{
+    separate();
+    if (value) {
+        put("true", 4);
+    } else {
+        put("false", 5);
+    }
+    written();
+}
+
+void JsonWriter::null()
+{
+    separate();
+    put("null", 4);
+    written();
+}
+
+void JsonWriter::separate()
+{
+    if (_after_key) {
+        _after_key = false;
+    } else if (_depth > 0 && (_filled & (1 << _depth))) {
+        put(',');
+    }
+}
+
+void JsonWriter::written()
+{
+    _filled |= 1 << _depth;
+}
+
+void JsonWriter::open(char c)
+{
+    separate();
+    if (_depth + 1 >= MAX_DEPTH) {
+        _overflow = true;
+        return;
+    }
+    put(c);
+    _depth++;
+    _filled &= ~(1 << _depth);
+}
+
+void JsonWriter::close(char c)
+{
+    if (_depth == 0) {
+        _overflow = true;
+        return;
+    }
+    put(c);
+    _depth--;
+    written();
+}
+
+void JsonWriter::put_uint(uint32_t value, uint8_t min_digits)
+{
+    char digits[10];
+    uint8_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 || n < min_digits);
+    while (n > 0) {
+        put(digits[--n]);
+    }
+}
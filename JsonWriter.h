@@ -0,0 +1,148 @@
+/*
+ *  JSON written straight into a caller's buffer
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file JsonWriter.h
+ *  \brief Structured messages without snprintf or a heap
+ *  The writer appends to a fixed buffer, a TLS output record for one, and
+ *  puts in the commas, quotes and escapes itself:
+ *
+ *    JsonWriter json(buf, size);
+ *    json.begin_object();
+ *    json.key("temp");
+ *    json.fixed(215, 1);           // 21.5
+ *    json.key("node");
+ *    json.string("0013A200");
+ *    json.end_object();
+ *    int len = json.length();      // -1 if it did not fit
+ *
+ *  Without a buffer it only counts, so a message whose length has to be
+ *  written ahead of it, as in an MQTT PUBLISH, is written twice: once to
+ *  measure it, once in place.
+ *
+ *  The calls are not checked against each other: a key() outside of an
+ *  object gives JSON that is not valid.
+ *
+ *  Only the C library is used, so the writer builds on a host as well.
+ */
+
+#ifndef __JSON_WRITER_H_
+#define __JSON_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * \brief JsonWriter appends a JSON value to a buffer.
+ */
+class JsonWriter {
+public:
+    /** Objects and arrays nested in one another */
+    static const uint8_t MAX_DEPTH = 16;
+
+    /**
+     * JsonWriter Constructor
+     *
+     * @param[in] buf The buffer to write to, NULL to only count the bytes
+     * @param[in] size Its size
+     */
+    JsonWriter(char *buf, size_t size);
+
+    void begin_object();
+    void end_object();
+    void begin_array();
+    void end_array();
+
+    /**
+     * The key of the next member of an object
+     */
+    void key(const char *name);
+
+    /**
+     * A string value, escaped as needed
+     */
+    void string(const char *value);
+    void string(const char *value, size_t len);
+
+    void integer(int32_t value);
+
+    /**
+     * A number with a fixed number of decimals
+     *
+     * @param[in] value The number times 10^decimals
+     * @param[in] decimals Digits after the point, at most 9
+     */
+    void fixed(int32_t value, uint8_t decimals);
+
+    void boolean(bool value);
+    void null();
+
+    /**
+     * The bytes written or counted
+     *
+     * @return The length, or -1 if the buffer was too small or the values
+     *         nested too deep
+     */
+    int length() const {
+        return _overflow ? -1 : (int) _pos;
+    }
+
+protected:
+    /**
+     * Before a value or key: a comma unless it is the first in its container
+     */
+    void separate();
+
+    /**
+     * After a value: the container is not empty anymore
+     */
+    void written();
+
+    void open(char c);
+    void close(char c);
+
+    void put(char c) {
+        if (_buf != NULL) {
+            if (_pos >= _size) {
+                _overflow = true;
+                return;
+            }
+            _buf[_pos] = c;
+        }
+        _pos++;
+    }
+
+    void put(const char *s, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            put(s[i]);
+        }
+    }
+
+    void put_uint(uint32_t value, uint8_t min_digits);
+
+protected:
+    char *_buf;
+    size_t _size;
+    size_t _pos;
+    bool _overflow;
+    uint8_t _depth;
+    uint16_t _filled;           /**< A bit per depth, set once its container has a value */
+    bool _after_key;            /**< The value of a key is next, no comma */
+};
+
+#endif /* __JSON_WRITER_H_ */
@@ -0,0 +1,151 @@
+/*
+ *  Pacing of the writes to a slow uplink
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "LinkPacer.h"
+
+LinkPacer::LinkPacer(uint32_t burst, uint32_t max_rate) :
+        _burst(burst), _max_rate(max_rate), _tokens(burst), _refilled_us(0),
+        _avg_bytes(0), _avg_us(0)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    _clock.start();
+}
+
+uint32_t LinkPacer::acquire(size_t len)
+{
+    uint32_t start = now_us();
+    if (_burst == 0) {
+        return start;
+    }
+
+    /* A write larger than the bucket goes once it is full, and leaves it in debt */
+    int32_t need = len < _burst ? len : _burst;
+    bool waited = false;
+    for (;;) {
+        _mutex.lock();
+        uint32_t now = now_us();
+        refill(now);
+        if (_tokens >= need) {
+            _tokens -= (int32_t) len;
+            if (waited) {
+                _stats.paced++;
+                _stats.paced_ms += (now - start) / 1000;
+            }
+            _mutex.unlock();
+            return now;
+        }
+        /* refill() filled the bucket if the rate were unlimited */
+        uint32_t wait = (uint64_t)(need - _tokens) * 1000 / rate() + 1;
+        _mutex.unlock();
+
+        waited = true;
+        Thread::wait(wait);
+    }
+}
+
+void LinkPacer::written(size_t len, int sent, uint32_t start_us)
+{
+    uint32_t elapsed = now_us() - start_us;
+    size_t done = sent > 0 ? sent : 0;
+
+    _mutex.lock();
+    if (_burst > 0 && done < len) {
+        /* Give back what the socket did not take */
+        _tokens += len - done;
+        if (_tokens > (int32_t) _burst) {
+            _tokens = _burst;
+        }
+    }
+
+    if (done > 0) {
+        if (_stats.writes == 0) {
+            _avg_bytes = done << AVERAGE_SHIFT;
+            _avg_us = elapsed << AVERAGE_SHIFT;
+        } else {
+            _avg_bytes += done - (_avg_bytes >> AVERAGE_SHIFT);
+            _avg_us += elapsed - (_avg_us >> AVERAGE_SHIFT);
+        }
+        if (_avg_us > 0) {
+            _stats.bandwidth = (uint64_t) _avg_bytes * 1000000 / _avg_us;
+        }
+        _stats.write_us = _avg_us >> AVERAGE_SHIFT;
+        _stats.writes++;
+        _stats.bytes += done;
+    }
+    _mutex.unlock();
+}
+
+uint32_t LinkPacer::adapt(uint32_t smallest, uint32_t largest)
+{
+    _mutex.lock();
+    uint32_t bandwidth = _stats.bandwidth;
+    _mutex.unlock();
+
+    if (bandwidth == 0) {
+        return smallest + (largest - smallest) / 2;
+    }
+    if (bandwidth <= MBED_CONF_APP_LINK_SLOW_RATE) {
+        return largest;
+    }
+    if (bandwidth >= MBED_CONF_APP_LINK_FAST_RATE) {
+        return smallest;
+    }
+    return largest - (uint64_t)(largest - smallest) * (bandwidth - MBED_CONF_APP_LINK_SLOW_RATE) /
+                     (MBED_CONF_APP_LINK_FAST_RATE - MBED_CONF_APP_LINK_SLOW_RATE);
+}
+
+LinkStats LinkPacer::stats()
+{
+    _mutex.lock();
+    LinkStats stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+uint32_t LinkPacer::rate()
+{
+    uint32_t rate = (uint64_t) _stats.bandwidth * MBED_CONF_APP_LINK_RATE_MARGIN / 100;
+    if (_max_rate > 0 && (rate == 0 || rate > _max_rate)) {
+        rate = _max_rate;
+    }
+    return rate;
+}
+
+void LinkPacer::refill(uint32_t now)
+{
+    uint32_t rate = this->rate();
+    if (rate == 0) {
+        _tokens = _burst;
+        _refilled_us = now;
+        return;
+    }
+
+    uint32_t elapsed = now - _refilled_us;
+    uint64_t add = (uint64_t) elapsed * rate / 1000000;
+    if (add == 0) {
+        /* Keep the fraction of a byte for the next refill */
+        return;
+    }
+    if ((int64_t) _tokens + (int64_t) add >= _burst) {
+        _tokens = _burst;
+        _refilled_us = now;
+    } else {
+        _tokens += add;
+        _refilled_us += add * 1000000 / rate;
+    }
+}
@@ -0,0 +1,155 @@
+/*
+ *  Pacing of the writes to a slow uplink
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file LinkPacer.h
+ *  \brief Token bucket in front of the socket, at the rate the link takes
+ *  An ESP8266 running the AT firmware has small buffers, and a burst of
+ *  writes overruns them: the module stalls or resets. Every socket write
+ *  of the TLS connection goes through the pacer, which
+ *
+ *  - times it, and keeps moving averages of the bytes and microseconds per
+ *    write, their ratio being the bandwidth the link takes data at and the
+ *    latter the write time;
+ *  - lets it through once a token bucket holds as many bytes, the bucket
+ *    filling at link-rate-margin percent of that bandwidth, at most
+ *    link-max-rate, and holding at most link-burst bytes.
+ *
+ *  Until the first writes are timed only link-max-rate applies. The
+ *  estimate also tells the batching how slow the link is: adapt() scales
+ *  a batch size or window from its smallest, on a link at least
+ *  link-fast-rate, to its largest, on a link at most link-slow-rate.
+ */
+
+#ifndef __LINK_PACER_H_
+#define __LINK_PACER_H_
+
+#include "mbed.h"
+
+/** Bytes the bucket holds, the largest burst; 0 to not pace at all */
+#ifndef MBED_CONF_APP_LINK_BURST
+#define MBED_CONF_APP_LINK_BURST 1024
+#endif
+
+/** Highest rate in bytes per second, 0 for no fixed limit */
+#ifndef MBED_CONF_APP_LINK_MAX_RATE
+#define MBED_CONF_APP_LINK_MAX_RATE 0
+#endif
+
+/** Percentage of the estimated bandwidth the bucket fills at */
+#ifndef MBED_CONF_APP_LINK_RATE_MARGIN
+#define MBED_CONF_APP_LINK_RATE_MARGIN 80
+#endif
+
+/** Bandwidth in bytes per second at or below which batches are largest */
+#ifndef MBED_CONF_APP_LINK_SLOW_RATE
+#define MBED_CONF_APP_LINK_SLOW_RATE 2000
+#endif
+
+/** Bandwidth in bytes per second at or above which batches are smallest */
+#ifndef MBED_CONF_APP_LINK_FAST_RATE
+#define MBED_CONF_APP_LINK_FAST_RATE 20000
+#endif
+
+/**
+ * Link statistics
+ */
+struct LinkStats {
+    uint32_t bandwidth;     /**< Estimated bytes per second, 0 until known */
+    uint32_t write_us;      /**< Average time of a write */
+    uint32_t writes;
+    uint32_t bytes;
+    uint32_t paced;         /**< Writes that waited for tokens */
+    uint32_t paced_ms;      /**< Time they waited, in total */
+};
+
+/**
+ * \brief LinkPacer estimates the uplink's bandwidth and paces the writes.
+ *
+ * acquire() and written() are called by the writing thread, the other
+ * methods from any thread.
+ */
+class LinkPacer {
+public:
+    /**
+     * LinkPacer Constructor
+     *
+     * @param[in] burst Bytes the bucket holds, 0 to not pace
+     * @param[in] max_rate Highest rate in bytes per second, 0 for none
+     */
+    LinkPacer(uint32_t burst = MBED_CONF_APP_LINK_BURST,
+              uint32_t max_rate = MBED_CONF_APP_LINK_MAX_RATE);
+
+    /**
+     * Wait until len bytes may be written, and take them from the bucket
+     *
+     * @return The start of the write, to pass to written()
+     */
+    uint32_t acquire(size_t len);
+
+    /**
+     * Account for a write
+     *
+     * @param[in] len The bytes acquired
+     * @param[in] sent The bytes written, or a negative error code
+     * @param[in] start_us The value acquire() returned
+     */
+    void written(size_t len, int sent, uint32_t start_us);
+
+    /**
+     * Scale a batch size or window to the link: the smallest on a fast
+     * link, the largest on a slow one, halfway while it is unknown
+     */
+    uint32_t adapt(uint32_t smallest, uint32_t largest);
+
+    /**
+     * A snapshot of the statistics
+     */
+    LinkStats stats();
+
+protected:
+    /** Weight of a new sample in the averages, 1/2^AVERAGE_SHIFT */
+    static const int AVERAGE_SHIFT = 3;
+
+    /**
+     * The rate the bucket fills at, 0 for unlimited, with _mutex held
+     */
+    uint32_t rate();
+
+    /**
+     * Add the tokens since the last refill, with _mutex held
+     */
+    void refill(uint32_t now);
+
+    uint32_t now_us() {
+        return _clock.read_high_resolution_us();
+    }
+
+protected:
+    uint32_t _burst;
+    uint32_t _max_rate;
+
+    Mutex _mutex;                   /**< Guards everything below */
+    Timer _clock;
+    int32_t _tokens;                /**< Bytes that may be written, negative after a large write */
+    uint32_t _refilled_us;
+    uint32_t _avg_bytes;            /**< Moving average of the bytes per write, times 2^AVERAGE_SHIFT */
+    uint32_t _avg_us;               /**< Same for the microseconds per write */
+    LinkStats _stats;
+};
+
+#endif /* __LINK_PACER_H_ */
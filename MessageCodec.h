@@ -0,0 +1,636 @@
+/*
+ *  Binary encodings of message structs, generated from a schema
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file MessageCodec.h
+ *  \brief CBOR or packed encoders and decoders of structs, at compile time
+ *  A struct is given a schema by specializing MessageSchema with the list
+ *  of its members to encode, in order:
+ *
+ *    struct Reading {
+ *        uint32_t time_ms;
+ *        int16_t temp;
+ *        uint8_t battery;
+ *    };
+ *
+ *    template <> struct MessageSchema<Reading> {
+ *        typedef MessageFields<
+ *            MessageField<Reading, uint32_t, &Reading::time_ms>,
+ *            MessageField<Reading, int16_t, &Reading::temp>,
+ *            MessageField<Reading, uint8_t, &Reading::battery> > Fields;
+ *    };
+ *
+ *    uint8_t buf[MessageCodec<CborFormat, Reading>::MAX_LEN];
+ *    size_t len = MessageCodec<CborFormat, Reading>::encode(reading, buf);
+ *
+ *  The encoder and decoder are templates instantiated for the struct, so
+ *  nothing is looked up at run time, and MAX_LEN is a constant a buffer
+ *  can be sized by.
+ *
+ *  Members may be uint8_t to uint32_t, int8_t to int32_t, bool, float,
+ *  char arrays holding a string, arrays of any of these, and structs with
+ *  a schema of their own. Members not in the schema are not encoded, and
+ *  left as they are by the decoder. A string is encoded up to its first
+ *  NUL and at most one char short of its array, so that it decodes NUL
+ *  terminated; a longer one is refused by the decoder. The decoder writes
+ *  a number, bool, float or string only once it decoded, a malformed one
+ *  is left as it was; of a struct or array refused part way through, the
+ *  members before the malformed one are written.
+ *
+ *  CborFormat encodes a struct as a CBOR (RFC 7049) array of its members,
+ *  each in its shortest form, which any CBOR decoder reads. PackedFormat
+ *  writes the members back to back with the width of their type, big
+ *  endian, strings padded to the size of their array: the length is
+ *  always MAX_LEN, and only this decoder reads it.
+ *
+ *  Only the C library is used, so the codecs build on a host as well.
+ */
+
+#ifndef __MESSAGE_CODEC_H_
+#define __MESSAGE_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MESSAGE_ERROR_MALFORMED     -3401   /**< Cut short, or not of the schema */
+
+/**
+ * \brief CborFormat writes the values as CBOR items, in their shortest form.
+ */
+struct CborFormat {
+    /** The most bytes the head of an array or string of N takes */
+    template <unsigned N> struct Head {
+        enum { LEN = N < 24 ? 1 : N < 0x100 ? 2 : N < 0x10000 ? 3 : 5 };
+    };
+
+    /** Bytes a number takes beyond those of its type, at most */
+    enum { OVERHEAD = 1 };
+
+    static size_t put_uint(uint8_t *p, uint32_t value, uint8_t bytes) {
+        (void) bytes;
+        return put_head(p, MAJOR_UINT, value);
+    }
+
+    static size_t put_int(uint8_t *p, int32_t value, uint8_t bytes) {
+        (void) bytes;
+        if (value < 0) {
+            return put_head(p, MAJOR_NINT, (uint32_t) (-1 - value));
+        }
+        return put_head(p, MAJOR_UINT, value);
+    }
+
+    static size_t put_bool(uint8_t *p, bool value) {
+        *p = value ? SIMPLE_TRUE : SIMPLE_FALSE;
+        return 1;
+    }
+
+    static size_t put_float(uint8_t *p, float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof (bits));
+        *p = FLOAT32;
+        put_be(p + 1, bits, 4);
+        return 5;
+    }
+
+    static size_t put_array(uint8_t *p, unsigned count) {
+        return put_head(p, MAJOR_ARRAY, count);
+    }
+
+    static size_t put_string(uint8_t *p, const char *s, size_t size) {
+        const char *end = (const char *) memchr(s, '\0', size - 1);
+        size_t len = end != NULL ? end - s : size - 1;
+        size_t n = put_head(p, MAJOR_TEXT, len);
+        memcpy(p + n, s, len);
+        return n + len;
+    }
+
+    static int get_uint(const uint8_t *p, size_t len, uint8_t bytes, uint32_t *value) {
+        uint32_t v;
+        int n = get_head(p, len, MAJOR_UINT, &v);
+        if (n < 0 || (bytes < 4 && (v >> (8 * bytes)) != 0)) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        *value = v;
+        return n;
+    }
+
+    static int get_int(const uint8_t *p, size_t len, uint8_t bytes, int32_t *value) {
+        if (len == 0) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        bool negative = (p[0] >> 5) == MAJOR_NINT;
+        uint32_t magnitude;
+        int n = get_head(p, len, negative ? MAJOR_NINT : MAJOR_UINT, &magnitude);
+        if (n < 0 || magnitude >= (uint32_t) 1 << (8 * bytes - 1)) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        *value = negative ? -1 - (int32_t) magnitude : (int32_t) magnitude;
+        return n;
+    }
+
+    static int get_bool(const uint8_t *p, size_t len, bool *value) {
+        if (len == 0 || (p[0] != SIMPLE_TRUE && p[0] != SIMPLE_FALSE)) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        *value = p[0] == SIMPLE_TRUE;
+        return 1;
+    }
+
+    static int get_float(const uint8_t *p, size_t len, float *value) {
+        if (len < 5 || p[0] != FLOAT32) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        uint32_t bits = get_be(p + 1, 4);
+        memcpy(value, &bits, sizeof (bits));
+        return 5;
+    }
+
+    static int get_array(const uint8_t *p, size_t len, unsigned count) {
+        uint32_t n;
+        int ret = get_head(p, len, MAJOR_ARRAY, &n);
+        return ret > 0 && n != count ? MESSAGE_ERROR_MALFORMED : ret;
+    }
+
+    static int get_string(const uint8_t *p, size_t len, char *s, size_t size) {
+        uint32_t n;
+        int ret = get_head(p, len, MAJOR_TEXT, &n);
+        if (ret < 0 || n >= size || n > len - ret) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        memcpy(s, p + ret, n);
+        memset(s + n, 0, size - n);
+        return ret + n;
+    }
+
+protected:
+    enum {
+        MAJOR_UINT = 0,
+        MAJOR_NINT = 1,
+        MAJOR_TEXT = 3,
+        MAJOR_ARRAY = 4,
+        SIMPLE_FALSE = 0xF4,
+        SIMPLE_TRUE = 0xF5,
+        FLOAT32 = 0xFA
+    };
+
+    static size_t put_head(uint8_t *p, uint8_t major, uint32_t value) {
+        major <<= 5;
+        if (value < 24) {
+            p[0] = major | value;
+            return 1;
+        } else if (value < 0x100) {
+            p[0] = major | 24;
+            p[1] = value;
+            return 2;
+        } else if (value < 0x10000) {
+            p[0] = major | 25;
+            put_be(p + 1, value, 2);
+            return 3;
+        }
+        p[0] = major | 26;
+        put_be(p + 1, value, 4);
+        return 5;
+    }
+
+    static int get_head(const uint8_t *p, size_t len, uint8_t major, uint32_t *value) {
+        if (len == 0 || (p[0] >> 5) != major) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        uint8_t info = p[0] & 0x1F;
+        if (info < 24) {
+            *value = info;
+            return 1;
+        }
+        /* 64 bit and indefinite lengths are not written, nor read */
+        if (info > 26) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        uint8_t bytes = 1 << (info - 24);
+        if (len < 1u + bytes) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        *value = get_be(p + 1, bytes);
+        return 1 + bytes;
+    }
+
+    static void put_be(uint8_t *p, uint32_t value, uint8_t bytes) {
+        while (bytes-- > 0) {
+            *p++ = value >> (8 * bytes);
+        }
+    }
+
+    static uint32_t get_be(const uint8_t *p, uint8_t bytes) {
+        uint32_t value = 0;
+        while (bytes-- > 0) {
+            value = (value << 8) | *p++;
+        }
+        return value;
+    }
+};
+
+/**
+ * \brief PackedFormat writes the values with the width of their type, big
+ * endian, without any framing.
+ */
+struct PackedFormat {
+    template <unsigned N> struct Head {
+        enum { LEN = 0 };
+    };
+
+    enum { OVERHEAD = 0 };
+
+    static size_t put_uint(uint8_t *p, uint32_t value, uint8_t bytes) {
+        for (uint8_t i = bytes; i-- > 0; ) {
+            *p++ = value >> (8 * i);
+        }
+        return bytes;
+    }
+
+    static size_t put_int(uint8_t *p, int32_t value, uint8_t bytes) {
+        return put_uint(p, (uint32_t) value, bytes);
+    }
+
+    static size_t put_bool(uint8_t *p, bool value) {
+        *p = value ? 1 : 0;
+        return 1;
+    }
+
+    static size_t put_float(uint8_t *p, float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof (bits));
+        return put_uint(p, bits, 4);
+    }
+
+    static size_t put_array(uint8_t *p, unsigned count) {
+        (void) p;
+        (void) count;
+        return 0;
+    }
+
+    static size_t put_string(uint8_t *p, const char *s, size_t size) {
+        const char *end = (const char *) memchr(s, '\0', size - 1);
+        size_t len = end != NULL ? end - s : size - 1;
+        memcpy(p, s, len);
+        memset(p + len, 0, size - len);
+        return size;
+    }
+
+    static int get_uint(const uint8_t *p, size_t len, uint8_t bytes, uint32_t *value) {
+        if (len < bytes) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        uint32_t v = 0;
+        for (uint8_t i = 0; i < bytes; i++) {
+            v = (v << 8) | p[i];
+        }
+        *value = v;
+        return bytes;
+    }
+
+    static int get_int(const uint8_t *p, size_t len, uint8_t bytes, int32_t *value) {
+        uint32_t bits;
+        int n = get_uint(p, len, bytes, &bits);
+        if (n < 0) {
+            return n;
+        }
+        if (bytes < 4 && (bits & ((uint32_t) 1 << (8 * bytes - 1)))) {
+            /* Extend the sign */
+            bits |= ~(uint32_t) 0 << (8 * bytes);
+        }
+        *value = (int32_t) bits;
+        return n;
+    }
+
+    static int get_bool(const uint8_t *p, size_t len, bool *value) {
+        if (len < 1 || p[0] > 1) {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        *value = p[0] == 1;
+        return 1;
+    }
+
+    static int get_float(const uint8_t *p, size_t len, float *value) {
+        uint32_t bits;
+        int n = get_uint(p, len, 4, &bits);
+        if (n > 0) {
+            memcpy(value, &bits, sizeof (bits));
+        }
+        return n;
+    }
+
+    static int get_array(const uint8_t *p, size_t len, unsigned count) {
+        (void) p;
+        (void) len;
+        (void) count;
+        return 0;
+    }
+
+    static int get_string(const uint8_t *p, size_t len, char *s, size_t size) {
+        if (len < size || p[size - 1] != '\0') {
+            return MESSAGE_ERROR_MALFORMED;
+        }
+        memcpy(s, p, size);
+        return size;
+    }
+};
+
+/**
+ * The schema of a struct, specialized for every struct to encode with a
+ * typedef MessageFields<...> Fields
+ */
+template <typename T> struct MessageSchema;
+
+/**
+ * \brief MessageCodec encodes and decodes a T in a Format.
+ *
+ * This is the codec of a struct with a MessageSchema, it is specialized
+ * for the other types members may be of.
+ */
+template <typename Format, typename T>
+struct MessageCodec {
+    typedef typename MessageSchema<T>::Fields Fields;
+
+    /** The most bytes an encoded T takes */
+    enum { MAX_LEN = Format::template Head<Fields::COUNT>::LEN + Fields::template Max<Format>::LEN };
+
+    /**
+     * Encode a T
+     *
+     * @param[in] value The T
+     * @param[in] buf The buffer, of at least MAX_LEN bytes
+     * @return The bytes written
+     */
+    static size_t encode(const T &value, uint8_t *buf) {
+        size_t n = Format::put_array(buf, Fields::COUNT);
+        return n + Fields::template encode<Format>(value, buf + n);
+    }
+
+    /**
+     * Decode a T
+     *
+     * @param[in] buf The encoded T
+     * @param[in] len Its length, or more
+     * @param[out] value The T decoded
+     * @return The bytes read, or MESSAGE_ERROR_MALFORMED
+     */
+    static int decode(const uint8_t *buf, size_t len, T *value) {
+        int n = Format::get_array(buf, len, Fields::COUNT);
+        if (n < 0) {
+            return n;
+        }
+        int m = Fields::template decode<Format>(buf + n, len - n, value);
+        return m < 0 ? m : n + m;
+    }
+};
+
+/**
+ * \brief UnsignedCodec encodes the unsigned integer types.
+ */
+template <typename Format, typename T>
+struct UnsignedCodec {
+    enum { MAX_LEN = Format::OVERHEAD + sizeof (T) };
+
+    static size_t encode(const T &value, uint8_t *buf) {
+        return Format::put_uint(buf, value, sizeof (T));
+    }
+
+    static int decode(const uint8_t *buf, size_t len, T *value) {
+        uint32_t v;
+        int n = Format::get_uint(buf, len, sizeof (T), &v);
+        if (n > 0) {
+            *value = (T) v;
+        }
+        return n;
+    }
+};
+
+/**
+ * \brief SignedCodec encodes the signed integer types.
+ */
+template <typename Format, typename T>
+struct SignedCodec {
+    enum { MAX_LEN = Format::OVERHEAD + sizeof (T) };
+
+    static size_t encode(const T &value, uint8_t *buf) {
+        return Format::put_int(buf, value, sizeof (T));
+    }
+
+    static int decode(const uint8_t *buf, size_t len, T *value) {
+        int32_t v;
+        int n = Format::get_int(buf, len, sizeof (T), &v);
+        if (n > 0) {
+            *value = (T) v;
+        }
+        return n;
+    }
+};
+
+template <typename Format> struct MessageCodec<Format, uint8_t> : UnsignedCodec<Format, uint8_t> {};
+template <typename Format> struct MessageCodec<Format, uint16_t> : UnsignedCodec<Format, uint16_t> {};
+template <typename Format> struct MessageCodec<Format, uint32_t> : UnsignedCodec<Format, uint32_t> {};
+template <typename Format> struct MessageCodec<Format, int8_t> : SignedCodec<Format, int8_t> {};
+template <typename Format> struct MessageCodec<Format, int16_t> : SignedCodec<Format, int16_t> {};
+template <typename Format> struct MessageCodec<Format, int32_t> : SignedCodec<Format, int32_t> {};
+
+template <typename Format>
+struct MessageCodec<Format, bool> {
+    enum { MAX_LEN = 1 };
+
+    static size_t encode(const bool &value, uint8_t *buf) {
+        return Format::put_bool(buf, value);
+    }
+
+    static int decode(const uint8_t *buf, size_t len, bool *value) {
+        return Format::get_bool(buf, len, value);
+    }
+};
+
+template <typename Format>
+struct MessageCodec<Format, float> {
+    enum { MAX_LEN = Format::OVERHEAD + 4 };
+
+    static size_t encode(const float &value, uint8_t *buf) {
+        return Format::put_float(buf, value);
+    }
+
+    static int decode(const uint8_t *buf, size_t len, float *value) {
+        return Format::get_float(buf, len, value);
+    }
+};
+
+/**
+ * A char array holds a string, up to its first NUL and at most N - 1 chars
+ */
+template <typename Format, unsigned N>
+struct MessageCodec<Format, char[N]> {
+    enum { MAX_LEN = Format::template Head<N>::LEN + N };
+
+    static size_t encode(const char (&value)[N], uint8_t *buf) {
+        return Format::put_string(buf, value, N);
+    }
+
+    static int decode(const uint8_t *buf, size_t len, char (*value)[N]) {
+        return Format::get_string(buf, len, *value, N);
+    }
+};
+
+template <typename Format, typename T, unsigned N>
+struct MessageCodec<Format, T[N]> {
+    enum { MAX_LEN = Format::template Head<N>::LEN + N * MessageCodec<Format, T>::MAX_LEN };
+
+    static size_t encode(const T (&value)[N], uint8_t *buf) {
+        size_t n = Format::put_array(buf, N);
+        for (unsigned i = 0; i < N; i++) {
+            n += MessageCodec<Format, T>::encode(value[i], buf + n);
+        }
+        return n;
+    }
+
+    static int decode(const uint8_t *buf, size_t len, T (*value)[N]) {
+        int n = Format::get_array(buf, len, N);
+        for (unsigned i = 0; n >= 0 && i < N; i++) {
+            int m = MessageCodec<Format, T>::decode(buf + n, len - n, &(*value)[i]);
+            n = m < 0 ? m : n + m;
+        }
+        return n;
+    }
+};
+
+/**
+ * \brief MessageField is the member M of type T of the struct S.
+ */
+template <typename S, typename T, T S::*M>
+struct MessageField {
+    enum { COUNT = 1 };
+
+    template <typename Format> struct Max {
+        enum { LEN = MessageCodec<Format, T>::MAX_LEN };
+    };
+
+    template <typename Format>
+    static size_t encode(const S &value, uint8_t *buf) {
+        return MessageCodec<Format, T>::encode(value.*M, buf);
+    }
+
+    template <typename Format>
+    static int decode(const uint8_t *buf, size_t len, S *value) {
+        return MessageCodec<Format, T>::decode(buf, len, &(value->*M));
+    }
+};
+
+/**
+ * \brief MessageNoField fills the list of fields up.
+ */
+struct MessageNoField {
+    enum { COUNT = 0 };
+
+    template <typename Format> struct Max {
+        enum { LEN = 0 };
+    };
+
+    template <typename Format, typename S>
+    static size_t encode(const S &value, uint8_t *buf) {
+        (void) value;
+        (void) buf;
+        return 0;
+    }
+
+    template <typename Format, typename S>
+    static int decode(const uint8_t *buf, size_t len, S *value) {
+        (void) buf;
+        (void) len;
+        (void) value;
+        return 0;
+    }
+};
+
+/**
+ * \brief MessageFields lists the fields of a schema, up to 12; a struct
+ * member makes room for more.
+ */
+template <typename F1, typename F2 = MessageNoField, typename F3 = MessageNoField,
+          typename F4 = MessageNoField, typename F5 = MessageNoField,
+          typename F6 = MessageNoField, typename F7 = MessageNoField,
+          typename F8 = MessageNoField, typename F9 = MessageNoField,
+          typename F10 = MessageNoField, typename F11 = MessageNoField,
+          typename F12 = MessageNoField>
+struct MessageFields {
+    enum {
+        COUNT = F1::COUNT + F2::COUNT + F3::COUNT + F4::COUNT + F5::COUNT + F6::COUNT +
+                F7::COUNT + F8::COUNT + F9::COUNT + F10::COUNT + F11::COUNT + F12::COUNT
+    };
+
+    template <typename Format> struct Max {
+        enum {
+            LEN = F1::template Max<Format>::LEN + F2::template Max<Format>::LEN +
+                  F3::template Max<Format>::LEN + F4::template Max<Format>::LEN +
+                  F5::template Max<Format>::LEN + F6::template Max<Format>::LEN +
+                  F7::template Max<Format>::LEN + F8::template Max<Format>::LEN +
+                  F9::template Max<Format>::LEN + F10::template Max<Format>::LEN +
+                  F11::template Max<Format>::LEN + F12::template Max<Format>::LEN
+        };
+    };
+
+    template <typename Format, typename S>
+    static size_t encode(const S &value, uint8_t *buf) {
+        uint8_t *p = buf;
+        p += F1::template encode<Format>(value, p);
+        p += F2::template encode<Format>(value, p);
+        p += F3::template encode<Format>(value, p);
+        p += F4::template encode<Format>(value, p);
+        p += F5::template encode<Format>(value, p);
+        p += F6::template encode<Format>(value, p);
+        p += F7::template encode<Format>(value, p);
+        p += F8::template encode<Format>(value, p);
+        p += F9::template encode<Format>(value, p);
+        p += F10::template encode<Format>(value, p);
+        p += F11::template encode<Format>(value, p);
+        p += F12::template encode<Format>(value, p);
+        return p - buf;
+    }
+
+    template <typename Format, typename S>
+    static int decode(const uint8_t *buf, size_t len, S *value) {
+        int used = 0;
+        if (next<F1, Format>(buf, len, value, &used) && next<F2, Format>(buf, len, value, &used) &&
+            next<F3, Format>(buf, len, value, &used) && next<F4, Format>(buf, len, value, &used) &&
+            next<F5, Format>(buf, len, value, &used) && next<F6, Format>(buf, len, value, &used) &&
+            next<F7, Format>(buf, len, value, &used) && next<F8, Format>(buf, len, value, &used) &&
+            next<F9, Format>(buf, len, value, &used) && next<F10, Format>(buf, len, value, &used) &&
+            next<F11, Format>(buf, len, value, &used) && next<F12, Format>(buf, len, value, &used)) {
+            return used;
+        }
+        return MESSAGE_ERROR_MALFORMED;
+    }
+
+protected:
+    /**
+     * Decode the field F after the bytes used so far
+     */
+    template <typename F, typename Format, typename S>
+    static bool next(const uint8_t *buf, size_t len, S *value, int *used) {
+        int n = F::template decode<Format>(buf + *used, len - *used, value);
+        if (n < 0) {
+            return false;
+        }
+        *used += n;
+        return true;
+    }
+};
+
+#endif /* __MESSAGE_CODEC_H_ */
@@ -0,0 +1,907 @@
+/*
+ *  An MQTT v5 client with the interface of MQTT::Client
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file Mqtt5Client.h
+ *  \brief MQTT v5 sessions for ConnectionManager
+ *  MQTT.lib only speaks MQTT 3.1.1. This client implements the part of
+ *  MQTT::Client that ConnectionManager uses, over the same Network, with
+ *  the v5 features that matter on a slow uplink:
+ *
+ *  Topic aliases: the first PUBLISH to a topic carries the topic and an
+ *  alias, the following ones only the two byte alias. Up to TOPIC_ALIASES
+ *  topics, or the broker's Topic Alias Maximum if lower, have an alias;
+ *  the least recently used one is given to a new topic.
+ *
+ *  Receive maximum: QoS 1 messages are not waited for one by one, up to
+ *  MBED_CONF_APP_MQTT5_MAX_INFLIGHT of them, or the broker's Receive
+ *  Maximum if lower, are sent ahead of their PUBACK. publish() only blocks
+ *  when that window is full, and the PUBACK handler learns which message
+ *  was acknowledged, so the caller keeps each one until then. QoS 2
+ *  messages are still sent one at a time.
+ *
+ *  Maximum packet size: the client announces its receive buffer, and does
+ *  not send a packet larger than the broker announced.
+ *
+ *  There is no table of message handlers, every message goes to the
+ *  default handler, where ConnectionManager matches it against its filters.
+ *  The broker is not allowed topic aliases towards the client.
+ */
+
+#ifndef __MQTT5_CLIENT_H_
+#define __MQTT5_CLIENT_H_
+
+#include "mbed.h"
+#include "MQTTClient.h"
+
+/** QoS 1 messages sent ahead of their PUBACK, within the broker's Receive Maximum */
+#ifndef MBED_CONF_APP_MQTT5_MAX_INFLIGHT
+#define MBED_CONF_APP_MQTT5_MAX_INFLIGHT 4
+#endif
+
+/** QoS 1 and 2 messages the broker may send ahead of their acknowledgement */
+#ifndef MBED_CONF_APP_MQTT5_RECEIVE_MAXIMUM
+#define MBED_CONF_APP_MQTT5_RECEIVE_MAXIMUM 8
+#endif
+
+/**
+ * \brief Mqtt5Client is an MQTT v5 session over a Network.
+ *
+ * @tparam Network Provides read() and write() with a timeout, as for MQTT::Client
+ * @tparam MAX_PACKET_SIZE The size of the send and receive buffers
+ * @tparam TOPIC_ALIASES The number of topics given an alias
+ * @tparam MAX_TOPIC_LEN The longest topic given an alias
+ */
+template <class Network, int MAX_PACKET_SIZE, int TOPIC_ALIASES, int MAX_TOPIC_LEN>
+class Mqtt5Client {
+public:
+    typedef void (*messageHandler)(MQTT::MessageData &);
+
+    /**
+     * Called with the packet id and reason code of every PUBACK
+     */
+    typedef void (*pubackHandler)(uint16_t id, uint8_t reason);
+
+    /**
+     * Mqtt5Client Constructor
+     *
+     * @param[in] network The connected network to run the session over
+     * @param[in] command_timeout_ms How long to wait for an acknowledgement
+     */
+    Mqtt5Client(Network &network, unsigned int command_timeout_ms = 30000) :
+            _network(network), _command_timeout(command_timeout_ms), _handler(NULL),
+            _puback_handler(NULL),
+            _connected(false), _keepalive_ms(0), _last_sent(0), _last_received(0), _ping_sent(0),
+            _ping_outstanding(false), _next_id(0),
+            _inflight_count(0), _inflight_max(MBED_CONF_APP_MQTT5_MAX_INFLIGHT),
+            _alias_max(0), _alias_clock(0), _max_packet_size(MAX_PACKET_SIZE),
+            _ack_type(0), _ack_id(0), _ack_reason(0), _body(0), _body_len(0) {
+        _clock.start();
+    }
+
+    /**
+     * Set the handler every incoming message is delivered to
+     */
+    void setDefaultMessageHandler(messageHandler mh) {
+        _handler = mh;
+    }
+
+    /**
+     * Set the handler told of the QoS 1 messages acknowledged
+     */
+    void setPubackHandler(pubackHandler ph) {
+        _puback_handler = ph;
+    }
+
+    /**
+     * There is no table of handlers, only removing one is accepted
+     *
+     * @return MQTT::SUCCESS if mh is NULL, else MQTT::FAILURE
+     */
+    int setMessageHandler(const char *topicFilter, messageHandler mh) {
+        (void) topicFilter;
+        return mh == NULL ? MQTT::SUCCESS : MQTT::FAILURE;
+    }
+
+    /**
+     * Send CONNECT and wait for the CONNACK. A will is not supported, and
+     * the MQTTVersion of the options is ignored.
+     *
+     * @return MQTT::SUCCESS, MQTT::FAILURE, or the CONNACK's reason code
+     */
+    int connect(MQTTPacket_connectData &options) {
+        if (_connected || options.willFlag) {
+            return MQTT::FAILURE;
+        }
+
+        size_t id_len, user_len = 0, pass_len = 0;
+        const char *id = string_data(options.clientID, &id_len);
+        const char *user = string_data(options.username, &user_len);
+        const char *pass = string_data(options.password, &pass_len);
+
+        /* Receive Maximum and Maximum Packet Size */
+        const size_t props = 3 + 5;
+        size_t rem = 10 + varint_len(props) + props + 2 + id_len;
+        if (user != NULL) {
+            rem += 2 + user_len;
+        }
+        if (pass != NULL) {
+            rem += 2 + pass_len;
+        }
+        if (1 + varint_len(rem) + rem > (size_t) MAX_PACKET_SIZE) {
+            return MQTT::BUFFER_OVERFLOW;
+        }
+
+        unsigned char *p = _sendbuf;
+        *p++ = CONNECT << 4;
+        p += encode_varint(p, rem);
+        p = write_string(p, "MQTT", 4);
+        *p++ = PROTOCOL_LEVEL;
+        *p++ = (user != NULL ? 0x80 : 0) | (pass != NULL ? 0x40 : 0) |
+               (options.cleansession ? 0x02 : 0);
+        p = write_u16(p, options.keepAliveInterval);
+        p += encode_varint(p, props);
+        *p++ = PROP_RECEIVE_MAXIMUM;
+        p = write_u16(p, MBED_CONF_APP_MQTT5_RECEIVE_MAXIMUM);
+        *p++ = PROP_MAXIMUM_PACKET_SIZE;
+        p = write_u32(p, MAX_PACKET_SIZE);
+        p = write_string(p, id, id_len);
+        if (user != NULL) {
+            p = write_string(p, user, user_len);
+        }
+        if (pass != NULL) {
+            p = write_string(p, pass, pass_len);
+        }
+
+        _keepalive_ms = options.keepAliveInterval * 1000UL;
+        if (send_packet(p - _sendbuf) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+        if (read_packet(_command_timeout) != CONNACK) {
+            return MQTT::FAILURE;
+        }
+
+        Reader r = reader();
+        read_u8(r);
+        uint8_t reason = read_u8(r);
+        if (!r.ok) {
+            return MQTT::FAILURE;
+        }
+        if (reason != 0) {
+            return reason;
+        }
+        if (!parse_connack_properties(r)) {
+            return MQTT::FAILURE;
+        }
+
+        /* A new session, no alias or message in flight carries over */
+        for (int i = 0; i < TOPIC_ALIASES; i++) {
+            _aliases[i].used = 0;
+        }
+        _alias_clock = 0;
+        _inflight_count = 0;
+        _ping_outstanding = false;
+        _connected = true;
+        return MQTT::SUCCESS;
+    }
+
+    /**
+     * Subscribe to a filter, waiting for the SUBACK
+     *
+     * @param[in] mh Ignored, messages go to the default handler
+     * @return MQTT::SUCCESS, or MQTT::FAILURE if the broker refused
+     */
+    int subscribe(const char *topicFilter, enum MQTT::QoS qos, messageHandler mh) {
+        (void) mh;
+        if (!_connected) {
+            return MQTT::FAILURE;
+        }
+
+        size_t len = strlen(topicFilter);
+        size_t rem = 2 + 1 + 2 + len + 1;
+        if (1 + varint_len(rem) + rem > (size_t) MAX_PACKET_SIZE) {
+            return MQTT::BUFFER_OVERFLOW;
+        }
+
+        uint16_t id = next_id();
+        unsigned char *p = _sendbuf;
+        *p++ = (SUBSCRIBE << 4) | 0x02;
+        p += encode_varint(p, rem);
+        p = write_u16(p, id);
+        *p++ = 0;
+        p = write_string(p, topicFilter, len);
+        *p++ = qos;
+        if (send_packet(p - _sendbuf) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+
+        int reason = wait_ack(SUBACK, id);
+        return reason >= 0 && reason < REASON_FAILURE ? MQTT::SUCCESS : MQTT::FAILURE;
+    }
+
+    /**
+     * Publish a message. A QoS 1 message is not waited for, its PUBACK
+     * frees its place in the window and goes to the PUBACK handler. If the
+     * session is lost first, the message may not have arrived.
+     *
+     * @param[in] content_type The Content Type property, NULL for none
+     * @param[out] packet_id Receives the id of a QoS 1 message, may be NULL
+     * @return MQTT::SUCCESS, or a negative MQTT::returnCode on failure
+     */
+    int publish(const char *topicName, void *payload, size_t payloadlen,
+                enum MQTT::QoS qos = MQTT::QOS0, bool retained = false,
+                const char *content_type = NULL, uint16_t *packet_id = NULL) {
+        if (!_connected) {
+            return MQTT::FAILURE;
+        }
+
+        uint16_t id = 0;
+        if (qos == MQTT::QOS1) {
+            uint32_t start = now_ms();
+            while (_inflight_count >= _inflight_max) {
+                if (cycle(remaining(start)) < 0 || remaining(start) == 0) {
+                    return MQTT::FAILURE;
+                }
+            }
+        }
+        if (qos != MQTT::QOS0) {
+            id = next_id();
+        }
+
+        int len = serialize_publish(_sendbuf, MAX_PACKET_SIZE, topicName, payload, payloadlen,
+                                    qos, id, retained, content_type);
+        if (len < 0) {
+            return len;
+        }
+        if (send_packet(len) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+
+        if (qos == MQTT::QOS1) {
+            _inflight[_inflight_count++] = id;
+            if (packet_id != NULL) {
+                *packet_id = id;
+            }
+        } else if (qos == MQTT::QOS2) {
+            int reason = wait_ack(PUBREC, id);
+            if (reason < 0 || reason >= REASON_FAILURE) {
+                return MQTT::FAILURE;
+            }
+            if (send_ack(PUBREL, id) != MQTT::SUCCESS || wait_ack(PUBCOMP, id) != 0) {
+                return MQTT::FAILURE;
+            }
+        }
+        return MQTT::SUCCESS;
+    }
+
+    /**
+     * Serialize a PUBLISH into a buffer, with the topic's alias if it has
+     * one and giving it one if not. The packet must then be sent, an alias
+     * is taken as known to the broker from here on.
+     *
+     * @param[in] payload The payload, or NULL to leave its len bytes at the
+     *            end of the packet to the caller
+     * @param[in] content_type The Content Type property, NULL for none
+     * @return The packet length, or MQTT::BUFFER_OVERFLOW if it does not
+     *         fit the buffer or exceeds the broker's maximum packet size
+     */
+    int serialize_publish(unsigned char *buf, size_t size, const char *topic,
+                          const void *payload, size_t len, enum MQTT::QoS qos,
+                          uint16_t id, bool retained = false,
+                          const char *content_type = NULL) {
+        size_t topic_len = strlen(topic);
+        int alias = -1;
+        bool known = false;
+        if (_alias_max > 0 && topic_len <= (size_t) MAX_TOPIC_LEN) {
+            alias = find_alias(topic);
+            known = alias >= 0;
+            if (!known) {
+                alias = oldest_alias();
+            }
+        }
+
+        size_t type_len = content_type != NULL ? strlen(content_type) : 0;
+        size_t props = (alias >= 0 ? 3 : 0) + (content_type != NULL ? 3 + type_len : 0);
+        size_t rem = 2 + (known ? 0 : topic_len) + (qos != MQTT::QOS0 ? 2 : 0) +
+                     varint_len(props) + props + len;
+        size_t total = 1 + varint_len(rem) + rem;
+        if (total > size || total > _max_packet_size) {
+            return MQTT::BUFFER_OVERFLOW;
+        }
+
+        unsigned char *p = buf;
+        *p++ = (PUBLISH << 4) | (qos << 1) | (retained ? 1 : 0);
+        p += encode_varint(p, rem);
+        p = known ? write_u16(p, 0) : write_string(p, topic, topic_len);
+        if (qos != MQTT::QOS0) {
+            p = write_u16(p, id);
+        }
+        p += encode_varint(p, props);
+        if (alias >= 0) {
+            *p++ = PROP_TOPIC_ALIAS;
+            p = write_u16(p, alias + 1);
+            if (!known) {
+                strcpy(_aliases[alias].topic, topic);
+            }
+            _aliases[alias].used = ++_alias_clock;
+        }
+        if (content_type != NULL) {
+            *p++ = PROP_CONTENT_TYPE;
+            p = write_string(p, content_type, type_len);
+        }
+        if (payload != NULL) {
+            memcpy(p, payload, len);
+        }
+        return static_cast<int>(total);
+    }
+
+    /**
+     * Send DISCONNECT, the session is over
+     */
+    int disconnect() {
+        if (!_connected) {
+            return MQTT::FAILURE;
+        }
+        _sendbuf[0] = DISCONNECT << 4;
+        _sendbuf[1] = 0;
+        int ret = send_packet(2);
+        _connected = false;
+        return ret;
+    }
+
+    /**
+     * Handle the incoming packets and keep the session alive for a while
+     *
+     * @return MQTT::SUCCESS, or MQTT::FAILURE once the session is lost
+     */
+    int yield(unsigned long timeout_ms = 1000L) {
+        uint32_t start = now_ms();
+        uint32_t elapsed = 0;
+        do {
+            if (cycle(timeout_ms - elapsed) < 0) {
+                return MQTT::FAILURE;
+            }
+            elapsed = now_ms() - start;
+        } while (elapsed < timeout_ms);
+        return MQTT::SUCCESS;
+    }
+
+    bool isConnected() {
+        return _connected;
+    }
+
+    /** Topics that can have an alias in this session */
+    uint16_t topic_aliases() const {
+        return _alias_max;
+    }
+
+    /** QoS 1 messages sent ahead of their PUBACK in this session */
+    uint16_t max_inflight() const {
+        return _inflight_max;
+    }
+
+    /** Largest packet the broker accepts */
+    uint32_t max_packet_size() const {
+        return _max_packet_size;
+    }
+
+protected:
+    static const uint8_t PROTOCOL_LEVEL = 5;
+    static const uint8_t REASON_FAILURE = 0x80;
+
+    /* The properties the client uses */
+    static const uint8_t PROP_CONTENT_TYPE = 0x03;
+    static const uint8_t PROP_SERVER_KEEP_ALIVE = 0x13;
+    static const uint8_t PROP_RECEIVE_MAXIMUM = 0x21;
+    static const uint8_t PROP_TOPIC_ALIAS_MAXIMUM = 0x22;
+    static const uint8_t PROP_TOPIC_ALIAS = 0x23;
+    static const uint8_t PROP_MAXIMUM_PACKET_SIZE = 0x27;
+
+    struct Alias {
+        char topic[MAX_TOPIC_LEN + 1];
+        uint32_t used;          /**< When last sent, 0 if never */
+    };
+
+    /** Bounds checked reading of a received packet */
+    struct Reader {
+        const unsigned char *p;
+        const unsigned char *end;
+        bool ok;
+    };
+
+    static size_t varint_len(uint32_t n) {
+        return n < 128 ? 1 : n < 16384 ? 2 : n < 2097152 ? 3 : 4;
+    }
+
+    static size_t encode_varint(unsigned char *p, uint32_t n) {
+        size_t len = 0;
+        do {
+            uint8_t byte = n % 128;
+            n /= 128;
+            p[len++] = byte | (n > 0 ? 0x80 : 0);
+        } while (n > 0);
+        return len;
+    }
+
+    static unsigned char *write_u16(unsigned char *p, uint16_t n) {
+        *p++ = n >> 8;
+        *p++ = n & 0xFF;
+        return p;
+    }
+
+    static unsigned char *write_u32(unsigned char *p, uint32_t n) {
+        p = write_u16(p, n >> 16);
+        return write_u16(p, n & 0xFFFF);
+    }
+
+    static unsigned char *write_string(unsigned char *p, const char *s, size_t len) {
+        p = write_u16(p, len);
+        memcpy(p, s, len);
+        return p + len;
+    }
+
+    /**
+     * The text of an MQTTString, or NULL if it is not set
+     */
+    static const char *string_data(const MQTTString &s, size_t *len) {
+        if (s.cstring != NULL) {
+            *len = strlen(s.cstring);
+            return s.cstring;
+        }
+        *len = s.lenstring.len;
+        return s.lenstring.data;
+    }
+
+    static uint8_t read_u8(Reader &r) {
+        if (r.end - r.p < 1) {
+            r.ok = false;
+            return 0;
+        }
+        return *r.p++;
+    }
+
+    static uint16_t read_u16(Reader &r) {
+        uint16_t n = read_u8(r) << 8;
+        return n | read_u8(r);
+    }
+
+    static uint32_t read_u32(Reader &r) {
+        uint32_t n = (uint32_t) read_u16(r) << 16;
+        return n | read_u16(r);
+    }
+
+    static uint32_t read_varint(Reader &r) {
+        uint32_t n = 0;
+        for (int shift = 0; shift < 28; shift += 7) {
+            uint8_t byte = read_u8(r);
+            n |= (uint32_t) (byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return n;
+            }
+        }
+        r.ok = false;
+        return 0;
+    }
+
+    static void skip(Reader &r, size_t len) {
+        if ((size_t) (r.end - r.p) < len) {
+            r.ok = false;
+            return;
+        }
+        r.p += len;
+    }
+
+    /**
+     * Skip the value of a property the client has no use for
+     */
+    static void skip_property(Reader &r, uint8_t id) {
+        switch (id) {
+            case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+                skip(r, 1);
+                break;
+            case 0x13: case 0x21: case 0x22: case 0x23:
+                skip(r, 2);
+                break;
+            case 0x02: case 0x11: case 0x18: case 0x27:
+                skip(r, 4);
+                break;
+            case 0x0B:
+                read_varint(r);
+                break;
+            case 0x26:
+                /* User property, a pair of strings */
+                skip(r, read_u16(r));
+                skip(r, read_u16(r));
+                break;
+            case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16:
+            case 0x1A: case 0x1C: case 0x1F:
+                skip(r, read_u16(r));
+                break;
+            default:
+                r.ok = false;
+                break;
+        }
+    }
+
+    /**
+     * Skip a property list, leaving r on what follows it
+     */
+    static void skip_properties(Reader &r) {
+        skip(r, read_varint(r));
+    }
+
+    /**
+     * A reader over the body of the packet received last
+     */
+    Reader reader() {
+        Reader r = { _readbuf + _body, _readbuf + _body + _body_len, true };
+        return r;
+    }
+
+    bool parse_connack_properties(Reader &r) {
+        uint32_t len = read_varint(r);
+        if (!r.ok || (size_t) (r.end - r.p) < len) {
+            return false;
+        }
+
+        Reader props = { r.p, r.p + len, true };
+        _inflight_max = MBED_CONF_APP_MQTT5_MAX_INFLIGHT;
+        _alias_max = 0;
+        _max_packet_size = MAX_PACKET_SIZE;
+        while (props.ok && props.p < props.end) {
+            uint8_t id = read_u8(props);
+            switch (id) {
+                case PROP_RECEIVE_MAXIMUM: {
+                    uint16_t n = read_u16(props);
+                    if (n == 0) {
+                        return false;
+                    }
+                    if (n < _inflight_max) {
+                        _inflight_max = n;
+                    }
+                    break;
+                }
+                case PROP_TOPIC_ALIAS_MAXIMUM: {
+                    uint16_t n = read_u16(props);
+                    _alias_max = n < TOPIC_ALIASES ? n : TOPIC_ALIASES;
+                    break;
+                }
+                case PROP_MAXIMUM_PACKET_SIZE: {
+                    uint32_t n = read_u32(props);
+                    if (n < _max_packet_size) {
+                        _max_packet_size = n;
+                    }
+                    break;
+                }
+                case PROP_SERVER_KEEP_ALIVE:
+                    _keepalive_ms = read_u16(props) * 1000UL;
+                    break;
+                default:
+                    skip_property(props, id);
+                    break;
+            }
+        }
+        return props.ok;
+    }
+
+    /**
+     * The alias of a topic, or -1
+     */
+    int find_alias(const char *topic) {
+        for (int i = 0; i < _alias_max; i++) {
+            if (_aliases[i].used != 0 && strcmp(_aliases[i].topic, topic) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * An alias not used yet, or the least recently used one
+     */
+    int oldest_alias() {
+        int oldest = 0;
+        for (int i = 0; i < _alias_max; i++) {
+            if (_aliases[i].used == 0) {
+                return i;
+            }
+            if ((int32_t) (_aliases[i].used - _aliases[oldest].used) < 0) {
+                oldest = i;
+            }
+        }
+        return oldest;
+    }
+
+    uint16_t next_id() {
+        _next_id = _next_id == 0xFFFF ? 1 : _next_id + 1;
+        return _next_id;
+    }
+
+    uint32_t now_ms() {
+        return _clock.read_high_resolution_us() / 1000;
+    }
+
+    /**
+     * Milliseconds left of the command timeout started at start
+     */
+    uint32_t remaining(uint32_t start) {
+        uint32_t elapsed = now_ms() - start;
+        return elapsed < _command_timeout ? _command_timeout - elapsed : 0;
+    }
+
+    int send_packet(size_t len) {
+        if (_network.write(_sendbuf, len, _command_timeout) != (int) len) {
+            _connected = false;
+            return MQTT::FAILURE;
+        }
+        _last_sent = now_ms();
+        return MQTT::SUCCESS;
+    }
+
+    /**
+     * Send PUBACK, PUBREC, PUBREL or PUBCOMP, with the success reason left out
+     */
+    int send_ack(uint8_t type, uint16_t id) {
+        _sendbuf[0] = (type << 4) | (type == PUBREL ? 0x02 : 0);
+        _sendbuf[1] = 2;
+        write_u16(_sendbuf + 2, id);
+        return send_packet(4);
+    }
+
+    /**
+     * Read a packet into _readbuf
+     *
+     * @return Its type, 0 if none arrived in time, or MQTT::FAILURE
+     */
+    int read_packet(uint32_t timeout_ms) {
+        int ret = _network.read(_readbuf, 1, timeout_ms);
+        if (ret == 0) {
+            return 0;
+        }
+        if (ret != 1) {
+            return MQTT::FAILURE;
+        }
+
+        /* The remaining length follows right away */
+        uint32_t rem = 0;
+        size_t len = 1;
+        do {
+            if (len == 5 || _network.read(_readbuf + len, 1, _command_timeout) != 1) {
+                return MQTT::FAILURE;
+            }
+            rem |= (uint32_t) (_readbuf[len] & 0x7F) << (7 * (len - 1));
+        } while (_readbuf[len++] & 0x80);
+
+        /* The broker was told the largest packet it can send */
+        if (len + rem > (size_t) MAX_PACKET_SIZE) {
+            return MQTT::FAILURE;
+        }
+        if (rem > 0 && _network.read(_readbuf + len, rem, _command_timeout) != (int) rem) {
+            return MQTT::FAILURE;
+        }
+
+        _body = len;
+        _body_len = rem;
+        _last_received = now_ms();
+        return _readbuf[0] >> 4;
+    }
+
+    /**
+     * Handle a PUBLISH: deliver it, then acknowledge it
+     */
+    int deliver() {
+        uint8_t flags = _readbuf[0] & 0x0F;
+        Reader r = reader();
+
+        MQTTString topic = MQTTString_initializer;
+        topic.lenstring.len = read_u16(r);
+        topic.lenstring.data = (char *) r.p;
+        skip(r, topic.lenstring.len);
+
+        MQTT::Message message;
+        message.qos = (enum MQTT::QoS) ((flags >> 1) & 0x03);
+        message.retained = flags & 0x01;
+        message.dup = flags & 0x08;
+        message.id = message.qos != MQTT::QOS0 ? read_u16(r) : 0;
+        skip_properties(r);
+        if (!r.ok || topic.lenstring.len == 0) {
+            return MQTT::FAILURE;
+        }
+        message.payload = (void *) r.p;
+        message.payloadlen = r.end - r.p;
+
+        if (_handler != NULL) {
+            MQTT::MessageData md(topic, message);
+            _handler(md);
+        }
+
+        if (message.qos == MQTT::QOS1) {
+            return send_ack(PUBACK, message.id);
+        } else if (message.qos == MQTT::QOS2) {
+            return send_ack(PUBREC, message.id);
+        }
+        return MQTT::SUCCESS;
+    }
+
+    /**
+     * Note an acknowledgement for wait_ack(), or free the place of a
+     * QoS 1 message in the window and pass its PUBACK on
+     */
+    void on_ack(uint8_t type) {
+        Reader r = reader();
+        uint16_t id = read_u16(r);
+        uint8_t reason = 0;
+        if (type == SUBACK) {
+            skip_properties(r);
+            reason = read_u8(r);
+        } else if (r.p < r.end) {
+            reason = read_u8(r);
+        }
+        if (!r.ok) {
+            return;
+        }
+
+        if (type == PUBACK) {
+            for (uint16_t i = 0; i < _inflight_count; i++) {
+                if (_inflight[i] == id) {
+                    _inflight[i] = _inflight[--_inflight_count];
+                    if (_puback_handler != NULL) {
+                        _puback_handler(id, reason);
+                    }
+                    break;
+                }
+            }
+            return;
+        }
+        _ack_type = type;
+        _ack_id = id;
+        _ack_reason = reason;
+    }
+
+    /**
+     * Handle the incoming packets until an acknowledgement arrives
+     *
+     * @return Its reason code, or MQTT::FAILURE on timeout or failure
+     */
+    int wait_ack(uint8_t type, uint16_t id) {
+        uint32_t start = now_ms();
+        _ack_type = 0;
+        while (true) {
+            if (cycle(remaining(start)) < 0) {
+                return MQTT::FAILURE;
+            }
+            if (_ack_type == type && _ack_id == id) {
+                return _ack_reason;
+            }
+            if (remaining(start) == 0) {
+                return MQTT::FAILURE;
+            }
+        }
+    }
+
+    /**
+     * Send a PINGREQ when the session was quiet for the keep alive
+     * interval, fail when its PINGRESP does not come in as long
+     */
+    int keepalive() {
+        if (_keepalive_ms == 0) {
+            return MQTT::SUCCESS;
+        }
+        uint32_t now = now_ms();
+        if (_ping_outstanding) {
+            return now - _ping_sent < _keepalive_ms ? MQTT::SUCCESS : MQTT::FAILURE;
+        }
+        if (now - _last_sent >= _keepalive_ms || now - _last_received >= _keepalive_ms) {
+            _sendbuf[0] = PINGREQ << 4;
+            _sendbuf[1] = 0;
+            if (send_packet(2) != MQTT::SUCCESS) {
+                return MQTT::FAILURE;
+            }
+            _ping_outstanding = true;
+            _ping_sent = now;
+        }
+        return MQTT::SUCCESS;
+    }
+
+    /**
+     * Handle at most one incoming packet
+     *
+     * @return Its type, 0 if none arrived, or MQTT::FAILURE once the
+     *         session is lost
+     */
+    int cycle(uint32_t timeout_ms) {
+        int type = read_packet(timeout_ms);
+        int ret = MQTT::SUCCESS;
+
+        switch (type) {
+            case PUBLISH:
+                ret = deliver();
+                break;
+            case PUBACK:
+            case PUBREC:
+            case PUBCOMP:
+            case SUBACK:
+                on_ack(type);
+                break;
+            case PUBREL: {
+                Reader r = reader();
+                ret = send_ack(PUBCOMP, read_u16(r));
+                break;
+            }
+            case PINGRESP:
+                _ping_outstanding = false;
+                break;
+            case DISCONNECT: {
+                Reader r = reader();
+                printf("MQTT: disconnected by the broker, reason 0x%02X\n", read_u8(r));
+                ret = MQTT::FAILURE;
+                break;
+            }
+            case MQTT::FAILURE:
+                ret = MQTT::FAILURE;
+                break;
+            default:
+                /* Nothing received, or nothing the client has to act on */
+                break;
+        }
+
+        if (ret == MQTT::SUCCESS) {
+            ret = keepalive();
+        }
+        if (ret != MQTT::SUCCESS) {
+            _connected = false;
+            return MQTT::FAILURE;
+        }
+        return type;
+    }
+
+protected:
+    Network &_network;
+    uint32_t _command_timeout;
+    messageHandler _handler;
+    pubackHandler _puback_handler;
+    bool _connected;
+
+    Timer _clock;
+    uint32_t _keepalive_ms;
+    uint32_t _last_sent;
+    uint32_t _last_received;
+    uint32_t _ping_sent;
+    bool _ping_outstanding;
+
+    uint16_t _next_id;
+    uint16_t _inflight[MBED_CONF_APP_MQTT5_MAX_INFLIGHT];  /**< QoS 1 ids awaiting PUBACK */
+    uint16_t _inflight_count;
+    uint16_t _inflight_max;
+
+    Alias _aliases[TOPIC_ALIASES];
+    uint16_t _alias_max;
+    uint32_t _alias_clock;
+    uint32_t _max_packet_size;
+
+    /* The last acknowledgement, for wait_ack() */
+    uint8_t _ack_type;
+    uint16_t _ack_id;
+    uint8_t _ack_reason;
+
+    unsigned char _sendbuf[MAX_PACKET_SIZE];
+    unsigned char _readbuf[MAX_PACKET_SIZE];
+    size_t _body;                   /**< Offset of the body in _readbuf */
+    size_t _body_len;
+};
+
+#endif /* __MQTT5_CLIENT_H_ */
@@ -0,0 +1,344 @@
+/*
+ *  MQTT-SN gateway for the nodes on the XBee network
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "MqttSnGateway.h"
+
+namespace {
+
+/* A message starting with this has a three byte length field */
+const uint8_t LONG_LENGTH = 0x01;
+
+const uint8_t PROTOCOL_ID = 0x01;
+
+/* Flags */
+const uint8_t FLAG_QOS_MASK = 0x60;
+const uint8_t FLAG_QOS_0 = 0x00;
+const uint8_t FLAG_QOS_1 = 0x20;
+const uint8_t FLAG_QOS_MINUS_1 = 0x60;
+const uint8_t FLAG_WILL = 0x08;
+const uint8_t FLAG_TOPIC_ID_TYPE = 0x03;
+
+uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+uint8_t *put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+    return p + 2;
+}
+
+}
+
+MqttSnGateway::MqttSnGateway(ConnectionManager &mqtt, XBeeRequests &requests,
+                             const char *topic_prefix) :
+        _mqtt(mqtt), _requests(requests), _topic_prefix(topic_prefix),
+        _addr64(0), _addr16(XBeeRequests::UNKNOWN_ADDR16), _sequence(0)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    memset(_clients, 0, sizeof (_clients));
+    load_predefined(MBED_CONF_APP_MQTTSN_PREDEFINED_TOPICS);
+}
+
+bool MqttSnGateway::handle(uint64_t addr64, uint16_t addr16, const uint8_t *msg, uint16_t len)
+{
+    /* The length field must cover the frame exactly, or this is plain data */
+    uint16_t header;
+    if (len >= 4 && msg[0] == LONG_LENGTH) {
+        if (get16(msg + 1) != len) {
+            return false;
+        }
+        header = 3;
+    } else if (len >= 2 && msg[0] == len) {
+        header = 1;
+    } else {
+        return false;
+    }
+
+    uint8_t type = msg[header];
+    switch (type) {
+        case SEARCHGW:
+        case CONNECT:
+        case REGISTER:
+        case PUBLISH:
+        case SUBSCRIBE:
+        case PINGREQ:
+        case DISCONNECT:
+            break;
+        default:
+            /* Not a message a node sends to us, the frame is data */
+            return false;
+    }
+
+    const uint8_t *body = msg + header + 1;
+    uint16_t body_len = len - header - 1;
+
+    _addr64 = addr64;
+    _addr16 = addr16;
+    _sequence++;
+    Client *client = find_client(addr64);
+    if (client != NULL) {
+        client->addr16 = addr16;
+        client->last_seen = _sequence;
+    }
+
+    _mutex.lock();
+    _stats.messages++;
+    _mutex.unlock();
+
+    switch (type) {
+        case SEARCHGW: {
+            uint8_t gwinfo[] = { GWINFO, MBED_CONF_APP_MQTTSN_GATEWAY_ID };
+            reply(gwinfo, sizeof (gwinfo));
+            break;
+        }
+        case CONNECT:
+            on_connect(body, body_len);
+            break;
+        case REGISTER:
+            on_register(client, body, body_len);
+            break;
+        case PUBLISH:
+            on_publish(client, body, body_len);
+            break;
+        case SUBSCRIBE:
+            on_subscribe(body, body_len);
+            break;
+        case PINGREQ: {
+            uint8_t pingresp[] = { PINGRESP };
+            reply(pingresp, sizeof (pingresp));
+            break;
+        }
+        case DISCONNECT: {
+            if (client != NULL) {
+                remove_client(client);
+            }
+            uint8_t disconnect[] = { DISCONNECT };
+            reply(disconnect, sizeof (disconnect));
+            break;
+        }
+    }
+
+    return true;
+}
+
+MqttSnStats MqttSnGateway::stats()
+{
+    _mutex.lock();
+    MqttSnStats stats = _stats;
+    _mutex.unlock();
+
+    stats.clients = 0;
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_CLIENTS; i++) {
+        if (_clients[i].connected) {
+            stats.clients++;
+        }
+    }
+    stats.topics = _topics.count();
+    return stats;
+}
+
+void MqttSnGateway::on_connect(const uint8_t *body, uint16_t len)
+{
+    uint8_t connack[] = { CONNACK, RC_ACCEPTED };
+
+    if (len < 4 || body[1] != PROTOCOL_ID || (body[0] & FLAG_WILL)) {
+        /* Asking for a will would start a dialogue we do not support */
+        connack[1] = RC_NOT_SUPPORTED;
+    } else {
+        /* Sessions are not kept, a new one starts without registrations */
+        Client *client = find_client(_addr64);
+        if (client != NULL) {
+            remove_client(client);
+        }
+        client = add_client();
+        client->connected = true;
+
+        _mutex.lock();
+        _stats.connects++;
+        _mutex.unlock();
+    }
+    reply(connack, sizeof (connack));
+}
+
+void MqttSnGateway::on_register(Client *client, const uint8_t *body, uint16_t len)
+{
+    if (len < 5) {
+        return;
+    }
+
+    uint16_t id = 0;
+    uint8_t rc = RC_ACCEPTED;
+    if (client == NULL) {
+        rc = RC_NOT_SUPPORTED;
+    } else if ((id = _topics.add(client - _clients, (const char *) body + 4, len - 4)) == 0) {
+        rc = RC_CONGESTION;
+    } else {
+        _mutex.lock();
+        _stats.registered++;
+        _mutex.unlock();
+    }
+
+    uint8_t regack[6];
+    regack[0] = REGACK;
+    put16(regack + 1, id);
+    memcpy(regack + 3, body + 2, 2);
+    regack[5] = rc;
+    reply(regack, sizeof (regack));
+}
+
+void MqttSnGateway::on_publish(Client *client, const uint8_t *body, uint16_t len)
+{
+    if (len < 5) {
+        return;
+    }
+
+    uint8_t flags = body[0];
+    uint16_t topic_id = get16(body + 1);
+    uint8_t qos = flags & FLAG_QOS_MASK;
+    uint8_t id_type = flags & FLAG_TOPIC_ID_TYPE;
+
+    /* Name the topic, as <prefix>/<name> */
+    char topic[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+    uint8_t rc = RC_ACCEPTED;
+    if (client == NULL && !(qos == FLAG_QOS_MINUS_1 && id_type != TOPIC_NORMAL)) {
+        rc = RC_NOT_SUPPORTED;
+    } else if (qos != FLAG_QOS_0 && qos != FLAG_QOS_1 && qos != FLAG_QOS_MINUS_1) {
+        rc = RC_NOT_SUPPORTED;
+    } else if (id_type == TOPIC_SHORT) {
+        snprintf(topic, sizeof (topic), "%s/%c%c", _topic_prefix, body[1], body[2]);
+    } else {
+        /* A node only publishes to the IDs it registered itself */
+        uint8_t index = client != NULL ? client - _clients : MBED_CONF_APP_MQTTSN_MAX_CLIENTS;
+        const char *name = _topics.find(index, topic_id, id_type == TOPIC_PREDEFINED);
+        if (name == NULL || (size_t) snprintf(topic, sizeof (topic), "%s/%s", _topic_prefix,
+                                              name) >= sizeof (topic)) {
+            rc = RC_INVALID_TOPIC_ID;
+        }
+    }
+
+    if (rc == RC_ACCEPTED &&
+        _mqtt.publish(topic, body + 5, len - 5, qos == FLAG_QOS_1 ? MQTT::QOS1 : MQTT::QOS0) != 0) {
+        rc = RC_CONGESTION;
+    }
+
+    _mutex.lock();
+    if (rc == RC_ACCEPTED) {
+        _stats.published++;
+    } else {
+        _stats.rejected++;
+    }
+    _mutex.unlock();
+
+    /* QoS 1 is acknowledged, and a refusal is reported whatever the QoS */
+    if (qos == FLAG_QOS_1 || (rc != RC_ACCEPTED && qos != FLAG_QOS_MINUS_1)) {
+        uint8_t puback[6];
+        puback[0] = PUBACK;
+        memcpy(puback + 1, body + 1, 4);
+        puback[5] = rc;
+        reply(puback, sizeof (puback));
+    }
+}
+
+void MqttSnGateway::on_subscribe(const uint8_t *body, uint16_t len)
+{
+    if (len < 3) {
+        return;
+    }
+
+    /* The uplink's messages are not routed to the nodes */
+    uint8_t suback[7];
+    suback[0] = SUBACK;
+    suback[1] = body[0] & FLAG_QOS_MASK;
+    put16(suback + 2, 0);
+    memcpy(suback + 4, body + 1, 2);
+    suback[6] = RC_NOT_SUPPORTED;
+    reply(suback, sizeof (suback));
+
+    _mutex.lock();
+    _stats.unsupported++;
+    _mutex.unlock();
+}
+
+MqttSnGateway::Client *MqttSnGateway::find_client(uint64_t addr64)
+{
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_CLIENTS; i++) {
+        if (_clients[i].connected && _clients[i].addr64 == addr64) {
+            return &_clients[i];
+        }
+    }
+    return NULL;
+}
+
+MqttSnGateway::Client *MqttSnGateway::add_client()
+{
+    Client *client = &_clients[0];
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_CLIENTS; i++) {
+        if (!_clients[i].connected) {
+            client = &_clients[i];
+            break;
+        }
+        if ((int32_t) (_clients[i].last_seen - client->last_seen) < 0) {
+            client = &_clients[i];
+        }
+    }
+
+    if (client->connected) {
+        remove_client(client);
+    }
+    client->addr64 = _addr64;
+    client->addr16 = _addr16;
+    client->last_seen = _sequence;
+    return client;
+}
+
+void MqttSnGateway::remove_client(Client *client)
+{
+    _topics.release(client - _clients);
+    client->connected = false;
+}
+
+void MqttSnGateway::load_predefined(const char *config)
+{
+    while (*config != '\0') {
+        const char *end = strchr(config, ';');
+        if (end == NULL) {
+            end = config + strlen(config);
+        }
+
+        const char *eq = (const char *) memchr(config, '=', end - config);
+        unsigned long id = strtoul(config, NULL, 10);
+        if (eq == NULL || id == 0 || id > 0xFFFF ||
+            !_topics.add_predefined(id, eq + 1, end - eq - 1)) {
+            printf("MQTT-SN: bad predefined topic \"%.*s\"\n", (int) (end - config), config);
+        }
+
+        config = *end == ';' ? end + 1 : end;
+    }
+}
+
+void MqttSnGateway::reply(const uint8_t *msg, uint8_t len)
+{
+    uint8_t out[16];
+
+    out[0] = len + 1;
+    memcpy(out + 1, msg, len);
+    _requests.send_data(_addr64, _addr16, out, len + 1, XBeeRequests::response_cb_t());
+}
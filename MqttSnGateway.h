@@ -0,0 +1,206 @@
+/*
+ *  MQTT-SN gateway for the nodes on the XBee network
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file MqttSnGateway.h
+ *  \brief Translates MQTT-SN from the radio to MQTT on the uplink
+ *  A node publishing full MQTT sends its topic name in every frame. With
+ *  MQTT-SN (v1.2) it names a topic by a two byte ID instead: one it
+ *  registered once, one predefined in the gateway's configuration, or a
+ *  two letter short name. The gateway keeps each node's registrations,
+ *  in MqttSnTopics, until the node disconnects or is evicted, and
+ *  publishes what the nodes send under <prefix>/<topic name>, through the
+ *  ConnectionManager.
+ *
+ *  Supported are SEARCHGW, CONNECT, REGISTER, PUBLISH at QoS -1, 0 and 1,
+ *  PINGREQ and DISCONNECT. Subscriptions, wills and sleeping clients are
+ *  not; a node asking for them gets a "not supported" return code. QoS -1
+ *  publishes, to predefined or short topics, are accepted from nodes that
+ *  never connected.
+ *
+ *  A frame is taken for MQTT-SN when its length field matches and it has
+ *  one of these types, which sensor data can happen to look like. So the
+ *  gateway is off unless mqttsn-enabled is set, for networks where every
+ *  node speaks MQTT-SN, and frames of any other type are forwarded as data.
+ */
+
+#ifndef __MQTTSN_GATEWAY_H_
+#define __MQTTSN_GATEWAY_H_
+
+#include "mbed.h"
+
+#include "ConnectionManager.h"
+#include "MqttSnTopics.h"
+#include "XBeeRequests.h"
+
+/** Look for MQTT-SN messages in the frames of the nodes */
+#ifndef MBED_CONF_APP_MQTTSN_ENABLED
+#define MBED_CONF_APP_MQTTSN_ENABLED 0
+#endif
+
+/** Gateway ID announced in GWINFO */
+#ifndef MBED_CONF_APP_MQTTSN_GATEWAY_ID
+#define MBED_CONF_APP_MQTTSN_GATEWAY_ID 1
+#endif
+
+/** Predefined topics, as "<id>=<name>;<id>=<name>" */
+#ifndef MBED_CONF_APP_MQTTSN_PREDEFINED_TOPICS
+#define MBED_CONF_APP_MQTTSN_PREDEFINED_TOPICS ""
+#endif
+
+/**
+ * MQTT-SN statistics
+ */
+struct MqttSnStats {
+    uint32_t messages;      /**< MQTT-SN messages received */
+    uint32_t published;     /**< PUBLISH messages handed to the uplink */
+    uint32_t rejected;      /**< PUBLISH messages refused, by us or by the uplink */
+    uint32_t registered;    /**< Topics registered */
+    uint32_t connects;
+    uint32_t unsupported;   /**< Requests for features not supported */
+    uint32_t clients;       /**< Nodes connected now */
+    uint32_t topics;        /**< Topics known now */
+};
+
+/**
+ * \brief MqttSnGateway serves the MQTT-SN nodes.
+ *
+ * handle() is called on a single thread, the replies are sent through
+ * XBeeRequests without waiting for their transmit status.
+ */
+class MqttSnGateway {
+public:
+    /**
+     * MqttSnGateway Constructor
+     *
+     * @param[in] mqtt The uplink to publish to
+     * @param[in] requests Sends the replies to the nodes
+     * @param[in] topic_prefix Prefix of the topics, kept by reference
+     */
+    MqttSnGateway(ConnectionManager &mqtt, XBeeRequests &requests, const char *topic_prefix);
+
+    /**
+     * Handle a frame if it is an MQTT-SN message
+     *
+     * @param[in] addr64 The node's 64 bit address
+     * @param[in] addr16 The node's network address
+     * @param[in] msg The frame data
+     * @param[in] len The frame data length
+     * @return true if the frame was an MQTT-SN message, false to treat it as data
+     */
+    bool handle(uint64_t addr64, uint16_t addr16, const uint8_t *msg, uint16_t len);
+
+    /**
+     * A snapshot of the statistics
+     */
+    MqttSnStats stats();
+
+protected:
+    /** Message types */
+    enum MsgType {
+        SEARCHGW = 0x01,
+        GWINFO = 0x02,
+        CONNECT = 0x04,
+        CONNACK = 0x05,
+        REGISTER = 0x0A,
+        REGACK = 0x0B,
+        PUBLISH = 0x0C,
+        PUBACK = 0x0D,
+        SUBSCRIBE = 0x12,
+        SUBACK = 0x13,
+        PINGREQ = 0x16,
+        PINGRESP = 0x17,
+        DISCONNECT = 0x18
+    };
+
+    /** Return codes */
+    enum ReturnCode {
+        RC_ACCEPTED = 0x00,
+        RC_CONGESTION = 0x01,
+        RC_INVALID_TOPIC_ID = 0x02,
+        RC_NOT_SUPPORTED = 0x03
+    };
+
+    /** Topic ID types, in the low bits of the flags */
+    enum TopicIdType {
+        TOPIC_NORMAL = 0x00,
+        TOPIC_PREDEFINED = 0x01,
+        TOPIC_SHORT = 0x02
+    };
+
+    struct Client {
+        uint64_t addr64;
+        uint16_t addr16;
+        bool connected;
+        uint32_t last_seen;     /**< Sequence of the last message, for eviction */
+    };
+
+    /**
+     * Message handlers, client is NULL when the node is not connected
+     */
+    void on_connect(const uint8_t *body, uint16_t len);
+    void on_register(Client *client, const uint8_t *body, uint16_t len);
+    void on_publish(Client *client, const uint8_t *body, uint16_t len);
+    void on_subscribe(const uint8_t *body, uint16_t len);
+
+    /**
+     * The node's client entry, or NULL if it is not connected
+     */
+    Client *find_client(uint64_t addr64);
+
+    /**
+     * A client entry for the current node, evicting the least recently
+     * heard node if needed
+     */
+    Client *add_client();
+
+    /**
+     * End a client's session, releasing its registrations
+     */
+    void remove_client(Client *client);
+
+    /**
+     * Parse MBED_CONF_APP_MQTTSN_PREDEFINED_TOPICS
+     */
+    void load_predefined(const char *config);
+
+    /**
+     * Send a message to the current node
+     *
+     * @param[in] msg The message from its type on, the length is prepended
+     * @param[in] len The message length, at most 15
+     */
+    void reply(const uint8_t *msg, uint8_t len);
+
+protected:
+    ConnectionManager &_mqtt;
+    XBeeRequests &_requests;
+    const char *_topic_prefix;
+
+    /** Node the message being handled came from */
+    uint64_t _addr64;
+    uint16_t _addr16;
+
+    Client _clients[MBED_CONF_APP_MQTTSN_MAX_CLIENTS];
+    MqttSnTopics _topics;
+    uint32_t _sequence;
+
+    Mutex _mutex;                   /**< Guards the statistics */
+    MqttSnStats _stats;
+};
+
+#endif /* __MQTTSN_GATEWAY_H_ */
@@ -0,0 +1,160 @@
+/*
+ *  The MQTT-SN gateway's table of topic IDs
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "MqttSnTopics.h"
+
+#include <string.h>
+
+MqttSnTopics::MqttSnTopics() :
+        _next_id(1)
+{
+    memset(_topics, 0, sizeof (_topics));
+    memset(_registered, 0, sizeof (_registered));
+}
+
+bool MqttSnTopics::add_predefined(uint16_t id, const char *name, size_t len)
+{
+    if (id == 0 || len == 0 || len >= sizeof (_topics[0].name)) {
+        return false;
+    }
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_TOPICS; i++) {
+        if (_topics[i].id == id && _topics[i].predefined) {
+            return false;
+        }
+    }
+
+    int i = lookup(name, len, true);
+    if (i < 0 || _topics[i].id != 0) {
+        return false;
+    }
+    _topics[i].id = id;
+    _topics[i].predefined = true;
+    memcpy(_topics[i].name, name, len);
+    _topics[i].name[len] = '\0';
+    return true;
+}
+
+uint16_t MqttSnTopics::add(uint8_t client, const char *name, size_t len)
+{
+    if (client >= MBED_CONF_APP_MQTTSN_MAX_CLIENTS || len == 0 ||
+        len >= sizeof (_topics[0].name)) {
+        return 0;
+    }
+
+    int i = lookup(name, len, false);
+    if (i < 0) {
+        return 0;
+    }
+
+    Topic *t = &_topics[i];
+    if (t->id == 0) {
+        /* IDs are given out in order, skipping those still held after a wrap */
+        uint16_t id;
+        do {
+            id = _next_id++;
+            if (_next_id == 0) {
+                _next_id = 1;
+            }
+        } while (in_use(id));
+        t->id = id;
+        t->predefined = false;
+        t->refs = 0;
+        memcpy(t->name, name, len);
+        t->name[len] = '\0';
+    }
+
+    uint32_t bit = 1UL << i;
+    if (!(_registered[client] & bit)) {
+        _registered[client] |= bit;
+        t->refs++;
+    }
+    return t->id;
+}
+
+const char *MqttSnTopics::find(uint8_t client, uint16_t id, bool predefined) const
+{
+    if (id == 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_TOPICS; i++) {
+        const Topic *t = &_topics[i];
+        if (t->id != id || t->predefined != predefined) {
+            continue;
+        }
+        if (!predefined && (client >= MBED_CONF_APP_MQTTSN_MAX_CLIENTS ||
+                            !(_registered[client] & (1UL << i)))) {
+            return NULL;
+        }
+        return t->name;
+    }
+    return NULL;
+}
+
+void MqttSnTopics::release(uint8_t client)
+{
+    if (client >= MBED_CONF_APP_MQTTSN_MAX_CLIENTS) {
+        return;
+    }
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_TOPICS; i++) {
+        if (!(_registered[client] & (1UL << i))) {
+            continue;
+        }
+        if (--_topics[i].refs == 0) {
+            _topics[i].id = 0;
+        }
+    }
+    _registered[client] = 0;
+}
+
+size_t MqttSnTopics::count() const
+{
+    size_t n = 0;
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_TOPICS; i++) {
+        if (_topics[i].id != 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+int MqttSnTopics::lookup(const char *name, size_t len, bool predefined) const
+{
+    int free_entry = -1;
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_TOPICS; i++) {
+        const Topic *t = &_topics[i];
+        if (t->id == 0) {
+            if (free_entry < 0) {
+                free_entry = i;
+            }
+        } else if (t->predefined == predefined && strlen(t->name) == len &&
+                   memcmp(t->name, name, len) == 0) {
+            return i;
+        }
+    }
+    return free_entry;
+}
+
+bool MqttSnTopics::in_use(uint16_t id) const
+{
+    for (size_t i = 0; i < MBED_CONF_APP_MQTTSN_MAX_TOPICS; i++) {
+        if (_topics[i].id == id && !_topics[i].predefined) {
+            return true;
+        }
+    }
+    return false;
+}
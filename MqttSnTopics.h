@@ -0,0 +1,121 @@
+/*
+ *  The MQTT-SN gateway's table of topic IDs
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file MqttSnTopics.h
+ *  \brief Topic IDs, predefined or registered by the clients
+ *  In MQTT-SN a registration belongs to the client that made it, and ends
+ *  with its session. The table holds each name once, with the clients that
+ *  registered it: a client only publishes to the IDs it registered, and an
+ *  entry is freed once the last of them disconnected or was evicted.
+ *  Predefined topics are for every client and stay.
+ *
+ *  Only the C library is used, so the table builds on a host as well.
+ */
+
+#ifndef __MQTTSN_TOPICS_H_
+#define __MQTTSN_TOPICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Number of nodes connected at the same time */
+#ifndef MBED_CONF_APP_MQTTSN_MAX_CLIENTS
+#define MBED_CONF_APP_MQTTSN_MAX_CLIENTS 8
+#endif
+
+/** Number of topics, registered and predefined, at most 32 */
+#ifndef MBED_CONF_APP_MQTTSN_MAX_TOPICS
+#define MBED_CONF_APP_MQTTSN_MAX_TOPICS 16
+#endif
+
+/** Longest topic name */
+#ifndef MBED_CONF_APP_MQTT_MAX_TOPIC_LEN
+#define MBED_CONF_APP_MQTT_MAX_TOPIC_LEN 63
+#endif
+
+#if MBED_CONF_APP_MQTTSN_MAX_TOPICS > 32
+#error "mqttsn-max-topics must be at most 32, a client's topics are a 32 bit mask"
+#endif
+
+/**
+ * \brief MqttSnTopics maps topic IDs to names, per client.
+ *
+ * Clients are numbered from 0 to MBED_CONF_APP_MQTTSN_MAX_CLIENTS - 1.
+ * Not thread safe, the gateway uses it from one thread.
+ */
+class MqttSnTopics {
+public:
+    MqttSnTopics();
+
+    /**
+     * Add a topic every client may publish to
+     *
+     * @return false if the name is empty or too long, the ID taken, or the table full
+     */
+    bool add_predefined(uint16_t id, const char *name, size_t len);
+
+    /**
+     * Register a name for a client, under the ID it already has if another
+     * client registered it
+     *
+     * @return The topic ID, or 0 if the name is empty or too long or the table full
+     */
+    uint16_t add(uint8_t client, const char *name, size_t len);
+
+    /**
+     * The name of a topic the client may publish to
+     *
+     * @return The name, or NULL if the ID is unknown, or not registered by the client
+     */
+    const char *find(uint8_t client, uint16_t id, bool predefined) const;
+
+    /**
+     * End a client's registrations, when its session ends
+     */
+    void release(uint8_t client);
+
+    /**
+     * Number of topics held, predefined ones included
+     */
+    size_t count() const;
+
+protected:
+    struct Topic {
+        uint16_t id;            /**< 0 when the entry is free */
+        bool predefined;
+        uint8_t refs;           /**< Clients that registered it */
+        char name[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+    };
+
+    /**
+     * The entry of a name, or a free one for it, or -1 if the table is full
+     */
+    int lookup(const char *name, size_t len, bool predefined) const;
+
+    /**
+     * Whether a registered topic ID is held by an entry
+     */
+    bool in_use(uint16_t id) const;
+
+protected:
+    Topic _topics[MBED_CONF_APP_MQTTSN_MAX_TOPICS];
+    uint32_t _registered[MBED_CONF_APP_MQTTSN_MAX_CLIENTS];    /**< A bit per entry, per client */
+    uint16_t _next_id;
+};
+
+#endif /* __MQTTSN_TOPICS_H_ */
@@ -0,0 +1,443 @@
+/*
+ *  Store and forward queue of MQTT messages in flash
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "OfflineQueue.h"
+
+namespace {
+
+const uint32_t UNIT_MAGIC = 0x4f515532;     /* "OQU2" */
+const uint32_t DRAINED_MAGIC = 0x4f514452;  /* "OQDR" */
+const uint16_t RECORD_MAGIC = 0x5152;       /* "QR" */
+
+/* Errors besides the block device ones */
+const int OFFLINE_QUEUE_ERROR_PARAMETER = -4001;
+const int OFFLINE_QUEUE_ERROR_NO_MEMORY = -4002;
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+}
+
+OfflineQueue::OfflineQueue(BlockDevice *bd) :
+        _bd(bd), _erase_size(0), _unit_count(0), _prog_size(1),
+        _head_seq(0), _tail_seq(0), _count(0), _peeked(0), _last_peeked(0),
+        _dropped(0), _empty_log(true), _scratch(NULL)
+{
+    _head.unit = _head.offset = 0;
+    _read = _last = _tail = _head;
+}
+
+OfflineQueue::~OfflineQueue()
+{
+    delete[] _scratch;
+}
+
+uint32_t OfflineQueue::align(uint32_t len) const
+{
+    return ((len + _prog_size - 1) / _prog_size) * _prog_size;
+}
+
+uint32_t OfflineQueue::first_offset() const
+{
+    return align(sizeof (UnitHeader)) + align(sizeof (uint32_t));
+}
+
+int OfflineQueue::mount()
+{
+    _mutex.lock();
+
+    _erase_size = _bd->get_erase_size();
+    _unit_count = _bd->size() / _erase_size;
+    _prog_size = _bd->get_program_size();
+    if (_unit_count < 2) {
+        _mutex.unlock();
+        return OFFLINE_QUEUE_ERROR_PARAMETER;
+    }
+    delete[] _scratch;
+    _scratch = new uint8_t[align(sizeof (RecordHeader))];
+
+    /*
+     * The units in use are contiguous, from the lowest to the highest seq.
+     * Writing goes on after the highest seq, drained or not.
+     */
+    bool found = false;
+    _empty_log = true;
+    _tail.unit = _unit_count - 1;
+    for (uint32_t unit = 0; unit < _unit_count; unit++) {
+        UnitHeader header;
+        bool drained;
+        if (!read_unit_header(unit, &header, &drained)) {
+            continue;
+        }
+        if (!found || (int32_t) (header.seq - _tail_seq) > 0) {
+            _tail.unit = unit;
+            _tail_seq = header.seq;
+        }
+        found = true;
+        if (drained) {
+            continue;
+        }
+        if (_empty_log || (int32_t) (header.seq - _head_seq) < 0) {
+            _head.unit = unit;
+            _head_seq = header.seq;
+        }
+        _empty_log = false;
+    }
+
+    _count = 0;
+    _peeked = _last_peeked = 0;
+    if (_empty_log) {
+        _tail.offset = _erase_size;
+        _head = _read = _last = _tail;
+        _mutex.unlock();
+        return 0;
+    }
+
+    /* Count the records and find the end of the log */
+    Position pos = { _head.unit, first_offset() };
+    _head = pos;
+    while (true) {
+        int ret = read_record(pos, NULL, 0, NULL, NULL);
+        if (ret > 0 || ret == -1) {
+            _count++;
+        } else if (ret == 0 && pos.unit != _tail.unit) {
+            pos.unit = (pos.unit + 1) % _unit_count;
+            pos.offset = first_offset();
+        } else {
+            break;
+        }
+    }
+    _tail = pos;
+    _read = _last = _head;
+
+    /* A torn write leaves the end unerased, continue in a fresh unit */
+    if (_tail.offset + sizeof (RecordHeader) <= _erase_size &&
+        _bd->read(_scratch, _tail.unit * _erase_size + _tail.offset, sizeof (RecordHeader)) == 0) {
+        for (size_t i = 0; i < sizeof (RecordHeader); i++) {
+            if (_scratch[i] != 0xFF) {
+                _tail.offset = _erase_size;
+                break;
+            }
+        }
+    }
+
+    printf("Offline queue: %lu records in %lu units\n", (unsigned long) _count,
+           (unsigned long) ((_tail.unit + _unit_count - _head.unit) % _unit_count + 1));
+    _mutex.unlock();
+    return 0;
+}
+
+int OfflineQueue::push(const char *topic, const void *payload, size_t len)
+{
+    size_t topic_len = strlen(topic);
+    uint32_t data_len = 1 + topic_len + len;
+    uint32_t total = align(sizeof (RecordHeader) + data_len);
+
+    if (topic_len > MAX_TOPIC_LEN || total > _erase_size - first_offset()) {
+        return OFFLINE_QUEUE_ERROR_PARAMETER;
+    }
+
+    uint8_t *buf = new uint8_t[total];
+    if (buf == NULL) {
+        return OFFLINE_QUEUE_ERROR_NO_MEMORY;
+    }
+    memset(buf, 0xFF, total);
+
+    uint8_t *data = buf + sizeof (RecordHeader);
+    data[0] = (uint8_t) topic_len;
+    memcpy(data + 1, topic, topic_len);
+    memcpy(data + 1 + topic_len, payload, len);
+
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.len = data_len;
+    header.crc = crc32_update(0, data, data_len);
+    memcpy(buf, &header, sizeof (header));
+
+    _write_mutex.lock();
+    _mutex.lock();
+    int ret = 0;
+    if (_empty_log || _tail.offset + total > _erase_size) {
+        ret = open_unit();
+    }
+    if (ret == 0) {
+        ret = _bd->program(buf, _tail.unit * _erase_size + _tail.offset, total);
+    }
+    if (ret == 0) {
+        _tail.offset += total;
+        _count++;
+    }
+    _mutex.unlock();
+    _write_mutex.unlock();
+
+    delete[] buf;
+    return ret;
+}
+
+int OfflineQueue::peek(char *topic, size_t topic_size, void *payload, size_t *len)
+{
+    _mutex.lock();
+    _last = _read;
+    _last_peeked = _peeked;
+    while (!_empty_log && (_read.unit != _tail.unit || _read.offset != _tail.offset)) {
+        int ret = read_record(_read, topic, topic_size, static_cast<uint8_t *>(payload), len);
+        if (ret > 0) {
+            _peeked++;
+            _mutex.unlock();
+            return 1;
+        } else if (ret == -1) {
+            /* Corrupt record, skipped but removed by the next pop() */
+            _peeked++;
+        } else if (ret == 0 && _read.unit != _tail.unit) {
+            _read.unit = (_read.unit + 1) % _unit_count;
+            _read.offset = first_offset();
+        } else {
+            _mutex.unlock();
+            return ret;
+        }
+    }
+    _mutex.unlock();
+    return 0;
+}
+
+int OfflineQueue::pop()
+{
+    int ret = 0;
+
+    _mutex.lock();
+    _count -= _peeked;
+    _peeked = 0;
+
+    /* Mark the units the read position moved past, they are erased when reused */
+    while (ret == 0 && _head.unit != _read.unit) {
+        ret = mark_drained(_head.unit);
+        _head.unit = (_head.unit + 1) % _unit_count;
+        _head_seq++;
+    }
+    _head = _last = _read;
+    _last_peeked = 0;
+
+    if (ret == 0 && !_empty_log && _count == 0) {
+        /*
+         * Fully drained, so nothing is sent twice after a reboot. The next
+         * push() goes on in the next unit rather than erasing this one.
+         */
+        ret = mark_drained(_tail.unit);
+        _empty_log = true;
+        _tail.offset = _erase_size;
+        _head = _read = _last = _tail;
+    }
+    _mutex.unlock();
+
+    return ret;
+}
+
+void OfflineQueue::unpeek()
+{
+    _mutex.lock();
+    _read = _last;
+    _peeked = _last_peeked;
+    _mutex.unlock();
+}
+
+void OfflineQueue::rewind()
+{
+    _mutex.lock();
+    _read = _last = _head;
+    _peeked = _last_peeked = 0;
+    _mutex.unlock();
+}
+
+bool OfflineQueue::empty()
+{
+    return count() == 0;
+}
+
+uint32_t OfflineQueue::count()
+{
+    _mutex.lock();
+    uint32_t count = _count;
+    _mutex.unlock();
+    return count;
+}
+
+bool OfflineQueue::read_unit_header(uint32_t unit, UnitHeader *header, bool *drained)
+{
+    uint32_t marker;
+    if (_bd->read(header, unit * _erase_size, sizeof (*header)) != 0 ||
+        header->magic != UNIT_MAGIC ||
+        _bd->read(&marker, unit * _erase_size + align(sizeof (UnitHeader)), sizeof (marker)) != 0) {
+        return false;
+    }
+    *drained = marker == DRAINED_MAGIC;
+    return true;
+}
+
+int OfflineQueue::mark_drained(uint32_t unit)
+{
+    /* Programmed once per erase, the word is left erased by open_unit() */
+    uint32_t size = align(sizeof (uint32_t));
+    uint8_t *buf = new uint8_t[size];
+    if (buf == NULL) {
+        return OFFLINE_QUEUE_ERROR_NO_MEMORY;
+    }
+    memset(buf, 0xFF, size);
+    memcpy(buf, &DRAINED_MAGIC, sizeof (DRAINED_MAGIC));
+    int ret = _bd->program(buf, unit * _erase_size + align(sizeof (UnitHeader)), size);
+    delete[] buf;
+    return ret;
+}
+
+int OfflineQueue::read_record(Position &pos, char *topic, size_t topic_size,
+                              uint8_t *payload, size_t *len)
+{
+    RecordHeader header;
+    bd_addr_t addr = pos.unit * _erase_size + pos.offset;
+
+    if (pos.offset + sizeof (header) > _erase_size) {
+        return 0;
+    }
+    int ret = _bd->read(&header, addr, sizeof (header));
+    if (ret != 0) {
+        return ret;
+    }
+    if (header.magic != RECORD_MAGIC || header.len == 0 ||
+        pos.offset + align(sizeof (header) + header.len) > _erase_size) {
+        return 0;
+    }
+    pos.offset += align(sizeof (header) + header.len);
+
+    if (topic == NULL) {
+        return header.len;
+    }
+
+    /* Read the topic length, the topic and the payload, checking the CRC */
+    uint8_t topic_len;
+    addr += sizeof (header);
+    if ((ret = _bd->read(&topic_len, addr, 1)) != 0) {
+        return ret;
+    }
+    size_t payload_len = header.len - 1 - topic_len;
+    if (1u + topic_len > header.len || topic_len >= topic_size || payload_len > *len) {
+        return -1;
+    }
+    if ((ret = _bd->read(topic, addr + 1, topic_len)) != 0 ||
+        (ret = _bd->read(payload, addr + 1 + topic_len, payload_len)) != 0) {
+        return ret;
+    }
+
+    uint32_t crc = crc32_update(0, &topic_len, 1);
+    crc = crc32_update(crc, reinterpret_cast<uint8_t *>(topic), topic_len);
+    crc = crc32_update(crc, payload, payload_len);
+    if (crc != header.crc) {
+        return -1;
+    }
+
+    topic[topic_len] = '\0';
+    *len = payload_len;
+    return header.len;
+}
+
+int OfflineQueue::open_unit()
+{
+    uint32_t unit = (_tail.unit + 1) % _unit_count;
+
+    if (!_empty_log && unit == _head.unit) {
+        /* The log is full, the oldest readings make room */
+        drop_head();
+    }
+
+    uint32_t header_size = align(sizeof (UnitHeader));
+    uint8_t *buf = new uint8_t[header_size];
+    if (buf == NULL) {
+        return OFFLINE_QUEUE_ERROR_NO_MEMORY;
+    }
+    memset(buf, 0xFF, header_size);
+    UnitHeader header;
+    header.magic = UNIT_MAGIC;
+    header.seq = _tail_seq + 1;
+    memcpy(buf, &header, sizeof (header));
+
+    /*
+     * The unit is outside the log, readers do not touch it. Only push()
+     * changes the tail, and _write_mutex keeps other pushes out.
+     */
+    _mutex.unlock();
+    int ret = _bd->erase(unit * _erase_size, _erase_size);
+    if (ret == 0) {
+        ret = _bd->program(buf, unit * _erase_size, header_size);
+    }
+    _mutex.lock();
+    delete[] buf;
+    if (ret != 0) {
+        return ret;
+    }
+
+    _tail.unit = unit;
+    _tail.offset = first_offset();
+    _tail_seq = header.seq;
+    if (_empty_log) {
+        _head = _read = _last = _tail;
+        _head_seq = _tail_seq;
+        _peeked = _last_peeked = 0;
+        _empty_log = false;
+    }
+    return 0;
+}
+
+void OfflineQueue::drop_head()
+{
+    /* Records of the unit still queued are lost */
+    Position pos = _head;
+    uint32_t lost = 0;
+    while (true) {
+        int ret = read_record(pos, NULL, 0, NULL, NULL);
+        if (ret > 0 || ret == -1) {
+            lost++;
+        } else {
+            break;
+        }
+    }
+
+    _dropped += lost;
+    _count -= lost < _count ? lost : _count;
+
+    if (_head.unit == _tail.unit) {
+        _empty_log = true;
+        _count = 0;
+        _head.offset = 0;
+        _tail = _head;
+    } else {
+        _head.unit = (_head.unit + 1) % _unit_count;
+        _head.offset = first_offset();
+        _head_seq++;
+    }
+
+    /* A drain in progress must not pop records it did not read */
+    _read = _last = _head;
+    _peeked = _last_peeked = 0;
+}
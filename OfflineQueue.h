@@ -0,0 +1,225 @@
+/*
+ *  Store and forward queue of MQTT messages in flash
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file OfflineQueue.h
+ *  \brief Log structured message queue on a block device
+ *  Messages published while the uplink is down are appended to a circular
+ *  log of erase units. Writing always moves forward through the device,
+ *  also after the log was drained, and a unit is only erased right before
+ *  it is written again, so every unit is erased once per pass over the
+ *  device and wear is spread evenly.
+ *
+ *  Every erase unit starts with a header carrying a sequence number, which
+ *  orders the units when the log is mounted again after a reboot, and a
+ *  drained word, programmed once all of the unit's records were sent.
+ *  Every record carries a CRC32, records torn by a power loss are skipped.
+ *  Delivery is at least once: records of a partly drained unit are sent
+ *  again after a reboot.
+ *
+ *  Erasing takes up to seconds, it is done without holding the lock the
+ *  readers take, so count() and peek() do not wait for it.
+ */
+
+#ifndef __OFFLINE_QUEUE_H_
+#define __OFFLINE_QUEUE_H_
+
+#include "mbed.h"
+
+/**
+ * \brief OfflineQueue keeps topic/payload records in a circular log.
+ *
+ * All methods are thread safe.
+ */
+class OfflineQueue {
+public:
+    /** Longest topic a record can hold */
+    static const size_t MAX_TOPIC_LEN = 255;
+
+    /**
+     * OfflineQueue Constructor
+     *
+     * @param[in] bd The initialized block device, at least two erase units
+     */
+    OfflineQueue(BlockDevice *bd);
+    /**
+     * OfflineQueue Destructor
+     */
+    ~OfflineQueue();
+
+    /**
+     * Scan the device and recover the queue left by the previous boot.
+     *
+     * @return 0 on success, or a block device error code on failure
+     */
+    int mount();
+
+    /**
+     * Append a message. When the log is full the oldest erase unit is
+     * dropped to make room.
+     *
+     * @param[in] topic The topic name
+     * @param[in] payload The payload
+     * @param[in] len The payload length
+     * @return 0 on success, or a negative error code on failure
+     */
+    int push(const char *topic, const void *payload, size_t len);
+
+    /**
+     * Read the next record without removing it. Successive calls return
+     * the following records, until rewind() or pop().
+     *
+     * @param[out] topic Receives the NUL terminated topic
+     * @param[in] topic_size Size of the topic buffer
+     * @param[out] payload Receives the payload
+     * @param[in,out] len The payload buffer size in, the payload length out
+     * @return 1 if a record was read, 0 if there are no more, or a negative
+     *         error code on failure
+     */
+    int peek(char *topic, size_t topic_size, void *payload, size_t *len);
+
+    /**
+     * Forget the records read by peek() since the last pop() or rewind().
+     * Erase units that became empty are marked drained.
+     */
+    int pop();
+
+    /**
+     * Put back the record returned by the last peek(), the next peek()
+     * returns it again.
+     */
+    void unpeek();
+
+    /**
+     * Make the next peek() start at the oldest record again
+     */
+    void rewind();
+
+    /**
+     * Whether any record is queued
+     */
+    bool empty();
+
+    /**
+     * Number of records queued
+     */
+    uint32_t count();
+
+    /**
+     * Number of records lost because the log was full
+     */
+    uint32_t dropped() const {
+        return _dropped;
+    }
+
+protected:
+    /** A position in the log */
+    struct Position {
+        uint32_t unit;          /**< Erase unit index */
+        uint32_t offset;        /**< Byte offset within the unit */
+    };
+
+    /**
+     * Record header, the data follows padded to the program size
+     */
+    struct RecordHeader {
+        uint16_t magic;
+        uint16_t len;           /**< Length of the data */
+        uint32_t crc;           /**< CRC32 of the data */
+    };
+
+    /**
+     * Erase unit header
+     */
+    struct UnitHeader {
+        uint32_t magic;
+        uint32_t seq;           /**< Increments with every unit written */
+    };
+
+    /**
+     * Read a unit header, with _mutex held
+     *
+     * @param[out] drained Set if all of the unit's records were sent
+     * @return true if the unit holds a header
+     */
+    bool read_unit_header(uint32_t unit, UnitHeader *header, bool *drained);
+
+    /**
+     * Program the drained word of a unit, with _mutex held
+     */
+    int mark_drained(uint32_t unit);
+
+    /**
+     * Read the record at a position, with _mutex held
+     *
+     * @param[in,out] pos Advanced past the record, unchanged at the end
+     * @param[out] topic Receives the topic, NULL to only skip the record
+     * @param[in] topic_size The size of topic
+     * @param[out] payload Receives the payload
+     * @param[in,out] len The payload buffer size in, the payload length out
+     * @return The record length, 0 at the end of the unit, -1 for a corrupt
+     *         record, or a block device error code
+     */
+    int read_record(Position &pos, char *topic, size_t topic_size,
+                    uint8_t *payload, size_t *len);
+
+    /**
+     * Start writing the next erase unit, dropping the oldest if needed.
+     * Called with _mutex held, which is released while erasing.
+     */
+    int open_unit();
+
+    /**
+     * Forget the oldest unit when the log is full, losing its records.
+     * open_unit() erases it next.
+     */
+    void drop_head();
+
+    /**
+     * Round a length up to the program size
+     */
+    uint32_t align(uint32_t len) const;
+
+    /**
+     * Offset of the first record in a unit, past the header and the drained word
+     */
+    uint32_t first_offset() const;
+
+protected:
+    BlockDevice *_bd;
+    Mutex _mutex;                   /**< Guards the positions and counts */
+    Mutex _write_mutex;             /**< Serializes push(), held while erasing */
+    uint32_t _erase_size;
+    uint32_t _unit_count;
+    uint32_t _prog_size;
+
+    Position _head;                 /**< The oldest queued record */
+    Position _read;                 /**< Where the next peek() reads */
+    Position _tail;                 /**< Where the next push() writes */
+    uint32_t _head_seq;             /**< Sequence number of the head unit */
+    uint32_t _tail_seq;             /**< Sequence number of the tail unit */
+    uint32_t _count;                /**< Records between _head and _tail */
+    uint32_t _peeked;               /**< Records between _head and _read */
+    Position _last;                 /**< _read before the last peek() */
+    uint32_t _last_peeked;          /**< _peeked before the last peek() */
+    uint32_t _dropped;
+    bool _empty_log;                /**< No record is queued, the next push() opens a unit */
+
+    uint8_t *_scratch;              /**< Checks the end of the log is erased */
+};
+
+#endif /* __OFFLINE_QUEUE_H_ */
@@ -0,0 +1,363 @@
+/*
+ *  LZSS compression of the payloads published to the broker
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "PayloadCompressor.h"
+
+/* No NUL, it is not part of the window */
+static const char DICTIONARY[] = MBED_CONF_APP_COMPRESS_DICTIONARY;
+static const size_t DICTIONARY_LEN = sizeof (DICTIONARY) - 1;
+
+/* A copy costs 1 + WINDOW_BITS + LOOKAHEAD_BITS bits, two literals 18 */
+static const uint16_t MIN_MATCH = 2;
+
+void LzEncoder::begin(uint8_t *out, size_t size)
+{
+    /* The dictionary ends right before the first byte */
+    for (size_t back = 1; back <= WINDOW; back++) {
+        _window[WINDOW - back] = back <= DICTIONARY_LEN ? DICTIONARY[DICTIONARY_LEN - back] : 0;
+    }
+    _head = 0;
+    _ahead_len = 0;
+
+    _out = out;
+    _size = size;
+    _pos = 0;
+    _bits = 0;
+    _bit_count = 0;
+    _overflow = false;
+}
+
+int LzEncoder::write(const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len && !_overflow; i++) {
+        _ahead[_ahead_len++] = data[i];
+        if (_ahead_len == LOOKAHEAD) {
+            encode();
+        }
+    }
+    return _overflow ? -1 : 0;
+}
+
+int LzEncoder::finish()
+{
+    while (_ahead_len > 0 && !_overflow) {
+        encode();
+    }
+    if (_bit_count > 0) {
+        put_bits(0, 8 - _bit_count);
+    }
+    return _overflow ? -1 : (int) _pos;
+}
+
+void LzEncoder::encode()
+{
+    uint16_t best_len = 0;
+    uint16_t best_distance = 0;
+
+    for (uint16_t distance = 1; distance <= WINDOW; distance++) {
+        if (_window[(_head - distance) & (WINDOW - 1)] != _ahead[0]) {
+            continue;
+        }
+        /* A copy may run on into the bytes it produces */
+        uint16_t len = 1;
+        while (len < _ahead_len) {
+            uint8_t c = len < distance ? _window[(_head - distance + len) & (WINDOW - 1)] :
+                                         _ahead[len - distance];
+            if (c != _ahead[len]) {
+                break;
+            }
+            len++;
+        }
+        if (len > best_len) {
+            best_len = len;
+            best_distance = distance;
+            if (len == _ahead_len) {
+                break;
+            }
+        }
+    }
+
+    if (best_len >= MIN_MATCH) {
+        put_bits(0, 1);
+        put_bits(best_distance - 1, MBED_CONF_APP_COMPRESS_WINDOW_BITS);
+        put_bits(best_len - 1, MBED_CONF_APP_COMPRESS_LOOKAHEAD_BITS);
+    } else {
+        best_len = 1;
+        put_bits(1, 1);
+        put_bits(_ahead[0], 8);
+    }
+
+    for (uint16_t i = 0; i < best_len; i++) {
+        _window[_head] = _ahead[i];
+        _head = (_head + 1) & (WINDOW - 1);
+    }
+    _ahead_len -= best_len;
+    memmove(_ahead, _ahead + best_len, _ahead_len);
+}
+
+void LzEncoder::put_bits(uint16_t value, uint8_t count)
+{
+    while (count-- > 0) {
+        _bits = (_bits << 1) | ((value >> count) & 1);
+        if (++_bit_count == 8) {
+            if (_pos < _size) {
+                _out[_pos++] = _bits;
+            } else {
+                _overflow = true;
+            }
+            _bits = 0;
+            _bit_count = 0;
+        }
+    }
+}
+
+void LzDecoder::begin(uint8_t *out, size_t size)
+{
+    _out = out;
+    _size = size;
+    _pos = 0;
+    _state = TAG;
+    _needed = 1;
+    _value = 0;
+    _distance = 0;
+    _error = false;
+}
+
+int LzDecoder::write(const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len && !_error; i++) {
+        for (int bit = 7; bit >= 0 && !_error; bit--) {
+            _value = (_value << 1) | ((data[i] >> bit) & 1);
+            if (--_needed > 0) {
+                continue;
+            }
+
+            switch (_state) {
+            case TAG:
+                _state = _value ? LITERAL : DISTANCE;
+                _needed = _value ? 8 : MBED_CONF_APP_COMPRESS_WINDOW_BITS;
+                break;
+            case LITERAL:
+                if (_pos == _size) {
+                    _error = true;
+                    break;
+                }
+                _out[_pos++] = _value;
+                _state = TAG;
+                _needed = 1;
+                break;
+            case DISTANCE:
+                _distance = _value + 1;
+                _state = LENGTH;
+                _needed = MBED_CONF_APP_COMPRESS_LOOKAHEAD_BITS;
+                break;
+            case LENGTH:
+                if (_pos + _value + 1 > _size) {
+                    _error = true;
+                    break;
+                }
+                for (uint16_t k = 0; k <= _value; k++, _pos++) {
+                    _out[_pos] = _pos >= _distance ? _out[_pos - _distance] :
+                                                     before(_distance - _pos);
+                }
+                _state = TAG;
+                _needed = 1;
+                break;
+            }
+            _value = 0;
+        }
+    }
+    return _error ? -1 : 0;
+}
+
+int LzDecoder::finish()
+{
+    /* A copy cut short is the padding of the last byte */
+    return _error ? -1 : (int) _pos;
+}
+
+uint8_t LzDecoder::before(size_t back)
+{
+    return back <= DICTIONARY_LEN ? DICTIONARY[DICTIONARY_LEN - back] : 0;
+}
+
+PayloadCompressor::PayloadCompressor(const char *topics) :
+        _topic_count(0)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    _clock.start();
+
+    char filter[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+    while (*topics != '\0') {
+        const char *end = strchr(topics, ';');
+        if (end == NULL) {
+            end = topics + strlen(topics);
+        }
+
+        if ((size_t) (end - topics) >= sizeof (filter)) {
+            printf("MQTT: compressed topic \"%.*s\" too long\n", (int) (end - topics), topics);
+        } else {
+            memcpy(filter, topics, end - topics);
+            filter[end - topics] = '\0';
+            if (add_topic(filter) != 0) {
+                printf("MQTT: compressed topic %s not added\n", filter);
+            }
+        }
+
+        topics = *end == ';' ? end + 1 : end;
+    }
+}
+
+int PayloadCompressor::add_topic(const char *filter)
+{
+    if (!_topics.valid_filter(filter)) {
+        return -1;
+    }
+
+    _mutex.lock();
+    int ret = -1;
+    if (_topic_count < MAX_TOPICS) {
+        ret = _topics.insert(filter, _topic_count);
+        if (ret == 0) {
+            _topic_count++;
+        }
+    }
+    _mutex.unlock();
+    return ret;
+}
+
+bool PayloadCompressor::selected(const char *topic)
+{
+    if (_topic_count == 0) {
+        return false;
+    }
+
+    _mutex.lock();
+    bool matched = _topics.match(topic, strlen(topic), &PayloadCompressor::on_match, NULL) > 0;
+    _mutex.unlock();
+    return matched;
+}
+
+int PayloadCompressor::compress(const void *payload, size_t len, uint8_t *out, size_t size)
+{
+    _mutex.lock();
+    uint32_t start = now_us();
+    _encoder.begin(out, size);
+    int n = _encoder.write(static_cast<const uint8_t *>(payload), len);
+    if (n == 0) {
+        n = _encoder.finish();
+    }
+
+    _stats.total_us += now_us() - start;
+    if (n < 0) {
+        _stats.refused++;
+    } else {
+        _stats.messages++;
+        _stats.bytes_in += len;
+        _stats.bytes_out += n;
+    }
+    _mutex.unlock();
+    return n;
+}
+
+CompressStats PayloadCompressor::stats()
+{
+    _mutex.lock();
+    CompressStats stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void PayloadCompressor::on_match(void *context, uint16_t value)
+{
+    (void) context;
+    (void) value;
+}
+
+void PayloadCompressor::benchmark()
+{
+    static const char reading[] =
+        "{\"temp\":21.5,\"hum\":48,\"batt\":3.02,\"rssi\":-71,\"seq\":1042,\"ts\":1528454400}";
+    static const char tagged[] =
+        "{\"temp\":21.5,\"hum\":48,\"batt\":3.02,\"rssi\":-71,\"seq\":1042,\"ts\":1528454400,"
+        "\"node\":\"0013A20040A1B2C3\",\"level\":\"info\",\"msg\":\"sensor reading\"}";
+    static const char line[] =
+        "{\"level\":\"info\",\"msg\":\"link up after 3 retries, rssi -71, "
+        "parent 0013A20040A1B2C3, 2 children\",\"ts\":1528454400}";
+    /* A FrameAggregator batch of three frames */
+    static const char batch[] =
+        "\x9f\x1a\x00\x01\xe2\x40\x82\x00\x43\x01\x02\x03\x82\x18\x64\x43\x01\x02\x04"
+        "\x82\x18\xc8\x43\x01\x02\x05\xff";
+    static const struct {
+        const char *data;
+        size_t len;
+    } samples[] = {
+        { reading, sizeof (reading) - 1 },
+        { tagged, sizeof (tagged) - 1 },
+        { line, sizeof (line) - 1 },
+        { batch, sizeof (batch) - 1 },
+    };
+    static const int ROUNDS = 100;
+
+    LzEncoder *encoder = new LzEncoder;
+    LzDecoder decoder;
+    uint8_t packed[256];
+    uint8_t unpacked[256];
+    Timer timer;
+    timer.start();
+
+    printf("LZ: window %d, lookahead %d, dictionary %d bytes\n", LzEncoder::WINDOW,
+           LzEncoder::LOOKAHEAD, (int) DICTIONARY_LEN);
+    for (size_t s = 0; s < sizeof (samples) / sizeof (samples[0]); s++) {
+        const uint8_t *sample = reinterpret_cast<const uint8_t *>(samples[s].data);
+        size_t len = samples[s].len;
+        int n = 0;
+
+        uint64_t start = timer.read_high_resolution_us();
+        for (int r = 0; r < ROUNDS; r++) {
+            encoder->begin(packed, sizeof (packed));
+            encoder->write(sample, len);
+            n = encoder->finish();
+        }
+        uint32_t compress_us = (timer.read_high_resolution_us() - start) / ROUNDS;
+
+        int m = 0;
+        start = timer.read_high_resolution_us();
+        for (int r = 0; r < ROUNDS && n > 0; r++) {
+            decoder.begin(unpacked, sizeof (unpacked));
+            decoder.write(packed, n);
+            m = decoder.finish();
+        }
+        uint32_t decompress_us = (timer.read_high_resolution_us() - start) / ROUNDS;
+
+        if (n < 0 || m != (int) len || memcmp(unpacked, sample, len) != 0) {
+            printf("LZ: sample %d does not round trip\n", (int) s);
+            continue;
+        }
+
+        /* Below this rate the airtime saved is worth more than the CPU time */
+        int saved = (int) len - n;
+        unsigned long break_even = saved > 0 && compress_us > 0 ?
+                                   (unsigned long) ((uint64_t) saved * 1000000 / compress_us) : 0;
+        printf("LZ: sample %d, %d -> %d bytes (%d%%), compress %lu us, decompress %lu us, "
+               "pays off below %lu B/s\n",
+               (int) s, (int) len, n, (int) (n * 100 / len), (unsigned long) compress_us,
+               (unsigned long) decompress_us, break_even);
+    }
+    delete encoder;
+}
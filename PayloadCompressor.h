@@ -0,0 +1,263 @@
+/*
+ *  LZSS compression of the payloads published to the broker
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file PayloadCompressor.h
+ *  \brief Smaller payloads for the topics whose subscribers decompress them
+ *  Sensor JSON and log lines repeat the same keys and words over and over.
+ *  The payloads of the topics matching compress-topics are compressed
+ *  before they are queued, so they take less RAM, flash and airtime.
+ *
+ *  The stream is laid out as heatshrink's, with a window of 2^WINDOW_BITS and a
+ *  lookahead of 2^LOOKAHEAD_BITS bytes, most significant bit first:
+ *
+ *    1 <8 bit byte>                               a literal
+ *    0 <WINDOW_BITS distance - 1> <LOOKAHEAD_BITS length - 1>
+ *                                                 a copy from distance back
+ *
+ *  and the last byte padded with 0 bits. A message alone is too short to
+ *  repeat itself much, so the window starts out holding the static
+ *  dictionary, the last 2^WINDOW_BITS bytes of compress-dictionary right
+ *  before the first byte and zeros before those. A decoder must start
+ *  from the same window, LzDecoder below does: a stock heatshrink decoder
+ *  starts from an empty one and cannot read these payloads.
+ *
+ *  Every message to a selected topic is compressed, that is the agreement
+ *  with its subscribers. With MQTT v5 the PUBLISH also carries the
+ *  compress-content-type as its Content Type, by default one of our own
+ *  naming the dictionary; change it along with the dictionary.
+ */
+
+#ifndef __PAYLOAD_COMPRESSOR_H_
+#define __PAYLOAD_COMPRESSOR_H_
+
+#include "mbed.h"
+#include "TopicTrie.h"
+#include "PublishScheduler.h"
+
+/** Topic filters whose payloads are compressed, separated by ';' */
+#ifndef MBED_CONF_APP_COMPRESS_TOPICS
+#define MBED_CONF_APP_COMPRESS_TOPICS ""
+#endif
+
+/** Bytes the window starts out with, only the last 2^WINDOW_BITS are used */
+#ifndef MBED_CONF_APP_COMPRESS_DICTIONARY
+#define MBED_CONF_APP_COMPRESS_DICTIONARY "\"level\":\"info\",\"msg\":\"\",\"node\":\"\"," \
+                                          "\"seq\":,\"ts\":,\"rssi\":-,\"batt\":,\"hum\":,{\"temp\":"
+#endif
+
+/** Content Type of the compressed messages under MQTT v5 */
+#ifndef MBED_CONF_APP_COMPRESS_CONTENT_TYPE
+#define MBED_CONF_APP_COMPRESS_CONTENT_TYPE "application/x-lzss-dict1"
+#endif
+
+/** Log2 of the window, 4 to 12 */
+#ifndef MBED_CONF_APP_COMPRESS_WINDOW_BITS
+#define MBED_CONF_APP_COMPRESS_WINDOW_BITS 8
+#endif
+
+/** Log2 of the longest copy, 3 to WINDOW_BITS - 1 */
+#ifndef MBED_CONF_APP_COMPRESS_LOOKAHEAD_BITS
+#define MBED_CONF_APP_COMPRESS_LOOKAHEAD_BITS 4
+#endif
+
+/** Time compressing sample payloads at boot */
+#ifndef MBED_CONF_APP_COMPRESS_BENCHMARK
+#define MBED_CONF_APP_COMPRESS_BENCHMARK false
+#endif
+
+/**
+ * \brief LzEncoder compresses a stream into a buffer.
+ */
+class LzEncoder {
+public:
+    static const uint16_t WINDOW = 1 << MBED_CONF_APP_COMPRESS_WINDOW_BITS;
+    static const uint16_t LOOKAHEAD = 1 << MBED_CONF_APP_COMPRESS_LOOKAHEAD_BITS;
+
+    /**
+     * Start a stream, with the window holding the dictionary
+     *
+     * @param[in] out The buffer the stream is written to
+     * @param[in] size Its size
+     */
+    void begin(uint8_t *out, size_t size);
+
+    /**
+     * Compress the next part of the stream
+     *
+     * @return 0 on success, or -1 once the buffer is full
+     */
+    int write(const uint8_t *data, size_t len);
+
+    /**
+     * Compress what is left and end the stream
+     *
+     * @return The length of the stream, or -1 if it did not fit
+     */
+    int finish();
+
+protected:
+    /**
+     * Encode the longest match of the lookahead, or its first byte
+     */
+    void encode();
+
+    void put_bits(uint16_t value, uint8_t count);
+
+protected:
+    uint8_t _window[WINDOW];        /**< The bytes before the lookahead, as a ring */
+    uint16_t _head;                 /**< Where the next byte goes in _window */
+    uint8_t _ahead[LOOKAHEAD];
+    uint16_t _ahead_len;
+
+    uint8_t *_out;
+    size_t _size;
+    size_t _pos;
+    uint8_t _bits;                  /**< The byte being filled */
+    uint8_t _bit_count;
+    bool _overflow;
+};
+
+/**
+ * \brief LzDecoder decompresses an LzEncoder stream into a buffer.
+ */
+class LzDecoder {
+public:
+    /**
+     * Start a stream
+     *
+     * @param[in] out The buffer the bytes are written to, which is also
+     *                the window, so it holds the whole message
+     * @param[in] size Its size
+     */
+    void begin(uint8_t *out, size_t size);
+
+    /**
+     * Decompress the next part of the stream
+     *
+     * @return 0 on success, or -1 if the message does not fit or refers
+     *         to before the window
+     */
+    int write(const uint8_t *data, size_t len);
+
+    /**
+     * End the stream
+     *
+     * @return The length of the message, or -1 after an error
+     */
+    int finish();
+
+protected:
+    enum State {
+        TAG,
+        LITERAL,
+        DISTANCE,
+        LENGTH
+    };
+
+    /**
+     * A byte before the message: the dictionary, then zeros
+     */
+    static uint8_t before(size_t back);
+
+protected:
+    uint8_t *_out;
+    size_t _size;
+    size_t _pos;
+    State _state;
+    uint8_t _needed;                /**< Bits still to read for the state */
+    uint16_t _value;
+    uint16_t _distance;
+    bool _error;
+};
+
+/**
+ * Compression statistics
+ */
+struct CompressStats {
+    uint32_t messages;
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t refused;           /**< Did not fit the largest payload compressed */
+    uint32_t total_us;          /**< Time spent compressing */
+};
+
+/**
+ * \brief PayloadCompressor picks the topics to compress and compresses
+ * their payloads.
+ *
+ * compress() may be called from any thread.
+ */
+class PayloadCompressor {
+public:
+    /** Topic filters that can be selected */
+    static const uint16_t MAX_TOPICS = 4;
+
+    /**
+     * PayloadCompressor Constructor
+     *
+     * @param[in] topics Topic filters to compress, separated by ';'
+     */
+    PayloadCompressor(const char *topics = MBED_CONF_APP_COMPRESS_TOPICS);
+
+    /**
+     * Compress the payloads of the topics matching a filter as well
+     *
+     * @return 0 on success, or -1 if the filter is invalid or there is no room
+     */
+    int add_topic(const char *filter);
+
+    /**
+     * Whether the payloads to a topic are compressed
+     */
+    bool selected(const char *topic);
+
+    /**
+     * Compress a payload
+     *
+     * @return The compressed length, or -1 if it does not fit
+     */
+    int compress(const void *payload, size_t len, uint8_t *out, size_t size);
+
+    /**
+     * A snapshot of the statistics
+     */
+    CompressStats stats();
+
+    /**
+     * Time compressing and decompressing sample payloads, and print what
+     * it costs against what it saves
+     */
+    static void benchmark();
+
+protected:
+    static void on_match(void *context, uint16_t value);
+
+    uint32_t now_us() {
+        return _clock.read_high_resolution_us();
+    }
+
+protected:
+    Mutex _mutex;                   /**< Guards everything below */
+    Timer _clock;
+    TopicTrie<MAX_TOPICS * 8, MAX_TOPICS * 32, MAX_TOPICS> _topics;
+    uint16_t _topic_count;
+    LzEncoder _encoder;
+    CompressStats _stats;
+};
+
+#endif /* __PAYLOAD_COMPRESSOR_H_ */
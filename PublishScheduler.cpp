@@ -0,0 +1,295 @@
+/*
+ *  Priority classes for the messages published to the broker
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "PublishScheduler.h"
+
+/* Per class, alarms first; alarms have no weight, they are always served */
+static const int32_t WEIGHTS[PUBLISH_CLASSES] = {
+    0,
+    MBED_CONF_APP_PUBLISH_WEIGHT_CONTROL,
+    MBED_CONF_APP_PUBLISH_WEIGHT_TELEMETRY,
+    MBED_CONF_APP_PUBLISH_WEIGHT_BULK
+};
+
+static const uint32_t TARGETS[PUBLISH_CLASSES] = {
+    MBED_CONF_APP_PUBLISH_TARGET_ALARM,
+    MBED_CONF_APP_PUBLISH_TARGET_CONTROL,
+    MBED_CONF_APP_PUBLISH_TARGET_TELEMETRY,
+    MBED_CONF_APP_PUBLISH_TARGET_BULK
+};
+
+PublishScheduler::PublishScheduler() :
+        _turn(PUBLISH_CONTROL), _next_seq(0)
+{
+    for (uint16_t i = 0; i < MBED_CONF_APP_PUBLISH_QUEUE_SIZE; i++) {
+        _entries[i].next = i + 1 < MBED_CONF_APP_PUBLISH_QUEUE_SIZE ? i + 1 : NONE;
+    }
+    _free = 0;
+
+    for (int c = 0; c < PUBLISH_CLASSES; c++) {
+        _queues[c].head = NONE;
+        _queues[c].tail = NONE;
+        _queues[c].deficit = 0;
+    }
+    _queues[_turn].deficit = WEIGHTS[_turn] * MBED_CONF_APP_PUBLISH_QUANTUM;
+    _inflight.head = NONE;
+    _inflight.tail = NONE;
+    _inflight.deficit = 0;
+    memset(_stats, 0, sizeof (_stats));
+}
+
+int PublishScheduler::push(PublishClass cls, const char *topic, const void *payload, size_t len,
+                           MQTT::QoS qos, uint32_t now_ms)
+{
+    _mutex.lock();
+    uint16_t e = _free;
+    if (e != NONE) {
+        _free = _entries[e].next;
+    } else {
+        /* Make room at the expense of the least urgent, never a more urgent class */
+        for (int c = PUBLISH_CLASSES - 1; c >= cls; c--) {
+            if (_queues[c].head != NONE) {
+                e = unlink_head(c);
+                _stats[c].dropped++;
+                break;
+            }
+        }
+        if (e == NONE) {
+            _stats[cls].refused++;
+            _mutex.unlock();
+            return -1;
+        }
+    }
+
+    PublishMessage &msg = _entries[e].msg;
+    strcpy(msg.topic, topic);
+    memcpy(msg.payload, payload, len);
+    msg.len = len;
+    msg.qos = qos;
+    msg.seq = _next_seq++;
+    msg.queued_ms = now_ms;
+
+    append(_queues[cls], e);
+    _stats[cls].queued++;
+    _mutex.unlock();
+
+    return 0;
+}
+
+int PublishScheduler::next(uint32_t now_ms, bool backlog)
+{
+    int cls = -1;
+
+    _mutex.lock();
+    if (_queues[PUBLISH_ALARM].head != NONE) {
+        cls = PUBLISH_ALARM;
+    }
+
+    /* A class past its latency target jumps the turns */
+    for (int c = PUBLISH_CONTROL; cls < 0 && c < PUBLISH_CLASSES; c++) {
+        uint16_t head = _queues[c].head;
+        if (TARGETS[c] > 0 && head != NONE &&
+            now_ms - _entries[head].msg.queued_ms >= TARGETS[c]) {
+            cls = c;
+        }
+    }
+
+    bool any = false;
+    for (int c = PUBLISH_CONTROL; c < PUBLISH_CLASSES; c++) {
+        any = any || ready(c, backlog);
+    }
+
+    /* Deficit round robin, every turn adds to the credit so this ends */
+    while (cls < 0 && any) {
+        Queue &q = _queues[_turn];
+        if (ready(_turn, backlog) && q.deficit > 0) {
+            cls = _turn;
+            break;
+        }
+        if (!ready(_turn, backlog) && q.deficit > 0) {
+            /* An idle class does not save up credit */
+            q.deficit = 0;
+        }
+        _turn = _turn + 1 < PUBLISH_CLASSES ? _turn + 1 : PUBLISH_CONTROL;
+        _queues[_turn].deficit += WEIGHTS[_turn] * MBED_CONF_APP_PUBLISH_QUANTUM;
+    }
+    _mutex.unlock();
+
+    return cls;
+}
+
+bool PublishScheduler::peek(PublishClass cls, PublishMessage *msg)
+{
+    _mutex.lock();
+    uint16_t head = _queues[cls].head;
+    if (head != NONE) {
+        *msg = _entries[head].msg;
+    }
+    _mutex.unlock();
+    return head != NONE;
+}
+
+void PublishScheduler::sent(PublishClass cls, const PublishMessage *msg, size_t bytes,
+                            uint32_t now_ms, uint16_t packet_id)
+{
+    _mutex.lock();
+    if (cls != PUBLISH_ALARM) {
+        /* Served out of turn for its latency target, it pays all the same */
+        _queues[cls].deficit -= bytes;
+    }
+
+    PublishClassStats &s = _stats[cls];
+    s.sent++;
+    if (msg != NULL) {
+        uint32_t wait = now_ms - msg->queued_ms;
+        if (wait > s.max_wait_ms) {
+            s.max_wait_ms = wait;
+        }
+        if (TARGETS[cls] > 0 && wait > TARGETS[cls]) {
+            s.late++;
+        }
+
+        /* Unless push() dropped it meanwhile, the head is what was sent */
+        uint16_t head = _queues[cls].head;
+        if (head != NONE && _entries[head].msg.seq == msg->seq) {
+            unlink_head(cls);
+            if (packet_id != 0) {
+                _entries[head].packet_id = packet_id;
+                _entries[head].cls = cls;
+                append(_inflight, head);
+            } else {
+                _entries[head].next = _free;
+                _free = head;
+            }
+        }
+    }
+    _mutex.unlock();
+}
+
+void PublishScheduler::drop(PublishClass cls, uint32_t seq)
+{
+    _mutex.lock();
+    uint16_t head = _queues[cls].head;
+    if (head != NONE && _entries[head].msg.seq == seq) {
+        unlink_head(cls);
+        _entries[head].next = _free;
+        _free = head;
+        _stats[cls].refused++;
+    }
+    _mutex.unlock();
+}
+
+void PublishScheduler::acked(uint16_t packet_id)
+{
+    _mutex.lock();
+    uint16_t prev = NONE;
+    for (uint16_t e = _inflight.head; e != NONE; prev = e, e = _entries[e].next) {
+        if (_entries[e].packet_id != packet_id) {
+            continue;
+        }
+        if (prev == NONE) {
+            _inflight.head = _entries[e].next;
+        } else {
+            _entries[prev].next = _entries[e].next;
+        }
+        if (_inflight.tail == e) {
+            _inflight.tail = prev;
+        }
+        _entries[e].next = _free;
+        _free = e;
+        break;
+    }
+    _mutex.unlock();
+}
+
+void PublishScheduler::requeue()
+{
+    _mutex.lock();
+    for (int c = 0; c < PUBLISH_CLASSES; c++) {
+        /* Take the class's messages out of flight, in order */
+        Queue chain = { NONE, NONE, 0 };
+        uint16_t prev = NONE;
+        uint16_t e = _inflight.head;
+        while (e != NONE) {
+            uint16_t next = _entries[e].next;
+            if (_entries[e].cls == c) {
+                if (prev == NONE) {
+                    _inflight.head = next;
+                } else {
+                    _entries[prev].next = next;
+                }
+                if (_inflight.tail == e) {
+                    _inflight.tail = prev;
+                }
+                append(chain, e);
+            } else {
+                prev = e;
+            }
+            e = next;
+        }
+
+        /* And ahead of what was queued after them */
+        if (chain.head != NONE) {
+            Queue &q = _queues[c];
+            _entries[chain.tail].next = q.head;
+            q.head = chain.head;
+            if (q.tail == NONE) {
+                q.tail = chain.tail;
+            }
+        }
+    }
+    _mutex.unlock();
+}
+
+bool PublishScheduler::empty(PublishClass cls)
+{
+    _mutex.lock();
+    bool empty = _queues[cls].head == NONE;
+    _mutex.unlock();
+    return empty;
+}
+
+PublishClassStats PublishScheduler::stats(PublishClass cls)
+{
+    _mutex.lock();
+    PublishClassStats stats = _stats[cls];
+    _mutex.unlock();
+    return stats;
+}
+
+void PublishScheduler::append(Queue &q, uint16_t e)
+{
+    _entries[e].next = NONE;
+    if (q.tail != NONE) {
+        _entries[q.tail].next = e;
+    } else {
+        q.head = e;
+    }
+    q.tail = e;
+}
+
+uint16_t PublishScheduler::unlink_head(int cls)
+{
+    Queue &q = _queues[cls];
+    uint16_t e = q.head;
+    q.head = _entries[e].next;
+    if (q.head == NONE) {
+        q.tail = NONE;
+    }
+    return e;
+}
@@ -0,0 +1,255 @@
+/*
+ *  Priority classes for the messages published to the broker
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file PublishScheduler.h
+ *  \brief Which outbound message goes on the wire next
+ *  Messages are queued in four classes sharing one pool:
+ *
+ *    alarm       always sent first
+ *    control     \
+ *    telemetry    > share the link by weight
+ *    bulk        /  the offline backlog counts as bulk as well
+ *
+ *  Alarms have strict priority. The other classes take turns by deficit
+ *  round robin: a class is given its weight times publish-quantum bytes on
+ *  its turn and keeps the turn while it has credit left, so each gets its
+ *  share of the bytes whatever the size of its messages. A class whose
+ *  oldest message has waited past its latency target is served before the
+ *  turn order, the higher class first.
+ *
+ *  When the pool is full a new message takes the place of the oldest one
+ *  of the lowest class not above its own, so telemetry never pushes out an
+ *  alarm. If there is none it is refused.
+ *
+ *  A message sent without waiting for its acknowledgement stays in the
+ *  pool, in flight, until acked(). If the session is lost first, requeue()
+ *  puts it back at the front of its class to be sent again.
+ */
+
+#ifndef __PUBLISH_SCHEDULER_H_
+#define __PUBLISH_SCHEDULER_H_
+
+#include "mbed.h"
+#include "MQTTClient.h"
+
+/** Longest topic name or filter, excluding the NUL */
+#ifndef MBED_CONF_APP_MQTT_MAX_TOPIC_LEN
+#define MBED_CONF_APP_MQTT_MAX_TOPIC_LEN 63
+#endif
+
+/** Number of messages kept in RAM, all classes together */
+#ifndef MBED_CONF_APP_PUBLISH_QUEUE_SIZE
+#define MBED_CONF_APP_PUBLISH_QUEUE_SIZE 8
+#endif
+
+/** Largest payload accepted by publish() */
+#ifndef MBED_CONF_APP_PUBLISH_MAX_PAYLOAD
+#define MBED_CONF_APP_PUBLISH_MAX_PAYLOAD 128
+#endif
+
+/** Bytes a class may send on its turn, per unit of weight */
+#ifndef MBED_CONF_APP_PUBLISH_QUANTUM
+#define MBED_CONF_APP_PUBLISH_QUANTUM 256
+#endif
+
+/** Weights of the classes sharing the link */
+#ifndef MBED_CONF_APP_PUBLISH_WEIGHT_CONTROL
+#define MBED_CONF_APP_PUBLISH_WEIGHT_CONTROL 4
+#endif
+#ifndef MBED_CONF_APP_PUBLISH_WEIGHT_TELEMETRY
+#define MBED_CONF_APP_PUBLISH_WEIGHT_TELEMETRY 2
+#endif
+#ifndef MBED_CONF_APP_PUBLISH_WEIGHT_BULK
+#define MBED_CONF_APP_PUBLISH_WEIGHT_BULK 1
+#endif
+
+/** Latency targets of the classes in milliseconds, 0 for none */
+#ifndef MBED_CONF_APP_PUBLISH_TARGET_ALARM
+#define MBED_CONF_APP_PUBLISH_TARGET_ALARM 100
+#endif
+#ifndef MBED_CONF_APP_PUBLISH_TARGET_CONTROL
+#define MBED_CONF_APP_PUBLISH_TARGET_CONTROL 500
+#endif
+#ifndef MBED_CONF_APP_PUBLISH_TARGET_TELEMETRY
+#define MBED_CONF_APP_PUBLISH_TARGET_TELEMETRY 5000
+#endif
+#ifndef MBED_CONF_APP_PUBLISH_TARGET_BULK
+#define MBED_CONF_APP_PUBLISH_TARGET_BULK 0
+#endif
+
+/**
+ * Outbound message classes, the most urgent first
+ */
+enum PublishClass {
+    PUBLISH_ALARM,
+    PUBLISH_CONTROL,
+    PUBLISH_TELEMETRY,
+    PUBLISH_BULK,
+    PUBLISH_CLASSES
+};
+
+/**
+ * A queued message
+ */
+struct PublishMessage {
+    char topic[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+    uint8_t payload[MBED_CONF_APP_PUBLISH_MAX_PAYLOAD];
+    size_t len;
+    MQTT::QoS qos;
+    uint32_t seq;           /**< Tells a message from the one that took its place */
+    uint32_t queued_ms;
+};
+
+/**
+ * Statistics of one class
+ */
+struct PublishClassStats {
+    uint32_t queued;
+    uint32_t sent;          /**< Messages, or backlog batches for bulk */
+    uint32_t dropped;       /**< Pushed out by a newer message */
+    uint32_t refused;       /**< Not queued for lack of room, or too large to send */
+    uint32_t late;          /**< Sent after the latency target */
+    uint32_t max_wait_ms;   /**< Longest a sent message waited */
+};
+
+/**
+ * \brief PublishScheduler queues the messages to publish by class and
+ * picks the next one to send.
+ *
+ * push() may be called from any thread, the other methods are called by
+ * the thread sending.
+ */
+class PublishScheduler {
+public:
+    /**
+     * PublishScheduler Constructor, empty
+     */
+    PublishScheduler();
+
+    /**
+     * Queue a message
+     *
+     * @param[in] cls The message's class
+     * @param[in] topic The topic, at most MBED_CONF_APP_MQTT_MAX_TOPIC_LEN long
+     * @param[in] payload The payload, at most MBED_CONF_APP_PUBLISH_MAX_PAYLOAD long
+     * @param[in] now_ms The current time in milliseconds, wrapping at 2^32
+     * @return 0 on success, or -1 if the pool is full of more urgent messages
+     */
+    int push(PublishClass cls, const char *topic, const void *payload, size_t len,
+             MQTT::QoS qos, uint32_t now_ms);
+
+    /**
+     * Pick the class to send from next
+     *
+     * @param[in] backlog The offline backlog has messages, served as bulk
+     * @return The class, or -1 if there is nothing to send
+     */
+    int next(uint32_t now_ms, bool backlog);
+
+    /**
+     * Copy out the oldest message of a class
+     *
+     * @return false if the class is empty
+     */
+    bool peek(PublishClass cls, PublishMessage *msg);
+
+    /**
+     * Charge a class for what it sent, and remove the message peeked
+     * unless it was dropped meanwhile
+     *
+     * @param[in] msg The message sent, or NULL for a backlog batch
+     * @param[in] bytes The bytes sent
+     * @param[in] packet_id Non zero to keep the message in flight until acked()
+     */
+    void sent(PublishClass cls, const PublishMessage *msg, size_t bytes, uint32_t now_ms,
+              uint16_t packet_id = 0);
+
+    /**
+     * Remove the message peeked without sending it, it can never be sent,
+     * unless it was dropped meanwhile
+     *
+     * @param[in] seq The sequence number of the message peeked
+     */
+    void drop(PublishClass cls, uint32_t seq);
+
+    /**
+     * Remove a message in flight, it was acknowledged
+     */
+    void acked(uint16_t packet_id);
+
+    /**
+     * Put the messages in flight back at the front of their class, in the
+     * order they were sent, when the session they were sent in is lost
+     */
+    void requeue();
+
+    /**
+     * Whether a class has messages queued
+     */
+    bool empty(PublishClass cls);
+
+    /**
+     * A snapshot of the statistics of a class
+     */
+    PublishClassStats stats(PublishClass cls);
+
+protected:
+    static const uint16_t NONE = 0xFFFF;
+
+    struct Entry {
+        PublishMessage msg;
+        uint16_t next;          /**< Next in a queue or in the free list */
+        uint16_t packet_id;     /**< While in flight */
+        uint8_t cls;            /**< While in flight */
+    };
+
+    struct Queue {
+        uint16_t head;          /**< Oldest message, or NONE */
+        uint16_t tail;
+        int32_t deficit;        /**< Bytes the class may still send on its turn */
+    };
+
+    /**
+     * Take the oldest message of a class off its queue, with _mutex held
+     */
+    uint16_t unlink_head(int cls);
+
+    /**
+     * Append an entry to a queue, with _mutex held
+     */
+    void append(Queue &q, uint16_t e);
+
+    /**
+     * Whether a class has something to send, with _mutex held
+     */
+    bool ready(int cls, bool backlog) const {
+        return _queues[cls].head != NONE || (cls == PUBLISH_BULK && backlog);
+    }
+
+protected:
+    Mutex _mutex;                   /**< Guards everything below */
+    Entry _entries[MBED_CONF_APP_PUBLISH_QUEUE_SIZE];
+    uint16_t _free;                 /**< First free entry, or NONE */
+    Queue _queues[PUBLISH_CLASSES];
+    Queue _inflight;                /**< Sent and not acknowledged yet, oldest first */
+    int _turn;                      /**< The weighted class whose turn it is */
+    uint32_t _next_seq;
+    PublishClassStats _stats[PUBLISH_CLASSES];
+};
+
+#endif /* __PUBLISH_SCHEDULER_H_ */
@@ -0,0 +1,231 @@
+/*
+ *  UART receiver writing into a ring, by DMA where available
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "SerialRxRing.h"
+
+#if SERIAL_RX_RING_DMA
+#include "pinmap.h"
+#include "PeripheralPins.h"
+
+/**
+ * The DMA stream and channel serving a USART's receiver (RM0090, table 42/43)
+ */
+struct DmaRoute {
+    uint32_t uart;              /**< USART base address */
+    IRQn_Type uart_irq;
+    uint32_t dma;               /**< DMA controller base address */
+    uint32_t stream;            /**< DMA stream base address */
+    uint32_t stream_index;
+    IRQn_Type dma_irq;
+    uint32_t channel;
+};
+
+namespace {
+
+const DmaRoute DMA_ROUTES[] = {
+    { USART1_BASE, USART1_IRQn, DMA2_BASE, DMA2_Stream2_BASE, 2, DMA2_Stream2_IRQn, 4 },
+    { USART2_BASE, USART2_IRQn, DMA1_BASE, DMA1_Stream5_BASE, 5, DMA1_Stream5_IRQn, 4 },
+#if defined(USART6_BASE)
+    { USART6_BASE, USART6_IRQn, DMA2_BASE, DMA2_Stream1_BASE, 1, DMA2_Stream1_IRQn, 5 },
+#endif
+};
+
+/* Every stream has six flag bits in LISR/HISR, at these offsets */
+const uint8_t FLAG_SHIFT[] = { 0, 6, 16, 22 };
+const uint32_t FLAG_ALL = 0x3D;
+const uint32_t FLAG_HT = 0x10;
+const uint32_t FLAG_TC = 0x20;
+
+uint32_t dma_flags(const DmaRoute *route)
+{
+    DMA_TypeDef *dma = reinterpret_cast<DMA_TypeDef *>(route->dma);
+    uint32_t isr = route->stream_index < 4 ? dma->LISR : dma->HISR;
+    return (isr >> FLAG_SHIFT[route->stream_index % 4]) & FLAG_ALL;
+}
+
+void dma_clear(const DmaRoute *route, uint32_t flags)
+{
+    DMA_TypeDef *dma = reinterpret_cast<DMA_TypeDef *>(route->dma);
+    uint32_t bits = flags << FLAG_SHIFT[route->stream_index % 4];
+    if (route->stream_index < 4) {
+        dma->LIFCR = bits;
+    } else {
+        dma->HIFCR = bits;
+    }
+}
+
+}
+
+SerialRxRing *SerialRxRing::_dma_instance = NULL;
+#endif /* SERIAL_RX_RING_DMA */
+
+SerialRxRing::SerialRxRing(PinName tx, PinName rx, int baud) :
+        RawSerial(tx, rx, baud),
+#if SERIAL_RX_RING_DMA
+        _route(NULL),
+#endif
+        _rx_pin(rx), _written(0), _laps(0), _read(0), _dma(false)
+{
+}
+
+SerialRxRing::~SerialRxRing()
+{
+#if SERIAL_RX_RING_DMA
+    if (_dma) {
+        USART_TypeDef *usart = reinterpret_cast<USART_TypeDef *>(_route->uart);
+        DMA_Stream_TypeDef *stream = reinterpret_cast<DMA_Stream_TypeDef *>(_route->stream);
+        usart->CR1 &= ~USART_CR1_IDLEIE;
+        usart->CR3 &= ~USART_CR3_DMAR;
+        stream->CR &= ~DMA_SxCR_EN;
+        NVIC_DisableIRQ(_route->dma_irq);
+        _dma_instance = NULL;
+        return;
+    }
+#endif
+    attach(Callback<void()>(), RxIrq);
+}
+
+int SerialRxRing::start(Callback<void()> rx_event)
+{
+    _rx_event = rx_event;
+
+#if SERIAL_RX_RING_DMA
+    if (_dma_instance == NULL && start_dma() == 0) {
+        _dma = true;
+        return 0;
+    }
+#endif
+
+    attach(callback(this, &SerialRxRing::rx_irq), RxIrq);
+    return 0;
+}
+
+uint32_t SerialRxRing::write_position()
+{
+#if SERIAL_RX_RING_DMA
+    if (_dma) {
+        DMA_Stream_TypeDef *stream = reinterpret_cast<DMA_Stream_TypeDef *>(_route->stream);
+
+        core_util_critical_section_enter();
+        uint32_t remaining = stream->NDTR;
+        uint32_t laps = _laps;
+        if ((dma_flags(_route) & FLAG_TC) && remaining > sizeof (_ring) / 2) {
+            /* Wrapped, but the interrupt did not run yet */
+            laps++;
+        }
+        core_util_critical_section_exit();
+
+        return laps * sizeof (_ring) + (sizeof (_ring) - remaining);
+    }
+#endif
+    return _written;
+}
+
+void SerialRxRing::rx_irq()
+{
+    while (readable()) {
+        _ring[_written % sizeof (_ring)] = getc();
+
+        /* Only the first byte after the consumer caught up needs waking it */
+        bool was_empty = _written == _read;
+        _written++;
+        if (was_empty && _rx_event) {
+            _rx_event();
+        }
+    }
+}
+
+#if SERIAL_RX_RING_DMA
+int SerialRxRing::start_dma()
+{
+    uint32_t uart = pinmap_peripheral(_rx_pin, PinMap_UART_RX);
+
+    _route = NULL;
+    for (size_t i = 0; i < sizeof (DMA_ROUTES) / sizeof (DMA_ROUTES[0]); i++) {
+        if (DMA_ROUTES[i].uart == uart) {
+            _route = &DMA_ROUTES[i];
+        }
+    }
+    if (_route == NULL) {
+        return -1;
+    }
+
+    USART_TypeDef *usart = reinterpret_cast<USART_TypeDef *>(_route->uart);
+    DMA_Stream_TypeDef *stream = reinterpret_cast<DMA_Stream_TypeDef *>(_route->stream);
+
+    if (_route->dma == DMA1_BASE) {
+        __HAL_RCC_DMA1_CLK_ENABLE();
+    } else {
+        __HAL_RCC_DMA2_CLK_ENABLE();
+    }
+
+    stream->CR &= ~DMA_SxCR_EN;
+    while (stream->CR & DMA_SxCR_EN) {
+    }
+    dma_clear(_route, FLAG_ALL);
+
+    /* Peripheral to memory, bytes, circular, interrupts at half and end */
+    stream->PAR = reinterpret_cast<uint32_t>(&usart->DR);
+    stream->M0AR = reinterpret_cast<uint32_t>(_ring);
+    stream->NDTR = sizeof (_ring);
+    stream->FCR = 0;
+    stream->CR = (_route->channel << 25) | DMA_SxCR_MINC | DMA_SxCR_CIRC |
+                 DMA_SxCR_HTIE | DMA_SxCR_TCIE;
+
+    _dma_instance = this;
+    NVIC_SetVector(_route->dma_irq, reinterpret_cast<uint32_t>(&SerialRxRing::dma_irq));
+    NVIC_EnableIRQ(_route->dma_irq);
+    stream->CR |= DMA_SxCR_EN;
+    usart->CR3 |= USART_CR3_DMAR;
+
+    /* The idle line interrupt ends every burst */
+    NVIC_SetVector(_route->uart_irq, reinterpret_cast<uint32_t>(&SerialRxRing::uart_irq));
+    usart->CR1 |= USART_CR1_IDLEIE;
+    NVIC_EnableIRQ(_route->uart_irq);
+
+    return 0;
+}
+
+void SerialRxRing::uart_irq()
+{
+    SerialRxRing *self = _dma_instance;
+    USART_TypeDef *usart = reinterpret_cast<USART_TypeDef *>(self->_route->uart);
+
+    if (usart->SR & (USART_SR_IDLE | USART_SR_ORE)) {
+        /* Reading SR then DR clears the flags, the DMA already took the data */
+        (void) usart->DR;
+        if (self->_rx_event) {
+            self->_rx_event();
+        }
+    }
+}
+
+void SerialRxRing::dma_irq()
+{
+    SerialRxRing *self = _dma_instance;
+    uint32_t flags = dma_flags(self->_route);
+
+    dma_clear(self->_route, flags);
+    if (flags & FLAG_TC) {
+        self->_laps++;
+    }
+    if ((flags & (FLAG_HT | FLAG_TC)) && self->_rx_event) {
+        self->_rx_event();
+    }
+}
+#endif /* SERIAL_RX_RING_DMA */
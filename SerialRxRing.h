@@ -0,0 +1,143 @@
+/*
+ *  UART receiver writing into a ring, by DMA where available
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file SerialRxRing.h
+ *  \brief Serial reception that does not depend on the CPU keeping up
+ *  On STM32F4 targets a DMA stream in circular mode copies every received
+ *  byte into the ring, so no byte is lost while interrupts are held off,
+ *  for instance during the big number arithmetic of a TLS handshake. The
+ *  consumer is woken on idle line, which ends every burst, and at the half
+ *  and the end of the ring, so it never falls a whole ring behind under
+ *  continuous traffic. Elsewhere, or with xbee-rx-dma disabled, a receive
+ *  interrupt writes the ring one byte at a time.
+ *
+ *  Positions count the bytes received since start() and wrap at 2^32, the
+ *  byte at position p is buffer()[p % size()].
+ */
+
+#ifndef __SERIAL_RX_RING_H_
+#define __SERIAL_RX_RING_H_
+
+#include "mbed.h"
+
+/** Size in bytes of the ring the XBee UART receives into, a power of two */
+#ifndef MBED_CONF_APP_XBEE_RX_RING_SIZE
+#define MBED_CONF_APP_XBEE_RX_RING_SIZE 1024
+#endif
+
+/** Receive by DMA on the targets that support it */
+#ifndef MBED_CONF_APP_XBEE_RX_DMA
+#define MBED_CONF_APP_XBEE_RX_DMA 1
+#endif
+
+#if MBED_CONF_APP_XBEE_RX_DMA && defined(TARGET_STM32F4)
+#define SERIAL_RX_RING_DMA 1
+#else
+#define SERIAL_RX_RING_DMA 0
+#endif
+
+/**
+ * \brief SerialRxRing receives into a ring, sending works as on RawSerial.
+ */
+class SerialRxRing : public RawSerial {
+public:
+    /**
+     * SerialRxRing Constructor
+     *
+     * @param[in] tx The transmit pin
+     * @param[in] rx The receive pin
+     * @param[in] baud The baud rate
+     */
+    SerialRxRing(PinName tx, PinName rx, int baud);
+    /**
+     * SerialRxRing Destructor
+     */
+    ~SerialRxRing();
+
+    /**
+     * Start receiving. Only one SerialRxRing can receive by DMA, others and
+     * pins without a DMA route fall back to the receive interrupt.
+     *
+     * @param[in] rx_event Called from interrupt context when data arrived
+     * @return 0 on success
+     */
+    int start(Callback<void()> rx_event);
+
+    /**
+     * The position past the last byte received
+     */
+    uint32_t write_position();
+
+    /**
+     * Tell the receiver the bytes before a position were consumed
+     */
+    void consume(uint32_t position) {
+        _read = position;
+    }
+
+    /**
+     * The ring
+     */
+    const uint8_t *buffer() const {
+        return _ring;
+    }
+
+    /**
+     * The size of the ring
+     */
+    uint32_t size() const {
+        return sizeof (_ring);
+    }
+
+    /**
+     * Whether bytes arrive by DMA
+     */
+    bool is_dma() const {
+        return _dma;
+    }
+
+protected:
+    /**
+     * Receive interrupt of the byte at a time fallback
+     */
+    void rx_irq();
+
+#if SERIAL_RX_RING_DMA
+    /**
+     * Set up the DMA stream and the idle line interrupt
+     */
+    int start_dma();
+
+    static void uart_irq();
+    static void dma_irq();
+
+    static SerialRxRing *_dma_instance;
+    const struct DmaRoute *_route;
+#endif
+
+protected:
+    PinName _rx_pin;
+    uint8_t _ring[MBED_CONF_APP_XBEE_RX_RING_SIZE];
+    volatile uint32_t _written;     /**< Bytes written, fallback only */
+    volatile uint32_t _laps;        /**< Times the DMA wrapped the ring */
+    volatile uint32_t _read;        /**< Consumer position */
+    bool _dma;
+    Callback<void()> _rx_event;
+};
+
+#endif /* __SERIAL_RX_RING_H_ */
@@ -0,0 +1,505 @@
+/*
+ *  A lightweight TLS client connection over any transport
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TLSConnection.h
+ *  \brief One TLS session over one transport, see Transport.h
+ *  The heavy TLS state (DRBG, CA chain, configuration) lives in a shared
+ *  TLSContext; a connection only owns its mbedtls_ssl_context, and uses a
+ *  transport it is given: a TcpTransport, or an XBeeTransport to a node
+ *  that bridges to the server.
+ */
+
+#ifndef __TLS_CONNECTION_H_
+#define __TLS_CONNECTION_H_
+
+#include "mbed.h"
+#include "mbedtls/version.h"
+#include "mbedtls/ssl_internal.h"
+#include "TLSContext.h"
+#include "AsyncConnector.h"
+#include "Transport.h"
+
+/* begin_record() and end_record() use mbed TLS internals, whose signatures
+   are only known for the 2.x releases */
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#error "TLSConnection writes records in place through mbed TLS 2.x internals"
+#endif
+
+/** Bytes of application data decrypted ahead of recv(), 0 to read directly */
+#ifndef MBED_CONF_APP_TLS_READ_AHEAD
+#define MBED_CONF_APP_TLS_READ_AHEAD 512
+#endif
+
+/**
+ * \brief TransportBio gives mbed TLS the send and receive callbacks of a
+ * transport, see Transport.h, whose calls are then inlined.
+ */
+template <typename Transport>
+struct TransportBio {
+    static int send(void *ctx, const unsigned char *buf, size_t len) {
+        int size = static_cast<Transport *>(ctx)->send(buf, len);
+        if (Transport::would_block(size)) {
+            return MBEDTLS_ERR_SSL_WANT_WRITE;
+        } else if (size < 0) {
+            mbedtls_printf("Socket send error %d\n", size);
+            return -1;
+        }
+        return size;
+    }
+
+    static int recv(void *ctx, unsigned char *buf, size_t len) {
+        int recv = static_cast<Transport *>(ctx)->recv(buf, len);
+        if (Transport::would_block(recv)) {
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        } else if (recv < 0) {
+            mbedtls_printf("Socket recv error %d\n", recv);
+            return -1;
+        }
+        return recv;
+    }
+};
+
+/**
+ * \brief TLSConnection is a client TLS session on top of a transport.
+ *
+ * The mbedtls_ssl_context record buffers are only allocated while the
+ * connection is open, so idle connection objects are cheap to keep around.
+ * The session of the last handshake is kept and offered again on the next
+ * connect to the same server, so reconnects usually skip the key exchange.
+ * A connection must only be used from one thread at a time.
+ *
+ * The MQTT client reads a packet a byte or two at a time, the fixed header
+ * and the remaining length, and each of those reads would go through
+ * mbedtls_ssl_read(), and through the transport when the record is consumed.
+ * recv() instead decrypts up to MBED_CONF_APP_TLS_READ_AHEAD bytes at once
+ * into a read-ahead buffer, allocated with the record buffers, and serves
+ * the small reads from there. Reads as large as the buffer bypass it.
+ *
+ * A connection is itself a transport, see Transport.h, which the MQTT
+ * clients reach through a TLSNetwork.
+ */
+template <typename Transport>
+class TLSConnection {
+public:
+    /**
+     * TLSConnection Constructor
+     *
+     * @param[in] context The shared TLS context, must outlive the connection
+     * @param[in] transport The transport the records go through, must
+     *            outlive the connection
+     */
+    TLSConnection(TLSContext &context, Transport &transport) :
+            _context(context), _transport(transport),
+            _connected(false), _has_session(false), _resumed(false),
+            _rx_buf(NULL), _rx_pos(0), _rx_len(0) {
+        _session_host[0] = '\0';
+        mbedtls_ssl_init(&_ssl);
+        mbedtls_ssl_session_init(&_session);
+    }
+
+    /**
+     * TLSConnection Destructor
+     */
+    ~TLSConnection() {
+        close();
+        mbedtls_ssl_free(&_ssl);
+        mbedtls_ssl_session_free(&_session);
+    }
+
+    /**
+     * Connect the transport to the server and run the TLS handshake.
+     *
+     * @param[in] hostname The server name, also used for SNI and verification
+     * @param[in] port The server port
+     * @return 0 on success, or a transport or mbed TLS error code on failure
+     */
+    int connect(const char *hostname, uint16_t port) {
+        close();
+        int ret = _transport.connect(hostname, port);
+        if (ret != 0) {
+            mbedtls_printf("Failed to connect\n");
+            mbedtls_printf("MBED: Socket Error: %d\n", ret);
+            return ret;
+        }
+        return handshake(hostname);
+    }
+
+    /**
+     * Connect to whichever of several servers answers first and run the
+     * TLS handshake with it, see AsyncConnector. Only for a transport that
+     * races servers, as TcpTransport does.
+     *
+     * @param[in] endpoints The servers, in order of preference
+     * @param[in] count The number of servers
+     * @param[in] timeout_ms Time before giving up on all servers
+     * @return 0 on success, or an nsapi or mbed TLS error code on failure
+     */
+    int connect(const ConnectEndpoint *endpoints, size_t count,
+                uint32_t timeout_ms = MBED_CONF_APP_CONNECT_TIMEOUT) {
+        int index = -1;
+
+        close();
+        int ret = _transport.connect(endpoints, count, timeout_ms, &index);
+        if (ret != 0) {
+            mbedtls_printf("Failed to connect\n");
+            mbedtls_printf("MBED: Socket Error: %d\n", ret);
+            return ret;
+        }
+        return handshake(endpoints[index].hostname);
+    }
+
+    /**
+     * Run the TLS handshake over the transport once it is connected, e.g.
+     * after TcpTransport::attach() of a socket handed over by
+     * AsyncConnector::start().
+     *
+     * @param[in] hostname The server name, used for SNI and verification
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int handshake(const char *hostname) {
+        int ret;
+
+        release();
+
+        if ((ret = mbedtls_ssl_setup(&_ssl, _context.config())) != 0) {
+            print_mbedtls_error("mbedtls_ssl_setup", ret);
+            close();
+            return ret;
+        }
+
+        mbedtls_ssl_set_hostname(&_ssl, hostname);
+
+        /* Offer the last session with this server for an abbreviated handshake */
+        bool offered = _has_session && strcmp(_session_host, hostname) == 0;
+        if (offered && (ret = mbedtls_ssl_set_session(&_ssl, &_session)) != 0) {
+            print_mbedtls_error("mbedtls_ssl_set_session", ret);
+            offered = false;
+        }
+
+        mbedtls_ssl_set_bio(&_ssl, static_cast<void *>(&_transport),
+                            TransportBio<Transport>::send, TransportBio<Transport>::recv, NULL);
+
+        mbedtls_printf("Starting the TLS handshake...\n");
+        do {
+            ret = mbedtls_ssl_handshake(&_ssl);
+        } while (ret != 0 && (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+                ret == MBEDTLS_ERR_SSL_WANT_WRITE));
+        if (ret < 0) {
+            print_mbedtls_error("mbedtls_ssl_handshake", ret);
+            /* Do not offer a session the server may have choked on again */
+            forget_session();
+            close();
+            return ret;
+        }
+
+        /* The server echoes our session id when it accepted the resumption */
+        _resumed = offered && _ssl.session != NULL && _ssl.session->id_len != 0 &&
+                   _ssl.session->id_len == _session.id_len &&
+                   memcmp(_ssl.session->id, _session.id, _session.id_len) == 0;
+        save_session(hostname);
+
+        if (MBED_CONF_APP_TLS_READ_AHEAD > 0) {
+            _rx_buf = new unsigned char[MBED_CONF_APP_TLS_READ_AHEAD];
+        }
+
+        _connected = true;
+        return 0;
+    }
+
+    /**
+     * Write the whole buffer to the TLS session.
+     *
+     * @return len on success, or an mbed TLS error code on failure
+     */
+    int send(const unsigned char *buf, size_t len) {
+        int ret;
+        size_t offset = 0;
+
+        do {
+            ret = mbedtls_ssl_write(&_ssl, buf + offset, len - offset);
+            if (ret > 0)
+              offset += ret;
+            else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+              Thread::wait(1);
+        } while (offset < len && (ret > 0 || ret == MBEDTLS_ERR_SSL_WANT_READ ||
+                ret == MBEDTLS_ERR_SSL_WANT_WRITE));
+        if (ret < 0) {
+            print_mbedtls_error("mbedtls_ssl_write", ret);
+            _connected = false;
+            return ret;
+        }
+
+        return static_cast<int>(len);
+    }
+
+    /**
+     * Start an application data record to be written in place: whatever
+     * goes into the returned buffer is encrypted by end_record() without
+     * being copied first, as mbedtls_ssl_write() would.
+     *
+     * @param[out] room The bytes the record can hold
+     * @return The record's plaintext, or NULL if the connection failed
+     */
+    unsigned char *begin_record(size_t *room) {
+        /* The output buffer is only free once the previous record is sent */
+        if (!_connected || flush_record() != 0) {
+            return NULL;
+        }
+
+#if MBEDTLS_VERSION_NUMBER >= 0x02100000
+        /* The output buffer, the negotiated fragment length and the MTU */
+        int max_len = mbedtls_ssl_get_max_out_record_payload(&_ssl);
+        if (max_len <= 0) {
+            return NULL;
+        }
+        *room = max_len;
+#else
+#if defined(MBEDTLS_SSL_OUT_CONTENT_LEN)
+        size_t max_len = MBEDTLS_SSL_OUT_CONTENT_LEN;
+#else
+        size_t max_len = MBEDTLS_SSL_MAX_CONTENT_LEN;
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        if (mbedtls_ssl_get_max_frag_len(&_ssl) < max_len) {
+            max_len = mbedtls_ssl_get_max_frag_len(&_ssl);
+        }
+#endif
+        *room = max_len;
+#endif
+        return _ssl.out_msg;
+    }
+
+    /**
+     * Encrypt and send the record started by begin_record()
+     *
+     * @param[in] len The bytes written into the record, at most room
+     * @return len on success, or an mbed TLS error code on failure
+     */
+    int end_record(size_t len) {
+        /* What mbedtls_ssl_write() does once it copied the data into out_msg */
+        _ssl.out_msgtype = MBEDTLS_SSL_MSG_APPLICATION_DATA;
+        _ssl.out_msglen = len;
+#if MBEDTLS_VERSION_NUMBER >= 0x020D0000
+        /* From 2.13 on it may hold a record back to group it, unless forced */
+        int ret = mbedtls_ssl_write_record(&_ssl, 1);
+#else
+        int ret = mbedtls_ssl_write_record(&_ssl);
+#endif
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            /* Encrypted already, only the transport is behind */
+            ret = flush_record();
+        }
+        if (ret < 0) {
+            print_mbedtls_error("mbedtls_ssl_write_record", ret);
+            _connected = false;
+            return ret;
+        }
+
+        return static_cast<int>(len);
+    }
+
+    /**
+     * Read whatever application data is available, at most len bytes,
+     * from the read-ahead buffer first.
+     *
+     * @return The number of bytes read, 0 when the peer closed the session,
+     *         MBEDTLS_ERR_SSL_WANT_READ if nothing is available yet, or an
+     *         mbed TLS error code on failure
+     */
+    int recv(unsigned char *buf, size_t len) {
+        if (_rx_pos == _rx_len && (_rx_buf == NULL || len >= MBED_CONF_APP_TLS_READ_AHEAD)) {
+            return read_session(buf, len);
+        }
+
+        if (_rx_pos == _rx_len) {
+            /* A whole record at once, the next reads come from memory */
+            int ret = read_session(_rx_buf, MBED_CONF_APP_TLS_READ_AHEAD);
+            if (ret <= 0) {
+                return ret;
+            }
+            _rx_pos = 0;
+            _rx_len = ret;
+        }
+
+        size_t n = _rx_len - _rx_pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf, _rx_buf + _rx_pos, n);
+        _rx_pos += n;
+        return static_cast<int>(n);
+    }
+
+    /**
+     * The bytes of application data already decrypted, that recv() returns
+     * without reading from the session
+     */
+    size_t buffered() const {
+        return _rx_len - _rx_pos;
+    }
+
+    /**
+     * Notify the peer, close the transport and release the record buffers.
+     */
+    void close() {
+        if (_connected) {
+            mbedtls_ssl_close_notify(&_ssl);
+            _connected = false;
+        }
+
+        _transport.close();
+        release();
+    }
+
+    /**
+     * Whether the handshake completed and the session was not closed, or
+     * failed on a read or write, since
+     */
+    bool is_connected() const {
+        return _connected;
+    }
+
+    /**
+     * Whether a send() or recv() return value means to try again later
+     */
+    static bool would_block(int ret) {
+        return ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+
+    /**
+     * Whether the last handshake resumed the previous session instead of
+     * running a full key exchange
+     */
+    bool is_resumed() const {
+        return _resumed;
+    }
+
+    /**
+     * Drop the saved session, the next handshake will be a full one
+     */
+    void forget_session() {
+        mbedtls_ssl_session_free(&_session);
+        mbedtls_ssl_session_init(&_session);
+        _session_host[0] = '\0';
+        _has_session = false;
+    }
+
+    /**
+     * The shared TLS context this connection uses
+     */
+    TLSContext &context() {
+        return _context;
+    }
+
+    /**
+     * The transport the records go through, e.g. to pace a TcpTransport
+     */
+    Transport &transport() {
+        return _transport;
+    }
+
+    /**
+     * The underlying session, for inspecting certificates and the like
+     */
+    mbedtls_ssl_context *ssl() {
+        return &_ssl;
+    }
+
+protected:
+    /**
+     * Keep the session of the completed handshake for resuming it later
+     */
+    void save_session(const char *hostname) {
+        forget_session();
+        if (strlen(hostname) >= sizeof (_session_host)) {
+            return;
+        }
+        if (mbedtls_ssl_get_session(&_ssl, &_session) == 0) {
+            strcpy(_session_host, hostname);
+            _has_session = true;
+        }
+    }
+
+    /**
+     * Send whatever is left of the previous record
+     *
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int flush_record() {
+        while (_ssl.out_left > 0) {
+            int ret = mbedtls_ssl_flush_output(&_ssl);
+            if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                /* The transport is full, let it drain */
+                Thread::wait(1);
+            } else if (ret != 0) {
+                print_mbedtls_error("mbedtls_ssl_flush_output", ret);
+                _connected = false;
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Read from the session, mapping a close notification to 0
+     */
+    int read_session(unsigned char *buf, size_t len) {
+        int ret = mbedtls_ssl_read(&_ssl, buf, len);
+
+        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            ret = 0;
+        }
+        if (ret == 0 || (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ &&
+                         ret != MBEDTLS_ERR_SSL_WANT_WRITE)) {
+            /* The session is unusable from here on */
+            _connected = false;
+        }
+        return ret;
+    }
+
+    /**
+     * Drop the session state and the record buffers until the next
+     * handshake, leaving the transport as it is
+     */
+    void release() {
+        _connected = false;
+        mbedtls_ssl_free(&_ssl);
+        mbedtls_ssl_init(&_ssl);
+        delete[] _rx_buf;
+        _rx_buf = NULL;
+        _rx_pos = 0;
+        _rx_len = 0;
+    }
+
+protected:
+    TLSContext &_context;           /**< The shared TLS configuration */
+    Transport &_transport;          /**< Carries the records */
+    bool _connected;                /**< Set once the handshake completed */
+    bool _has_session;              /**< Set when _session can be offered */
+    bool _resumed;                  /**< The last handshake was abbreviated */
+    char _session_host[64];         /**< The server _session belongs to */
+
+    unsigned char *_rx_buf;         /**< Read-ahead buffer, only set while open */
+    size_t _rx_pos;                 /**< Next byte of _rx_buf to return */
+    size_t _rx_len;                 /**< Bytes held in _rx_buf */
+
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_session _session;   /**< Saved for session resumption */
+};
+
+#endif /* __TLS_CONNECTION_H_ */
@@ -0,0 +1,136 @@
+/*
+ *  Shared TLS state for the client connections
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "TLSContext.h"
+
+#include "mbedtls/error.h"
+
+#if DEBUG_LEVEL > 0
+#include "mbedtls/debug.h"
+#endif
+
+void print_mbedtls_error(const char *name, int err) {
+    char buf[128];
+    mbedtls_strerror(err, buf, sizeof (buf));
+    mbedtls_printf("%s() failed: -0x%04x (%d): %s\n", name, -err, err, buf);
+}
+
+TLSContext::TLSContext(DrbgService &drbg) : _ready(false), _drbg(drbg)
+{
+    mbedtls_x509_crt_init(&_cacert);
+    mbedtls_ssl_config_init(&_ssl_conf);
+}
+
+TLSContext::~TLSContext()
+{
+    mbedtls_x509_crt_free(&_cacert);
+    mbedtls_ssl_config_free(&_ssl_conf);
+}
+
+int TLSContext::setup(const char *ca_pem, size_t ca_pem_len)
+{
+    int ret = 0;
+
+    _mutex.lock();
+    if (_ready) {
+        _mutex.unlock();
+        return 0;
+    }
+
+    if ((ret = mbedtls_x509_crt_parse(&_cacert, (const unsigned char *) ca_pem,
+                       ca_pem_len)) != 0) {
+        print_mbedtls_error("mbedtls_x509_crt_parse", ret);
+        goto exit;
+    }
+
+    if ((ret = mbedtls_ssl_config_defaults(&_ssl_conf,
+                    MBEDTLS_SSL_IS_CLIENT,
+                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                    MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+        print_mbedtls_error("mbedtls_ssl_config_defaults", ret);
+        goto exit;
+    }
+
+    mbedtls_ssl_conf_ca_chain(&_ssl_conf, &_cacert, NULL);
+    mbedtls_ssl_conf_rng(&_ssl_conf, DrbgService::rng, &_drbg);
+
+    /* It is possible to disable authentication by passing
+     * MBEDTLS_SSL_VERIFY_NONE in the call to mbedtls_ssl_conf_authmode()
+     */
+    mbedtls_ssl_conf_authmode(&_ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+
+#if DEBUG_LEVEL > 0
+    mbedtls_ssl_conf_verify(&_ssl_conf, my_verify, NULL);
+    mbedtls_ssl_conf_dbg(&_ssl_conf, my_debug, NULL);
+    mbedtls_debug_set_threshold(DEBUG_LEVEL);
+#endif
+
+    _ready = true;
+
+exit:
+    _mutex.unlock();
+    return ret;
+}
+
+#if DEBUG_LEVEL > 0
+/**
+ * Debug callback for Mbed TLS
+ * Just prints on the USB serial port
+ */
+void TLSContext::my_debug(void *ctx, int level, const char *file, int line,
+                          const char *str)
+{
+    const char *p, *basename;
+    (void) ctx;
+
+    /* Extract basename from file */
+    for(p = basename = file; *p != '\0'; p++) {
+        if(*p == '/' || *p == '\\') {
+            basename = p + 1;
+        }
+    }
+
+    mbedtls_printf("%s:%04d: |%d| %s", basename, line, level, str);
+}
+
+/**
+ * Certificate verification callback for Mbed TLS
+ * Here we only use it to display information on each cert in the chain
+ */
+int TLSContext::my_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *flags)
+{
+    const uint32_t buf_size = 1024;
+    char *buf = new char[buf_size];
+    (void) data;
+
+    mbedtls_printf("\nVerifying certificate at depth %d:\n", depth);
+    mbedtls_x509_crt_info(buf, buf_size - 1, "  ", crt);
+    mbedtls_printf("%s", buf);
+
+    if (*flags == 0)
+        mbedtls_printf("No verification issue for this certificate\n");
+    else
+    {
+        mbedtls_x509_crt_verify_info(buf, buf_size, "  ! ", *flags);
+        mbedtls_printf("%s\n", buf);
+    }
+
+    delete[] buf;
+    return 0;
+}
+#endif
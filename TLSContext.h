@@ -0,0 +1,110 @@
+/*
+ *  Shared TLS state for the client connections
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TLSContext.h
+ *  \brief The TLS state shared by every connection of the application
+ *  A single parsed CA chain and mbedtls_ssl_config are kept here, drawing
+ *  randomness from the shared DrbgService. Each TLSConnection only owns its
+ *  mbedtls_ssl_context and socket, so running several connections costs
+ *  little extra RAM.
+ */
+
+#ifndef __TLS_CONTEXT_H_
+#define __TLS_CONTEXT_H_
+
+/* Change to a number between 1 and 4 to debug the TLS connection */
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL 0
+#endif
+
+#include "mbed.h"
+
+#include "mbedtls/platform.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+
+#include "DrbgService.h"
+
+/**
+ * Helper for pretty-printing mbed TLS error codes
+ */
+void print_mbedtls_error(const char *name, int err);
+
+/**
+ * \brief TLSContext holds the TLS configuration shared by all connections.
+ *
+ * The configuration is built once by setup() and is read-only afterwards.
+ * The only mutable state reached through it is the DRBG, which serializes
+ * its own access so handshakes can run from several threads at once.
+ */
+class TLSContext {
+public:
+    /**
+     * TLSContext Constructor
+     *
+     * @param[in] drbg The seeded random generator, must outlive the context
+     */
+    TLSContext(DrbgService &drbg);
+    /**
+     * TLSContext Destructor
+     */
+    ~TLSContext();
+
+    /**
+     * Parse the trusted CA chain and build the client configuration.
+     * Calling it again after a success is a no-op.
+     *
+     * @param[in] ca_pem The PEM encoded trusted root certificates
+     * @param[in] ca_pem_len Length of ca_pem, including the terminating NUL
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int setup(const char *ca_pem, size_t ca_pem_len);
+
+    /**
+     * The shared client configuration, valid once setup() succeeded
+     */
+    const mbedtls_ssl_config *config() const {
+        return &_ssl_conf;
+    }
+
+    /**
+     * Fill a buffer with random bytes from the shared DRBG
+     *
+     * @return 0 on success, or an mbed TLS error code on failure
+     */
+    int random(unsigned char *output, size_t len) {
+        return _drbg.random(output, len);
+    }
+
+protected:
+#if DEBUG_LEVEL > 0
+    static void my_debug(void *ctx, int level, const char *file, int line,
+                         const char *str);
+    static int my_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *flags);
+#endif
+
+protected:
+    Mutex _mutex;                   /**< Guards setup() */
+    bool _ready;                    /**< Set once setup() succeeded */
+    DrbgService &_drbg;             /**< The shared random generator */
+
+    mbedtls_x509_crt _cacert;
+    mbedtls_ssl_config _ssl_conf;
+};
+
+#endif /* __TLS_CONTEXT_H_ */
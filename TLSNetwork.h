@@ -0,0 +1,37 @@
+/*
+ *  MQTT network adapter over a TLS connection
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TLSNetwork.h
+ *  \brief The Network class MQTT::Client expects, on top of TLS over TCP
+ */
+
+#ifndef __TLS_NETWORK_H_
+#define __TLS_NETWORK_H_
+
+#include "mbed.h"
+#include "TLSConnection.h"
+#include "TcpTransport.h"
+#include "TransportNetwork.h"
+
+/**
+ * The blocking read/write with timeout that the MQTT clients use, over a
+ * non-blocking TLSConnection on a TcpTransport
+ */
+typedef TransportNetwork<TLSConnection<TcpTransport> > TLSNetwork;
+
+#endif /* __TLS_NETWORK_H_ */
@@ -0,0 +1,159 @@
+/*
+ *  Transport over a TCP socket
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TcpTransport.h
+ *  \brief A TCPSocket as a transport, see Transport.h
+ */
+
+#ifndef __TCP_TRANSPORT_H_
+#define __TCP_TRANSPORT_H_
+
+#include "mbed.h"
+#include "Transport.h"
+#include "AsyncConnector.h"
+#include "LinkPacer.h"
+
+/**
+ * \brief TcpTransport reads and writes a non-blocking TCPSocket.
+ *
+ * connect() opens the socket through an AsyncConnector, or attach() takes
+ * one connected elsewhere. With a LinkPacer set, every write waits for its
+ * tokens and is timed.
+ */
+class TcpTransport {
+public:
+    /**
+     * TcpTransport Constructor
+     *
+     * @param[in] net_iface The network interface to open sockets on, NULL
+     *            if only attach() is used
+     * @param[in] dns An optional cache to resolve the server names through
+     */
+    TcpTransport(NetworkInterface *net_iface = NULL, DnsCache *dns = NULL) :
+            _net_iface(net_iface), _dns(dns), _socket(NULL), _pacer(NULL) {
+    }
+
+    ~TcpTransport() {
+        close();
+    }
+
+    /**
+     * Connect to a server
+     *
+     * @return 0 on success, or an nsapi error code on failure
+     */
+    int connect(const char *hostname, uint16_t port) {
+        ConnectEndpoint endpoint = { hostname, port };
+        return connect(&endpoint, 1, MBED_CONF_APP_CONNECT_TIMEOUT, NULL);
+    }
+
+    /**
+     * Connect to whichever of several servers answers first, see
+     * AsyncConnector
+     *
+     * @param[in] endpoints The servers, in order of preference
+     * @param[in] count The number of servers
+     * @param[in] timeout_ms Time before giving up on all servers
+     * @param[out] index Receives the index of the server connected to, may be NULL
+     * @return 0 on success, or an nsapi error code on failure
+     */
+    int connect(const ConnectEndpoint *endpoints, size_t count, uint32_t timeout_ms,
+                int *index) {
+        AsyncConnector connector(_net_iface, _dns);
+        TCPSocket *socket = NULL;
+        int winner = -1;
+
+        close();
+        int ret = connector.connect(endpoints, count, &socket, &winner, timeout_ms);
+        if (ret != NSAPI_ERROR_OK) {
+            return ret;
+        }
+        attach(socket);
+        if (index != NULL) {
+            *index = winner;
+        }
+        return 0;
+    }
+
+    /**
+     * Take a connected socket over, closing the one before
+     *
+     * @param[in] socket The socket, owned and deleted by the transport
+     */
+    void attach(TCPSocket *socket) {
+        close();
+        _socket = socket;
+        _socket->set_blocking(false);
+    }
+
+    /**
+     * Pace the writes, and measure the link, with a pacer
+     *
+     * @param[in] pacer The pacer, NULL for none; must outlive the transport
+     */
+    void set_pacer(LinkPacer *pacer) {
+        _pacer = pacer;
+    }
+
+    int send(const unsigned char *buf, size_t len) {
+        if (_socket == NULL) {
+            return NSAPI_ERROR_NO_SOCKET;
+        }
+        if (_pacer == NULL) {
+            return _socket->send(buf, len);
+        }
+        uint32_t start = _pacer->acquire(len);
+        int size = _socket->send(buf, len);
+        _pacer->written(len, size, start);
+        return size;
+    }
+
+    int recv(unsigned char *buf, size_t len) {
+        if (_socket == NULL) {
+            return NSAPI_ERROR_NO_SOCKET;
+        }
+        return _socket->recv(buf, len);
+    }
+
+    static bool would_block(int ret) {
+        return ret == NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    bool is_connected() const {
+        return _socket != NULL;
+    }
+
+    /**
+     * Close and delete the socket
+     */
+    void close() {
+        if (_socket != NULL) {
+            _socket->close();
+            delete _socket;
+            _socket = NULL;
+        }
+    }
+
+protected:
+    NetworkInterface *_net_iface;   /**< The interface sockets are opened on */
+    DnsCache *_dns;                 /**< Resolves the server names, may be NULL */
+    TCPSocket *_socket;             /**< The socket, only set while open */
+    LinkPacer *_pacer;              /**< Paces the writes, may be NULL */
+};
+
+#endif /* __TCP_TRANSPORT_H_ */
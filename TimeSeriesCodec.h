@@ -0,0 +1,332 @@
+/*
+ *  Delta of delta and XOR compression of sensor readings
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TimeSeriesCodec.h
+ *  \brief A series of timestamped 32 bit readings in a few bits each
+ *  The encoding of Facebook's Gorilla, with millisecond timestamps and 32
+ *  bit values. A node reporting every second with a slowly changing value
+ *  costs about 2 bytes per reading, where a CBOR batch takes 9 or 10.
+ *
+ *  The header, big endian:
+ *
+ *    47          'G', tells a series from a CBOR batch
+ *    nn nn       number of readings
+ *    tt tt tt tt time the series started, in milliseconds
+ *
+ *  followed by the readings as a bit stream, most significant bit first,
+ *  the last byte padded with 0 bits. The timestamp of a reading is given
+ *  by the change of its delta to the one before, the first delta being
+ *  from the start of the series and the delta before it 0:
+ *
+ *    0                         the same delta
+ *    10   <7 bit dod + 63>     -63 to 64 ms
+ *    110  <9 bit dod + 255>    -255 to 256 ms
+ *    1110 <12 bit dod + 2047>  -2047 to 2048 ms
+ *    1111 <32 bit dod>         anything else
+ *
+ *  The first value is given as its 32 bits, the others by their XOR with
+ *  the value before:
+ *
+ *    0                         the same value
+ *    10 <bits>                 the XOR fits the window of the last one
+ *                              written with 11, those bits of it follow
+ *    11 <5 bit leading zeros> <5 bit length - 1> <length bits>
+ *
+ *  Values are opaque bits, typically IEEE 754 floats.
+ *
+ *  Only the C library is used, so the decoder builds on a host as well.
+ */
+
+#ifndef __TIME_SERIES_CODEC_H_
+#define __TIME_SERIES_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * \brief TimeSeriesEncoder appends readings to a series in a buffer.
+ */
+class TimeSeriesEncoder {
+public:
+    static const uint8_t MAGIC = 0x47;
+    static const size_t HEADER_LEN = 7;
+    /** The most bits a reading takes: the longest delta of delta and value */
+    static const size_t MAX_READING_BITS = 4 + 32 + 2 + 5 + 5 + 32;
+
+    /**
+     * Start a series
+     *
+     * @param[in] buf The buffer the series is written to
+     * @param[in] size Its size, at least HEADER_LEN
+     * @param[in] start_ms The time the series starts
+     */
+    void begin(uint8_t *buf, size_t size, uint32_t start_ms) {
+        _buf = buf;
+        _size = size;
+        _bit_pos = HEADER_LEN * 8;
+        _count = 0;
+        _last_ms = start_ms;
+        _last_delta = 0;
+        _last_value = 0;
+        _leading = NO_WINDOW;
+        _trailing = 0;
+
+        buf[0] = MAGIC;
+        put_count();
+        buf[3] = start_ms >> 24;
+        buf[4] = start_ms >> 16;
+        buf[5] = start_ms >> 8;
+        buf[6] = start_ms;
+    }
+
+    /**
+     * Whether another reading surely fits
+     */
+    bool has_room() const {
+        return _count < 0xFFFF && _bit_pos + MAX_READING_BITS <= _size * 8;
+    }
+
+    /**
+     * Append a reading
+     *
+     * @param[in] time_ms Its time, at or after the previous one
+     * @param[in] value Its bits
+     * @return 0 on success, or -1 if it might not fit, nothing is written then
+     */
+    int append(uint32_t time_ms, uint32_t value) {
+        if (!has_room()) {
+            return -1;
+        }
+
+        int32_t delta = time_ms - _last_ms;
+        int32_t dod = delta - _last_delta;
+        if (dod == 0) {
+            put_bits(0, 1);
+        } else if (dod >= -63 && dod <= 64) {
+            put_bits(0x2, 2);
+            put_bits(dod + 63, 7);
+        } else if (dod >= -255 && dod <= 256) {
+            put_bits(0x6, 3);
+            put_bits(dod + 255, 9);
+        } else if (dod >= -2047 && dod <= 2048) {
+            put_bits(0xE, 4);
+            put_bits(dod + 2047, 12);
+        } else {
+            put_bits(0xF, 4);
+            put_bits(dod, 32);
+        }
+        _last_ms = time_ms;
+        _last_delta = delta;
+
+        if (_count == 0) {
+            put_bits(value, 32);
+        } else {
+            uint32_t x = value ^ _last_value;
+            if (x == 0) {
+                put_bits(0, 1);
+            } else {
+                uint8_t leading = leading_zeros(x);
+                uint8_t trailing = trailing_zeros(x);
+                if (_leading != NO_WINDOW && leading >= _leading && trailing >= _trailing) {
+                    put_bits(0x2, 2);
+                    put_bits(x >> _trailing, 32 - _leading - _trailing);
+                } else {
+                    uint8_t len = 32 - leading - trailing;
+                    put_bits(0x3, 2);
+                    put_bits(leading, 5);
+                    put_bits(len - 1, 5);
+                    put_bits(x >> trailing, len);
+                    _leading = leading;
+                    _trailing = trailing;
+                }
+            }
+        }
+        _last_value = value;
+
+        _count++;
+        put_count();
+        return 0;
+    }
+
+    /** Readings in the series */
+    uint16_t count() const {
+        return _count;
+    }
+
+    /** Bytes of the series so far */
+    size_t length() const {
+        return (_bit_pos + 7) / 8;
+    }
+
+protected:
+    static const uint8_t NO_WINDOW = 0xFF;
+
+    void put_count() {
+        _buf[1] = _count >> 8;
+        _buf[2] = _count;
+    }
+
+    void put_bits(uint32_t value, uint8_t count) {
+        while (count-- > 0) {
+            uint8_t mask = 0x80 >> (_bit_pos & 7);
+            if (mask == 0x80) {
+                _buf[_bit_pos / 8] = 0;
+            }
+            if ((value >> count) & 1) {
+                _buf[_bit_pos / 8] |= mask;
+            }
+            _bit_pos++;
+        }
+    }
+
+    static uint8_t leading_zeros(uint32_t x) {
+        uint8_t n = 0;
+        while (!(x & 0x80000000UL)) {
+            x <<= 1;
+            n++;
+        }
+        return n;
+    }
+
+    static uint8_t trailing_zeros(uint32_t x) {
+        uint8_t n = 0;
+        while (!(x & 1)) {
+            x >>= 1;
+            n++;
+        }
+        return n;
+    }
+
+protected:
+    uint8_t *_buf;
+    size_t _size;
+    size_t _bit_pos;            /**< Next bit to write, from the start of the buffer */
+    uint16_t _count;
+    uint32_t _last_ms;
+    int32_t _last_delta;
+    uint32_t _last_value;
+    uint8_t _leading;           /**< Window of the last value written with 11 */
+    uint8_t _trailing;
+};
+
+/**
+ * \brief TimeSeriesDecoder reads the readings back from a series.
+ */
+class TimeSeriesDecoder {
+public:
+    /**
+     * TimeSeriesDecoder Constructor
+     *
+     * @param[in] buf The series, kept by the caller while decoding
+     * @param[in] len Its length
+     */
+    TimeSeriesDecoder(const uint8_t *buf, size_t len) :
+            _buf(buf), _len(len), _bit_pos(TimeSeriesEncoder::HEADER_LEN * 8), _read(0),
+            _last_delta(0), _last_value(0), _leading(0), _trailing(0)
+    {
+        _valid = len >= TimeSeriesEncoder::HEADER_LEN && buf[0] == TimeSeriesEncoder::MAGIC;
+        _count = _valid ? (buf[1] << 8) | buf[2] : 0;
+        _last_ms = _valid ? ((uint32_t) buf[3] << 24) | ((uint32_t) buf[4] << 16) |
+                            ((uint32_t) buf[5] << 8) | buf[6] : 0;
+    }
+
+    /** Whether the buffer starts as a series does */
+    bool valid() const {
+        return _valid;
+    }
+
+    /** Readings in the series */
+    uint16_t count() const {
+        return _count;
+    }
+
+    /**
+     * Read the next reading
+     *
+     * @return false at the end of the series, or if it is cut short
+     */
+    bool next(uint32_t *time_ms, uint32_t *value) {
+        if (_read == _count) {
+            return false;
+        }
+
+        int32_t dod;
+        if (get_bits(1) == 0) {
+            dod = 0;
+        } else if (get_bits(1) == 0) {
+            dod = (int32_t) get_bits(7) - 63;
+        } else if (get_bits(1) == 0) {
+            dod = (int32_t) get_bits(9) - 255;
+        } else if (get_bits(1) == 0) {
+            dod = (int32_t) get_bits(12) - 2047;
+        } else {
+            dod = get_bits(32);
+        }
+        _last_delta += dod;
+        _last_ms += _last_delta;
+
+        if (_read == 0) {
+            _last_value = get_bits(32);
+        } else if (get_bits(1) == 1) {
+            if (get_bits(1) == 1) {
+                _leading = get_bits(5);
+                _trailing = 32 - _leading - (get_bits(5) + 1);
+            }
+            _last_value ^= get_bits(32 - _leading - _trailing) << _trailing;
+        }
+
+        if (_bit_pos > _len * 8) {
+            _count = _read;
+            return false;
+        }
+        _read++;
+        *time_ms = _last_ms;
+        *value = _last_value;
+        return true;
+    }
+
+protected:
+    uint32_t get_bits(uint8_t count) {
+        uint32_t value = 0;
+        while (count-- > 0) {
+            uint8_t bit = 0;
+            if (_bit_pos < _len * 8) {
+                bit = (_buf[_bit_pos / 8] >> (7 - (_bit_pos & 7))) & 1;
+            }
+            value = (value << 1) | bit;
+            _bit_pos++;
+        }
+        return value;
+    }
+
+protected:
+    const uint8_t *_buf;
+    size_t _len;
+    size_t _bit_pos;
+    bool _valid;
+    uint16_t _count;
+    uint16_t _read;
+    uint32_t _last_ms;
+    int32_t _last_delta;
+    uint32_t _last_value;
+    uint8_t _leading;
+    uint8_t _trailing;
+};
+
+#endif /* __TIME_SERIES_CODEC_H_ */
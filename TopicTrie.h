@@ -0,0 +1,356 @@
+/*
+ *  MQTT topic filter trie in a fixed arena
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TopicTrie.h
+ *  \brief Finds the filters matching a topic, level by level
+ *  Each node of the trie is one level of a topic filter, its text kept in
+ *  a shared character arena. A child is found through an open addressed
+ *  hash table keyed by its parent and its text, so a filter costs 12 bytes
+ *  per level it does not share with another plus the text of those
+ *  levels. A filter ends at a node with a list of values.
+ *
+ *  Matching a topic walks it once, looking up at every level the child
+ *  equal to the level, the "+" child and the "#" child, each a hash of the
+ *  level and a probe or two. The cost grows with the length of the topic
+ *  and the "+" filters on the way, not with the number of filters or of
+ *  siblings. As MQTT requires, a topic whose first level starts with '$'
+ *  is matched by no filter starting with a wildcard.
+ *
+ *  Removed filters free their values but not their nodes, which are reused
+ *  when the same filter is inserted again.
+ *
+ *  Only the C library is used, so the trie builds on a host as well.
+ */
+
+#ifndef __TOPIC_TRIE_H_
+#define __TOPIC_TRIE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * \brief TopicTrie maps MQTT topic filters to 16 bit values.
+ *
+ * @tparam NODES The number of filter levels
+ * @tparam CHARS The bytes of level text
+ * @tparam VALUES The number of filter values
+ */
+template <uint16_t NODES, uint16_t CHARS, uint16_t VALUES>
+class TopicTrie {
+public:
+    /**
+     * Called for every value of a matching filter
+     *
+     * @param[in] context The context given to match()
+     * @param[in] value The value
+     */
+    typedef void (*match_fn_t)(void *context, uint16_t value);
+
+    /**
+     * TopicTrie Constructor, empty
+     */
+    TopicTrie() {
+        clear();
+    }
+
+    /**
+     * Remove every filter
+     */
+    void clear() {
+        _nodes[ROOT].text = 0;
+        _nodes[ROOT].len = 0;
+        _nodes[ROOT].parent = NONE;
+        _nodes[ROOT].values = NONE;
+        _node_count = 1;
+        _char_count = 0;
+
+        for (uint32_t i = 0; i < BUCKETS; i++) {
+            _buckets[i] = NONE;
+        }
+
+        /* Every value entry on the free list */
+        for (uint16_t i = 0; i < VALUES; i++) {
+            _values[i].next = i + 1 < VALUES ? i + 1 : NONE;
+        }
+        _free_values = VALUES > 0 ? 0 : NONE;
+    }
+
+    /**
+     * Add a value to a filter
+     *
+     * @param[in] filter The topic filter, a valid one
+     * @param[in] value The value
+     * @return 0 on success, or -1 if the filter is invalid or the arena full
+     */
+    int insert(const char *filter, uint16_t value) {
+        if (!valid_filter(filter) || _free_values == NONE) {
+            return -1;
+        }
+
+        uint16_t node = ROOT;
+        const char *level = filter;
+        while (true) {
+            const char *end = strchr(level, '/');
+            size_t len = end != NULL ? (size_t) (end - level) : strlen(level);
+
+            uint16_t child = find_child(node, level, len);
+            if (child == NONE && (child = add_child(node, level, len)) == NONE) {
+                return -1;
+            }
+            node = child;
+
+            if (end == NULL) {
+                break;
+            }
+            level = end + 1;
+        }
+
+        uint16_t entry = _free_values;
+        _free_values = _values[entry].next;
+        _values[entry].value = value;
+        _values[entry].next = _nodes[node].values;
+        _nodes[node].values = entry;
+        return 0;
+    }
+
+    /**
+     * Remove a value from a filter
+     *
+     * @return 0 on success, or -1 if the filter does not have the value
+     */
+    int remove(const char *filter, uint16_t value) {
+        uint16_t node = ROOT;
+        const char *level = filter;
+        while (node != NONE) {
+            const char *end = strchr(level, '/');
+            size_t len = end != NULL ? (size_t) (end - level) : strlen(level);
+            node = find_child(node, level, len);
+            if (end == NULL) {
+                break;
+            }
+            level = end + 1;
+        }
+        if (node == NONE) {
+            return -1;
+        }
+
+        uint16_t *link = &_nodes[node].values;
+        while (*link != NONE) {
+            uint16_t entry = *link;
+            if (_values[entry].value == value) {
+                *link = _values[entry].next;
+                _values[entry].next = _free_values;
+                _free_values = entry;
+                return 0;
+            }
+            link = &_values[entry].next;
+        }
+        return -1;
+    }
+
+    /**
+     * Find the filters matching a topic
+     *
+     * @param[in] topic The topic name, not necessarily NUL terminated
+     * @param[in] len The topic length
+     * @param[in] fn Called for the values of every matching filter
+     * @param[in] context Passed to fn
+     * @return The number of values matched
+     */
+    uint32_t match(const char *topic, size_t len, match_fn_t fn, void *context) const {
+        /* $SYS and the like are for filters that name them explicitly */
+        bool system = len > 0 && topic[0] == '$';
+        return match_level(ROOT, topic, topic + len, system, fn, context);
+    }
+
+    /**
+     * Check a topic filter: "+" and "#" take a whole level, "#" only the last
+     */
+    static bool valid_filter(const char *filter) {
+        const char *level = filter;
+        while (true) {
+            const char *end = strchr(level, '/');
+            size_t len = end != NULL ? (size_t) (end - level) : strlen(level);
+            if (len > MAX_LEVEL_LEN) {
+                return false;
+            }
+            for (size_t i = 0; i < len; i++) {
+                if ((level[i] == '+' || level[i] == '#') && len != 1) {
+                    return false;
+                }
+            }
+            if (len == 1 && level[0] == '#' && end != NULL) {
+                return false;
+            }
+            if (end == NULL) {
+                return true;
+            }
+            level = end + 1;
+        }
+    }
+
+    /** Levels in use, the root included */
+    uint16_t nodes_used() const {
+        return _node_count;
+    }
+
+    /** Bytes of level text in use */
+    uint16_t chars_used() const {
+        return _char_count;
+    }
+
+protected:
+    static const uint16_t NONE = 0xFFFF;
+    static const uint16_t ROOT = 0;
+    static const size_t MAX_LEVEL_LEN = 0xFF;
+    /** At most half full, so a probe seldom goes past the next bucket */
+    static const uint32_t BUCKETS = 2 * (uint32_t) NODES;
+
+    struct Node {
+        uint16_t text;          /**< Offset of the level in _chars */
+        uint8_t len;
+        uint16_t parent;
+        uint16_t values;        /**< First value entry, or NONE */
+    };
+
+    struct Value {
+        uint16_t value;
+        uint16_t next;
+    };
+
+    bool is_level(uint16_t node, const char *level, size_t len) const {
+        return _nodes[node].len == len && memcmp(_chars + _nodes[node].text, level, len) == 0;
+    }
+
+    /**
+     * The first bucket of a child, FNV-1a of its parent and its text
+     */
+    static uint32_t bucket(uint16_t parent, const char *level, size_t len) {
+        uint32_t h = 2166136261UL ^ parent;
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ (uint8_t) level[i]) * 16777619UL;
+        }
+        return h % BUCKETS;
+    }
+
+    uint16_t find_child(uint16_t node, const char *level, size_t len) const {
+        /* Nodes are never taken out, so the first empty bucket ends the probe */
+        for (uint32_t b = bucket(node, level, len); _buckets[b] != NONE; b = (b + 1) % BUCKETS) {
+            uint16_t c = _buckets[b];
+            if (_nodes[c].parent == node && is_level(c, level, len)) {
+                return c;
+            }
+        }
+        return NONE;
+    }
+
+    uint16_t add_child(uint16_t node, const char *level, size_t len) {
+        if (_node_count == NODES || _char_count + len > CHARS) {
+            return NONE;
+        }
+
+        uint16_t child = _node_count++;
+        memcpy(_chars + _char_count, level, len);
+        _nodes[child].text = _char_count;
+        _nodes[child].len = len;
+        _nodes[child].parent = node;
+        _nodes[child].values = NONE;
+        _char_count += len;
+
+        uint32_t b = bucket(node, level, len);
+        while (_buckets[b] != NONE) {
+            b = (b + 1) % BUCKETS;
+        }
+        _buckets[b] = child;
+        return child;
+    }
+
+    uint32_t report(uint16_t node, match_fn_t fn, void *context) const {
+        uint32_t matched = 0;
+        for (uint16_t v = _nodes[node].values; v != NONE; v = _values[v].next) {
+            fn(context, _values[v].value);
+            matched++;
+        }
+        return matched;
+    }
+
+    /**
+     * Match the levels from topic on against the children of node
+     */
+    uint32_t match_level(uint16_t node, const char *topic, const char *end, bool system,
+                         match_fn_t fn, void *context) const {
+        const char *sep = (const char *) memchr(topic, '/', end - topic);
+        const char *level_end = sep != NULL ? sep : end;
+        uint32_t matched = 0;
+
+        uint16_t exact = find_child(node, topic, level_end - topic);
+        if (exact != NONE && _nodes[exact].len == 1 &&
+            (_chars[_nodes[exact].text] == '+' || _chars[_nodes[exact].text] == '#')) {
+            /* A topic level of "+" or "#" is matched by the wildcard child below */
+            exact = NONE;
+        }
+        if (exact != NONE) {
+            matched += match_child(exact, sep, end, fn, context);
+        }
+        if (system) {
+            return matched;
+        }
+
+        uint16_t plus = find_child(node, "+", 1);
+        if (plus != NONE) {
+            matched += match_child(plus, sep, end, fn, context);
+        }
+        uint16_t hash = find_child(node, "#", 1);
+        if (hash != NONE) {
+            /* The rest of the topic, whatever it is */
+            matched += report(hash, fn, context);
+        }
+        return matched;
+    }
+
+    /**
+     * Match what follows a level the child matched, sep being the separator
+     * after the level or NULL if it was the last
+     */
+    uint32_t match_child(uint16_t child, const char *sep, const char *end,
+                         match_fn_t fn, void *context) const {
+        if (sep != NULL) {
+            return match_level(child, sep + 1, end, false, fn, context);
+        }
+
+        uint32_t matched = report(child, fn, context);
+        /* "a/#" matches "a" as well */
+        uint16_t hash = find_child(child, "#", 1);
+        if (hash != NONE) {
+            matched += report(hash, fn, context);
+        }
+        return matched;
+    }
+
+protected:
+    Node _nodes[NODES];
+    uint16_t _buckets[BUCKETS];     /**< Node indexes, NONE when empty */
+    char _chars[CHARS];
+    Value _values[VALUES];
+    uint16_t _node_count;
+    uint16_t _char_count;
+    uint16_t _free_values;
+};
+
+#endif /* __TOPIC_TRIE_H_ */
@@ -0,0 +1,217 @@
+/*
+ *  Byte stream transports the clients are compiled against
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file Transport.h
+ *  \brief The transport policy, and the ring the in-memory ones buffer in
+ *  A transport is any class with these members, passed as a template
+ *  parameter, so its calls are resolved and inlined at compile time
+ *  rather than made through a table of virtual functions:
+ *
+ *    int connect(const char *hostname, uint16_t port);
+ *        Open the stream to a server: 0, or a negative error code. A
+ *        transport with a fixed peer opens the stream to it, the server
+ *        only names what is at the other end.
+ *
+ *    int send(const unsigned char *buf, size_t len);
+ *        Write what can be written without blocking: the bytes written,
+ *        a would block code, or a negative error code.
+ *
+ *    int recv(unsigned char *buf, size_t len);
+ *        Read what is available, at most len bytes: the bytes read, 0 once
+ *        the peer closed the stream, a would block code, or a negative
+ *        error code.
+ *
+ *    static bool would_block(int ret);
+ *        Whether send() or recv() returned the transport's would block code.
+ *
+ *    bool is_connected() const;
+ *    void close();
+ *
+ *  The transports are TcpTransport, a TCPSocket; XBeeTransport, the
+ *  messages exchanged with one node through an XBeeFragmenter;
+ *  LoopbackTransport, two in memory ends of a stream; and TLSConnection,
+ *  a TLS session on any of those. TransportNetwork turns any of them into
+ *  the Network of the MQTT clients, and TransportBio into the send and
+ *  receive callbacks of mbed TLS.
+ *
+ *  Only the C library is used, so the header builds on a host as well,
+ *  see host/TransportTest.cpp.
+ */
+
+#ifndef __TRANSPORT_H_
+#define __TRANSPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TRANSPORT_ERROR_WOULD_BLOCK -3501   /**< Nothing to read, or no room to write, for now */
+#define TRANSPORT_ERROR_CLOSED      -3502   /**< Written after the stream was closed */
+#define TRANSPORT_ERROR_OVERFLOW    -3503   /**< Bytes received were lost for lack of room */
+
+/**
+ * \brief TransportRing buffers a byte stream from one thread to another.
+ *
+ * One thread writes and one reads, without a lock: each position is only
+ * changed by its own side.
+ */
+template <uint32_t SIZE>
+class TransportRing {
+public:
+    TransportRing() : _head(0), _tail(0) {
+    }
+
+    /**
+     * Empty the ring, while neither side uses it
+     */
+    void clear() {
+        _head = 0;
+        _tail = 0;
+    }
+
+    /**
+     * Append as many bytes as fit
+     *
+     * @return The bytes appended
+     */
+    size_t write(const uint8_t *data, size_t len) {
+        uint32_t head = _head;
+        size_t room = SIZE - (head - _tail);
+        if (len > room) {
+            len = room;
+        }
+        size_t at = head % SIZE;
+        size_t first = len < SIZE - at ? len : SIZE - at;
+        memcpy(_buf + at, data, first);
+        memcpy(_buf, data + first, len - first);
+        _head = head + len;
+        return len;
+    }
+
+    /**
+     * Take up to len bytes out
+     *
+     * @return The bytes taken
+     */
+    size_t read(uint8_t *data, size_t len) {
+        uint32_t tail = _tail;
+        size_t available = _head - tail;
+        if (len > available) {
+            len = available;
+        }
+        size_t at = tail % SIZE;
+        size_t first = len < SIZE - at ? len : SIZE - at;
+        memcpy(data, _buf + at, first);
+        memcpy(data + first, _buf, len - first);
+        _tail = tail + len;
+        return len;
+    }
+
+    /** Bytes that can be read */
+    size_t available() const {
+        return _head - _tail;
+    }
+
+protected:
+    uint8_t _buf[SIZE];
+    volatile uint32_t _head;        /**< Bytes written, wrapping at 2^32 */
+    volatile uint32_t _tail;        /**< Bytes read */
+};
+
+/**
+ * \brief LoopbackTransport is one end of a byte stream in memory.
+ *
+ * What one end sends, the other receives, up to SIZE bytes ahead of it.
+ * Made for running a client against a server in the same process, in a
+ * test or a benchmark, with no network or radio.
+ */
+template <uint32_t SIZE = 1024>
+class LoopbackTransport {
+public:
+    LoopbackTransport() : _peer(NULL), _closed(false) {
+    }
+
+    /**
+     * Connect two ends to each other, with empty streams
+     */
+    static void pair(LoopbackTransport &a, LoopbackTransport &b) {
+        a._peer = &b;
+        b._peer = &a;
+        a._closed = false;
+        b._closed = false;
+        a._rx.clear();
+        b._rx.clear();
+    }
+
+    /**
+     * Reopen both ends, with empty streams; the server is the other end
+     *
+     * @return 0, or TRANSPORT_ERROR_CLOSED if the end was never paired
+     */
+    int connect(const char *hostname, uint16_t port) {
+        (void) hostname;
+        (void) port;
+        if (_peer == NULL) {
+            return TRANSPORT_ERROR_CLOSED;
+        }
+        pair(*this, *_peer);
+        return 0;
+    }
+
+    int send(const unsigned char *buf, size_t len) {
+        if (!is_connected()) {
+            return TRANSPORT_ERROR_CLOSED;
+        }
+        size_t n = _peer->_rx.write(buf, len);
+        return n == 0 && len > 0 ? TRANSPORT_ERROR_WOULD_BLOCK : (int) n;
+    }
+
+    int recv(unsigned char *buf, size_t len) {
+        size_t n = _rx.read(buf, len);
+        if (n > 0 || len == 0) {
+            return (int) n;
+        }
+        /* What was sent before the close is still read */
+        return is_connected() ? TRANSPORT_ERROR_WOULD_BLOCK : 0;
+    }
+
+    static bool would_block(int ret) {
+        return ret == TRANSPORT_ERROR_WOULD_BLOCK;
+    }
+
+    bool is_connected() const {
+        return _peer != NULL && !_closed;
+    }
+
+    /**
+     * Close both ends
+     */
+    void close() {
+        _closed = true;
+        if (_peer != NULL) {
+            _peer->_closed = true;
+        }
+    }
+
+protected:
+    LoopbackTransport *_peer;
+    volatile bool _closed;
+    TransportRing<SIZE> _rx;        /**< What the peer sent */
+};
+
+#endif /* __TRANSPORT_H_ */
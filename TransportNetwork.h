@@ -0,0 +1,104 @@
+/*
+ *  The MQTT clients' network over any transport
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TransportNetwork.h
+ *  \brief The Network class MQTT::Client and Mqtt5Client expect, on top of
+ *  a transport, see Transport.h
+ */
+
+#ifndef __TRANSPORT_NETWORK_H_
+#define __TRANSPORT_NETWORK_H_
+
+#include "mbed.h"
+#include "Transport.h"
+
+/**
+ * \brief TransportNetwork provides the blocking read/write with timeout
+ * that the MQTT clients use, over a non-blocking transport.
+ */
+template <typename Transport>
+class TransportNetwork {
+public:
+    /**
+     * TransportNetwork Constructor
+     *
+     * @param[in] transport The transport to read and write through
+     */
+    TransportNetwork(Transport &transport) : _transport(transport) {
+    }
+
+    /**
+     * Read exactly len bytes, unless the timeout expires first.
+     *
+     * @return The number of bytes read, or a negative error code
+     */
+    int read(unsigned char *buffer, int len, int timeout) {
+        Timer timer;
+        int received = 0;
+
+        timer.start();
+        while (received < len) {
+            int ret = _transport.recv(buffer + received, len - received);
+            if (ret > 0) {
+                received += ret;
+            } else if (Transport::would_block(ret)) {
+                if (timer.read_ms() >= timeout) {
+                    break;
+                }
+                Thread::wait(1);
+            } else {
+                /* Closed by the peer, or a fatal error */
+                return ret < 0 ? ret : -1;
+            }
+        }
+
+        return received;
+    }
+
+    /**
+     * Write the whole buffer, unless the timeout expires first.
+     *
+     * @return The number of bytes written, or a negative error code
+     */
+    int write(unsigned char *buffer, int len, int timeout) {
+        Timer timer;
+        int sent = 0;
+
+        timer.start();
+        while (sent < len) {
+            int ret = _transport.send(buffer + sent, len - sent);
+            if (ret > 0) {
+                sent += ret;
+            } else if (ret == 0 || Transport::would_block(ret)) {
+                if (timer.read_ms() >= timeout) {
+                    break;
+                }
+                Thread::wait(1);
+            } else {
+                return ret;
+            }
+        }
+
+        return sent;
+    }
+
+protected:
+    Transport &_transport;
+};
+
+#endif /* __TRANSPORT_NETWORK_H_ */
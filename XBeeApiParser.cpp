@@ -0,0 +1,209 @@
+/*
+ *  XBee API frame parser and encoder
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "XBeeApiParser.h"
+
+#include <string.h>
+
+XBeeApiParser::XBeeApiParser(uint8_t *buf, uint16_t buf_size, bool escaped) :
+        _buf(buf), _buf_size(buf_size), _escaped(escaped), _handler(NULL), _context(NULL),
+        _stop(false), _frames(0), _checksum_errors(0), _length_errors(0), _discarded(0)
+{
+    reset();
+}
+
+void XBeeApiParser::set_handler(frame_handler_t handler, void *context)
+{
+    _handler = handler;
+    _context = context;
+}
+
+void XBeeApiParser::reset()
+{
+    _state = WAIT_DELIMITER;
+    _escape_next = false;
+    _len = 0;
+    _received = 0;
+    _sum = 0;
+}
+
+uint32_t XBeeApiParser::scan(const uint8_t *ring, uint32_t ring_size, uint32_t read, uint32_t write)
+{
+    while (read != write) {
+        /* Parse up to the wrap of the ring, then from its start */
+        uint32_t index = read % ring_size;
+        uint32_t n = write - read;
+        if (n > ring_size - index) {
+            n = ring_size - index;
+        }
+        size_t consumed = parse(ring + index, n);
+        read += consumed;
+        if (consumed < n) {
+            break;
+        }
+    }
+    return read;
+}
+
+size_t XBeeApiParser::parse(const uint8_t *data, size_t len)
+{
+    const uint8_t *begin = data;
+    const uint8_t *end = data + len;
+
+    _stop = false;
+    while (data < end && !_stop) {
+        if (_state == WAIT_DELIMITER) {
+            /* Skip the noise between frames in one go */
+            const uint8_t *start = static_cast<const uint8_t *>(
+                    memchr(data, START_DELIMITER, end - data));
+            if (start == NULL) {
+                _discarded += end - data;
+                return len;
+            }
+            _discarded += start - data;
+            data = start + 1;
+            _state = LENGTH_MSB;
+            _escape_next = false;
+            continue;
+        }
+
+        if (_state == FRAME_DATA && !_escaped) {
+            /* In API mode 1 the frame data can be copied as it is */
+            size_t n = end - data;
+            if (n > (size_t) (_len - _received)) {
+                n = _len - _received;
+            }
+            memcpy(_buf + _received, data, n);
+            for (size_t i = 0; i < n; i++) {
+                _sum += data[i];
+            }
+            _received += n;
+            data += n;
+            if (_received == _len) {
+                _state = CHECKSUM;
+            }
+            continue;
+        }
+
+        uint8_t byte = *data++;
+        if (_escaped) {
+            if (byte == START_DELIMITER) {
+                /* Never escaped, so a frame was cut short */
+                _length_errors++;
+                reset();
+                _state = LENGTH_MSB;
+                continue;
+            }
+            if (byte == ESCAPE) {
+                _escape_next = true;
+                continue;
+            }
+            if (_escape_next) {
+                byte ^= ESCAPE_XOR;
+                _escape_next = false;
+            }
+        }
+        feed(byte);
+    }
+
+    return data - begin;
+}
+
+void XBeeApiParser::feed(uint8_t byte)
+{
+    switch (_state) {
+        case WAIT_DELIMITER:
+            break;
+        case LENGTH_MSB:
+            _len = byte << 8;
+            _state = LENGTH_LSB;
+            break;
+        case LENGTH_LSB:
+            _len |= byte;
+            if (_len == 0 || _len > _buf_size) {
+                /* Look for the next delimiter right after this one */
+                _length_errors++;
+                reset();
+                break;
+            }
+            _received = 0;
+            _sum = 0;
+            _state = FRAME_DATA;
+            break;
+        case FRAME_DATA:
+            _buf[_received++] = byte;
+            _sum += byte;
+            if (_received == _len) {
+                _state = CHECKSUM;
+            }
+            break;
+        case CHECKSUM:
+            if ((uint8_t) (_sum + byte) == 0xFF) {
+                _frames++;
+                if (_handler != NULL) {
+                    _handler(_context, _buf, _len);
+                }
+            } else {
+                _checksum_errors++;
+            }
+            reset();
+            break;
+    }
+}
+
+size_t XBeeApiParser::encode(const uint8_t *frame, uint16_t len, uint8_t *out, size_t out_size,
+                             bool escaped)
+{
+    size_t pos = 0;
+    uint8_t sum = 0;
+    uint8_t header[2] = { (uint8_t) (len >> 8), (uint8_t) len };
+
+    if (out_size < 1) {
+        return 0;
+    }
+    out[pos++] = START_DELIMITER;
+
+    /* Length, frame data and checksum, escaping all but the delimiter */
+    for (size_t i = 0; i < (size_t) len + 3; i++) {
+        uint8_t byte;
+        if (i < 2) {
+            byte = header[i];
+        } else if (i < (size_t) len + 2) {
+            byte = frame[i - 2];
+            sum += byte;
+        } else {
+            byte = 0xFF - sum;
+        }
+
+        if (escaped && (byte == START_DELIMITER || byte == ESCAPE ||
+                        byte == XON || byte == XOFF)) {
+            if (pos + 2 > out_size) {
+                return 0;
+            }
+            out[pos++] = ESCAPE;
+            out[pos++] = byte ^ ESCAPE_XOR;
+        } else {
+            if (pos + 1 > out_size) {
+                return 0;
+            }
+            out[pos++] = byte;
+        }
+    }
+
+    return pos;
+}
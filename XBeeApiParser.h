@@ -0,0 +1,172 @@
+/*
+ *  XBee API frame parser and encoder
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeApiParser.h
+ *  \brief Finds XBee API frames in a receive ring
+ *  The parser works on the ring the UART receiver writes into, so the
+ *  bytes are not copied out of it before they are parsed. It keeps its
+ *  state between calls, a frame may straddle the end of what was received
+ *  so far as well as the wrap of the ring.
+ *
+ *  Only the C library is used, so the parser builds on a host as well.
+ */
+
+#ifndef __XBEE_API_PARSER_H_
+#define __XBEE_API_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief XBeeApiParser extracts checked API frames, in API mode 1 or 2.
+ */
+class XBeeApiParser {
+public:
+    static const uint8_t START_DELIMITER = 0x7E;
+    static const uint8_t ESCAPE = 0x7D;
+    static const uint8_t XON = 0x11;
+    static const uint8_t XOFF = 0x13;
+    static const uint8_t ESCAPE_XOR = 0x20;
+
+    /**
+     * Called for every frame with a valid checksum
+     *
+     * @param[in] context The context given to set_handler()
+     * @param[in] frame The frame data, from the frame type on, valid during the call
+     * @param[in] len The frame data length
+     */
+    typedef void (*frame_handler_t)(void *context, const uint8_t *frame, uint16_t len);
+
+    /**
+     * XBeeApiParser Constructor
+     *
+     * @param[in] buf Receives the frame data, a frame longer than it is dropped
+     * @param[in] buf_size The size of buf
+     * @param[in] escaped true for API mode 2 (AP=2), with escaped bytes
+     */
+    XBeeApiParser(uint8_t *buf, uint16_t buf_size, bool escaped = false);
+
+    /**
+     * Set the function called for every frame
+     */
+    void set_handler(frame_handler_t handler, void *context);
+
+    /**
+     * Parse the bytes of a ring between two positions. Positions count
+     * bytes since the start and wrap at 2^32, the byte at position p is
+     * ring[p % ring_size].
+     *
+     * @param[in] ring The ring
+     * @param[in] ring_size The size of the ring, a power of two so that
+     *            the positions still map onto it when they wrap
+     * @param[in] read The position of the first byte to parse
+     * @param[in] write The position past the last byte to parse
+     * @return The new read position, write unless stop() was called
+     */
+    uint32_t scan(const uint8_t *ring, uint32_t ring_size, uint32_t read, uint32_t write);
+
+    /**
+     * Parse a linear buffer
+     *
+     * @return The bytes consumed, less than len only after stop()
+     */
+    size_t parse(const uint8_t *data, size_t len);
+
+    /**
+     * Called from the handler, make scan() and parse() return right after
+     * the frame being delivered. The following bytes are parsed by the
+     * next call.
+     */
+    void stop() {
+        _stop = true;
+    }
+
+    /**
+     * Drop the frame being parsed, after bytes were lost
+     */
+    void reset();
+
+    /**
+     * Encode a frame for sending
+     *
+     * @param[in] frame The frame data, from the frame type on
+     * @param[in] len The frame data length
+     * @param[out] out Receives the encoded frame
+     * @param[in] out_size The size of out, 2 * len + 4 always suffices
+     * @param[in] escaped true for API mode 2
+     * @return The encoded length, or 0 if out is too small
+     */
+    static size_t encode(const uint8_t *frame, uint16_t len, uint8_t *out, size_t out_size,
+                         bool escaped = false);
+
+    /** Frames delivered */
+    uint32_t frames() const {
+        return _frames;
+    }
+
+    /** Frames dropped for a bad checksum */
+    uint32_t checksum_errors() const {
+        return _checksum_errors;
+    }
+
+    /** Frames dropped for a bad length, or cut by a new start delimiter */
+    uint32_t length_errors() const {
+        return _length_errors;
+    }
+
+    /** Bytes skipped while looking for a start delimiter */
+    uint32_t discarded() const {
+        return _discarded;
+    }
+
+protected:
+    enum State {
+        WAIT_DELIMITER,
+        LENGTH_MSB,
+        LENGTH_LSB,
+        FRAME_DATA,
+        CHECKSUM
+    };
+
+    /**
+     * Feed the next byte, after unescaping
+     */
+    void feed(uint8_t byte);
+
+protected:
+    uint8_t *_buf;
+    uint16_t _buf_size;
+    bool _escaped;
+
+    frame_handler_t _handler;
+    void *_context;
+
+    State _state;
+    bool _escape_next;              /**< The previous byte was ESCAPE */
+    bool _stop;                     /**< stop() was called */
+    uint16_t _len;                  /**< Length of the frame being parsed */
+    uint16_t _received;             /**< Frame data bytes received so far */
+    uint8_t _sum;                   /**< Sum of the frame data bytes so far */
+
+    uint32_t _frames;
+    uint32_t _checksum_errors;
+    uint32_t _length_errors;
+    uint32_t _discarded;
+};
+
+#endif /* __XBEE_API_PARSER_H_ */
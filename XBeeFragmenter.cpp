@@ -0,0 +1,444 @@
+/*
+ *  Fragmentation and reassembly of messages larger than a radio frame
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "XBeeFragmenter.h"
+
+namespace {
+
+/* An acknowledgement is asked for every half window */
+const uint32_t ACK_INTERVAL = MBED_CONF_APP_XBEE_FRAGMENT_WINDOW / 2 > 0 ?
+                              MBED_CONF_APP_XBEE_FRAGMENT_WINDOW / 2 : 1;
+
+}
+
+XBeeFragmenter::XBeeFragmenter(XBeeRequests &requests) :
+        _requests(requests), _tx_addr64(0), _tx_addr16(XBeeRequests::UNKNOWN_ADDR16),
+        _tx_data(NULL), _tx_len(0), _tx_count(0), _next_msg_id(0),
+        _ack_event(0), _tx_active(false), _tx_msg_id(0), _ack_ready(false), _ack_index(0),
+        _peer_count(0), _all_peers(false)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    memset(_acked, 0, sizeof (_acked));
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_REASSEMBLY_SLOTS; i++) {
+        _slots[i].state = SLOT_FREE;
+    }
+    load_peers(MBED_CONF_APP_XBEE_FRAGMENT_PEERS);
+}
+
+int XBeeFragmenter::add_peer(uint64_t addr64)
+{
+    int ret = 0;
+    if (!is_peer(addr64)) {
+        _mutex.lock();
+        if (_peer_count < MBED_CONF_APP_XBEE_FRAGMENT_MAX_PEERS) {
+            _peers[_peer_count++] = addr64;
+        } else {
+            ret = -1;
+        }
+        _mutex.unlock();
+    }
+    return ret;
+}
+
+bool XBeeFragmenter::is_peer(uint64_t addr64)
+{
+    _mutex.lock();
+    bool peer = _all_peers;
+    for (uint32_t i = 0; i < _peer_count && !peer; i++) {
+        peer = _peers[i] == addr64;
+    }
+    _mutex.unlock();
+    return peer;
+}
+
+int XBeeFragmenter::send(uint64_t addr64, uint16_t addr16, const uint8_t *data, size_t len)
+{
+    size_t count = len > 0 ? (len + MBED_CONF_APP_XBEE_FRAGMENT_SIZE - 1) / MBED_CONF_APP_XBEE_FRAGMENT_SIZE : 1;
+    if (count > MAX_FRAGMENTS) {
+        return XBEE_FRAGMENT_ERROR_TOO_LARGE;
+    }
+    if (!is_peer(addr64)) {
+        return XBEE_FRAGMENT_ERROR_NOT_PEER;
+    }
+
+    _send_mutex.lock();
+    _tx_addr64 = addr64;
+    _tx_addr16 = addr16;
+    _tx_data = data;
+    _tx_len = len;
+    _tx_count = count;
+
+    _ack_mutex.lock();
+    _tx_active = true;
+    _tx_msg_id = _next_msg_id++;
+    _ack_ready = false;
+    memset(_acked, 0, sizeof (_acked));
+    _ack_mutex.unlock();
+    while (_ack_event.wait(0) > 0) {
+        /* Left over from the previous message */
+    }
+
+    uint8_t sent[BITMAP_LEN];           /* Sent and not reported lost */
+    uint8_t ever_sent[BITMAP_LEN];
+    uint8_t acked[BITMAP_LEN];
+    memset(sent, 0, sizeof (sent));
+    memset(ever_sent, 0, sizeof (ever_sent));
+    memset(acked, 0, sizeof (acked));
+    uint32_t acked_count = 0;
+    uint32_t inflight = 0;
+    uint32_t since_request = 0;
+    uint32_t retries = 0;
+    int ret = 0;
+
+    while (acked_count < count && ret == 0) {
+        /* Fill the window, the lowest fragment not sent first */
+        uint16_t next = 0;
+        while (inflight < MBED_CONF_APP_XBEE_FRAGMENT_WINDOW) {
+            while (next < count && test_bit(sent, next)) {
+                next++;
+            }
+            if (next == count) {
+                break;
+            }
+            uint16_t after = next + 1;
+            while (after < count && test_bit(sent, after)) {
+                after++;
+            }
+
+            set_bit(sent, next);
+            inflight++;
+            since_request++;
+            bool request = after == count || inflight == MBED_CONF_APP_XBEE_FRAGMENT_WINDOW ||
+                           since_request >= ACK_INTERVAL;
+            if (send_fragment(next, request) != 0) {
+                ret = XBEE_FRAGMENT_ERROR_SEND;
+                break;
+            }
+            if (request) {
+                since_request = 0;
+            }
+
+            _mutex.lock();
+            _stats.fragments_sent++;
+            if (test_bit(ever_sent, next)) {
+                _stats.retransmits++;
+            }
+            _mutex.unlock();
+            set_bit(ever_sent, next);
+        }
+        if (ret != 0) {
+            break;
+        }
+
+        int32_t tokens = _ack_event.wait(MBED_CONF_APP_XBEE_FRAGMENT_ACK_TIMEOUT);
+
+        uint8_t report[BITMAP_LEN];
+        _ack_mutex.lock();
+        bool ready = _ack_ready;
+        uint8_t index = _ack_index;
+        memcpy(report, _acked, sizeof (report));
+        _ack_ready = false;
+        _ack_mutex.unlock();
+
+        if (!ready) {
+            if (tokens > 0) {
+                /* Its acknowledgement was taken with an earlier token */
+                continue;
+            }
+            if (++retries > MBED_CONF_APP_XBEE_FRAGMENT_RETRIES) {
+                ret = XBEE_FRAGMENT_ERROR_TIMEOUT;
+                break;
+            }
+            /* Nothing heard, whatever is outstanding is sent again */
+            for (uint16_t i = 0; i < count; i++) {
+                if (!test_bit(acked, i)) {
+                    sent[i / 8] &= ~(1 << (i % 8));
+                }
+            }
+            inflight = 0;
+            since_request = 0;
+            continue;
+        }
+
+        bool progress = false;
+        inflight = 0;
+        for (uint16_t i = 0; i < count; i++) {
+            if (test_bit(report, i)) {
+                if (!test_bit(acked, i)) {
+                    set_bit(acked, i);
+                    acked_count++;
+                    progress = true;
+                }
+            } else if (i <= index) {
+                /* Sent before the fragment that asked, so lost */
+                sent[i / 8] &= ~(1 << (i % 8));
+            } else if (test_bit(sent, i)) {
+                inflight++;
+            }
+        }
+        if (progress) {
+            retries = 0;
+        }
+    }
+
+    _ack_mutex.lock();
+    _tx_active = false;
+    _ack_mutex.unlock();
+    _tx_data = NULL;
+    _send_mutex.unlock();
+
+    _mutex.lock();
+    if (ret == 0) {
+        _stats.messages_sent++;
+    } else {
+        _stats.send_failures++;
+    }
+    _mutex.unlock();
+
+    return ret;
+}
+
+bool XBeeFragmenter::handle(uint64_t addr64, uint16_t addr16, const uint8_t *frame, uint16_t len,
+                            uint32_t now_ms)
+{
+    if (!is_peer(addr64)) {
+        return false;
+    }
+
+    /* A peer's frame that is neither is dropped, it cannot be data */
+    if (len < 4) {
+        return true;
+    }
+    switch (frame[0]) {
+        case FRAGMENT_DATA:
+        case FRAGMENT_DATA_ACK_REQUEST:
+            on_fragment(addr64, addr16, frame, len, now_ms);
+            return true;
+        case FRAGMENT_ACK:
+            on_ack(addr64, frame, len);
+            return true;
+        default:
+            return true;
+    }
+}
+
+void XBeeFragmenter::expire(uint32_t now_ms)
+{
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_REASSEMBLY_SLOTS; i++) {
+        Slot *slot = &_slots[i];
+        if (slot->state == SLOT_FREE ||
+            (int32_t) (now_ms - slot->last_ms) < MBED_CONF_APP_XBEE_REASSEMBLY_TIMEOUT) {
+            continue;
+        }
+        if (slot->state == SLOT_ASSEMBLING) {
+            _mutex.lock();
+            _stats.expired++;
+            _mutex.unlock();
+        }
+        slot->state = SLOT_FREE;
+    }
+}
+
+XBeeFragmenterStats XBeeFragmenter::stats()
+{
+    _mutex.lock();
+    XBeeFragmenterStats stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+void XBeeFragmenter::on_fragment(uint64_t addr64, uint16_t addr16, const uint8_t *frame,
+                                 uint16_t len, uint32_t now_ms)
+{
+    if (len < HEADER_LEN) {
+        return;
+    }
+
+    uint8_t msg_id = frame[1];
+    uint8_t index = frame[2];
+    uint8_t count = frame[3];
+    uint16_t offset = (frame[4] << 8) | frame[5];
+    uint16_t n = len - HEADER_LEN;
+    if (count == 0 || index >= count) {
+        return;
+    }
+
+    _mutex.lock();
+    _stats.fragments_received++;
+    _mutex.unlock();
+
+    if (offset + n > MBED_CONF_APP_XBEE_REASSEMBLY_SIZE) {
+        _mutex.lock();
+        _stats.oversized++;
+        _mutex.unlock();
+        return;
+    }
+
+    Slot *slot = slot_for(addr64, msg_id, count);
+    if (slot == NULL) {
+        _mutex.lock();
+        _stats.pool_full++;
+        _mutex.unlock();
+        return;
+    }
+    slot->last_ms = now_ms;
+
+    if (slot->state == SLOT_ASSEMBLING && !test_bit(slot->received, index)) {
+        memcpy(slot->data + offset, frame + HEADER_LEN, n);
+        set_bit(slot->received, index);
+        slot->received_count++;
+        if (index == count - 1) {
+            slot->len = offset + n;
+        }
+    } else {
+        _mutex.lock();
+        _stats.duplicates++;
+        _mutex.unlock();
+    }
+
+    bool complete = slot->state == SLOT_ASSEMBLING && slot->received_count == count;
+    if (frame[0] == FRAGMENT_DATA_ACK_REQUEST || complete) {
+        send_ack(addr64, addr16, slot, index);
+    }
+
+    if (complete) {
+        slot->state = SLOT_DONE;
+        _mutex.lock();
+        _stats.messages_received++;
+        _mutex.unlock();
+
+        if (_message_cb) {
+            _message_cb(addr64, addr16, slot->data, slot->len);
+        }
+    }
+}
+
+void XBeeFragmenter::on_ack(uint64_t addr64, const uint8_t *frame, uint16_t len)
+{
+    uint8_t count = frame[3];
+    uint16_t bitmap_len = (count + 7) / 8;
+    if (len < 4 + bitmap_len) {
+        return;
+    }
+
+    _ack_mutex.lock();
+    if (_tx_active && addr64 == _tx_addr64 && frame[1] == _tx_msg_id && count == _tx_count) {
+        for (uint16_t i = 0; i < bitmap_len; i++) {
+            _acked[i] |= frame[4 + i];
+        }
+        _ack_index = frame[2];
+        _ack_ready = true;
+        _ack_event.release();
+    }
+    _ack_mutex.unlock();
+}
+
+void XBeeFragmenter::load_peers(const char *config)
+{
+    if (strcmp(config, "*") == 0) {
+        _all_peers = true;
+        return;
+    }
+
+    while (*config != '\0') {
+        const char *end = strchr(config, ';');
+        if (end == NULL) {
+            end = config + strlen(config);
+        }
+
+        uint64_t addr64;
+        if (!XBeeRequests::parse_addr64(config, end - config, &addr64) || add_peer(addr64) != 0) {
+            printf("XBee: bad fragment peer \"%.*s\"\n", (int) (end - config), config);
+        }
+
+        config = *end == ';' ? end + 1 : end;
+    }
+}
+
+XBeeFragmenter::Slot *XBeeFragmenter::slot_for(uint64_t addr64, uint8_t msg_id, uint8_t count)
+{
+    Slot *free_slot = NULL;
+    Slot *done_slot = NULL;
+
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_REASSEMBLY_SLOTS; i++) {
+        Slot *slot = &_slots[i];
+        if (slot->state == SLOT_FREE) {
+            if (free_slot == NULL) {
+                free_slot = slot;
+            }
+            continue;
+        }
+        if (slot->addr64 == addr64 && slot->msg_id == msg_id && slot->count == count) {
+            return slot;
+        }
+        if (slot->state == SLOT_DONE &&
+            (done_slot == NULL || (int32_t) (slot->last_ms - done_slot->last_ms) < 0)) {
+            done_slot = slot;
+        }
+    }
+
+    /* A delivered message only waits for repeats, a new one takes precedence */
+    Slot *slot = free_slot != NULL ? free_slot : done_slot;
+    if (slot == NULL) {
+        return NULL;
+    }
+    slot->state = SLOT_ASSEMBLING;
+    slot->addr64 = addr64;
+    slot->msg_id = msg_id;
+    slot->count = count;
+    slot->received_count = 0;
+    slot->len = 0;
+    memset(slot->received, 0, sizeof (slot->received));
+    return slot;
+}
+
+void XBeeFragmenter::send_ack(uint64_t addr64, uint16_t addr16, const Slot *slot, uint8_t index)
+{
+    uint8_t ack[4 + BITMAP_LEN];
+    uint16_t bitmap_len = (slot->count + 7) / 8;
+
+    ack[0] = FRAGMENT_ACK;
+    ack[1] = slot->msg_id;
+    ack[2] = index;
+    ack[3] = slot->count;
+    memcpy(ack + 4, slot->received, bitmap_len);
+    _requests.send_data(addr64, addr16, ack, 4 + bitmap_len, XBeeRequests::response_cb_t());
+}
+
+int XBeeFragmenter::send_fragment(uint8_t index, bool ack_request)
+{
+    size_t offset = (size_t) index * MBED_CONF_APP_XBEE_FRAGMENT_SIZE;
+    size_t n = _tx_len - offset;
+    if (n > MBED_CONF_APP_XBEE_FRAGMENT_SIZE) {
+        n = MBED_CONF_APP_XBEE_FRAGMENT_SIZE;
+    }
+
+    _frame[0] = ack_request ? FRAGMENT_DATA_ACK_REQUEST : FRAGMENT_DATA;
+    _frame[1] = _tx_msg_id;
+    _frame[2] = index;
+    _frame[3] = _tx_count;
+    _frame[4] = offset >> 8;
+    _frame[5] = offset;
+    if (n > 0) {
+        memcpy(_frame + HEADER_LEN, _tx_data + offset, n);
+    }
+
+    int ret = _requests.send_data(_tx_addr64, _tx_addr16, _frame, HEADER_LEN + n,
+                                  XBeeRequests::response_cb_t());
+    return ret < 0 ? XBEE_FRAGMENT_ERROR_SEND : 0;
+}
@@ -0,0 +1,298 @@
+/*
+ *  Fragmentation and reassembly of messages larger than a radio frame
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeFragmenter.h
+ *  \brief Messages of up to 255 fragments over the XBee network
+ *  A ZigBee unicast carries at most 84 bytes of RF data, a config push or
+ *  a firmware chunk does not fit. A message is cut into fragments that
+ *  each carry a six byte header:
+ *
+ *    type    0xF0 data, 0xF1 data with an acknowledgement requested, 0xF2 ack
+ *    msg id  the sender's message number
+ *    index   the fragment number
+ *    count   the number of fragments
+ *    offset  two bytes, big endian, where the data goes in the message
+ *
+ *  An acknowledgement is [0xF2, msg id, index, count, bitmap], the index
+ *  being that of the fragment that asked for it and the bitmap holding a
+ *  bit per fragment received, least significant bit first.
+ *
+ *  The sender keeps up to xbee-fragment-window fragments unacknowledged
+ *  and asks for an acknowledgement every half window, so the radio keeps
+ *  sending while the acknowledgement of the first half is on its way.
+ *  Fragments an acknowledgement reports missing are sent again, and only
+ *  those. The receiver assembles messages in a fixed pool of slots, and
+ *  keeps a completed message's slot until its timeout so that a repeated
+ *  fragment is acknowledged again rather than delivered twice.
+ *
+ *  Only the nodes listed in xbee-fragment-peers speak the protocol. Their
+ *  frames are all fragments or acknowledgements, and every message to
+ *  them is fragmented, however short. The frames of other nodes are never
+ *  taken for fragments, whatever their first byte.
+ */
+
+#ifndef __XBEE_FRAGMENTER_H_
+#define __XBEE_FRAGMENTER_H_
+
+#include "mbed.h"
+
+#include "XBeeRequests.h"
+
+/** Data bytes per fragment, the 6 byte header included at most 84 */
+#ifndef MBED_CONF_APP_XBEE_FRAGMENT_SIZE
+#define MBED_CONF_APP_XBEE_FRAGMENT_SIZE 72
+#endif
+
+/** Fragments sent ahead of their acknowledgement */
+#ifndef MBED_CONF_APP_XBEE_FRAGMENT_WINDOW
+#define MBED_CONF_APP_XBEE_FRAGMENT_WINDOW 8
+#endif
+
+/** Milliseconds the sender waits for an acknowledgement */
+#ifndef MBED_CONF_APP_XBEE_FRAGMENT_ACK_TIMEOUT
+#define MBED_CONF_APP_XBEE_FRAGMENT_ACK_TIMEOUT 1000
+#endif
+
+/** Acknowledgement timeouts in a row before a send fails */
+#ifndef MBED_CONF_APP_XBEE_FRAGMENT_RETRIES
+#define MBED_CONF_APP_XBEE_FRAGMENT_RETRIES 5
+#endif
+
+/** Messages assembled at the same time */
+#ifndef MBED_CONF_APP_XBEE_REASSEMBLY_SLOTS
+#define MBED_CONF_APP_XBEE_REASSEMBLY_SLOTS 2
+#endif
+
+/** Largest message assembled */
+#ifndef MBED_CONF_APP_XBEE_REASSEMBLY_SIZE
+#define MBED_CONF_APP_XBEE_REASSEMBLY_SIZE 1024
+#endif
+
+/** Milliseconds a slot is kept after its last fragment */
+#ifndef MBED_CONF_APP_XBEE_REASSEMBLY_TIMEOUT
+#define MBED_CONF_APP_XBEE_REASSEMBLY_TIMEOUT 10000
+#endif
+
+/** Nodes speaking the protocol, as "<64 bit address in hex>;...", or "*" for all */
+#ifndef MBED_CONF_APP_XBEE_FRAGMENT_PEERS
+#define MBED_CONF_APP_XBEE_FRAGMENT_PEERS ""
+#endif
+
+/** Number of nodes xbee-fragment-peers can list */
+#ifndef MBED_CONF_APP_XBEE_FRAGMENT_MAX_PEERS
+#define MBED_CONF_APP_XBEE_FRAGMENT_MAX_PEERS 8
+#endif
+
+/** Send errors */
+#define XBEE_FRAGMENT_ERROR_TOO_LARGE   -3201   /**< More than 255 fragments */
+#define XBEE_FRAGMENT_ERROR_TIMEOUT     -3202   /**< The receiver stopped acknowledging */
+#define XBEE_FRAGMENT_ERROR_SEND        -3203   /**< A fragment could not be sent */
+#define XBEE_FRAGMENT_ERROR_NOT_PEER    -3204   /**< The node does not speak the protocol */
+
+/**
+ * Fragmentation statistics
+ */
+struct XBeeFragmenterStats {
+    uint32_t messages_sent;
+    uint32_t send_failures;
+    uint32_t fragments_sent;
+    uint32_t retransmits;       /**< Fragments sent again */
+    uint32_t messages_received; /**< Messages assembled and delivered */
+    uint32_t fragments_received;
+    uint32_t duplicates;        /**< Fragments received twice */
+    uint32_t expired;           /**< Messages dropped incomplete at their timeout */
+    uint32_t pool_full;         /**< Fragments dropped for lack of a slot */
+    uint32_t oversized;         /**< Fragments beyond the largest message */
+};
+
+/**
+ * \brief XBeeFragmenter sends and assembles fragmented messages.
+ *
+ * handle() and expire() are called on the thread the frames are received
+ * on; send() blocks and is called from any other thread.
+ */
+class XBeeFragmenter {
+public:
+    /**
+     * Called with every message assembled, on the handle() thread
+     *
+     * @param[in] addr64 The sender's 64 bit address
+     * @param[in] addr16 The sender's network address
+     * @param[in] data The message, valid during the call
+     * @param[in] len The message length
+     */
+    typedef Callback<void(uint64_t addr64, uint16_t addr16, const uint8_t *data, size_t len)> message_cb_t;
+
+    /** Fragment types */
+    static const uint8_t FRAGMENT_DATA = 0xF0;
+    static const uint8_t FRAGMENT_DATA_ACK_REQUEST = 0xF1;
+    static const uint8_t FRAGMENT_ACK = 0xF2;
+
+    static const uint16_t HEADER_LEN = 6;
+    static const uint16_t MAX_FRAGMENTS = 255;
+
+    /**
+     * XBeeFragmenter Constructor
+     *
+     * @param[in] requests Sends the fragments and acknowledgements
+     */
+    XBeeFragmenter(XBeeRequests &requests);
+
+    /**
+     * Set the callback for the messages assembled
+     */
+    void attach(message_cb_t cb) {
+        _message_cb = cb;
+    }
+
+    /**
+     * Add a node speaking the protocol
+     *
+     * @return 0 on success, or -1 if the table is full
+     */
+    int add_peer(uint64_t addr64);
+
+    /**
+     * Whether a node speaks the protocol
+     */
+    bool is_peer(uint64_t addr64);
+
+    /**
+     * Send a message, waiting until every fragment is acknowledged
+     *
+     * @param[in] addr64 The node's 64 bit address
+     * @param[in] addr16 The node's network address, or XBeeRequests::UNKNOWN_ADDR16
+     * @param[in] data The message
+     * @param[in] len The message length, at most 255 fragments
+     * @return 0 on success, or a negative error code on failure
+     */
+    int send(uint64_t addr64, uint16_t addr16, const uint8_t *data, size_t len);
+
+    /**
+     * Handle a frame if it is from a peer, as a fragment or an acknowledgement
+     *
+     * @param[in] now_ms The current time in milliseconds, wrapping at 2^32
+     * @return true if the frame belonged to this layer, false for other nodes
+     */
+    bool handle(uint64_t addr64, uint16_t addr16, const uint8_t *frame, uint16_t len,
+                uint32_t now_ms);
+
+    /**
+     * Free the slots past their timeout
+     */
+    void expire(uint32_t now_ms);
+
+    /**
+     * A snapshot of the statistics
+     */
+    XBeeFragmenterStats stats();
+
+protected:
+    enum SlotState {
+        SLOT_FREE,
+        SLOT_ASSEMBLING,
+        SLOT_DONE           /**< Delivered, kept to acknowledge repeats */
+    };
+
+    /** Bitmap of fragments */
+    static const uint16_t BITMAP_LEN = (MAX_FRAGMENTS + 7) / 8;
+
+    struct Slot {
+        SlotState state;
+        uint64_t addr64;
+        uint8_t msg_id;
+        uint8_t count;
+        uint8_t received_count;
+        uint16_t len;               /**< Known once the last fragment arrived, else 0 */
+        uint32_t last_ms;
+        uint8_t received[BITMAP_LEN];
+        uint8_t data[MBED_CONF_APP_XBEE_REASSEMBLY_SIZE];
+    };
+
+    static bool test_bit(const uint8_t *bitmap, uint16_t i) {
+        return bitmap[i / 8] & (1 << (i % 8));
+    }
+
+    static void set_bit(uint8_t *bitmap, uint16_t i) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+    /**
+     * Assemble a data fragment
+     */
+    void on_fragment(uint64_t addr64, uint16_t addr16, const uint8_t *frame, uint16_t len,
+                     uint32_t now_ms);
+
+    /**
+     * Record an acknowledgement for the message being sent
+     */
+    void on_ack(uint64_t addr64, const uint8_t *frame, uint16_t len);
+
+    /**
+     * Parse MBED_CONF_APP_XBEE_FRAGMENT_PEERS
+     */
+    void load_peers(const char *config);
+
+    /**
+     * The slot of a message, or a free one, or NULL
+     */
+    Slot *slot_for(uint64_t addr64, uint8_t msg_id, uint8_t count);
+
+    /**
+     * Acknowledge the fragments of a slot
+     */
+    void send_ack(uint64_t addr64, uint16_t addr16, const Slot *slot, uint8_t index);
+
+    /**
+     * Send one fragment of the message being sent
+     */
+    int send_fragment(uint8_t index, bool ack_request);
+
+protected:
+    XBeeRequests &_requests;
+    message_cb_t _message_cb;
+
+    /* The message being sent, under _send_mutex */
+    Mutex _send_mutex;
+    uint64_t _tx_addr64;
+    uint16_t _tx_addr16;
+    const uint8_t *_tx_data;
+    size_t _tx_len;
+    uint8_t _tx_count;
+    uint8_t _next_msg_id;
+    uint8_t _frame[HEADER_LEN + MBED_CONF_APP_XBEE_FRAGMENT_SIZE];
+
+    /* The latest acknowledgement, passed from handle() to send() */
+    Mutex _ack_mutex;
+    Semaphore _ack_event;
+    bool _tx_active;                /**< A message is being sent, guarded by _ack_mutex */
+    uint8_t _tx_msg_id;
+    bool _ack_ready;
+    uint8_t _ack_index;
+    uint8_t _acked[BITMAP_LEN];
+
+    Slot _slots[MBED_CONF_APP_XBEE_REASSEMBLY_SLOTS];
+
+    Mutex _mutex;                   /**< Guards the peers and the statistics */
+    uint64_t _peers[MBED_CONF_APP_XBEE_FRAGMENT_MAX_PEERS];
+    uint32_t _peer_count;
+    bool _all_peers;                /**< Every node is a peer */
+    XBeeFragmenterStats _stats;
+};
+
+#endif /* __XBEE_FRAGMENTER_H_ */
@@ -0,0 +1,285 @@
+/*
+ *  Forwards XBee sensor frames to the MQTT uplink
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "XBeeGateway.h"
+
+namespace {
+
+/* How long the radio thread waits for bytes, or for room in the pipeline */
+const uint32_t RADIO_WAIT_MS = 100;
+const uint32_t PAUSED_POLL_MS = 2;
+
+/* Request callbacks run on the radio thread too */
+const uint32_t RADIO_STACK_SIZE = 1536;
+
+/* The forward thread runs the whole publish path: a batch flushed by the
+   FrameAggregator, XBeeGateway::publish() with its topic, then
+   ConnectionManager::publish() with its publish-max-payload bytes for
+   compression, then the PublishScheduler or the OfflineQueue's block
+   device write. That is about 1 KB of frames at the default sizes, and
+   snprintf() or an error's printf() take up to 1 KB more with newlib.
+   3 KB leaves a margin; print_stats() shows the high-water mark when the
+   build has MBED_STACK_STATS_ENABLED, to check a configuration against. */
+const uint32_t FORWARD_STACK_SIZE = 3072;
+
+}
+
+XBeeGateway::XBeeGateway(ConnectionManager &mqtt, const char *topic_prefix) :
+        _mqtt(mqtt), _topic_prefix(topic_prefix),
+        _radio(RADIO_TX, RADIO_RX, RADIO_RESET, MBED_CONF_APP_XBEE_BAUD_RATE),
+        _requests(_radio), _mqttsn(mqtt, _requests, topic_prefix), _fragmenter(_requests),
+        _downlink(mqtt, _requests, _fragmenter, topic_prefix), _transport(NULL),
+        _rts(RADIO_RTS, 0), _paused(false),
+        _radio_thread(osPriorityAboveNormal, RADIO_STACK_SIZE),
+        _forward_thread(osPriorityNormal, FORWARD_STACK_SIZE),
+        _aggregator(callback(this, &XBeeGateway::publish))
+{
+    memset(&_stats, 0, sizeof (_stats));
+    _clock.start();
+
+    /* Parsing stops only when the pool is full, and resumes once it is half empty */
+    _pipeline.set_watermarks(MBED_CONF_APP_XBEE_FRAME_POOL_SIZE,
+                             MBED_CONF_APP_XBEE_FRAME_POOL_SIZE / 2);
+    _pipeline.attach(callback(this, &XBeeGateway::on_pressure));
+    _fragmenter.attach(callback(this, &XBeeGateway::dispatch));
+}
+
+XBeeGateway::~XBeeGateway()
+{
+    _radio_thread.terminate();
+    _forward_thread.terminate();
+}
+
+int XBeeGateway::start()
+{
+    if (_radio.init() != 0) {
+        printf("XBee: radio init failed\n");
+        return -1;
+    }
+    _radio.attach(callback(this, &XBeeGateway::on_frame));
+
+    _forward_thread.start(callback(this, &XBeeGateway::forward_task));
+    _radio_thread.start(callback(this, &XBeeGateway::radio_task));
+    if (_downlink.start() != 0) {
+        printf("XBee: downlink not started\n");
+    }
+
+    /* Only logged, the nodes' frames are forwarded whether or not we joined */
+    if (_requests.at_command("AI", NULL, 0, callback(this, &XBeeGateway::on_association)) < 0) {
+        printf("XBee: association query failed\n");
+    }
+    return 0;
+}
+
+XBeeGatewayStats XBeeGateway::stats()
+{
+    _mutex.lock();
+    XBeeGatewayStats stats = _stats;
+    _mutex.unlock();
+    stats.pool = _pipeline.stats();
+    stats.radio = _radio.stats();
+    stats.requests = _requests.stats();
+    stats.batching = _aggregator.stats();
+    stats.mqttsn = _mqttsn.stats();
+    stats.fragments = _fragmenter.stats();
+    stats.downlink = _downlink.stats();
+    return stats;
+}
+
+void XBeeGateway::reset_high_water()
+{
+    _pipeline.reset_high_water();
+}
+
+void XBeeGateway::print_stats()
+{
+    XBeeGatewayStats s = stats();
+    printf("XBee: %lu frames received, %lu forwarded, %lu rejected, in %lu messages\n",
+           (unsigned long) s.received, (unsigned long) s.forwarded,
+           (unsigned long) s.rejected, (unsigned long) s.messages);
+    printf("XBee: %lu batches of %lu payload bytes in %lu, %lu window, %lu size, %lu priority flushes, %lu evictions, %lu oversized\n",
+           (unsigned long) s.batching.batches, (unsigned long) s.batching.payload_bytes,
+           (unsigned long) s.batching.message_bytes, (unsigned long) s.batching.window_flushes,
+           (unsigned long) s.batching.size_flushes, (unsigned long) s.batching.priority_flushes,
+           (unsigned long) s.batching.evictions, (unsigned long) s.batching.oversized);
+    if (MBED_CONF_APP_XBEE_BATCH_SERIES) {
+        printf("XBee: %lu batches as series of readings, %lu flushed for a frame of the other kind\n",
+               (unsigned long) s.batching.series, (unsigned long) s.batching.format_flushes);
+    }
+    printf("MQTT-SN: %lu messages, %lu published, %lu rejected, %lu unsupported, %lu clients, %lu topics\n",
+           (unsigned long) s.mqttsn.messages, (unsigned long) s.mqttsn.published,
+           (unsigned long) s.mqttsn.rejected, (unsigned long) s.mqttsn.unsupported,
+           (unsigned long) s.mqttsn.clients, (unsigned long) s.mqttsn.topics);
+    printf("XBee: %lu messages sent in %lu fragments, %lu retransmits, %lu failures\n",
+           (unsigned long) s.fragments.messages_sent, (unsigned long) s.fragments.fragments_sent,
+           (unsigned long) s.fragments.retransmits, (unsigned long) s.fragments.send_failures);
+    printf("XBee: %lu messages assembled from %lu fragments, %lu duplicates, %lu expired, %lu pool full, %lu oversized\n",
+           (unsigned long) s.fragments.messages_received,
+           (unsigned long) s.fragments.fragments_received, (unsigned long) s.fragments.duplicates,
+           (unsigned long) s.fragments.expired, (unsigned long) s.fragments.pool_full,
+           (unsigned long) s.fragments.oversized);
+    printf("XBee: downlink %lu received, %lu unrouted, %lu queued, %lu sent, %lu failed, %lu dropped, %lu queue full, max %lu queued\n",
+           (unsigned long) s.downlink.received, (unsigned long) s.downlink.unrouted,
+           (unsigned long) s.downlink.queued, (unsigned long) s.downlink.sent,
+           (unsigned long) s.downlink.send_failures, (unsigned long) s.downlink.dropped,
+           (unsigned long) s.downlink.queue_full, (unsigned long) s.downlink.max_queued);
+    printf("XBee: pool of %lu frames, %lu in use, high-water %lu, %lu drops, %lu pauses\n",
+           (unsigned long) s.pool.capacity, (unsigned long) s.pool.in_use,
+           (unsigned long) s.pool.high_water, (unsigned long) s.pool.drops,
+           (unsigned long) s.pool.pauses);
+    printf("XBee: %s link, %lu frames, %lu checksum errors, %lu length errors, %lu overruns\n",
+           s.radio.dma ? "DMA" : "interrupt", (unsigned long) s.radio.frames,
+           (unsigned long) s.radio.checksum_errors, (unsigned long) s.radio.length_errors,
+           (unsigned long) s.radio.overruns);
+    printf("XBee: %lu requests, %lu completed, %lu timeouts, %lu busy, %lu unmatched, %lu max pending\n",
+           (unsigned long) s.requests.sent, (unsigned long) s.requests.completed,
+           (unsigned long) s.requests.timeouts, (unsigned long) s.requests.busy,
+           (unsigned long) s.requests.unmatched, (unsigned long) s.requests.max_pending);
+#if defined(MBED_STACK_STATS_ENABLED)
+    printf("XBee: stack high-water %lu of %lu bytes forwarding, %lu of %lu receiving\n",
+           (unsigned long) _forward_thread.max_stack(), (unsigned long) _forward_thread.stack_size(),
+           (unsigned long) _radio_thread.max_stack(), (unsigned long) _radio_thread.stack_size());
+#endif
+}
+
+void XBeeGateway::on_frame(const XBeeRxPacket &packet)
+{
+    /* Never wait for the uplink here, the receive ring would overflow instead */
+    Frame *frame = _pipeline.alloc();
+
+    _mutex.lock();
+    _stats.received++;
+    _mutex.unlock();
+
+    if (frame == NULL) {
+        /* Counted by the pool */
+        return;
+    }
+
+    frame->addr64 = packet.addr64;
+    frame->addr16 = packet.addr16;
+    frame->broadcast = packet.options & XBeeRadio::RX_OPTION_BROADCAST;
+    frame->len = packet.len < sizeof (frame->data) ? packet.len : sizeof (frame->data);
+    memcpy(frame->data, packet.data, frame->len);
+    _pipeline.put(frame);
+}
+
+void XBeeGateway::on_pressure(bool pause)
+{
+    _paused = pause;
+    /* Without RADIO_RTS wired only the forwarding pauses */
+    if (_rts.is_connected()) {
+        _rts = pause ? 1 : 0;
+    }
+}
+
+void XBeeGateway::on_association(const XBeeResponse &response)
+{
+    if (response.status != 0) {
+        printf("XBee: association query failed: %d\n", response.status);
+    } else if (response.len < 1) {
+        printf("XBee: association query returned no value\n");
+    } else if (response.data[0] == 0) {
+        printf("XBee: joined the network\n");
+    } else {
+        printf("XBee: not joined, association indication 0x%02X\n", response.data[0]);
+    }
+}
+
+void XBeeGateway::radio_task()
+{
+    while (true) {
+        if (_paused) {
+            Thread::wait(PAUSED_POLL_MS);
+        } else {
+            /* One packet at a time, so parsing stops as soon as the pool is full */
+            _radio.process(RADIO_WAIT_MS, 1);
+        }
+        _requests.poll();
+    }
+}
+
+void XBeeGateway::forward_task()
+{
+    while (true) {
+        Frame *frame = _pipeline.get(_aggregator.wait_time(now_ms()));
+        _fragmenter.expire(now_ms());
+        if (MBED_CONF_APP_XBEE_BATCH_WINDOW > 0) {
+            /* Longer batches while the uplink is slow, shorter ones while it is fast */
+            _aggregator.set_window(_mqtt.pacer().adapt(MBED_CONF_APP_XBEE_BATCH_WINDOW_MIN,
+                                                       MBED_CONF_APP_XBEE_BATCH_WINDOW));
+        }
+        if (frame != NULL) {
+            _downlink.node_heard(frame->addr64, frame->addr16);
+
+            /* Fragments come back through dispatch() once their message is complete */
+            if (!_fragmenter.handle(frame->addr64, frame->addr16, frame->data, frame->len,
+                                    now_ms())) {
+                dispatch(frame->addr64, frame->addr16, frame->data, frame->len);
+            }
+            _pipeline.free(frame);
+        }
+        _aggregator.flush_due(now_ms());
+    }
+}
+
+void XBeeGateway::dispatch(uint64_t addr64, uint16_t addr16, const uint8_t *data, size_t len)
+{
+#if MBED_CONF_APP_XBEE_PRIORITY_TAG >= 0
+    bool priority = len > 0 && data[0] == MBED_CONF_APP_XBEE_PRIORITY_TAG;
+#else
+    bool priority = false;
+#endif
+
+    XBeeTransport *transport = _transport;
+    if (transport != NULL && transport->deliver(addr64, data, len)) {
+        /* A byte stream with that node */
+    } else if (MBED_CONF_APP_MQTTSN_ENABLED && _mqttsn.handle(addr64, addr16, data, len)) {
+        /* Published under its own topic, or a control message */
+    } else if (MBED_CONF_APP_XBEE_BATCH_WINDOW == 0) {
+        publish(addr64, data, len, 1, priority);
+    } else {
+        _aggregator.add(addr64, data, len, priority, now_ms());
+    }
+}
+
+void XBeeGateway::publish(uint64_t node, const uint8_t *payload, size_t len, uint32_t frames,
+                          bool priority)
+{
+    char topic[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1];
+
+    /* printf may lack %llx, print the address in two halves */
+    snprintf(topic, sizeof (topic), "%s/%08lX%08lX", _topic_prefix,
+             (unsigned long) (node >> 32), (unsigned long) node);
+    int ret = _mqtt.publish(topic, payload, len, MQTT::QOS0,
+                            priority ? PUBLISH_ALARM : PUBLISH_TELEMETRY);
+
+    _mutex.lock();
+    if (ret == 0) {
+        _stats.forwarded += frames;
+        _stats.messages++;
+    } else {
+        _stats.rejected += frames;
+    }
+    _mutex.unlock();
+}
+
+uint32_t XBeeGateway::now_ms()
+{
+    return _clock.read_high_resolution_us() / 1000;
+}
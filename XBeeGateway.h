@@ -0,0 +1,243 @@
+/*
+ *  Forwards XBee sensor frames to the MQTT uplink
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeGateway.h
+ *  \brief XBee ZigBee to MQTT gateway
+ *  Two threads are connected by a bounded pipeline. The radio thread runs
+ *  above normal priority and only moves frames from the XBeeRadio's receive
+ *  ring into the pipeline, so it keeps up with a burst even while the
+ *  uplink is busy in a TLS handshake. The forward thread takes frames out
+ *  of the pipeline and publishes them, one topic per sensor node. With a
+ *  batch window set, the frames of a node are collected by a
+ *  FrameAggregator and published together as one CBOR message; frames
+ *  whose first byte is the priority tag close their batch within the
+ *  priority latency. Either way those are published as alarms, ahead of
+ *  the telemetry and of the offline backlog.
+ *
+ *  The pipeline is a FramePool. Once it is full, the radio thread stops
+ *  parsing and the bytes wait in the receive ring. When RADIO_RTS is wired
+ *  to the module's RTS input, it is de-asserted at the same time, so the
+ *  module holds further frames back instead of overrunning the ring.
+ *
+ *  The radio thread also completes the XBeeRequests made through
+ *  requests(), whose responses arrive in the same ring.
+ */
+
+#ifndef __XBEE_GATEWAY_H_
+#define __XBEE_GATEWAY_H_
+
+#include "mbed.h"
+
+#include "ConnectionManager.h"
+#include "DownlinkRouter.h"
+#include "FrameAggregator.h"
+#include "FramePool.h"
+#include "MqttSnGateway.h"
+#include "XBeeFragmenter.h"
+#include "XBeeRadio.h"
+#include "XBeeRequests.h"
+#include "XBeeTransport.h"
+
+/** Baud rate of the XBee module's serial interface */
+#ifndef MBED_CONF_APP_XBEE_BAUD_RATE
+#define MBED_CONF_APP_XBEE_BAUD_RATE 9600
+#endif
+
+/** Number of frames the pool between radio and uplink holds */
+#ifndef MBED_CONF_APP_XBEE_FRAME_POOL_SIZE
+#define MBED_CONF_APP_XBEE_FRAME_POOL_SIZE 16
+#endif
+
+/** Frames are published to <prefix>/<64 bit address of the node> */
+#ifndef MBED_CONF_APP_XBEE_TOPIC_PREFIX
+#define MBED_CONF_APP_XBEE_TOPIC_PREFIX "xbee"
+#endif
+
+/** First data byte marking a priority frame, or -1 for none */
+#ifndef MBED_CONF_APP_XBEE_PRIORITY_TAG
+#define MBED_CONF_APP_XBEE_PRIORITY_TAG -1
+#endif
+
+/**
+ * Gateway statistics
+ */
+struct XBeeGatewayStats {
+    uint32_t received;      /**< Frames received from the radio */
+    uint32_t forwarded;     /**< Frames handed to the uplink */
+    uint32_t rejected;      /**< Frames the uplink did not accept */
+    uint32_t messages;      /**< Messages published, a batch counts once */
+    FramePoolStats pool;    /**< The pipeline, drops are frames lost to a burst */
+    XBeeRadioStats radio;   /**< The link to the module */
+    XBeeRequestStats requests;
+    FrameAggregatorStats batching;
+    MqttSnStats mqttsn;
+    XBeeFragmenterStats fragments;
+    DownlinkStats downlink;
+};
+
+/**
+ * \brief XBeeGateway publishes the data frames of XBee sensor nodes.
+ */
+class XBeeGateway {
+public:
+    /**
+     * XBeeGateway Constructor
+     *
+     * @param[in] mqtt The uplink to publish to
+     * @param[in] topic_prefix Prefix of the topics, kept by reference
+     */
+    XBeeGateway(ConnectionManager &mqtt,
+                const char *topic_prefix = MBED_CONF_APP_XBEE_TOPIC_PREFIX);
+    /**
+     * XBeeGateway Destructor
+     */
+    ~XBeeGateway();
+
+    /**
+     * Initialize the radio and start the radio and forward threads.
+     *
+     * @return 0 on success, or -1 on failure
+     */
+    int start();
+
+    /**
+     * A snapshot of the statistics
+     */
+    XBeeGatewayStats stats();
+
+    /**
+     * AT commands and transmissions to the module, completed on the radio thread
+     */
+    XBeeRequests &requests() {
+        return _requests;
+    }
+
+    /**
+     * Sends messages larger than a frame to the nodes, from any thread but
+     * the forward thread
+     */
+    XBeeFragmenter &fragmenter() {
+        return _fragmenter;
+    }
+
+    /**
+     * Routes the broker's messages to the nodes
+     */
+    DownlinkRouter &downlink() {
+        return _downlink;
+    }
+
+    /**
+     * Pass a node's messages to a transport rather than publishing them
+     *
+     * @param[in] transport The transport, NULL for none; must outlive the gateway
+     */
+    void attach_transport(XBeeTransport *transport) {
+        _transport = transport;
+    }
+
+    /**
+     * Start measuring the pipeline high-water mark again
+     */
+    void reset_high_water();
+
+    /**
+     * Print the statistics
+     */
+    void print_stats();
+
+protected:
+    /** A frame on its way from the radio to the uplink */
+    struct Frame {
+        uint64_t addr64;
+        uint16_t addr16;
+        bool broadcast;
+        uint16_t len;
+        uint8_t data[MAX_FRAME_PAYLOAD_LEN];
+    };
+
+    /**
+     * Queue a received frame, called on the radio thread, never blocks
+     */
+    void on_frame(const XBeeRxPacket &packet);
+
+    /**
+     * Pause or resume the module through its RTS input
+     */
+    void on_pressure(bool pause);
+
+    /**
+     * Report the association indication, queried at start
+     */
+    void on_association(const XBeeResponse &response);
+
+    /**
+     * Radio thread: parse the frames received, while the pipeline has room
+     */
+    void radio_task();
+
+    /**
+     * Forward thread: publish the frames in the pipeline
+     */
+    void forward_task();
+
+    /**
+     * Handle a frame, or a message assembled from fragments, on the forward thread
+     */
+    void dispatch(uint64_t addr64, uint16_t addr16, const uint8_t *data, size_t len);
+
+    /**
+     * Publish a node's frames, on the forward thread
+     *
+     * @param[in] node The node's 64 bit address
+     * @param[in] payload A frame, or a batch of them
+     * @param[in] len The payload length
+     * @param[in] frames The number of frames in the payload
+     * @param[in] priority Publish it as an alarm, ahead of the telemetry
+     */
+    void publish(uint64_t node, const uint8_t *payload, size_t len, uint32_t frames,
+                 bool priority);
+
+    /**
+     * Milliseconds on the gateway's clock, wrapping at 2^32
+     */
+    uint32_t now_ms();
+
+protected:
+    ConnectionManager &_mqtt;
+    const char *_topic_prefix;
+    XBeeRadio _radio;
+    XBeeRequests _requests;
+    MqttSnGateway _mqttsn;
+    XBeeFragmenter _fragmenter;
+    DownlinkRouter _downlink;
+    XBeeTransport *volatile _transport;
+
+    FramePool<Frame, MBED_CONF_APP_XBEE_FRAME_POOL_SIZE> _pipeline;
+    DigitalOut _rts;                /**< Active low, the module sends while it is 0 */
+    volatile bool _paused;          /**< The pipeline is full */
+    Thread _radio_thread;
+    Thread _forward_thread;
+    FrameAggregator _aggregator;
+    Timer _clock;
+
+    Mutex _mutex;                   /**< Guards the statistics */
+    XBeeGatewayStats _stats;
+};
+
+#endif /* __XBEE_GATEWAY_H_ */
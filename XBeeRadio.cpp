@@ -0,0 +1,147 @@
+/*
+ *  XBee module in API mode over a DMA driven UART
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "XBeeRadio.h"
+
+namespace {
+
+/* Time the module needs after a reset before it takes frames */
+const uint32_t RESET_PULSE_MS = 10;
+const uint32_t RESET_BOOT_MS = 500;
+
+/* Receive packet layout: type, 64 bit address, 16 bit address, options */
+const uint16_t RX_PACKET_HEADER_LEN = 12;
+
+}
+
+XBeeRadio::XBeeRadio(PinName tx, PinName rx, PinName reset, int baud) :
+        _serial(tx, rx, baud), _reset(reset, 1), _reset_pin(reset),
+        _parser(_frame, sizeof (_frame), MBED_CONF_APP_XBEE_API_ESCAPED),
+        _read(0), _max_packets(0), _rx_packets(0), _other_frames(0), _overruns(0)
+{
+    _parser.set_handler(&XBeeRadio::frame_handler, this);
+}
+
+int XBeeRadio::init()
+{
+    if (_reset_pin != NC) {
+        _reset = 0;
+        Thread::wait(RESET_PULSE_MS);
+        _reset = 1;
+        Thread::wait(RESET_BOOT_MS);
+    }
+
+    _read = _serial.write_position();
+    _serial.consume(_read);
+    return _serial.start(callback(this, &XBeeRadio::on_rx_event));
+}
+
+uint32_t XBeeRadio::process(uint32_t timeout_ms, uint32_t max_packets)
+{
+    uint32_t write = _serial.write_position();
+    if (write == _read) {
+        _rx_event.wait(timeout_ms);
+        write = _serial.write_position();
+    }
+
+    if (write - _read > _serial.size()) {
+        /* The receiver lapped the parser, what is in the ring is not contiguous */
+        _overruns++;
+        _parser.reset();
+        _read = write;
+        _serial.consume(_read);
+        return 0;
+    }
+
+    uint32_t delivered = _rx_packets;
+    _max_packets = max_packets;
+    _read = _parser.scan(_serial.buffer(), _serial.size(), _read, write);
+    _serial.consume(_read);
+    return _rx_packets - delivered;
+}
+
+int XBeeRadio::send_frame(const uint8_t *frame, uint16_t len)
+{
+    _tx_mutex.lock();
+    size_t n = XBeeApiParser::encode(frame, len, _tx_buf, sizeof (_tx_buf),
+                                     MBED_CONF_APP_XBEE_API_ESCAPED);
+    for (size_t i = 0; i < n; i++) {
+        _serial.putc(_tx_buf[i]);
+    }
+    _tx_mutex.unlock();
+
+    return n > 0 ? 0 : -1;
+}
+
+XBeeRadioStats XBeeRadio::stats()
+{
+    XBeeRadioStats s;
+    s.frames = _parser.frames();
+    s.rx_packets = _rx_packets;
+    s.other_frames = _other_frames;
+    s.checksum_errors = _parser.checksum_errors();
+    s.length_errors = _parser.length_errors();
+    s.discarded = _parser.discarded();
+    s.overruns = _overruns;
+    s.dma = _serial.is_dma();
+    return s;
+}
+
+void XBeeRadio::frame_handler(void *context, const uint8_t *frame, uint16_t len)
+{
+    static_cast<XBeeRadio *>(context)->on_frame(frame, len);
+}
+
+void XBeeRadio::on_frame(const uint8_t *frame, uint16_t len)
+{
+    if (frame[0] != FRAME_RX_PACKET) {
+        _other_frames++;
+        if (_frame_cb) {
+            _frame_cb(frame, len);
+        }
+        return;
+    }
+    if (len < RX_PACKET_HEADER_LEN) {
+        _other_frames++;
+        return;
+    }
+
+    XBeeRxPacket packet;
+    packet.addr64 = 0;
+    for (int i = 1; i <= 8; i++) {
+        packet.addr64 = (packet.addr64 << 8) | frame[i];
+    }
+    packet.addr16 = (frame[9] << 8) | frame[10];
+    packet.options = frame[11];
+    packet.data = frame + RX_PACKET_HEADER_LEN;
+    packet.len = len - RX_PACKET_HEADER_LEN;
+
+    _rx_packets++;
+    if (_receive_cb) {
+        _receive_cb(packet);
+    }
+
+    if (--_max_packets == 0) {
+        _parser.stop();
+    }
+}
+
+void XBeeRadio::on_rx_event()
+{
+    _rx_event.release();
+}
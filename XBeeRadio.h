@@ -0,0 +1,173 @@
+/*
+ *  XBee module in API mode over a DMA driven UART
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeRadio.h
+ *  \brief The link to the XBee module
+ *  Bytes from the module are received into a SerialRxRing, and the API
+ *  frames are found by an XBeeApiParser scanning that ring in the thread
+ *  calling process(). ZigBee receive packets are handed to the receive
+ *  callback, with their data still in the parser's frame buffer; any other
+ *  frame, a response to a request for one, goes to the frame callback.
+ */
+
+#ifndef __XBEE_RADIO_H_
+#define __XBEE_RADIO_H_
+
+#include "mbed.h"
+#include "config.h"
+
+#include "SerialRxRing.h"
+#include "XBeeApiParser.h"
+
+/** Use API mode 2, with escaped bytes (AP=2) instead of AP=1 */
+#ifndef MBED_CONF_APP_XBEE_API_ESCAPED
+#define MBED_CONF_APP_XBEE_API_ESCAPED 0
+#endif
+
+/**
+ * A ZigBee receive packet (frame type 0x90)
+ */
+struct XBeeRxPacket {
+    uint64_t addr64;        /**< 64 bit address of the sender */
+    uint16_t addr16;        /**< 16 bit network address of the sender */
+    uint8_t options;        /**< Receive options, 0x02 for a broadcast */
+    const uint8_t *data;    /**< The RF data, valid during the callback */
+    uint16_t len;           /**< The RF data length */
+};
+
+/**
+ * Link statistics
+ */
+struct XBeeRadioStats {
+    uint32_t frames;            /**< API frames with a valid checksum */
+    uint32_t rx_packets;        /**< Receive packets delivered */
+    uint32_t other_frames;      /**< Frames of other types */
+    uint32_t checksum_errors;
+    uint32_t length_errors;
+    uint32_t discarded;         /**< Bytes outside of frames */
+    uint32_t overruns;          /**< Times the ring was overwritten before parsing */
+    bool dma;                   /**< Bytes arrive by DMA */
+};
+
+/**
+ * \brief XBeeRadio sends and receives API frames.
+ */
+class XBeeRadio {
+public:
+    /** Frame types */
+    static const uint8_t FRAME_RX_PACKET = 0x90;
+
+    /** Receive option of a broadcast packet */
+    static const uint8_t RX_OPTION_BROADCAST = 0x02;
+
+    /**
+     * XBeeRadio Constructor
+     *
+     * @param[in] tx The pin connected to the module's DIN
+     * @param[in] rx The pin connected to the module's DOUT
+     * @param[in] reset The pin connected to the module's reset, or NC
+     * @param[in] baud The baud rate
+     */
+    XBeeRadio(PinName tx, PinName rx, PinName reset, int baud);
+
+    /**
+     * Reset the module and start receiving
+     *
+     * @return 0 on success, or a negative error code on failure
+     */
+    int init();
+
+    /**
+     * Set the callback for receive packets, called on the process() thread
+     */
+    void attach(Callback<void(const XBeeRxPacket &)> cb) {
+        _receive_cb = cb;
+    }
+
+    /**
+     * Set the callback for the frames that are not receive packets, called
+     * on the process() thread with the frame from its type on
+     */
+    void attach_frame(Callback<void(const uint8_t *, uint16_t)> cb) {
+        _frame_cb = cb;
+    }
+
+    /**
+     * Parse the bytes received, waiting for some if there are none
+     *
+     * @param[in] timeout_ms How long to wait for data
+     * @param[in] max_packets Return after delivering this many receive packets
+     * @return The number of receive packets delivered
+     */
+    uint32_t process(uint32_t timeout_ms, uint32_t max_packets = 0xFFFFFFFF);
+
+    /**
+     * Send an API frame
+     *
+     * @param[in] frame The frame data, from the frame type on
+     * @param[in] len The frame data length
+     * @return 0 on success, or -1 if the frame is too long
+     */
+    int send_frame(const uint8_t *frame, uint16_t len);
+
+    /**
+     * A snapshot of the statistics
+     */
+    XBeeRadioStats stats();
+
+protected:
+    /**
+     * Parser callback
+     */
+    static void frame_handler(void *context, const uint8_t *frame, uint16_t len);
+
+    /**
+     * Dispatch a complete API frame
+     */
+    void on_frame(const uint8_t *frame, uint16_t len);
+
+    /**
+     * Called from interrupt context when bytes arrived
+     */
+    void on_rx_event();
+
+protected:
+    /** Room for the largest receive packet, type and addressing included */
+    static const uint16_t MAX_FRAME_LEN = MAX_FRAME_PAYLOAD_LEN + 18;
+
+    SerialRxRing _serial;
+    DigitalOut _reset;
+    PinName _reset_pin;
+    Semaphore _rx_event;
+
+    XBeeApiParser _parser;
+    uint8_t _frame[MAX_FRAME_LEN];
+    uint32_t _read;                 /**< Ring position parsed up to */
+    uint32_t _max_packets;          /**< Left in the current process() */
+
+    Mutex _tx_mutex;
+    uint8_t _tx_buf[2 * MAX_FRAME_LEN + 4];
+
+    Callback<void(const XBeeRxPacket &)> _receive_cb;
+    Callback<void(const uint8_t *, uint16_t)> _frame_cb;
+    uint32_t _rx_packets;
+    uint32_t _other_frames;
+    uint32_t _overruns;
+};
+
+#endif /* __XBEE_RADIO_H_ */
@@ -0,0 +1,351 @@
+/*
+ *  Asynchronous XBee requests matched to their responses by frame ID
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "XBeeRequests.h"
+
+namespace {
+
+/* Transmit options of the remote AT command request */
+const uint8_t REMOTE_AT_APPLY_CHANGES = 0x02;
+
+void put_addr64(uint8_t *p, uint64_t addr64)
+{
+    for (int i = 7; i >= 0; i--) {
+        *p++ = addr64 >> (8 * i);
+    }
+}
+
+uint64_t get_addr64(const uint8_t *p)
+{
+    uint64_t addr64 = 0;
+    for (int i = 0; i < 8; i++) {
+        addr64 = (addr64 << 8) | p[i];
+    }
+    return addr64;
+}
+
+}
+
+XBeeRequests::XBeeRequests(XBeeRadio &radio) :
+        _radio(radio), _next_id(1)
+{
+    memset(&_stats, 0, sizeof (_stats));
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS; i++) {
+        _pending[i].frame_id = 0;
+    }
+    _clock.start();
+    _radio.attach_frame(callback(this, &XBeeRequests::on_frame));
+}
+
+int XBeeRequests::at_command(const char *command, const uint8_t *param, uint16_t len,
+                             response_cb_t cb)
+{
+    if (len > MAX_REQUEST_LEN - 4) {
+        return XBEE_REQUEST_ERROR_SEND;
+    }
+
+    _frame_mutex.lock();
+    Pending *pending = reserve(FRAME_AT_RESPONSE, cb);
+    if (pending == NULL) {
+        _frame_mutex.unlock();
+        return XBEE_REQUEST_ERROR_BUSY;
+    }
+
+    _frame[0] = FRAME_AT_COMMAND;
+    _frame[1] = pending->frame_id;
+    _frame[2] = command[0];
+    _frame[3] = command[1];
+    if (len > 0) {
+        memcpy(_frame + 4, param, len);
+    }
+    int ret = send(pending, _frame, 4 + len);
+    _frame_mutex.unlock();
+
+    return ret;
+}
+
+int XBeeRequests::remote_at_command(uint64_t addr64, uint16_t addr16, const char *command,
+                                    const uint8_t *param, uint16_t len, bool apply,
+                                    response_cb_t cb)
+{
+    if (len > MAX_REQUEST_LEN - 15) {
+        return XBEE_REQUEST_ERROR_SEND;
+    }
+
+    _frame_mutex.lock();
+    Pending *pending = reserve(FRAME_REMOTE_AT_RESPONSE, cb);
+    if (pending == NULL) {
+        _frame_mutex.unlock();
+        return XBEE_REQUEST_ERROR_BUSY;
+    }
+
+    _frame[0] = FRAME_REMOTE_AT_COMMAND;
+    _frame[1] = pending->frame_id;
+    put_addr64(_frame + 2, addr64);
+    _frame[10] = addr16 >> 8;
+    _frame[11] = addr16;
+    _frame[12] = apply ? REMOTE_AT_APPLY_CHANGES : 0;
+    _frame[13] = command[0];
+    _frame[14] = command[1];
+    if (len > 0) {
+        memcpy(_frame + 15, param, len);
+    }
+    int ret = send(pending, _frame, 15 + len);
+    _frame_mutex.unlock();
+
+    return ret;
+}
+
+int XBeeRequests::send_data(uint64_t addr64, uint16_t addr16, const uint8_t *data, uint16_t len,
+                            response_cb_t cb)
+{
+    if (len > MAX_REQUEST_LEN - 14) {
+        return XBEE_REQUEST_ERROR_SEND;
+    }
+
+    _frame_mutex.lock();
+    Pending *pending = NULL;
+    if (cb) {
+        if ((pending = reserve(FRAME_TX_STATUS, cb)) == NULL) {
+            _frame_mutex.unlock();
+            return XBEE_REQUEST_ERROR_BUSY;
+        }
+    }
+
+    /* Frame ID 0 tells the module not to report the transmit status */
+    _frame[0] = FRAME_TX_REQUEST;
+    _frame[1] = pending != NULL ? pending->frame_id : 0;
+    put_addr64(_frame + 2, addr64);
+    _frame[10] = addr16 >> 8;
+    _frame[11] = addr16;
+    _frame[12] = 0;             /* Maximum radius */
+    _frame[13] = 0;             /* Options */
+    memcpy(_frame + 14, data, len);
+    int ret = send(pending, _frame, 14 + len);
+    _frame_mutex.unlock();
+
+    return ret;
+}
+
+bool XBeeRequests::parse_addr64(const char *text, size_t len, uint64_t *addr64)
+{
+    if (len != 16) {
+        return false;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        uint8_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    *addr64 = value;
+    return true;
+}
+
+void XBeeRequests::poll()
+{
+    uint32_t now = _clock.read_high_resolution_us() / 1000;
+
+    while (true) {
+        Pending *expired = NULL;
+
+        _mutex.lock();
+        for (size_t i = 0; i < MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS; i++) {
+            if (_pending[i].frame_id != 0 && (int32_t) (now - _pending[i].deadline_ms) >= 0) {
+                expired = &_pending[i];
+                break;
+            }
+        }
+        if (expired == NULL) {
+            _mutex.unlock();
+            return;
+        }
+
+        XBeeResponse response;
+        memset(&response, 0, sizeof (response));
+        response.frame_id = expired->frame_id;
+        response.status = XBEE_REQUEST_ERROR_TIMEOUT;
+        response_cb_t cb = expired->cb;
+        expired->frame_id = 0;
+        _stats.timeouts++;
+        _mutex.unlock();
+
+        /* Outside the lock, the callback may well make the next request */
+        cb(response);
+    }
+}
+
+uint32_t XBeeRequests::pending()
+{
+    uint32_t count = 0;
+
+    _mutex.lock();
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS; i++) {
+        if (_pending[i].frame_id != 0) {
+            count++;
+        }
+    }
+    _mutex.unlock();
+
+    return count;
+}
+
+XBeeRequestStats XBeeRequests::stats()
+{
+    _mutex.lock();
+    XBeeRequestStats stats = _stats;
+    _mutex.unlock();
+    return stats;
+}
+
+XBeeRequests::Pending *XBeeRequests::reserve(uint8_t response_type, response_cb_t cb)
+{
+    Pending *slot = NULL;
+    uint32_t in_use = 0;
+
+    _mutex.lock();
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS; i++) {
+        if (_pending[i].frame_id != 0) {
+            in_use++;
+        } else if (slot == NULL) {
+            slot = &_pending[i];
+        }
+    }
+    if (slot == NULL) {
+        _stats.busy++;
+        _mutex.unlock();
+        return NULL;
+    }
+
+    /* Next ID not pending, there are far fewer slots than IDs */
+    uint8_t id;
+    bool taken;
+    do {
+        id = _next_id++;
+        if (_next_id == 0) {
+            _next_id = 1;
+        }
+        taken = false;
+        for (size_t i = 0; i < MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS; i++) {
+            taken |= _pending[i].frame_id == id;
+        }
+    } while (taken);
+
+    slot->frame_id = id;
+    slot->response_type = response_type;
+    slot->deadline_ms = _clock.read_high_resolution_us() / 1000 + MBED_CONF_APP_XBEE_REQUEST_TIMEOUT;
+    slot->cb = cb;
+    _stats.sent++;
+    if (in_use + 1 > _stats.max_pending) {
+        _stats.max_pending = in_use + 1;
+    }
+    _mutex.unlock();
+
+    return slot;
+}
+
+int XBeeRequests::send(Pending *pending, const uint8_t *frame, uint16_t len)
+{
+    if (_radio.send_frame(frame, len) != 0) {
+        if (pending != NULL) {
+            _mutex.lock();
+            pending->frame_id = 0;
+            _stats.sent--;
+            _mutex.unlock();
+        }
+        return XBEE_REQUEST_ERROR_SEND;
+    }
+    return frame[1];
+}
+
+void XBeeRequests::on_frame(const uint8_t *frame, uint16_t len)
+{
+    XBeeResponse response;
+    memset(&response, 0, sizeof (response));
+    response.frame_type = frame[0];
+    response.addr16 = UNKNOWN_ADDR16;
+
+    switch (frame[0]) {
+        case FRAME_AT_RESPONSE:
+            if (len < 5) {
+                return;
+            }
+            response.command[0] = frame[2];
+            response.command[1] = frame[3];
+            response.status = frame[4];
+            response.data = frame + 5;
+            response.len = len - 5;
+            break;
+        case FRAME_TX_STATUS:
+            if (len < 7) {
+                return;
+            }
+            response.addr16 = (frame[2] << 8) | frame[3];
+            response.retries = frame[4];
+            response.status = frame[5];
+            break;
+        case FRAME_REMOTE_AT_RESPONSE:
+            if (len < 15) {
+                return;
+            }
+            response.addr64 = get_addr64(frame + 2);
+            response.addr16 = (frame[10] << 8) | frame[11];
+            response.command[0] = frame[12];
+            response.command[1] = frame[13];
+            response.status = frame[14];
+            response.data = frame + 15;
+            response.len = len - 15;
+            break;
+        default:
+            /* Modem status and the like, nobody asked */
+            return;
+    }
+    response.frame_id = frame[1];
+
+    _mutex.lock();
+    Pending *match = NULL;
+    for (size_t i = 0; i < MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS; i++) {
+        if (response.frame_id != 0 && _pending[i].frame_id == response.frame_id &&
+            _pending[i].response_type == response.frame_type) {
+            match = &_pending[i];
+            break;
+        }
+    }
+    if (match == NULL) {
+        /* Answered after its deadline, most likely */
+        _stats.unmatched++;
+        _mutex.unlock();
+        return;
+    }
+    response_cb_t cb = match->cb;
+    match->frame_id = 0;
+    _stats.completed++;
+    _mutex.unlock();
+
+    cb(response);
+}
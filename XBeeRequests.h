@@ -0,0 +1,211 @@
+/*
+ *  Asynchronous XBee requests matched to their responses by frame ID
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeRequests.h
+ *  \brief Non-blocking AT commands and transmissions
+ *  XBeeLib waits up to SYNC_OPS_TIMEOUT_MS for the response to every AT
+ *  command and transmission, so a slow or absent node stalls the caller
+ *  for seconds. Here a request only sends its frame and returns the frame
+ *  ID; the response is matched by that ID when the radio thread parses it,
+ *  and the request's callback is called with it. Up to
+ *  xbee-max-pending-requests requests can be outstanding, each with its
+ *  own deadline.
+ */
+
+#ifndef __XBEE_REQUESTS_H_
+#define __XBEE_REQUESTS_H_
+
+#include "mbed.h"
+#include "config.h"
+
+#include "XBeeRadio.h"
+
+/** Requests that can wait for their response at the same time */
+#ifndef MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS
+#define MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS 8
+#endif
+
+/** Milliseconds a request waits for its response */
+#ifndef MBED_CONF_APP_XBEE_REQUEST_TIMEOUT
+#define MBED_CONF_APP_XBEE_REQUEST_TIMEOUT SYNC_OPS_TIMEOUT_MS
+#endif
+
+/** Request errors, besides XBeeRadio's */
+#define XBEE_REQUEST_ERROR_BUSY     -3101   /**< Every frame ID is in use */
+#define XBEE_REQUEST_ERROR_TIMEOUT  -3102   /**< No response before the deadline */
+#define XBEE_REQUEST_ERROR_SEND     -3103   /**< The frame could not be sent */
+
+/**
+ * The response to a request
+ */
+struct XBeeResponse {
+    uint8_t frame_id;
+    uint8_t frame_type;     /**< The response frame type, 0 on timeout */
+    int status;             /**< The module's status byte, or XBEE_REQUEST_ERROR_TIMEOUT */
+    uint64_t addr64;        /**< The remote node, for remote commands */
+    uint16_t addr16;        /**< The remote or destination network address */
+    char command[2];        /**< The AT command */
+    uint8_t retries;        /**< Transmit retries, for transmit status */
+    const uint8_t *data;    /**< Command data, valid during the callback */
+    uint16_t len;
+};
+
+/**
+ * Request statistics
+ */
+struct XBeeRequestStats {
+    uint32_t sent;
+    uint32_t completed;     /**< Answered, whatever their status */
+    uint32_t timeouts;
+    uint32_t busy;          /**< Refused because every slot was pending */
+    uint32_t unmatched;     /**< Responses without a pending request */
+    uint32_t max_pending;   /**< Most requests outstanding at once */
+};
+
+/**
+ * \brief XBeeRequests sends requests and calls back with their responses.
+ *
+ * Requests may be made from any thread. Callbacks are called on the thread
+ * running XBeeRadio::process(), which must also call poll() regularly.
+ */
+class XBeeRequests {
+public:
+    typedef Callback<void(const XBeeResponse &)> response_cb_t;
+
+    /** Frame types */
+    static const uint8_t FRAME_AT_COMMAND = 0x08;
+    static const uint8_t FRAME_TX_REQUEST = 0x10;
+    static const uint8_t FRAME_REMOTE_AT_COMMAND = 0x17;
+    static const uint8_t FRAME_AT_RESPONSE = 0x88;
+    static const uint8_t FRAME_TX_STATUS = 0x8B;
+    static const uint8_t FRAME_REMOTE_AT_RESPONSE = 0x97;
+
+    /** Addresses */
+    static const uint64_t BROADCAST_ADDR64 = 0xFFFFULL;
+    static const uint16_t UNKNOWN_ADDR16 = 0xFFFE;
+
+    /**
+     * XBeeRequests Constructor
+     *
+     * @param[in] radio The radio to send through, its frame callback is taken
+     */
+    XBeeRequests(XBeeRadio &radio);
+
+    /**
+     * Send an AT command to the local module
+     *
+     * @param[in] command The two letter command
+     * @param[in] param The parameter, may be NULL
+     * @param[in] len The parameter length
+     * @param[in] cb Called with the AT command response
+     * @return The frame ID, or a negative error code
+     */
+    int at_command(const char *command, const uint8_t *param, uint16_t len, response_cb_t cb);
+
+    /**
+     * Send an AT command to a remote node
+     *
+     * @param[in] addr64 The node's 64 bit address
+     * @param[in] addr16 The node's network address, or UNKNOWN_ADDR16
+     * @param[in] command The two letter command
+     * @param[in] param The parameter, may be NULL
+     * @param[in] len The parameter length
+     * @param[in] apply Apply the change right away
+     * @param[in] cb Called with the remote command response
+     * @return The frame ID, or a negative error code
+     */
+    int remote_at_command(uint64_t addr64, uint16_t addr16, const char *command,
+                          const uint8_t *param, uint16_t len, bool apply, response_cb_t cb);
+
+    /**
+     * Transmit data to a node
+     *
+     * @param[in] addr64 The node's 64 bit address, or BROADCAST_ADDR64
+     * @param[in] addr16 The node's network address, or UNKNOWN_ADDR16
+     * @param[in] data The data
+     * @param[in] len The data length
+     * @param[in] cb Called with the transmit status, or NULL to not ask for one
+     * @return The frame ID, 0 without a callback, or a negative error code
+     */
+    int send_data(uint64_t addr64, uint16_t addr16, const uint8_t *data, uint16_t len,
+                  response_cb_t cb);
+
+    /**
+     * Parse a 64 bit address of exactly 16 hex digits
+     *
+     * @return true if the text was one
+     */
+    static bool parse_addr64(const char *text, size_t len, uint64_t *addr64);
+
+    /**
+     * Fail the requests past their deadline, call from the radio thread
+     */
+    void poll();
+
+    /**
+     * Number of requests waiting for their response
+     */
+    uint32_t pending();
+
+    /**
+     * A snapshot of the statistics
+     */
+    XBeeRequestStats stats();
+
+protected:
+    struct Pending {
+        uint8_t frame_id;       /**< 0 when the slot is free */
+        uint8_t response_type;
+        uint32_t deadline_ms;
+        response_cb_t cb;
+    };
+
+    /**
+     * Reserve a slot and a frame ID
+     *
+     * @return The slot, or NULL if none is free
+     */
+    Pending *reserve(uint8_t response_type, response_cb_t cb);
+
+    /**
+     * Send a request frame whose ID is in frame[1], releasing the slot on failure
+     */
+    int send(Pending *pending, const uint8_t *frame, uint16_t len);
+
+    /**
+     * Radio callback for frames other than receive packets
+     */
+    void on_frame(const uint8_t *frame, uint16_t len);
+
+protected:
+    /** A request frame with the largest payload */
+    static const uint16_t MAX_REQUEST_LEN = MAX_FRAME_PAYLOAD_LEN + 15;
+
+    XBeeRadio &_radio;
+    Timer _clock;
+
+    Mutex _mutex;                   /**< Guards the slots and the statistics */
+    Pending _pending[MBED_CONF_APP_XBEE_MAX_PENDING_REQUESTS];
+    uint8_t _next_id;
+
+    Mutex _frame_mutex;             /**< Guards the request being built and sent */
+    uint8_t _frame[MAX_REQUEST_LEN];
+    XBeeRequestStats _stats;
+};
+
+#endif /* __XBEE_REQUESTS_H_ */
@@ -0,0 +1,150 @@
+/*
+ *  Transport over the XBee network
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeTransport.h
+ *  \brief A byte stream with one node, see Transport.h
+ *  Every send() goes to the node as one message of the XBeeFragmenter,
+ *  and the messages from the node are appended to a receive ring that
+ *  recv() reads, so a client can run over the radio as it does over TCP,
+ *  with a node that bridges to a server for instance.
+ *
+ *  The transport does not take the fragmenter's callback: whoever has it
+ *  passes the node's messages on with deliver(), XBeeGateway does once
+ *  given the transport. The node is made a peer of the fragmenter.
+ */
+
+#ifndef __XBEE_TRANSPORT_H_
+#define __XBEE_TRANSPORT_H_
+
+#include "mbed.h"
+#include "Transport.h"
+#include "XBeeFragmenter.h"
+
+/** Bytes received from the node held until read, a power of two */
+#ifndef MBED_CONF_APP_XBEE_TRANSPORT_RX_SIZE
+#define MBED_CONF_APP_XBEE_TRANSPORT_RX_SIZE 512
+#endif
+
+/**
+ * \brief XBeeTransport exchanges a byte stream with one node.
+ *
+ * deliver() is called on the thread the messages are assembled on,
+ * send() and recv() on one other thread. send() blocks until the node
+ * acknowledged the message.
+ */
+class XBeeTransport {
+public:
+    /** The most bytes sent in one message */
+    static const size_t MAX_MESSAGE = XBeeFragmenter::MAX_FRAGMENTS *
+                                      (MBED_CONF_APP_XBEE_FRAGMENT_SIZE - XBeeFragmenter::HEADER_LEN);
+
+    /**
+     * XBeeTransport Constructor
+     *
+     * @param[in] fragmenter Sends the messages to the node
+     * @param[in] addr64 The node's 64 bit address
+     * @param[in] addr16 The node's network address, or XBeeRequests::UNKNOWN_ADDR16
+     */
+    XBeeTransport(XBeeFragmenter &fragmenter, uint64_t addr64,
+                  uint16_t addr16 = XBeeRequests::UNKNOWN_ADDR16) :
+            _fragmenter(fragmenter), _addr64(addr64), _addr16(addr16), _closed(false),
+            _overflow(false) {
+        _fragmenter.add_peer(addr64);
+    }
+
+    /**
+     * Take a message in if it is from the node
+     *
+     * @return true if it was, even if it did not fit
+     */
+    bool deliver(uint64_t addr64, const uint8_t *data, size_t len) {
+        if (addr64 != _addr64) {
+            return false;
+        }
+        if (!_closed && _rx.write(data, len) < len) {
+            /* A stream with a hole is of no use, the session fails */
+            _overflow = true;
+        }
+        return true;
+    }
+
+    /**
+     * Start over with an empty stream, while no message is delivered
+     */
+    void open() {
+        _rx.clear();
+        _closed = false;
+        _overflow = false;
+    }
+
+    /**
+     * Open the stream with the node, which bridges to the server itself
+     *
+     * @return 0
+     */
+    int connect(const char *hostname, uint16_t port) {
+        (void) hostname;
+        (void) port;
+        open();
+        return 0;
+    }
+
+    int send(const unsigned char *buf, size_t len) {
+        if (!is_connected()) {
+            return TRANSPORT_ERROR_CLOSED;
+        }
+        if (len > MAX_MESSAGE) {
+            len = MAX_MESSAGE;
+        }
+        int ret = _fragmenter.send(_addr64, _addr16, buf, len);
+        return ret < 0 ? ret : (int) len;
+    }
+
+    int recv(unsigned char *buf, size_t len) {
+        if (_overflow) {
+            return TRANSPORT_ERROR_OVERFLOW;
+        }
+        size_t n = _rx.read(buf, len);
+        if (n > 0 || len == 0) {
+            return (int) n;
+        }
+        return _closed ? 0 : TRANSPORT_ERROR_WOULD_BLOCK;
+    }
+
+    static bool would_block(int ret) {
+        return ret == TRANSPORT_ERROR_WOULD_BLOCK;
+    }
+
+    bool is_connected() const {
+        return !_closed && !_overflow;
+    }
+
+    void close() {
+        _closed = true;
+    }
+
+protected:
+    XBeeFragmenter &_fragmenter;
+    const uint64_t _addr64;
+    const uint16_t _addr16;
+    volatile bool _closed;
+    volatile bool _overflow;        /**< A message did not fit the ring */
+    TransportRing<MBED_CONF_APP_XBEE_TRANSPORT_RX_SIZE> _rx;
+};
+
+#endif /* __XBEE_TRANSPORT_H_ */
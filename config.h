@@ -16,7 +16,6 @@
 /** Library configuration options */
 #define ENABLE_LOGGING
 #define ENABLE_ASSERTIONS
-#define FRAME_BUFFER_SIZE           4
 #define MAX_FRAME_PAYLOAD_LEN       256
 
 #define SYNC_OPS_TIMEOUT_MS         2000
@@ -44,6 +43,10 @@
     #error "Please define RADIO_RX pin"
 #endif
 
+#if !defined(RADIO_RTS)
+    #define RADIO_RTS               NC  /* No flow control towards the XBee module */
+#endif
+
 #if !defined(RADIO_RESET)
     #define RADIO_RESET             NC
     #warning "RADIO_RESET not defined, defaulted to 'NC'"
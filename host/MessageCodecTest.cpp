@@ -0,0 +1,257 @@
+/*
+ *  Host test of the message codecs
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file MessageCodecTest.cpp
+ *  \brief Round trips a struct of every member type through CborFormat and
+ *  PackedFormat, checks the CBOR against bytes written by hand, and feeds
+ *  the decoders values out of range, strings too long and messages cut
+ *  short at every byte. Build and run with the Makefile in this directory.
+ */
+
+#include "MessageCodec.h"
+
+#include <stdio.h>
+
+namespace {
+
+struct Inner {
+    int8_t offset;
+    bool enabled;
+};
+
+struct Sample {
+    uint32_t time_ms;
+    int16_t temp;
+    uint8_t battery;
+    int32_t delta;
+    float level;
+    char name[8];
+    uint16_t counts[3];
+    Inner inner;
+};
+
+}
+
+template <> struct MessageSchema<Inner> {
+    typedef MessageFields<
+        MessageField<Inner, int8_t, &Inner::offset>,
+        MessageField<Inner, bool, &Inner::enabled> > Fields;
+};
+
+template <> struct MessageSchema<Sample> {
+    typedef MessageFields<
+        MessageField<Sample, uint32_t, &Sample::time_ms>,
+        MessageField<Sample, int16_t, &Sample::temp>,
+        MessageField<Sample, uint8_t, &Sample::battery>,
+        MessageField<Sample, int32_t, &Sample::delta>,
+        MessageField<Sample, float, &Sample::level>,
+        MessageField<Sample, char[8], &Sample::name>,
+        MessageField<Sample, uint16_t[3], &Sample::counts>,
+        MessageField<Sample, Inner, &Sample::inner> > Fields;
+};
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+Sample make_sample()
+{
+    Sample s;
+    memset(&s, 0, sizeof (s));
+    s.time_ms = 123456789;
+    s.temp = -2150;
+    s.battery = 97;
+    s.delta = -2147483647 - 1;
+    s.level = 0.75f;
+    strcpy(s.name, "node-7");
+    s.counts[0] = 0;
+    s.counts[1] = 23;
+    s.counts[2] = 65535;
+    s.inner.offset = -128;
+    s.inner.enabled = true;
+    return s;
+}
+
+bool same(const Sample &a, const Sample &b)
+{
+    return a.time_ms == b.time_ms && a.temp == b.temp && a.battery == b.battery &&
+           a.delta == b.delta && a.level == b.level && strcmp(a.name, b.name) == 0 &&
+           memcmp(a.counts, b.counts, sizeof (a.counts)) == 0 &&
+           a.inner.offset == b.inner.offset && a.inner.enabled == b.inner.enabled;
+}
+
+/** Encoded and decoded back, in full, and refused when cut short */
+template <typename Format>
+void test_round_trip(const char *format)
+{
+    char what[64];
+    Sample in = make_sample();
+    uint8_t buf[MessageCodec<Format, Sample>::MAX_LEN];
+    size_t len = MessageCodec<Format, Sample>::encode(in, buf);
+
+    Sample out;
+    memset(&out, 0x5A, sizeof (out));
+    snprintf(what, sizeof (what), "%s round trip", format);
+    check(MessageCodec<Format, Sample>::decode(buf, len, &out) == (int) len && same(in, out),
+          what);
+
+    bool refused = true;
+    for (size_t cut = 0; cut < len; cut++) {
+        refused = refused &&
+                  MessageCodec<Format, Sample>::decode(buf, cut, &out) == MESSAGE_ERROR_MALFORMED;
+    }
+    snprintf(what, sizeof (what), "%s cut short", format);
+    check(refused, what);
+}
+
+/** The CBOR of a small struct, as RFC 7049 spells it */
+void test_cbor_bytes()
+{
+    Inner inner = { -1, false };
+    uint8_t buf[MessageCodec<CborFormat, Inner>::MAX_LEN];
+    size_t len = MessageCodec<CborFormat, Inner>::encode(inner, buf);
+    static const uint8_t expected[] = { 0x82, 0x20, 0xF4 };
+    check(len == sizeof (expected) && memcmp(buf, expected, len) == 0, "CBOR of a struct");
+
+    uint16_t counts[3] = { 23, 24, 256 };
+    uint8_t array[MessageCodec<CborFormat, uint16_t[3]>::MAX_LEN];
+    len = MessageCodec<CborFormat, uint16_t[3]>::encode(counts, array);
+    static const uint8_t expected_array[] = { 0x83, 0x17, 0x18, 0x18, 0x19, 0x01, 0x00 };
+    check(len == sizeof (expected_array) && memcmp(array, expected_array, len) == 0,
+          "CBOR of an array, shortest forms");
+}
+
+/** Integers out of the range of their type are refused, nothing is written */
+void test_cbor_integers()
+{
+    int16_t i16 = 42;
+    static const uint8_t too_big[] = { 0x19, 0x80, 0x00 };          /* 32768 */
+    static const uint8_t too_small[] = { 0x39, 0x80, 0x00 };        /* -32769 */
+    static const uint8_t smallest[] = { 0x39, 0x7F, 0xFF };         /* -32768 */
+    static const uint8_t text[] = { 0x61, 'a' };
+    static const uint8_t long_head[] = { 0x1B, 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    check(MessageCodec<CborFormat, int16_t>::decode(too_big, 3, &i16) < 0 && i16 == 42,
+          "int16 too big, left as it was");
+    check(MessageCodec<CborFormat, int16_t>::decode(too_small, 3, &i16) < 0 && i16 == 42,
+          "int16 too small, left as it was");
+    check(MessageCodec<CborFormat, int16_t>::decode(text, 2, &i16) < 0 && i16 == 42,
+          "int16 of the wrong type, left as it was");
+    check(MessageCodec<CborFormat, int16_t>::decode(long_head, 9, &i16) < 0 && i16 == 42,
+          "64 bit head refused");
+    check(MessageCodec<CborFormat, int16_t>::decode(too_small, 2, &i16) < 0 && i16 == 42,
+          "head cut short");
+    check(MessageCodec<CborFormat, int16_t>::decode(smallest, 3, &i16) == 3 && i16 == -32768,
+          "smallest int16");
+
+    uint8_t u8 = 7;
+    static const uint8_t u8_too_big[] = { 0x19, 0x01, 0x00 };       /* 256 */
+    static const uint8_t negative[] = { 0x20 };                     /* -1 */
+    check(MessageCodec<CborFormat, uint8_t>::decode(u8_too_big, 3, &u8) < 0 && u8 == 7,
+          "uint8 too big, left as it was");
+    check(MessageCodec<CborFormat, uint8_t>::decode(negative, 1, &u8) < 0 && u8 == 7,
+          "negative uint8 refused");
+
+    int32_t i32 = 0;
+    static const uint8_t min32[] = { 0x3A, 0x7F, 0xFF, 0xFF, 0xFF };
+    static const uint8_t below32[] = { 0x3A, 0x80, 0x00, 0x00, 0x00 };
+    check(MessageCodec<CborFormat, int32_t>::decode(min32, 5, &i32) == 5 &&
+          i32 == -2147483647 - 1, "smallest int32");
+    check(MessageCodec<CborFormat, int32_t>::decode(below32, 5, &i32) < 0 &&
+          i32 == -2147483647 - 1, "below int32 refused");
+}
+
+/** A string fills its array less one char, the encoder and decoder agree */
+void test_strings()
+{
+    char full[8];
+    memcpy(full, "abcdefgh", 8);                /* No NUL */
+    char out[8];
+
+    uint8_t cbor[MessageCodec<CborFormat, char[8]>::MAX_LEN];
+    size_t len = MessageCodec<CborFormat, char[8]>::encode(full, cbor);
+    check(len == 8 && cbor[0] == 0x67, "CBOR string of 7 chars");
+    check(MessageCodec<CborFormat, char[8]>::decode(cbor, len, &out) == (int) len &&
+          strcmp(out, "abcdefg") == 0, "CBOR string decoded NUL terminated");
+
+    static const uint8_t eight[] = { 0x68, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' };
+    strcpy(out, "kept");
+    check(MessageCodec<CborFormat, char[8]>::decode(eight, sizeof (eight), &out) < 0 &&
+          strcmp(out, "kept") == 0, "CBOR string too long refused");
+    check(MessageCodec<CborFormat, char[8]>::decode(eight, 5, &out) < 0, "CBOR string cut short");
+
+    uint8_t packed[MessageCodec<PackedFormat, char[8]>::MAX_LEN];
+    len = MessageCodec<PackedFormat, char[8]>::encode(full, packed);
+    check(len == 8 && packed[7] == '\0', "packed string padded");
+    check(MessageCodec<PackedFormat, char[8]>::decode(packed, len, &out) == 8 &&
+          strcmp(out, "abcdefg") == 0, "packed string decoded");
+
+    memcpy(packed, "abcdefgh", 8);
+    strcpy(out, "kept");
+    check(MessageCodec<PackedFormat, char[8]>::decode(packed, 8, &out) < 0 &&
+          strcmp(out, "kept") == 0, "packed string without NUL refused");
+
+    char empty[8] = "";
+    len = MessageCodec<CborFormat, char[8]>::encode(empty, cbor);
+    check(len == 1 && cbor[0] == 0x60 &&
+          MessageCodec<CborFormat, char[8]>::decode(cbor, len, &out) == 1 && out[0] == '\0',
+          "empty string");
+}
+
+/** Packed values are sign extended, and left as they were when cut short */
+void test_packed()
+{
+    static const uint8_t bytes[] = { 0xFF, 0x7E };
+    int16_t i16 = 5;
+    check(MessageCodec<PackedFormat, int16_t>::decode(bytes, 2, &i16) == 2 && i16 == -130,
+          "packed sign extended");
+    i16 = 5;
+    check(MessageCodec<PackedFormat, int16_t>::decode(bytes, 1, &i16) < 0 && i16 == 5,
+          "packed int cut short, left as it was");
+
+    float f = 1.5f;
+    check(MessageCodec<PackedFormat, float>::decode(bytes, 2, &f) < 0 && f == 1.5f,
+          "packed float cut short, left as it was");
+
+    bool b = true;
+    static const uint8_t two[] = { 2 };
+    check(MessageCodec<PackedFormat, bool>::decode(two, 1, &b) < 0 && b, "packed bool of 2");
+}
+
+}
+
+int main()
+{
+    test_round_trip<CborFormat>("CBOR");
+    test_round_trip<PackedFormat>("packed");
+    test_cbor_bytes();
+    test_cbor_integers();
+    test_strings();
+    test_packed();
+
+    printf("%s\n", failures == 0 ? "MessageCodec: all tests passed" : "MessageCodec: FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+/*
+ *  Host test of the MQTT-SN topic table
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file MqttSnTopicsTest.cpp
+ *  \brief Registers many more names than the table holds, over clients
+ *  connecting and disconnecting, and checks that what a client registered
+ *  is its own, shared by ID with the others, and freed with the last of
+ *  them. Build and run with the Makefile in this directory.
+ */
+
+#include "MqttSnTopics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const size_t MAX_TOPICS = MBED_CONF_APP_MQTTSN_MAX_TOPICS;
+
+int failures = 0;
+
+void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+uint16_t add(MqttSnTopics &topics, uint8_t client, const char *name)
+{
+    return topics.add(client, name, strlen(name));
+}
+
+/** A client's registrations are freed as it goes, cycle after cycle */
+void test_cycles()
+{
+    MqttSnTopics topics;
+    check(topics.add_predefined(7, "status", 6), "predefined added");
+
+    char name[32];
+    uint32_t names = 0;
+    uint16_t last_id = 0;
+    bool ok = true;
+    for (int cycle = 0; cycle < 20; cycle++) {
+        /* Two clients fill the table with names of their own */
+        uint16_t ids[MAX_TOPICS];
+        for (size_t i = 0; i < MAX_TOPICS - 1; i++) {
+            snprintf(name, sizeof (name), "sensor/%lu", (unsigned long) names++);
+            ids[i] = add(topics, i % 2, name);
+            ok = ok && ids[i] != 0 && ids[i] != last_id;
+            last_id = ids[i];
+        }
+        snprintf(name, sizeof (name), "sensor/%lu", (unsigned long) names);
+        ok = ok && add(topics, 0, name) == 0;
+        ok = ok && topics.count() == MAX_TOPICS;
+
+        ok = ok && topics.find(0, ids[0], false) != NULL;
+        ok = ok && topics.find(1, ids[0], false) == NULL;
+        ok = ok && topics.find(1, 7, true) != NULL;
+
+        /* Disconnected, or evicted, the clients free the table */
+        topics.release(0);
+        ok = ok && topics.find(0, ids[0], false) == NULL;
+        ok = ok && topics.find(1, ids[1], false) != NULL;
+        topics.release(1);
+        ok = ok && topics.count() == 1;
+    }
+    check(ok, "registrations freed over connect and disconnect cycles");
+    check(names > 16, "more than 16 names");
+    check(topics.find(0, 7, true) != NULL && topics.find(5, 7, true) != NULL,
+          "predefined kept");
+}
+
+/** A name registered by two clients stays until both released it */
+void test_shared()
+{
+    MqttSnTopics topics;
+
+    uint16_t a = add(topics, 2, "room/temp");
+    check(a != 0 && add(topics, 3, "room/temp") == a, "same name, same ID");
+    check(add(topics, 2, "room/temp") == a, "registered twice by a client");
+    check(topics.count() == 1, "held once");
+
+    topics.release(2);
+    check(topics.find(3, a, false) != NULL, "kept for the other client");
+    check(topics.find(2, a, false) == NULL, "not for the released one");
+
+    topics.release(3);
+    check(topics.count() == 0 && topics.find(3, a, false) == NULL, "freed with the last");
+
+    uint16_t b = add(topics, 3, "room/temp");
+    check(b != 0 && b != a, "new ID when registered again");
+}
+
+/** Names too long or empty, and bad predefined topics */
+void test_limits()
+{
+    MqttSnTopics topics;
+    char name[MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 2];
+    memset(name, 'a', sizeof (name));
+
+    check(topics.add(0, name, MBED_CONF_APP_MQTT_MAX_TOPIC_LEN) != 0, "longest name");
+    check(topics.add(0, name, MBED_CONF_APP_MQTT_MAX_TOPIC_LEN + 1) == 0, "name too long");
+    check(topics.add(0, name, 0) == 0, "empty name");
+    check(topics.add(MBED_CONF_APP_MQTTSN_MAX_CLIENTS, "x", 1) == 0, "unknown client");
+
+    check(!topics.add_predefined(0, "x", 1), "predefined ID 0");
+    check(topics.add_predefined(1, "x", 1) && !topics.add_predefined(1, "y", 1),
+          "predefined ID taken");
+    topics.release(0);
+    check(topics.count() == 1, "predefined not released");
+}
+
+}
+
+int main()
+{
+    test_cycles();
+    test_shared();
+    test_limits();
+
+    printf("%s\n", failures == 0 ? "MqttSnTopics: all tests passed" : "MqttSnTopics: FAILED");
+    return failures == 0 ? 0 : 1;
+}
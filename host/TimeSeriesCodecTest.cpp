@@ -0,0 +1,261 @@
+/*
+ *  Host test and benchmark of the time series codec
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TimeSeriesCodecTest.cpp
+ *  \brief Encodes series of every kind of step, in time and in value, and
+ *  checks they decode back, then prints the size and time of a series
+ *  against the CBOR batch FrameAggregator would send for the same
+ *  readings. Build and run with the Makefile in this directory.
+ */
+
+#include "TimeSeriesCodec.h"
+
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+const int MAX_READINGS = 512;
+
+int failures = 0;
+
+void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+uint32_t float_bits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof (bits));
+    return bits;
+}
+
+/** Encode readings, and check they all fit and decode back */
+bool round_trip(const uint32_t *times, const uint32_t *values, int count, uint32_t start_ms)
+{
+    static uint8_t buf[TimeSeriesEncoder::HEADER_LEN + MAX_READINGS * 15];
+
+    TimeSeriesEncoder encoder;
+    encoder.begin(buf, sizeof (buf), start_ms);
+    for (int i = 0; i < count; i++) {
+        if (encoder.append(times[i], values[i]) != 0) {
+            return false;
+        }
+    }
+
+    TimeSeriesDecoder decoder(buf, encoder.length());
+    if (!decoder.valid() || decoder.count() != count) {
+        return false;
+    }
+    uint32_t time_ms, value;
+    for (int i = 0; i < count; i++) {
+        if (!decoder.next(&time_ms, &value) || time_ms != times[i] || value != values[i]) {
+            return false;
+        }
+    }
+    return !decoder.next(&time_ms, &value);
+}
+
+/** The same value over and over, at a steady pace */
+void test_repeated()
+{
+    uint32_t times[MAX_READINGS];
+    uint32_t values[MAX_READINGS];
+    for (int i = 0; i < MAX_READINGS; i++) {
+        times[i] = 5000 + i * 1000;
+        values[i] = float_bits(21.5f);
+    }
+    check(round_trip(times, values, MAX_READINGS, 4000), "repeated values");
+    check(round_trip(times, values, 1, 4000), "single reading");
+    check(round_trip(times, values, 0, 4000), "empty series");
+}
+
+/** Deltas of delta in each range, both signs, and past 32 bits of time */
+void test_large_deltas()
+{
+    static const int32_t steps[] = {
+        0, 1000, 1064, 937, 1256, 745, 3048, 953, 100000, 50, 0, 7, 0xFFFFFFF, 1000
+    };
+    const int count = sizeof (steps) / sizeof (steps[0]);
+    uint32_t times[count];
+    uint32_t values[count];
+    uint32_t t = 0xFFFF0000UL;
+    for (int i = 0; i < count; i++) {
+        t += steps[i];
+        times[i] = t;
+        values[i] = i * 0x01010101UL;
+    }
+    check(round_trip(times, values, count, 0xFFFF0000UL), "large deltas, wrapping time");
+}
+
+/** Values changing in every bit, or in a few, with jitter in time */
+void test_jitter()
+{
+    uint32_t times[MAX_READINGS];
+    uint32_t values[MAX_READINGS];
+    uint32_t t = 123456;
+    uint32_t seed = 1;
+    for (int i = 0; i < MAX_READINGS; i++) {
+        seed = seed * 1103515245UL + 12345;
+        t += 1000 + (seed >> 16) % 41 - 20;
+        times[i] = t;
+        if (i % 16 == 0) {
+            values[i] = seed;
+        } else if (i % 5 == 0) {
+            values[i] = ~values[i - 1];
+        } else {
+            values[i] = float_bits(18.0f + 0.01f * (i % 37));
+        }
+    }
+    check(round_trip(times, values, MAX_READINGS, 120000), "jitter and changing values");
+}
+
+/** A full buffer refuses the reading, a series cut short stops early */
+void test_limits()
+{
+    uint8_t buf[TimeSeriesEncoder::HEADER_LEN + 20];
+    TimeSeriesEncoder encoder;
+    encoder.begin(buf, sizeof (buf), 0);
+
+    int appended = 0;
+    while (encoder.append(appended * 1000, 0x12345678UL ^ appended) == 0) {
+        appended++;
+    }
+    check(appended > 0 && encoder.count() == appended, "buffer fills");
+    check(encoder.length() <= sizeof (buf), "within the buffer");
+
+    TimeSeriesDecoder decoder(buf, TimeSeriesEncoder::HEADER_LEN + 2);
+    uint32_t time_ms, value;
+    int read = 0;
+    while (decoder.next(&time_ms, &value)) {
+        read++;
+    }
+    check(read < appended, "cut short");
+
+    uint8_t cbor[TimeSeriesEncoder::HEADER_LEN] = { 0x9F };
+    check(!TimeSeriesDecoder(cbor, sizeof (cbor)).valid(), "CBOR batch is not a series");
+}
+
+/** The head of a CBOR item, as FrameAggregator writes it */
+uint8_t *put_head(uint8_t *p, uint8_t major, uint32_t value)
+{
+    major <<= 5;
+    if (value < 24) {
+        *p++ = major | value;
+    } else if (value <= 0xFF) {
+        *p++ = major | 24;
+        *p++ = value;
+    } else if (value <= 0xFFFF) {
+        *p++ = major | 25;
+        *p++ = value >> 8;
+        *p++ = value;
+    } else {
+        *p++ = major | 26;
+        *p++ = value >> 24;
+        *p++ = value >> 16;
+        *p++ = value >> 8;
+        *p++ = value;
+    }
+    return p;
+}
+
+/**
+ * The backlog of FrameAggregator::benchmark(), as a CBOR batch and as a
+ * series
+ */
+void benchmark()
+{
+    static const int READINGS = 120;
+    static const int ROUNDS = 20000;
+    static uint8_t cbor[READINGS * (1 + 5 + 1 + 4) + 7];
+    static uint8_t series[TimeSeriesEncoder::HEADER_LEN + READINGS * 10];
+
+    uint32_t times[READINGS];
+    uint32_t values[READINGS];
+    uint32_t t = 123456;
+    for (int i = 0; i < READINGS; i++) {
+        t += 1000 + (i * 7) % 5 - 2;
+        times[i] = t;
+        values[i] = float_bits(21.5f + 0.05f * ((i / 4) % 8));
+    }
+
+    size_t cbor_len = 0;
+    clock_t start = clock();
+    for (int r = 0; r < ROUNDS; r++) {
+        uint8_t *p = cbor;
+        *p++ = 0x9F;
+        p = put_head(p, 0, times[0]);
+        for (int i = 0; i < READINGS; i++) {
+            p = put_head(p, 4, 2);
+            p = put_head(p, 0, times[i] - times[0]);
+            p = put_head(p, 2, 4);
+            memcpy(p, &values[i], 4);
+            p += 4;
+        }
+        *p++ = 0xFF;
+        cbor_len = p - cbor;
+    }
+    double cbor_us = (clock() - start) * 1e6 / CLOCKS_PER_SEC / ROUNDS;
+
+    TimeSeriesEncoder encoder;
+    start = clock();
+    for (int r = 0; r < ROUNDS; r++) {
+        encoder.begin(series, sizeof (series), times[0]);
+        for (int i = 0; i < READINGS; i++) {
+            encoder.append(times[i], values[i]);
+        }
+    }
+    double encode_us = (clock() - start) * 1e6 / CLOCKS_PER_SEC / ROUNDS;
+
+    bool ok = true;
+    start = clock();
+    for (int r = 0; r < ROUNDS; r++) {
+        TimeSeriesDecoder decoder(series, encoder.length());
+        uint32_t time_ms, value;
+        for (int i = 0; i < READINGS; i++) {
+            ok = decoder.next(&time_ms, &value) && time_ms == times[i] &&
+                 value == values[i] && ok;
+        }
+    }
+    double decode_us = (clock() - start) * 1e6 / CLOCKS_PER_SEC / ROUNDS;
+
+    check(ok, "benchmark round trip");
+    check(encoder.length() * 4 < cbor_len, "series a quarter of the CBOR batch at most");
+    printf("%d readings: CBOR %d bytes in %.1f us, series %d bytes (%d%%) in %.1f us, "
+           "decoded in %.1f us\n",
+           READINGS, (int) cbor_len, cbor_us, (int) encoder.length(),
+           (int) (encoder.length() * 100 / cbor_len), encode_us, decode_us);
+}
+
+}
+
+int main()
+{
+    test_repeated();
+    test_large_deltas();
+    test_jitter();
+    test_limits();
+    benchmark();
+
+    printf("%s\n", failures == 0 ? "TimeSeriesCodec: all tests passed" : "TimeSeriesCodec: FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+/*
+ *  Host test of the topic filter trie
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TopicTrieTest.cpp
+ *  \brief Matches topics against filters with "+" and "#", topics starting
+ *  with '$', and a level with many siblings, and checks filters are
+ *  removed and the arena limits hold. Build and run with the Makefile in
+ *  this directory.
+ */
+
+#include "TopicTrie.h"
+
+#include <stdio.h>
+
+namespace {
+
+typedef TopicTrie<128, 1024, 64> Trie;
+
+int failures = 0;
+
+void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/** The values matched, as a bit mask of values below 32 */
+void on_match(void *context, uint16_t value)
+{
+    *static_cast<uint32_t *>(context) |= 1UL << value;
+}
+
+uint32_t match(const Trie &trie, const char *topic)
+{
+    uint32_t mask = 0;
+    trie.match(topic, strlen(topic), on_match, &mask);
+    return mask;
+}
+
+uint32_t bit(int value)
+{
+    return 1UL << value;
+}
+
+/** "+" takes one level, "#" any number, the parent level included */
+void test_wildcards()
+{
+    static Trie trie;
+    check(trie.insert("a/b/c", 0) == 0, "insert a/b/c");
+    check(trie.insert("a/+/c", 1) == 0, "insert a/+/c");
+    check(trie.insert("a/#", 2) == 0, "insert a/#");
+    check(trie.insert("+/+", 3) == 0, "insert +/+");
+    check(trie.insert("#", 4) == 0, "insert #");
+    check(trie.insert("a/b", 5) == 0, "insert a/b");
+    check(trie.insert("+/b/#", 6) == 0, "insert +/b/#");
+
+    check(match(trie, "a/b/c") == (bit(0) | bit(1) | bit(2) | bit(4) | bit(6)), "a/b/c");
+    check(match(trie, "a/x/c") == (bit(1) | bit(2) | bit(4)), "a/x/c");
+    check(match(trie, "a/b") == (bit(2) | bit(3) | bit(4) | bit(5) | bit(6)), "a/b");
+    check(match(trie, "a") == (bit(2) | bit(4)), "a matches a/#");
+    check(match(trie, "x/y") == (bit(3) | bit(4)), "x/y");
+    check(match(trie, "x/b/y/z") == (bit(4) | bit(6)), "x/b/y/z");
+    check(match(trie, "a/b/c/d") == (bit(2) | bit(4) | bit(6)), "a/b/c/d");
+
+    /* Empty levels are levels */
+    check(match(trie, "a//c") == (bit(1) | bit(2) | bit(4)), "a//c");
+    check(match(trie, "/b") == (bit(3) | bit(4) | bit(6)), "/b");
+}
+
+/** A topic starting with '$' is only matched by filters naming it */
+void test_system()
+{
+    static Trie trie;
+    trie.insert("#", 0);
+    trie.insert("+/broker/load", 1);
+    trie.insert("$SYS/#", 2);
+    trie.insert("$SYS/+/load", 3);
+    trie.insert("$SYS/broker/load", 4);
+
+    check(match(trie, "$SYS/broker/load") == (bit(2) | bit(3) | bit(4)), "$SYS topic");
+    check(match(trie, "$SYS") == bit(2), "$SYS alone");
+    check(match(trie, "$other/broker/load") == 0, "other $ topic");
+    check(match(trie, "SYS/broker/load") == (bit(0) | bit(1)), "not a $ topic");
+    check(match(trie, "a/$SYS") == bit(0), "$ past the first level");
+}
+
+/** Many siblings under a level, all found, wildcards among them */
+void test_siblings()
+{
+    static TopicTrie<256, 2048, 128> trie;
+    char filter[32];
+    bool ok = true;
+    for (int i = 0; i < 100; i++) {
+        snprintf(filter, sizeof (filter), "node/%d/temp", i);
+        ok = ok && trie.insert(filter, i) == 0;
+    }
+    ok = ok && trie.insert("node/+/temp", 100) == 0;
+    check(ok, "siblings inserted");
+
+    uint32_t matched = 0;
+    for (int i = 0; i < 100; i++) {
+        uint32_t mask = 0;
+        snprintf(filter, sizeof (filter), "node/%d/temp", i);
+        matched += trie.match(filter, strlen(filter), on_match, &mask);
+    }
+    check(matched == 200, "every sibling and the wildcard matched");
+
+    uint32_t mask = 0;
+    check(trie.match("node/100/temp", 13, on_match, &mask) == 1, "only the wildcard");
+    check(trie.match("node/7/humidity", 15, on_match, &mask) == 0, "no such leaf");
+}
+
+/** Removed filters stop matching, their nodes are reused */
+void test_remove()
+{
+    static Trie trie;
+    trie.insert("a/+", 1);
+    trie.insert("a/+", 2);
+    uint16_t nodes = trie.nodes_used();
+
+    check(trie.remove("a/+", 1) == 0, "remove a value");
+    check(match(trie, "a/b") == bit(2), "other value kept");
+    check(trie.remove("a/+", 1) == -1, "remove it again");
+    check(trie.remove("a/b/c", 2) == -1, "remove an unknown filter");
+    check(trie.remove("a/+", 2) == 0 && match(trie, "a/b") == 0, "all removed");
+
+    check(trie.insert("a/+", 3) == 0 && trie.nodes_used() == nodes, "nodes reused");
+    check(match(trie, "a/b") == bit(3), "inserted again");
+}
+
+/** Invalid filters and a full arena are refused */
+void test_limits()
+{
+    static TopicTrie<4, 8, 2> trie;
+    check(trie.insert("a/#/b", 0) == -1, "# not last");
+    check(trie.insert("a/b+", 0) == -1, "+ within a level");
+    check(trie.insert("a/b/c", 0) == 0, "fills the nodes");
+    check(trie.insert("a/d", 1) == -1, "out of nodes");
+    check(trie.insert("a/b", 1) == 0, "shared levels take no node");
+    check(trie.insert("a/b", 2) == -1, "out of values");
+
+    static TopicTrie<8, 4, 4> small;
+    check(small.insert("abcde", 0) == -1, "out of characters");
+    check(small.insert("ab/cd", 0) == 0 && small.chars_used() == 4, "characters used");
+}
+
+}
+
+int main()
+{
+    test_wildcards();
+    test_system();
+    test_siblings();
+    test_remove();
+    test_limits();
+
+    printf("%s\n", failures == 0 ? "TopicTrie: all tests passed" : "TopicTrie: FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+/*
+ *  Host test of the loopback transport
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file TransportTest.cpp
+ *  \brief Streams bytes both ways between two LoopbackTransport ends, in
+ *  pieces that do not divide the ring so its wrap is crossed, and checks
+ *  the would block, close and reconnect behaviour the clients rely on.
+ *  Build and run with the Makefile in this directory.
+ */
+
+#include "Transport.h"
+
+#include <stdio.h>
+
+namespace {
+
+const uint32_t RING_SIZE = 64;
+
+typedef LoopbackTransport<RING_SIZE> Loopback;
+
+int failures = 0;
+
+void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/**
+ * The same pattern at both ends, so what one end wrote can be verified
+ * by the other
+ */
+uint8_t pattern(uint32_t pos)
+{
+    return (uint8_t) (pos * 31 + (pos >> 8));
+}
+
+/** Send from one end and receive at the other, write and read sizes differing */
+void test_stream(size_t write_size, size_t read_size)
+{
+    Loopback a;
+    Loopback b;
+    Loopback::pair(a, b);
+
+    const uint32_t total = 1000;
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    bool ok = true;
+    int rounds = 0;
+
+    while (received < total && rounds++ < 10000) {
+        if (sent < total) {
+            unsigned char out[RING_SIZE];
+            size_t len = write_size < total - sent ? write_size : total - sent;
+            for (size_t i = 0; i < len; i++) {
+                out[i] = pattern(sent + i);
+            }
+            int ret = a.send(out, len);
+            if (ret > 0) {
+                sent += ret;
+            } else if (!Loopback::would_block(ret)) {
+                ok = false;
+                break;
+            }
+        }
+
+        unsigned char in[RING_SIZE];
+        int ret = b.recv(in, read_size);
+        if (ret > 0) {
+            for (int i = 0; i < ret; i++) {
+                ok = ok && in[i] == pattern(received + i);
+            }
+            received += ret;
+        } else if (!Loopback::would_block(ret)) {
+            ok = false;
+            break;
+        }
+    }
+
+    check(ok && received == total, "stream received intact");
+    check(b.recv(NULL, 0) == 0, "empty read");
+}
+
+/** A full ring blocks the writer, an empty one the reader */
+void test_would_block()
+{
+    Loopback a;
+    Loopback b;
+    Loopback::pair(a, b);
+
+    unsigned char buf[RING_SIZE + 8];
+    memset(buf, 0x5a, sizeof (buf));
+
+    check(Loopback::would_block(b.recv(buf, sizeof (buf))), "read of nothing blocks");
+    check(a.send(buf, sizeof (buf)) == (int) RING_SIZE, "write up to the ring size");
+    check(Loopback::would_block(a.send(buf, 1)), "write to a full ring blocks");
+    check(b.recv(buf, 10) == 10, "read some");
+    check(a.send(buf, sizeof (buf)) == 10, "write into the room made");
+
+    /* The other direction is a stream of its own */
+    check(b.send(buf, 3) == 3 && a.recv(buf, sizeof (buf)) == 3, "other direction");
+}
+
+/** What was sent before a close is still read, then the end of stream */
+void test_close()
+{
+    Loopback a;
+    Loopback b;
+    Loopback::pair(a, b);
+
+    unsigned char buf[16] = { 1, 2, 3, 4 };
+    check(a.send(buf, 4) == 4, "write before close");
+    a.close();
+
+    check(!a.is_connected() && !b.is_connected(), "both ends closed");
+    check(a.send(buf, 1) == TRANSPORT_ERROR_CLOSED, "write after close");
+    check(b.recv(buf, sizeof (buf)) == 4 && buf[3] == 4, "read after close");
+    check(b.recv(buf, sizeof (buf)) == 0, "end of stream");
+
+    /* As a client reconnects, with empty streams */
+    check(b.connect("server", 1) == 0 && a.is_connected() && b.is_connected(), "reconnect");
+    check(Loopback::would_block(a.recv(buf, sizeof (buf))), "empty after reconnect");
+
+    Loopback alone;
+    check(alone.connect("server", 1) == TRANSPORT_ERROR_CLOSED, "connect unpaired");
+}
+
+}
+
+int main()
+{
+    /* Sizes that do and do not divide the ring, up to all of it */
+    static const size_t sizes[] = { 1, 7, 16, 63, RING_SIZE };
+    const size_t count = sizeof (sizes) / sizeof (sizes[0]);
+    for (size_t w = 0; w < count; w++) {
+        for (size_t r = 0; r < count; r++) {
+            test_stream(sizes[w], sizes[r]);
+        }
+    }
+    test_would_block();
+    test_close();
+
+    printf("%s\n", failures == 0 ? "Transport: all tests passed" : "Transport: FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/*
+ *  Host test of the XBee API frame parser
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeeApiParserTest.cpp
+ *  \brief Feeds encoded frames through a small ring, so that frames
+ *  straddle its wrap and the end of every scan(), in API mode 1 and 2.
+ *  Build and run with the Makefile in this directory.
+ */
+
+#include "XBeeApiParser.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const uint32_t RING_SIZE = 32;      /* Smaller than the longest encoded frame */
+const uint16_t MAX_FRAME = 64;
+
+struct Received {
+    uint32_t count;
+    uint8_t frame[MAX_FRAME];
+    uint16_t len;
+};
+
+int failures = 0;
+
+void check(bool ok, const char *what, int escaped)
+{
+    if (!ok) {
+        printf("FAIL: %s, API mode %d\n", what, escaped ? 2 : 1);
+        failures++;
+    }
+}
+
+void on_frame(void *context, const uint8_t *frame, uint16_t len)
+{
+    Received *received = static_cast<Received *>(context);
+    received->count++;
+    received->len = len;
+    memcpy(received->frame, frame, len);
+}
+
+/** A frame of the given length, with every byte that needs escaping */
+void make_frame(uint8_t *frame, uint16_t len, uint8_t seed)
+{
+    static const uint8_t special[] = {
+        XBeeApiParser::START_DELIMITER, XBeeApiParser::ESCAPE,
+        XBeeApiParser::XON, XBeeApiParser::XOFF
+    };
+    for (uint16_t i = 0; i < len; i++) {
+        frame[i] = (i % 3 == 0) ? special[(i / 3 + seed) % 4] : (uint8_t) (seed + i * 7);
+    }
+}
+
+/**
+ * Write every encoded frame into the ring behind some noise, scanning
+ * whenever at least chunk bytes are pending, and check each one arrives.
+ */
+void test_ring(bool escaped, uint32_t chunk)
+{
+    uint8_t buf[MAX_FRAME];
+    XBeeApiParser parser(buf, sizeof (buf), escaped);
+    Received received;
+    memset(&received, 0, sizeof (received));
+    parser.set_handler(on_frame, &received);
+
+    uint8_t ring[RING_SIZE];
+    /* Start close to 2^32 so the positions wrap as well */
+    uint32_t write = 0xFFFFFFF0u;
+    uint32_t read = write;
+    uint32_t expected = 0;
+
+    for (uint16_t len = 1; len <= 30; len++) {
+        uint8_t frame[MAX_FRAME];
+        uint8_t encoded[2 * MAX_FRAME + 4];
+        make_frame(frame, len, (uint8_t) len);
+        size_t n = XBeeApiParser::encode(frame, len, encoded, sizeof (encoded), escaped);
+        check(n > 0, "encode", escaped);
+
+        ring[write++ % RING_SIZE] = 0x55;
+        for (size_t i = 0; i < n; i++) {
+            if (write - read == RING_SIZE) {
+                read = parser.scan(ring, RING_SIZE, read, write);
+            }
+            ring[write++ % RING_SIZE] = encoded[i];
+            if (write - read >= chunk) {
+                read = parser.scan(ring, RING_SIZE, read, write);
+            }
+        }
+        read = parser.scan(ring, RING_SIZE, read, write);
+        expected++;
+
+        check(received.count == expected, "frame delivered", escaped);
+        check(received.len == len && memcmp(received.frame, frame, len) == 0,
+              "frame content", escaped);
+    }
+
+    check(read == write, "all bytes parsed", escaped);
+    check(parser.frames() == expected, "frame count", escaped);
+    check(parser.checksum_errors() == 0 && parser.length_errors() == 0,
+          "no errors", escaped);
+    check(parser.discarded() == expected, "noise discarded", escaped);
+}
+
+/** A corrupted frame is dropped, the next one still arrives */
+void test_checksum(bool escaped)
+{
+    uint8_t buf[MAX_FRAME];
+    XBeeApiParser parser(buf, sizeof (buf), escaped);
+    Received received;
+    memset(&received, 0, sizeof (received));
+    parser.set_handler(on_frame, &received);
+
+    uint8_t frame[8];
+    uint8_t encoded[2 * sizeof (frame) + 4];
+    make_frame(frame, sizeof (frame), 1);
+    size_t n = XBeeApiParser::encode(frame, sizeof (frame), encoded, sizeof (encoded), escaped);
+
+    encoded[n - 1] ^= 0x04;
+    parser.parse(encoded, n);
+    encoded[n - 1] ^= 0x04;
+    parser.parse(encoded, n);
+
+    check(parser.checksum_errors() == 1, "checksum error counted", escaped);
+    check(received.count == 1 && received.len == sizeof (frame), "frame after error", escaped);
+}
+
+/** A frame longer than the buffer is dropped */
+void test_too_long(bool escaped)
+{
+    uint8_t buf[8];
+    XBeeApiParser parser(buf, sizeof (buf), escaped);
+    Received received;
+    memset(&received, 0, sizeof (received));
+    parser.set_handler(on_frame, &received);
+
+    uint8_t frame[16];
+    uint8_t encoded[2 * sizeof (frame) + 4];
+    make_frame(frame, sizeof (frame), 2);
+    size_t n = XBeeApiParser::encode(frame, sizeof (frame), encoded, sizeof (encoded), escaped);
+    parser.parse(encoded, n);
+    n = XBeeApiParser::encode(frame, sizeof (buf), encoded, sizeof (encoded), escaped);
+    parser.parse(encoded, n);
+
+    /* In API mode 1 a delimiter in the dropped data may count once more */
+    check(parser.length_errors() >= 1, "length error counted", escaped);
+    check(received.count == 1 && received.len == sizeof (buf), "frame after long one", escaped);
+}
+
+}
+
+int main()
+{
+    for (int escaped = 0; escaped < 2; escaped++) {
+        for (uint32_t chunk = 1; chunk <= RING_SIZE; chunk += 6) {
+            test_ring(escaped != 0, chunk);
+        }
+        test_checksum(escaped != 0);
+        test_too_long(escaped != 0);
+    }
+
+    printf("%s\n", failures == 0 ? "XBeeApiParser: all tests passed" : "XBeeApiParser: FAILED");
+    return failures == 0 ? 0 : 1;
+}
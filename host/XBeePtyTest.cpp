@@ -0,0 +1,276 @@
+/*
+ *  Host test of the XBee API frame parser over a pseudo terminal
+ *
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/** \file XBeePtyTest.cpp
+ *  \brief Emulates the XBee's UART with a Linux pseudo terminal. The module
+ *  writes receive packets at the master side, in bursts of many sizes and
+ *  with noise in between, and the gateway side reads the raw slave side
+ *  into a ring as the DMA does, scanning it with XBeeApiParser. Frames the
+ *  gateway encodes go the other way and are parsed by the module. Build
+ *  and run with the Makefile in this directory.
+ */
+
+#include "XBeeApiParser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t RING_SIZE = 256;     /* Smaller than the stream, a power of two */
+const uint16_t MAX_FRAME = 128;
+const int FRAMES = 200;
+const uint8_t RECEIVE_PACKET = 0x90;
+const uint8_t TRANSMIT_REQUEST = 0x10;
+
+int failures = 0;
+
+void check(bool ok, const char *what, int escaped)
+{
+    if (!ok) {
+        printf("FAIL: %s, API mode %d\n", what, escaped ? 2 : 1);
+        failures++;
+    }
+}
+
+/**
+ * A pseudo terminal in raw mode, the master side is the module and the
+ * slave side the gateway's serial port
+ */
+class PtyUart {
+public:
+    PtyUart() : master(-1), slave(-1) {
+    }
+
+    ~PtyUart() {
+        if (slave >= 0) {
+            close(slave);
+        }
+        if (master >= 0) {
+            close(master);
+        }
+    }
+
+    bool open() {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            return false;
+        }
+        slave = ::open(ptsname(master), O_RDWR | O_NOCTTY);
+        if (slave < 0) {
+            return false;
+        }
+
+        /* No line editing, flow control or newline translation */
+        struct termios tio;
+        if (tcgetattr(slave, &tio) != 0) {
+            return false;
+        }
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);
+        if (tcsetattr(slave, TCSANOW, &tio) != 0) {
+            return false;
+        }
+        return fcntl(master, F_SETFL, O_NONBLOCK) == 0 && fcntl(slave, F_SETFL, O_NONBLOCK) == 0;
+    }
+
+    int master;
+    int slave;
+};
+
+struct Received {
+    uint32_t count;
+    bool ok;                        /**< Every frame was the one expected */
+};
+
+/** A receive packet from node n, with bytes that need escaping in API mode 2 */
+uint16_t make_packet(uint8_t *frame, int n)
+{
+    static const uint8_t special[] = {
+        XBeeApiParser::START_DELIMITER, XBeeApiParser::ESCAPE,
+        XBeeApiParser::XON, XBeeApiParser::XOFF
+    };
+    uint16_t len = 12 + (n * 37) % (MAX_FRAME - 12);
+    frame[0] = RECEIVE_PACKET;
+    for (int i = 1; i < 9; i++) {
+        frame[i] = 0x13 + n + i;        /* 64 bit address */
+    }
+    frame[9] = 0x7D;                    /* 16 bit address */
+    frame[10] = n;
+    frame[11] = 0x01;                   /* Options: acknowledged */
+    for (uint16_t i = 12; i < len; i++) {
+        frame[i] = (i % 5 == 0) ? special[(i + n) % 4] : (uint8_t) (n + i * 3);
+    }
+    return len;
+}
+
+void on_packet(void *context, const uint8_t *frame, uint16_t len)
+{
+    Received *received = static_cast<Received *>(context);
+    uint8_t expected[MAX_FRAME];
+    uint16_t expected_len = make_packet(expected, received->count);
+    received->ok = received->ok && len == expected_len && memcmp(frame, expected, len) == 0;
+    received->count++;
+}
+
+/**
+ * Receive FRAMES packets written by the module in bursts of burst bytes,
+ * read into the ring as much as fits each time the port is readable
+ */
+void test_receive(bool escaped, size_t burst)
+{
+    PtyUart uart;
+    if (!uart.open()) {
+        check(false, "pseudo terminal opened", escaped);
+        return;
+    }
+
+    /* What the module sends, a noise byte before every frame */
+    static uint8_t stream[FRAMES * (2 * MAX_FRAME + 5)];
+    size_t stream_len = 0;
+    for (int n = 0; n < FRAMES; n++) {
+        uint8_t frame[MAX_FRAME];
+        uint16_t len = make_packet(frame, n);
+        stream[stream_len++] = 0x55;
+        stream_len += XBeeApiParser::encode(frame, len, stream + stream_len,
+                                            sizeof (stream) - stream_len, escaped);
+    }
+
+    uint8_t buf[MAX_FRAME];
+    XBeeApiParser parser(buf, sizeof (buf), escaped);
+    Received received = { 0, true };
+    parser.set_handler(on_packet, &received);
+
+    uint8_t ring[RING_SIZE];
+    /* Start close to 2^32 so the positions wrap as well */
+    uint32_t write = 0xFFFFFF00u;
+    uint32_t read = write;
+    size_t sent = 0;
+    int idle = 0;
+
+    while (received.count < FRAMES && idle < 20) {
+        if (sent < stream_len) {
+            size_t len = burst < stream_len - sent ? burst : stream_len - sent;
+            ssize_t n = ::write(uart.master, stream + sent, len);
+            if (n > 0) {
+                sent += n;
+            } else if (n < 0 && errno != EAGAIN) {
+                break;
+            }
+        }
+
+        struct pollfd pfd = { uart.slave, POLLIN, 0 };
+        if (poll(&pfd, 1, sent < stream_len ? 0 : 100) <= 0) {
+            idle += sent < stream_len ? 0 : 1;
+            continue;
+        }
+        idle = 0;
+
+        /* As the DMA does, up to the end of the ring or the reader */
+        uint32_t room = RING_SIZE - (write - read);
+        uint32_t to_end = RING_SIZE - write % RING_SIZE;
+        ssize_t n = ::read(uart.slave, ring + write % RING_SIZE, room < to_end ? room : to_end);
+        if (n > 0) {
+            write += n;
+            read = parser.scan(ring, RING_SIZE, read, write);
+        } else if (n < 0 && errno != EAGAIN) {
+            break;
+        }
+    }
+
+    check(sent == stream_len, "stream written", escaped);
+    check(received.count == FRAMES && received.ok, "packets received intact", escaped);
+    check(read == write, "all bytes parsed", escaped);
+    check(parser.checksum_errors() == 0 && parser.length_errors() == 0, "no errors", escaped);
+    check(parser.discarded() == FRAMES, "noise discarded", escaped);
+}
+
+struct Transmitted {
+    uint32_t count;
+    uint8_t frame[MAX_FRAME];
+    uint16_t len;
+};
+
+void on_request(void *context, const uint8_t *frame, uint16_t len)
+{
+    Transmitted *transmitted = static_cast<Transmitted *>(context);
+    transmitted->count++;
+    transmitted->len = len;
+    memcpy(transmitted->frame, frame, len);
+}
+
+/** A transmit request the gateway encodes reaches the module */
+void test_transmit(bool escaped)
+{
+    PtyUart uart;
+    if (!uart.open()) {
+        check(false, "pseudo terminal opened", escaped);
+        return;
+    }
+
+    uint8_t request[] = {
+        TRANSMIT_REQUEST, 0x11, 0x00, 0x13, 0xA2, 0x00, 0x7E, 0x7D, 0x11, 0x13,
+        0xFF, 0xFE, 0x00, 0x00, 'p', 'i', 'n', 'g', 0x7E
+    };
+    uint8_t encoded[2 * sizeof (request) + 4];
+    size_t n = XBeeApiParser::encode(request, sizeof (request), encoded, sizeof (encoded),
+                                     escaped);
+    check(n > 0 && ::write(uart.slave, encoded, n) == (ssize_t) n, "request written", escaped);
+
+    uint8_t buf[MAX_FRAME];
+    XBeeApiParser module(buf, sizeof (buf), escaped);
+    Transmitted transmitted;
+    memset(&transmitted, 0, sizeof (transmitted));
+    module.set_handler(on_request, &transmitted);
+
+    struct pollfd pfd = { uart.master, POLLIN, 0 };
+    while (transmitted.count == 0 && poll(&pfd, 1, 1000) > 0) {
+        uint8_t in[64];
+        ssize_t len = ::read(uart.master, in, sizeof (in));
+        if (len <= 0) {
+            break;
+        }
+        module.parse(in, len);
+    }
+
+    check(transmitted.count == 1 && transmitted.len == sizeof (request) &&
+          memcmp(transmitted.frame, request, sizeof (request)) == 0,
+          "request received by the module", escaped);
+}
+
+}
+
+int main()
+{
+    static const size_t bursts[] = { 1, 17, 100, 1000, 4096 };
+    for (int escaped = 0; escaped < 2; escaped++) {
+        for (size_t i = 0; i < sizeof (bursts) / sizeof (bursts[0]); i++) {
+            test_receive(escaped != 0, bursts[i]);
+        }
+        test_transmit(escaped != 0);
+    }
+
+    printf("%s\n", failures == 0 ? "XBeePty: all tests passed" : "XBeePty: FAILED");
+    return failures == 0 ? 0 : 1;
+}
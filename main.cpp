@@ -24,27 +24,34 @@
  *  This application sends an HTTPS request to os.mbed.com and searches for a string in
  *  the result.
  *
- *  This example is implemented as a logic class (HelloHTTPS) wrapping a TCP socket.
+ *  This example is implemented as a logic class (HelloHTTPS) wrapping a TLS connection.
  *  The logic class handles all events, leaving the main loop to just check if the process
  *  has finished.
+ *
+ *  Next to it, a ConnectionManager keeps an MQTT uplink to the broker connected from its
+ *  own thread, sharing the TLS context with the HTTPS fetch. An XBeeGateway forwards the
+ *  frames of the XBee sensor nodes to that uplink.
  */
 
-/* Change to a number between 1 and 4 to debug the TLS connection */
-#define DEBUG_LEVEL 0
-
 #include "mbed.h"
 #include "easy-connect.h"
 
-#include "mbedtls/platform.h"
-#include "mbedtls/ssl.h"
-#include "mbedtls/entropy.h"
-#include "mbedtls/ctr_drbg.h"
-#include "mbedtls/error.h"
-
-#if DEBUG_LEVEL > 0
-#include "mbedtls/debug.h"
+#include "DrbgService.h"
+#include "TLSContext.h"
+#include "TLSConnection.h"
+#include "TcpTransport.h"
+#include "XBeeTransport.h"
+#include "DnsCache.h"
+#include "ConnectionManager.h"
+#include "XBeeGateway.h"
+#include "JsonParser.h"
+
+#if MBED_CONF_APP_STORAGE_SIZE > 0
+#include "FlashIAPBlockDevice.h"
 #endif
 
+#include <ctype.h>
+
 namespace {
 
 const char *HTTPS_SERVER_NAME = "os.mbed.com";
@@ -56,6 +63,41 @@ const char HTTPS_PATH[] = "/media/uploads/mbed_official/hello.txt";
 /* Test related data */
 const char *HTTPS_OK_STR = "200 OK";
 const char *HTTPS_HELLO_STR = "Hello world!";
+/* A response of this Content-Type is parsed as it arrives */
+const char *HTTPS_JSON_TYPE = "application/json";
+
+/**
+ * Find a header in the response headers, whatever its case
+ *
+ * @return Its value, or NULL if there is none
+ */
+const char *find_header(const char *headers, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *line = headers; line != NULL; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            line++;
+        }
+        size_t i = 0;
+        while (i < len && tolower((unsigned char) line[i]) == tolower((unsigned char) name[i])) {
+            i++;
+        }
+        if (i == len && line[i] == ':') {
+            const char *value = line + i + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/* The MQTT brokers, the backup one is raced against the primary */
+const ConnectEndpoint MQTT_BROKERS[] = {
+    { MBED_CONF_APP_MQTT_BROKER, MBED_CONF_APP_MQTT_PORT },
+    { MBED_CONF_APP_MQTT_BROKER_BACKUP, MBED_CONF_APP_MQTT_PORT },
+};
 
 /* personalization string for the drbg */
 const char *DRBG_PERS = "mbed TLS helloword client";
@@ -91,46 +133,38 @@ const char SSL_CA_PEM[] = "-----BEGIN CERTIFICATE-----\n"
 
 /**
  * \brief HelloHTTPS implements the logic for fetching a file from a webserver
- * using a TCP socket and parsing the result.
+ * using a TLS connection and parsing the result, over any transport, see
+ * Transport.h.
  */
+template <typename Transport>
 class HelloHTTPS {
 public:
     /**
      * HelloHTTPS Constructor
-     * Initializes the TCP socket, sets up event handlers and flags.
+     * Initializes the connection and flags.
      *
      * @param[in] domain The domain name to fetch from
      * @param[in] port The port of the HTTPS server
+     * @param[in] transport The transport to connect through
+     * @param[in] tls The shared TLS context
      */
-    HelloHTTPS(const char * domain, const uint16_t port, NetworkInterface *net_iface) :
-            _domain(domain), _port(port)
+    HelloHTTPS(const char * domain, const uint16_t port, Transport &transport,
+               TLSContext &tls) :
+            _domain(domain), _port(port), _connection(tls, transport),
+            _parser(&HelloHTTPS::on_token, this)
     {
 
         _gothello = false;
         _got200 = false;
         _bpos = 0;
         _request_sent = 0;
-        _tcpsocket = new TCPSocket(net_iface);
-        _tcpsocket->set_blocking(false);
         _buffer[RECV_BUFFER_SIZE - 1] = 0;
-
-        mbedtls_entropy_init(&_entropy);
-        mbedtls_ctr_drbg_init(&_ctr_drbg);
-        mbedtls_x509_crt_init(&_cacert);
-        mbedtls_ssl_init(&_ssl);
-        mbedtls_ssl_config_init(&_ssl_conf);
     }
     /**
      * HelloHTTPS Desctructor
      */
     ~HelloHTTPS() {
-        mbedtls_entropy_free(&_entropy);
-        mbedtls_ctr_drbg_free(&_ctr_drbg);
-        mbedtls_x509_crt_free(&_cacert);
-        mbedtls_ssl_free(&_ssl);
-        mbedtls_ssl_config_free(&_ssl_conf);
-        _tcpsocket->close();
-        delete _tcpsocket;
+        _connection.close();
     }
     /**
      * Start the test.
@@ -146,108 +180,40 @@ public:
         _gothello = false;
         _disconnected = false;
         _request_sent = false;
-
-        /*
-         * Initialize TLS-related stuf.
-         */
-        int ret;
-        if ((ret = mbedtls_ctr_drbg_seed(&_ctr_drbg, mbedtls_entropy_func, &_entropy,
-                          (const unsigned char *) DRBG_PERS,
-                          sizeof (DRBG_PERS))) != 0) {
-            print_mbedtls_error("mbedtls_crt_drbg_init", ret);
-            return;
-        }
-
-        if ((ret = mbedtls_x509_crt_parse(&_cacert, (const unsigned char *) SSL_CA_PEM,
-                           sizeof (SSL_CA_PEM))) != 0) {
-            print_mbedtls_error("mbedtls_x509_crt_parse", ret);
-            return;
-        }
-
-        if ((ret = mbedtls_ssl_config_defaults(&_ssl_conf,
-                        MBEDTLS_SSL_IS_CLIENT,
-                        MBEDTLS_SSL_TRANSPORT_STREAM,
-                        MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
-            print_mbedtls_error("mbedtls_ssl_config_defaults", ret);
-            return;
-        }
-
-        mbedtls_ssl_conf_ca_chain(&_ssl_conf, &_cacert, NULL);
-        mbedtls_ssl_conf_rng(&_ssl_conf, mbedtls_ctr_drbg_random, &_ctr_drbg);
-
-        /* It is possible to disable authentication by passing
-         * MBEDTLS_SSL_VERIFY_NONE in the call to mbedtls_ssl_conf_authmode()
-         */
-        mbedtls_ssl_conf_authmode(&_ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-
-#if DEBUG_LEVEL > 0
-        mbedtls_ssl_conf_verify(&_ssl_conf, my_verify, NULL);
-        mbedtls_ssl_conf_dbg(&_ssl_conf, my_debug, NULL);
-        mbedtls_debug_set_threshold(DEBUG_LEVEL);
-#endif
-
-        if ((ret = mbedtls_ssl_setup(&_ssl, &_ssl_conf)) != 0) {
-            print_mbedtls_error("mbedtls_ssl_setup", ret);
-            return;
-        }
-
-        mbedtls_ssl_set_hostname(&_ssl, HTTPS_SERVER_NAME);
-
-        mbedtls_ssl_set_bio(&_ssl, static_cast<void *>(_tcpsocket),
-                                   ssl_send, ssl_recv, NULL );
-
-
-        /* Connect to the server */
-        mbedtls_printf("Connecting with %s\n", _domain);
-        ret = _tcpsocket->connect(_domain, _port);
-        if (ret != NSAPI_ERROR_OK) {
-            mbedtls_printf("Failed to connect\n");
-            printf("MBED: Socket Error: %d\n", ret);
-            _tcpsocket->close();
-            return;
-        }
-
-       /* Start the handshake, the rest will be done in onReceive() */
-        mbedtls_printf("Starting the TLS handshake...\n");
-        do {
-            ret = mbedtls_ssl_handshake(&_ssl);
-        } while (ret != 0 && (ret == MBEDTLS_ERR_SSL_WANT_READ ||
-                ret == MBEDTLS_ERR_SSL_WANT_WRITE));
-        if (ret < 0) {
-            print_mbedtls_error("mbedtls_ssl_handshake", ret);
-            _tcpsocket->close();
+        _body = -1;
+        _json = false;
+        _chunked = false;
+        _length = -1;
+        _received = 0;
+        _tokens = 0;
+        _parser.reset();
+
+        /* Connect to the server and run the handshake */
+        int ret = _connection.connect(_domain, _port);
+        if (ret != 0) {
             return;
         }
 
         /* Fill the request buffer */
         _bpos = snprintf(_buffer, sizeof(_buffer) - 1,
-                         "GET %s HTTP/1.1\nHost: %s\n\n", path, HTTPS_SERVER_NAME);
+                         "GET %s HTTP/1.1\nHost: %s\n\n", path, _domain);
 
-        int offset = 0;
-        do {
-            ret = mbedtls_ssl_write(&_ssl,
-                                    (const unsigned char *) _buffer + offset,
-                                    _bpos - offset);
-            if (ret > 0)
-              offset += ret;
-        } while (offset < _bpos && (ret > 0 || ret == MBEDTLS_ERR_SSL_WANT_READ ||
-                ret == MBEDTLS_ERR_SSL_WANT_WRITE));
+        ret = _connection.send((const unsigned char *) _buffer, _bpos);
         if (ret < 0) {
-            print_mbedtls_error("mbedtls_ssl_write", ret);
-            _tcpsocket->close();
+            _connection.close();
             return;
         }
 
         /* It also means the handshake is done, time to print info */
-        printf("TLS connection to %s established\n", HTTPS_SERVER_NAME);
+        printf("TLS connection to %s established\n", _domain);
 
         const uint32_t buf_size = 1024;
         char *buf = new char[buf_size];
         mbedtls_x509_crt_info(buf, buf_size, "\r    ",
-                        mbedtls_ssl_get_peer_cert(&_ssl));
+                        mbedtls_ssl_get_peer_cert(_connection.ssl()));
         mbedtls_printf("Server certificate:\n%s", buf);
 
-        uint32_t flags = mbedtls_ssl_get_verify_result(&_ssl);
+        uint32_t flags = mbedtls_ssl_get_verify_result(_connection.ssl());
         if( flags != 0 )
         {
             mbedtls_x509_crt_verify_info(buf, buf_size, "\r  ! ", flags);
@@ -258,37 +224,77 @@ public:
 
 
         /* Read data out of the socket */
-        offset = 0;
+        int offset = 0;
+        bool complete = false;
         do {
-            ret = mbedtls_ssl_read(&_ssl, (unsigned char *) _buffer + offset,
+            ret = _connection.recv((unsigned char *) _buffer + offset,
                                    sizeof(_buffer) - offset - 1);
-            if (ret > 0)
-              offset += ret;
+            int start = offset;
+            if (ret > 0) {
+                offset += ret;
+                _received += ret;
+            }
 
             /* Check each of the flags */
             _buffer[offset] = 0;
+            if (_body < 0) {
+                char *end = strstr(_buffer, "\r\n\r\n");
+                if (end != NULL) {
+                    *end = 0;
+                    const char *value = find_header(_buffer, "Content-Length");
+                    if (value != NULL) {
+                        _length = strtol(value, NULL, 10);
+                    }
+                    value = find_header(_buffer, "Transfer-Encoding");
+                    _chunked = value != NULL && strncmp(value, "chunked", 7) == 0;
+                    value = find_header(_buffer, "Content-Type");
+                    /* The chunk sizes would be parsed as JSON, it is not decoded */
+                    _json = !_chunked && value != NULL &&
+                            strncmp(value, HTTPS_JSON_TYPE, strlen(HTTPS_JSON_TYPE)) == 0;
+                    *end = '\r';
+                    _body = end + 4 - _buffer;
+                    start = _body;
+                }
+            }
+            if (_json && _body >= 0 && offset > start) {
+                /* Parsed as it arrives, the buffer only keeps the headers */
+                _parser.feed(_buffer + start, offset - start);
+                offset = _body;
+                _buffer[offset] = 0;
+            }
             _got200 = _got200 || strstr(_buffer, HTTPS_OK_STR) != NULL;
             _gothello = _gothello || strstr(_buffer, HTTPS_HELLO_STR) != NULL;
-        } while ( (!_got200 || !_gothello) &&
+
+            /* Done once the body is, rather than when the server closes */
+            complete = (_got200 && _gothello) || (_json && _parser.done()) ||
+                       (_body >= 0 && _length >= 0 && _received - _body >= (size_t) _length);
+        } while (!complete &&
                 (ret > 0 || ret == MBEDTLS_ERR_SSL_WANT_READ ||
                 ret == MBEDTLS_ERR_SSL_WANT_WRITE));
         if (ret < 0) {
             print_mbedtls_error("mbedtls_ssl_read", ret);
             delete[] buf;
-            _tcpsocket->close();
+            _connection.close();
             return;
         }
         _bpos = static_cast<size_t>(offset);
 
         _buffer[_bpos] = 0;
 
-        /* Close socket before status */
-        _tcpsocket->close();
+        /* Close connection before status */
+        _connection.close();
 
         /* Print status messages */
-        mbedtls_printf("HTTPS: Received %d chars from server\n", _bpos);
+        mbedtls_printf("HTTPS: Received %lu chars from server\n", (unsigned long) _received);
         mbedtls_printf("HTTPS: Received 200 OK status ... %s\n", _got200 ? "[OK]" : "[FAIL]");
         mbedtls_printf("HTTPS: Received '%s' status ... %s\n", HTTPS_HELLO_STR, _gothello ? "[OK]" : "[FAIL]");
+        if (_chunked) {
+            mbedtls_printf("HTTPS: Received chunked body, not decoded ... [FAIL]\n");
+        }
+        if (_json) {
+            mbedtls_printf("HTTPS: Received JSON body, %lu tokens ... %s\n",
+                           (unsigned long) _tokens, _parser.finish() == 0 ? "[OK]" : "[FAIL]");
+        }
         mbedtls_printf("HTTPS: Received message:\n\n");
         mbedtls_printf("%s", _buffer);
 
@@ -297,115 +303,34 @@ public:
 
 protected:
     /**
-     * Helper for pretty-printing mbed TLS error codes
-     */
-    static void print_mbedtls_error(const char *name, int err) {
-        char buf[128];
-        mbedtls_strerror(err, buf, sizeof (buf));
-        mbedtls_printf("%s() failed: -0x%04x (%d): %s\n", name, -err, err, buf);
-    }
-
-#if DEBUG_LEVEL > 0
-    /**
-     * Debug callback for Mbed TLS
-     * Just prints on the USB serial port
+     * JsonParser callback, count the tokens of a JSON body
      */
-    static void my_debug(void *ctx, int level, const char *file, int line,
-                         const char *str)
-    {
-        const char *p, *basename;
-        (void) ctx;
-
-        /* Extract basename from file */
-        for(p = basename = file; *p != '\0'; p++) {
-            if(*p == '/' || *p == '\\') {
-                basename = p + 1;
-            }
-        }
-
-        mbedtls_printf("%s:%04d: |%d| %s", basename, line, level, str);
-    }
-
-    /**
-     * Certificate verification callback for Mbed TLS
-     * Here we only use it to display information on each cert in the chain
-     */
-    static int my_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *flags)
-    {
-        const uint32_t buf_size = 1024;
-        char *buf = new char[buf_size];
-        (void) data;
-
-        mbedtls_printf("\nVerifying certificate at depth %d:\n", depth);
-        mbedtls_x509_crt_info(buf, buf_size - 1, "  ", crt);
-        mbedtls_printf("%s", buf);
-
-        if (*flags == 0)
-            mbedtls_printf("No verification issue for this certificate\n");
-        else
-        {
-            mbedtls_x509_crt_verify_info(buf, buf_size, "  ! ", *flags);
-            mbedtls_printf("%s\n", buf);
+    static void on_token(void *context, JsonToken token, const char *text, size_t len,
+                         uint8_t depth) {
+        HelloHTTPS *self = static_cast<HelloHTTPS *>(context);
+        (void) len;
+        self->_tokens++;
+        if (token == JSON_KEY && depth == 1) {
+            mbedtls_printf("HTTPS: JSON key '%s'\n", text);
         }
-
-        delete[] buf;
-        return 0;
     }
-#endif
-
-    /**
-     * Receive callback for Mbed TLS
-     */
-    static int ssl_recv(void *ctx, unsigned char *buf, size_t len) {
-        int recv = -1;
-        TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-        recv = socket->recv(buf, len);
-
-        if(NSAPI_ERROR_WOULD_BLOCK == recv){
-            return MBEDTLS_ERR_SSL_WANT_READ;
-        }else if(recv < 0){
-            mbedtls_printf("Socket recv error %d\n", recv);
-            return -1;
-        }else{
-            return recv;
-        }
-   }
-
-    /**
-     * Send callback for Mbed TLS
-     */
-    static int ssl_send(void *ctx, const unsigned char *buf, size_t len) {
-       int size = -1;
-        TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-        size = socket->send(buf, len);
-
-        if(NSAPI_ERROR_WOULD_BLOCK == size){
-            return MBEDTLS_ERR_SSL_WANT_WRITE;
-        }else if(size < 0){
-            mbedtls_printf("Socket send error %d\n", size);
-            return -1;
-        }else{
-            return size;
-        }
-    }
-
-protected:
-    TCPSocket* _tcpsocket;
 
     const char *_domain;            /**< The domain name of the HTTPS server */
     const uint16_t _port;           /**< The HTTPS server port */
+    TLSConnection<Transport> _connection;   /**< The TLS session to the server */
     char _buffer[RECV_BUFFER_SIZE]; /**< The response buffer */
     size_t _bpos;                   /**< The current offset in the response buffer */
     volatile bool _got200;          /**< Status flag for HTTPS 200 */
     volatile bool _gothello;        /**< Status flag for finding the test string */
     volatile bool _disconnected;
     volatile bool _request_sent;
-
-    mbedtls_entropy_context _entropy;
-    mbedtls_ctr_drbg_context _ctr_drbg;
-    mbedtls_x509_crt _cacert;
-    mbedtls_ssl_context _ssl;
-    mbedtls_ssl_config _ssl_conf;
+    int _body;                      /**< Offset of the body in the response buffer, -1 before the headers end */
+    bool _json;                     /**< The body is JSON, fed to the parser */
+    bool _chunked;                  /**< The body has chunked Transfer-Encoding */
+    long _length;                   /**< The Content-Length of the body, -1 if none */
+    size_t _received;               /**< Bytes received, headers included */
+    uint32_t _tokens;               /**< Tokens of the JSON body */
+    JsonParser _parser;
 };
 
 /**
@@ -439,7 +364,115 @@ int main()
         return 1;
     }
 
-    HelloHTTPS *hello = new HelloHTTPS(HTTPS_SERVER_NAME, HTTPS_SERVER_PORT, network);
+#if MBED_CONF_APP_STORAGE_SIZE > 0
+    /* The flash area reserved for the application, see storage-* in mbed_app.json */
+    BlockDevice *storage = new FlashIAPBlockDevice(MBED_CONF_APP_STORAGE_ADDRESS,
+                                                   MBED_CONF_APP_STORAGE_SIZE);
+    if (storage->init() != 0) {
+        printf("Storage init failed\n");
+        return 1;
+    }
+#endif
+
+    /* The DRBG is seeded once here, every connection draws from it afterwards */
+    DrbgService *drbg = new DrbgService();
+#if defined(MBEDTLS_ENTROPY_NV_SEED)
+#if MBED_CONF_APP_STORAGE_SIZE > 0
+    /* The seed lives in the first two erase units of the storage area */
+    SlicingBlockDevice *seed_storage = new SlicingBlockDevice(storage, 0,
+                                                              2 * storage->get_erase_size());
+    if (seed_storage->init() != 0 || DrbgService::set_nv_seed_storage(seed_storage) != 0) {
+        printf("NV seed storage init failed\n");
+        return 1;
+    }
+#else
+#error "drbg-nv-seed needs a storage area, set storage-address and storage-size"
+#endif
+#endif
+    if (drbg->seed(DRBG_PERS) != 0) {
+        printf("DRBG seeding failed\n");
+        return 1;
+    }
+
+    /* One TLS context is shared by every connection of the application */
+    TLSContext *tls = new TLSContext(*drbg);
+    if (tls->setup(SSL_CA_PEM, sizeof (SSL_CA_PEM)) != 0) {
+        printf("TLS setup failed\n");
+        return 1;
+    }
+
+    /* Server addresses are cached, and kept across reboots when there is storage */
+    DnsCache *dns = new DnsCache(network);
+#if MBED_CONF_APP_STORAGE_SIZE > 0
+    SlicingBlockDevice *dns_storage = new SlicingBlockDevice(storage,
+                                                             2 * storage->get_erase_size(),
+                                                             3 * storage->get_erase_size());
+    if (dns_storage->init() != 0 || dns->set_storage(dns_storage) != 0) {
+        printf("DNS cache storage init failed\n");
+    }
+#endif
+
+#if MBED_CONF_APP_COMPRESS_BENCHMARK
+    /* What compressing the payloads costs, against the airtime it saves */
+    PayloadCompressor::benchmark();
+#endif
+#if MBED_CONF_APP_XBEE_SERIES_BENCHMARK
+    /* What a backlog of readings takes as a series, against CBOR batches */
+    FrameAggregator::benchmark();
+#endif
+
+    /* The MQTT uplink runs in its own thread and reconnects by itself */
+    TcpTransport *mqtt_transport = new TcpTransport(network, dns);
+    TLSConnection<TcpTransport> *mqtt_connection = new TLSConnection<TcpTransport>(*tls,
+                                                                                   *mqtt_transport);
+    ConnectionManager *mqtt = new ConnectionManager(*mqtt_connection, MQTT_BROKERS,
+                                                    strlen(MBED_CONF_APP_MQTT_BROKER_BACKUP) ? 2 : 1,
+                                                    MBED_CONF_APP_MQTT_CLIENT_ID);
+#if MBED_CONF_APP_STORAGE_SIZE > 0
+    /* The rest of the storage area keeps the messages published while offline */
+    SlicingBlockDevice *queue_storage = new SlicingBlockDevice(storage,
+                                                               3 * storage->get_erase_size(),
+                                                               storage->size());
+    OfflineQueue *offline = new OfflineQueue(queue_storage);
+    if (queue_storage->init() != 0 || offline->mount() != 0) {
+        printf("Offline queue init failed, messages are kept in RAM only\n");
+    } else {
+        mqtt->set_offline_queue(offline);
+    }
+#endif
+    Thread *mqtt_thread = new Thread(osPriorityNormal, MBED_CONF_APP_MQTT_THREAD_STACK_SIZE);
+    mqtt_thread->start(callback(mqtt, &ConnectionManager::run));
+
+    /* Sensor frames are queued while the uplink connects, and forwarded as it comes up */
+    XBeeGateway *gateway = new XBeeGateway(*mqtt);
+    if (gateway->start() != 0) {
+        printf("XBee gateway start failed\n");
+    }
+
+    /* The HTTPS fetch shares the TLS context with the MQTT connection */
+    TcpTransport *https_transport = new TcpTransport(network, dns);
+    HelloHTTPS<TcpTransport> *hello = new HelloHTTPS<TcpTransport>(HTTPS_SERVER_NAME,
+                                                                   HTTPS_SERVER_PORT,
+                                                                   *https_transport, *tls);
     hello->startTest(HTTPS_PATH);
     delete hello;
+    delete https_transport;
+
+    /* And over the radio, through a node that bridges to the server */
+    uint64_t bridge;
+    const char *bridge_addr = MBED_CONF_APP_HTTPS_XBEE_BRIDGE;
+    if (XBeeRequests::parse_addr64(bridge_addr, strlen(bridge_addr), &bridge)) {
+        XBeeTransport *radio = new XBeeTransport(gateway->fragmenter(), bridge);
+        gateway->attach_transport(radio);
+        HelloHTTPS<XBeeTransport> *hello_radio =
+            new HelloHTTPS<XBeeTransport>(HTTPS_SERVER_NAME, HTTPS_SERVER_PORT, *radio, *tls);
+        hello_radio->startTest(HTTPS_PATH);
+        delete hello_radio;
+        /* Kept, the gateway thread may still be delivering to it */
+        gateway->attach_transport(NULL);
+    }
+
+    drbg->print_stats();
+
+    mqtt_thread->join();
 }
@@ -17,6 +17,16 @@
  *  This file is part of Mbed TLS (https://tls.mbed.org)
  */
 
+/*
+ *  Targets without a hardware entropy source can use a seed persisted in
+ *  flash instead, see drbg-nv-seed in mbed_app.json and DrbgService.
+ */
+#if defined(MBED_CONF_APP_DRBG_NV_SEED) && MBED_CONF_APP_DRBG_NV_SEED && \
+    !defined(MBEDTLS_ENTROPY_HARDWARE_ALT)
+#define MBEDTLS_ENTROPY_NV_SEED
+#define MBEDTLS_PLATFORM_NV_SEED_ALT
+#endif /* MBED_CONF_APP_DRBG_NV_SEED && !MBEDTLS_ENTROPY_HARDWARE_ALT */
+
 #if !defined(MBEDTLS_ENTROPY_HARDWARE_ALT) && \
     !defined(MBEDTLS_ENTROPY_NV_SEED) && !defined(MBEDTLS_TEST_NULL_ENTROPY)
 #error "This hardware does not have an entropy source."